@@ -51,6 +51,12 @@ enum RFMode {
   VHF_MODE
 };
 
+enum RF103StreamFormat {
+  STREAM_FORMAT_RAW,              /* 16 bit real ADC samples */
+  STREAM_FORMAT_BASEBAND_CF32     /* VHF mode: complex float I/Q centered on
+                                     the tuned frequency */
+};
+
 enum LEDColors {
   LED_RED    = 0x01,
   LED_YELLOW = 0x02,
@@ -58,6 +64,16 @@ enum LEDColors {
 };
 
 
+/* threading: the control calls (RF mode, sample rate, start/stop streaming,
+ * frequency correction, HF attenuation, ADC dither/random, LEDs and the VHF
+ * tuner functions) are serialized by a per-device lock, so they may be made
+ * from any thread, including while timed commands are being executed.
+ * The configuration calls (async parameters, stream format, consumers,
+ * command queue, signal detector) are made from one thread while not
+ * streaming. The stream callbacks and consumers run on the streaming
+ * threads and must not make control calls - use rf103_schedule_command()
+ * instead, since stopping the stream waits for them */
+
 /* basic functions */
 int rf103_get_device_count();
 
@@ -98,6 +114,136 @@ int rf103_set_async_params(rf103_t *this, uint32_t frame_size,
                            uint32_t num_frames, rf103_read_async_cb_t callback,
                            void *callback_context);
 
+/* batched delivery: the completed frames (in the stream format) are held
+   back until there are batch_frames of them, or until the first of them has
+   waited twice the time a batch takes to fill at the sample rate (checked
+   by rf103_handle_events()), and then passed to the callback all at once;
+   their transfers are resubmitted together after it returns. With small
+   frames this saves most of the per frame overhead. batch_frames can be up to half of num_frames;
+   call it before rf103_set_async_params() (whose callback can then be 0) */
+struct rf103_frame {
+  uint8_t *data;
+  uint32_t size;                  /* bytes */
+  uint64_t sequence;              /* frames since streaming started */
+  uint64_t timestamp_ns;          /* transfer completion (CLOCK_MONOTONIC) */
+};
+
+typedef void (*rf103_read_batch_cb_t)(uint32_t nframes,
+                                      const struct rf103_frame *frames,
+                                      void *context);
+
+int rf103_set_async_batch(rf103_t *this, uint32_t batch_frames,
+                          rf103_read_batch_cb_t callback,
+                          void *callback_context);
+
+/* select the format of the data passed to the async callback; in baseband
+   mode the IF (including the spectral inversion and the exact LO error) is
+   converted to I/Q at sample_rate / decimation (decimation >= 2, since the
+   low pass rejects the image); not available with rf103_read_sync() */
+int rf103_set_stream_format(rf103_t *this, enum RF103StreamFormat format,
+                            uint32_t decimation);
+
+/* sample history: when enabled, every raw frame from the ADC is written once
+   to a ring buffer mapped twice back-to-back, so any span of up to 'size'
+   bytes can be read in place with no wraparound; size = 0 disables it */
+int rf103_set_history_size(rf103_t *this, uint32_t size);
+
+/* bytes written to the history since streaming started */
+uint64_t rf103_get_history_position(rf103_t *this);
+
+/* contiguous pointer to 'length' bytes of history starting at 'position';
+   the data can be overwritten by the writer once the history position moves
+   more than 'size' bytes past it, so check the position after using them */
+const uint8_t *rf103_get_history(rf103_t *this, uint64_t position,
+                                 uint32_t length);
+
+/* timed commands: gain, attenuation, frequency and GPIO changes scheduled
+   for a future ADC sample (counted from the start of streaming, before any
+   decimation). A control thread issues each command ahead of time, so that
+   it completes when the ADC gets to that sample; the ADC position is
+   extrapolated from the arrival time of the frames, plus stream_latency
+   seconds of buffering between the ADC and the host. Once the stream gets
+   to the sample where the change actually took effect, the callback gets a
+   tag for it (from the streaming thread, before the frame with that sample
+   is delivered). Async streaming only. Commands can be scheduled before
+   streaming starts; the pending ones are discarded when it stops */
+enum RF103CommandType {
+  COMMAND_HF_ATTENUATION,         /* value: attenuation in dB */
+  COMMAND_VHF_FREQUENCY,          /* value: frequency in Hz */
+  COMMAND_VHF_LNA_GAIN,           /* value: gain as in rf103_set_vhf_*_gain() */
+  COMMAND_VHF_MIXER_GAIN,
+  COMMAND_VHF_VGA_GAIN,
+  COMMAND_LED_ON,                 /* value: LED pattern */
+  COMMAND_LED_OFF,
+  COMMAND_ADC_DITHER,             /* value: 0 or 1 */
+  COMMAND_ADC_RANDOM,
+  COMMANDS
+};
+
+struct rf103_command_tag {
+  uint32_t id;                    /* from rf103_schedule_command() */
+  enum RF103CommandType type;
+  double value;
+  int result;                     /* 0 or -1 if the command failed */
+  uint64_t requested_sample;
+  uint64_t effective_sample;      /* estimated from the completion time */
+};
+
+typedef void (*rf103_command_tag_cb_t)(const struct rf103_command_tag *tag,
+                                       void *context);
+
+/* max_commands bounds the commands pending plus the tags not delivered yet;
+   max_commands = 0 removes the queue */
+int rf103_set_command_queue(rf103_t *this, uint32_t max_commands,
+                            double stream_latency,
+                            rf103_command_tag_cb_t callback,
+                            void *callback_context);
+
+/* both return the id of the command */
+int rf103_schedule_command(rf103_t *this, enum RF103CommandType type,
+                           double value, uint64_t sample);
+
+/* time_ns is CLOCK_MONOTONIC; only while streaming */
+int rf103_schedule_command_at(rf103_t *this, enum RF103CommandType type,
+                              double value, uint64_t time_ns);
+
+/* ADC samples received since streaming started */
+uint64_t rf103_get_stream_position(rf103_t *this);
+
+/* broadcast to several consumers in the same process: every frame (in the
+   stream format) is stored once in a shared ring of 'num_frames' frames and
+   each consumer reads it in place from its own thread, at its own pace;
+   consumers must not modify the data. When a consumer falls a full ring
+   behind, its overflow policy decides what happens */
+enum RF103OverflowPolicy {
+  OVERFLOW_BLOCK,                 /* the stream waits for the consumer (the
+                                     USB transfers back up) */
+  OVERFLOW_SKIP,                  /* the consumer jumps to the newest frame */
+  OVERFLOW_DROP_OLDEST            /* the consumer loses just the frames that
+                                     were overwritten */
+};
+
+struct rf103_consumer_stats {
+  uint64_t frames;                /* frames delivered */
+  uint64_t bytes;
+  uint64_t lost_frames;           /* skipped or dropped */
+  uint32_t lag;                   /* frames waiting for the consumer */
+  uint32_t max_lag;
+};
+
+int rf103_set_broadcast_frames(rf103_t *this, uint32_t num_frames);
+
+/* consumers are added and removed when not streaming; they need async
+   streaming, so add them before rf103_set_async_params() (whose callback
+   can then be 0); returns the consumer id */
+int rf103_add_consumer(rf103_t *this, enum RF103OverflowPolicy policy,
+                       rf103_read_async_cb_t callback, void *callback_context);
+
+int rf103_remove_consumer(rf103_t *this, int consumer);
+
+int rf103_get_consumer_stats(rf103_t *this, int consumer,
+                             struct rf103_consumer_stats *stats);
+
 int rf103_start_streaming(rf103_t *this);
 
 int rf103_handle_events(rf103_t *this);
@@ -108,6 +254,178 @@ int rf103_reset_status(rf103_t *this);
 
 int rf103_read_sync(rf103_t *this, uint8_t *data, int length, int *transferred);
 
+/* signal detection: while streaming, the power spectrum of the stream (raw
+   or baseband) is averaged over update_interval seconds and scanned with a
+   CFAR detector (threshold in dB over the local noise floor); the carriers
+   found are tracked over time and the list of the active ones is passed to
+   the callback at every update (from the streaming thread) */
+enum RF103DetectorMethod {
+  DETECTOR_CA_CFAR,               /* cell averaging */
+  DETECTOR_OS_CFAR                /* order statistic (better for crowded
+                                     bands) */
+};
+
+/* in raw stream format the frequencies are the ones seen by the ADC; in
+   baseband format they are RF frequencies */
+struct rf103_signal {
+  uint32_t id;                    /* stays the same while it is tracked */
+  double frequency;               /* Hz */
+  double bandwidth;               /* Hz */
+  float snr;                      /* dB */
+  double first_seen;              /* seconds since streaming started */
+  double last_seen;
+};
+
+typedef void (*rf103_signals_cb_t)(uint32_t nsignals,
+                                   const struct rf103_signal *signals,
+                                   void *context);
+
+/* callback = 0 disables the detector */
+int rf103_set_signal_detector(rf103_t *this, enum RF103DetectorMethod method,
+                              uint32_t fft_size, double update_interval,
+                              double threshold, rf103_signals_cb_t callback,
+                              void *callback_context);
+
+/* streaming statistics; the counters are lock-free and monotonic, so they can
+   be read from any thread without disturbing the USB event thread */
+struct rf103_stats {
+  uint64_t transfers;              /* completed USB bulk transfers */
+  uint64_t bytes;                  /* bytes received */
+  uint64_t transfer_errors;        /* failed bulk transfers (data lost) */
+  uint64_t callback_time_ns;       /* total time spent in the callbacks */
+  uint64_t callback_time_max_ns;   /* longest callback */
+  uint64_t callbacks;              /* calls to the callback (fewer than the
+                                      transfers with batched delivery) */
+  uint64_t control_transfers;      /* USB control transfers (GPIO, I2C, ..) */
+  uint64_t control_errors;
+  uint32_t active_transfers;       /* bulk transfers queued to the USB stack */
+  uint32_t num_transfers;          /* size of the transfer pool */
+};
+
+int rf103_get_stats(rf103_t *this, struct rf103_stats *stats);
+
+/* control path accounting: every USB control transfer (by kind) and every
+   library call that changes the hardware is counted and timed, and the
+   library calls also count the control transfers they issued, so an extra
+   register write per retune shows up as a change in control_transfers /
+   count */
+enum RF103Operation {
+  OPERATION_GPIO,                 /* USB control transfers */
+  OPERATION_I2C_WRITE,
+  OPERATION_I2C_READ,
+  OPERATION_FX3_COMMAND,          /* start, stop, reset, ... */
+  OPERATION_SET_RF_MODE,          /* library calls */
+  OPERATION_SET_SAMPLE_RATE,
+  OPERATION_SET_FREQUENCY_CORRECTION,
+  OPERATION_SET_VHF_FREQUENCY,    /* also the harmonic and auto variants */
+  OPERATION_SET_VHF_IF_FREQUENCY,
+  OPERATION_SET_VHF_IF_BANDWIDTH,
+  OPERATION_SET_VHF_LNA_GAIN,
+  OPERATION_SET_VHF_LNA_AGC,
+  OPERATION_SET_VHF_MIXER_GAIN,
+  OPERATION_SET_VHF_MIXER_AGC,
+  OPERATION_SET_VHF_VGA_GAIN,
+  OPERATION_LED,                  /* on, off and toggle */
+  OPERATION_HF_ATTENUATION,
+  OPERATION_ADC_DITHER,
+  OPERATION_ADC_RANDOM,
+  OPERATION_START_STREAMING,
+  OPERATION_STOP_STREAMING,
+  OPERATIONS
+};
+
+/* latency histogram: bucket 0 counts the calls under 1us, bucket i the
+   ones from 2^(i-1) to 2^i us, the last one everything longer */
+enum {
+  RF103_LATENCY_BUCKETS = 24
+};
+
+struct rf103_operation_stats {
+  uint64_t count;
+  uint64_t errors;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t control_transfers;      /* issued by the calls (library calls) */
+  uint64_t histogram[RF103_LATENCY_BUCKETS];
+};
+
+int rf103_get_operation_stats(rf103_t *this, enum RF103Operation operation,
+                              struct rf103_operation_stats *stats);
+
+void rf103_reset_operation_stats(rf103_t *this);
+
+const char *rf103_operation_name(enum RF103Operation operation);
+
+/* copies of frames into user memory (like a capture buffer) that is not
+   read again right away: large ones bypass the caches, so they do not
+   evict the data the processing threads are working on */
+void rf103_copy_frame(void *destination, const void *source, uint32_t size);
+
+/* same for the conversion of raw samples to float (full scale 1.0) */
+void rf103_convert_frame(float *destination, const int16_t *source,
+                         uint32_t nsamples);
+
+/* memory budget (process wide): the large buffers of the library (USB
+   transfers, rings, DSP buffers, frame copies for the consumers and the
+   flight recorder) are charged to a component; with a budget the
+   subsystems that can work with less memory (the transfer pool, the graph
+   rings and the consumer queues) shrink to fit it when they are set up,
+   and any other allocation past it fails; budget = 0 removes it */
+enum RF103MemoryComponent {
+  MEMORY_TRANSFERS,               /* USB transfer frames */
+  MEMORY_RINGS,                   /* history, DDC and graph rings */
+  MEMORY_DSP,                     /* filters, FFTs and scratch buffers */
+  MEMORY_WRITERS,                 /* frame copies for consumers and files */
+  MEMORY_RECORDER,                /* flight recorder */
+  MEMORY_COMPONENTS
+};
+
+struct rf103_memory_report {
+  uint64_t budget;                 /* 0 = no budget */
+  uint64_t used;                   /* bytes */
+  uint64_t peak;
+  uint64_t denied;                 /* allocations refused by the budget */
+  uint64_t component_used[MEMORY_COMPONENTS];
+  uint64_t component_peak[MEMORY_COMPONENTS];
+};
+
+/* fails if more than budget bytes are already in use */
+int rf103_set_memory_budget(uint64_t budget);
+
+void rf103_get_memory_report(struct rf103_memory_report *report);
+
+const char *rf103_memory_component_name(enum RF103MemoryComponent component);
+
+/* flight recorder: the library always keeps the most recent control requests,
+   I2C writes, transfer errors and ADC state changes in a memory ring (process
+   wide); the dump can be decoded with rf103_decode_flight_recorder */
+int rf103_flight_recorder_dump(const char *filename);
+
+/* dump automatically to this file when a transfer fails (0 = disabled) */
+int rf103_flight_recorder_set_dump_file(const char *filename);
+
+/* dump to the dump file when signum is received (e.g. SIGUSR1) */
+int rf103_flight_recorder_dump_on_signal(int signum);
+
+/* frequency correction functions */
+/* the frequency correction is the deviation (in ppm) of the actual Si5351
+   crystal frequency from its nominal value */
+int rf103_set_frequency_correction(rf103_t *this, double ppm);
+
+double rf103_get_frequency_correction(rf103_t *this);
+
+/* estimate the residual correction (in ppm) from real samples captured in HF
+   mode that contain a known carrier (like a broadcast time standard);
+   it does not need a device, so it can be used on recorded files too */
+int rf103_estimate_frequency_correction(const int16_t *samples,
+                                        uint32_t nsamples, double sample_rate,
+                                        double carrier_frequency, double *ppm);
+
+/* estimate the residual correction from an HF capture and apply it */
+int rf103_calibrate_frequency_correction(rf103_t *this, const int16_t *samples,
+                                         uint32_t nsamples,
+                                         double carrier_frequency);
+
 /* VHF/UHF tuner functions */
 int rf103_set_vhf_frequency(rf103_t *this, double frequency);
 
@@ -116,6 +434,22 @@ int rf103_set_vhf_harmonic_frequency(rf103_t *this, double frequency,
 
 int rf103_set_vhf_if_frequency(rf103_t *this, uint32_t if_frequency);
 
+/* choose fundamental or harmonic mode and the IF frequency automatically,
+   keeping the PLL boundary and xtal harmonic spurs out of the IF passband */
+int rf103_set_vhf_frequency_auto(rf103_t *this, double frequency);
+
+/* current tuning: the requested frequency ends up at
+   if_frequency + frequency_error in the ADC samples */
+struct rf103_vhf_tuning {
+  double frequency;
+  int harmonic;
+  uint32_t if_frequency;
+  double lo_frequency;
+  double frequency_error;
+};
+
+int rf103_get_vhf_tuning(rf103_t *this, struct rf103_vhf_tuning *tuning);
+
 int rf103_get_vhf_lna_gains(rf103_t *this, const int *gains[]);
 
 int rf103_set_vhf_lna_gain(rf103_t *this, int gain);
@@ -136,6 +470,255 @@ int rf103_get_vhf_if_bandwidths(rf103_t *this, uint32_t *if_bandwidths[]);
 
 int rf103_set_vhf_if_bandwidth(rf103_t *this, uint32_t bandwidth);
 
+
+/* dataflow graph: stages with typed ports connected by preallocated ring
+   buffers and run by a pool of worker threads; a stage runs only when its
+   input has data and all its readers have room for its output, so a slow
+   stage holds back the ones before it (down to the USB transfers for a
+   device source). The same graph runs on a live device or on a recording
+   by swapping the source */
+typedef struct rf103_graph rf103_graph_t;
+
+enum RF103SampleType {
+  SAMPLE_TYPE_NONE,               /* no input (sources) or output (sinks) */
+  SAMPLE_TYPE_S16,                /* real 16 bit (raw ADC samples) */
+  SAMPLE_TYPE_F32,                /* real float */
+  SAMPLE_TYPE_CF32,               /* complex float (interleaved I/Q) */
+  SAMPLE_TYPE_CS16                /* complex 16 bit (interleaved I/Q) */
+};
+
+/* work() consumes up to ninput items (at least min_input, unless the
+   upstream stage ended) and produces up to max_output items; it returns
+   the number of items consumed, RF103_STAGE_END when a source is done or
+   RF103_STAGE_ERROR */
+enum {
+  RF103_STAGE_ERROR = -1,
+  RF103_STAGE_END = -2
+};
+
+struct rf103_stage_ops {
+  const char *name;
+  enum RF103SampleType input_type;
+  enum RF103SampleType output_type;
+  uint32_t min_input;             /* items */
+  uint32_t max_input;
+  uint32_t max_output;
+  int (*work)(void *state, const void *input, uint32_t ninput, void *output,
+              uint32_t *noutput);
+  void (*close)(void *state);     /* optional */
+};
+
+struct rf103_stage_stats {
+  uint64_t calls;
+  uint64_t input_items;
+  uint64_t output_items;
+  uint64_t cpu_time_ns;           /* thread CPU time in work() */
+  uint64_t wall_time_ns;
+};
+
+rf103_graph_t *rf103_graph_open();
+
+void rf103_graph_close(rf103_graph_t *this);
+
+/* the functions that add a stage return its id */
+int rf103_graph_add_stage(rf103_graph_t *this,
+                          const struct rf103_stage_ops *ops, void *state);
+
+/* the stream of an rf103 device (type must match its stream format); it is
+   a consumer of the device, so add it before rf103_set_async_params() and
+   start streaming after rf103_graph_start() */
+int rf103_graph_add_device_source(rf103_graph_t *this, rf103_t *rf103,
+                                  enum RF103SampleType type);
+
+/* WAV file written by the stream tools: one channel is S16, two channels
+   (I/Q) are CF32; realtime paces it at its sample rate */
+int rf103_graph_add_file_source(rf103_graph_t *this, const char *filename,
+                                int realtime, double *sample_rate);
+
+/* S16 -> F32 (full scale 1.0) */
+int rf103_graph_add_converter(rf103_graph_t *this);
+
+/* S16 -> CF32 (see rf103_set_stream_format()) */
+int rf103_graph_add_ddc(rf103_graph_t *this, double sample_rate,
+                        double frequency, uint32_t decimation);
+
+/* S16 -> CS16: the same DDC in 16 bit fixed point, for half the memory
+   traffic; the output is the CF32 one times 32768, rounded and saturated */
+int rf103_graph_add_ddc16(rf103_graph_t *this, double sample_rate,
+                          double frequency, uint32_t decimation);
+
+/* S16 or CF32 -> F32 averaged power spectra (fft_size/2 or fft_size bins
+   each, one spectrum every averages * frame_interval input items) */
+int rf103_graph_add_spectrum(rf103_graph_t *this, enum RF103SampleType type,
+                             uint32_t fft_size, uint32_t averages,
+                             uint32_t frame_interval);
+
+/* S16 or CF32 -> F32: levels of a set of tones at exact frequencies (Hz
+   relative to the input, e.g. CW beacons or pilot tones) with a bank of
+   Goertzel filters of block_length samples (bandwidth about
+   sample_rate / block_length); after every block the output gets ntones
+   (magnitude, phase) pairs: the amplitude of the tone (full scale 1.0) and
+   its phase in radians relative to the first input sample, so a steady
+   tone keeps the same phase */
+int rf103_graph_add_tone_bank(rf103_graph_t *this, enum RF103SampleType type,
+                              double sample_rate, const double *frequencies,
+                              uint32_t ntones, uint32_t block_length);
+
+/* S16 -> S16: removes stable narrowband carriers (birdies) with adaptive
+   notches that track their amplitude, phase and frequency. The carriers
+   are listed in birdie_file, one per line: <frequency> <width> [<origin>]
+   (frequencies as seen by the ADC, width in Hz; a width of 0 keeps a known
+   carrier without removing it). If threshold > 0, the stage also looks for
+   new ones in averaged spectra (threshold in dB over the noise floor) and
+   adds the ones that stay for a minute to the file */
+int rf103_graph_add_birdie_filter(rf103_graph_t *this, double sample_rate,
+                                  const char *birdie_file, double threshold);
+
+/* CF32 -> (none): records a channel (e.g. a DDC output) only while there is
+   a signal in it, to a container file (see struct rf103_channel_record).
+   The channel opens when its power over 10ms is threshold dB over its
+   noise floor and closes after hang seconds below it; every segment
+   starts preroll seconds before that, so the onset of a burst is kept.
+   start_time is the UTC time (in seconds) of the first input sample,
+   0 = when the stage is added */
+int rf103_graph_add_gated_recorder(rf103_graph_t *this, const char *filename,
+                                   double sample_rate, double frequency,
+                                   double start_time, double threshold,
+                                   double preroll, double hang);
+
+int rf103_graph_add_file_sink(rf103_graph_t *this, enum RF103SampleType type,
+                              const char *filename);
+
+int rf103_graph_add_callback_sink(rf103_graph_t *this,
+                                  enum RF103SampleType type,
+                                  rf103_read_async_cb_t callback,
+                                  void *callback_context);
+
+/* an output can feed several stages; every stage has at most one input */
+int rf103_graph_connect(rf103_graph_t *this, int from, int to);
+
+int rf103_graph_start(rf103_graph_t *this, int num_workers);
+
+/* ask the sources to end; the stages drain what is already buffered */
+int rf103_graph_stop(rf103_graph_t *this);
+
+/* wait until all the stages are done; -1 if any of them failed */
+int rf103_graph_wait(rf103_graph_t *this);
+
+int rf103_graph_get_stage_stats(rf103_graph_t *this, int stage,
+                                struct rf103_stage_stats *stats);
+
+struct rf103_birdie {
+  double frequency;               /* Hz (tracked, while it is removed) */
+  double width;                   /* Hz; 0 = left alone */
+  char origin[16];                /* "si5351", "usb", "found" or from the file */
+  float level;                    /* of the removed carrier (dBFS) */
+  uint64_t cpu_time_ns;           /* spent removing it */
+  uint64_t samples;
+};
+
+/* the birdies of a birdie filter stage; returns how many there are (only
+   the first max are stored) */
+int rf103_graph_get_birdies(rf103_graph_t *this, int stage,
+                            struct rf103_birdie *birdies, int max);
+
+
+/* cross-receiver alignment: delay (with a fraction of a sample), clock
+   drift and frequency offset of stream b relative to stream a, from blocks
+   of both taken at the same sample index and cross-correlated with FFTs;
+   any wideband signal received by both will do. A few blocks per second
+   are enough, so recordings can be processed much faster than real time.
+   The delay must stay within +/- block_size / 2 (skip samples of one of
+   the streams first if it is larger). Like the frequency correction
+   estimate it needs no device */
+typedef struct rf103_alignment rf103_alignment_t;
+
+struct rf103_alignment_block {
+  double position;                /* sample index of the middle of the block */
+  double delay;                   /* samples b lags a */
+  double phase;                   /* of the correlation peak (radians) */
+  double peak;                    /* correlation peak (0..1) */
+  int valid;                      /* 0 = no clear peak */
+};
+
+/* to put b on the time base of a, resample it from
+   sample_rate * (1 + drift * 1e-6) to sample_rate, shift it by
+   -frequency_offset and drop its first delay samples */
+struct rf103_alignment_estimate {
+  uint32_t blocks;                /* used in the fit */
+  uint32_t rejected;              /* without a clear correlation peak */
+  uint32_t outliers;              /* with a peak too far from the fit */
+  double delay;                   /* samples b lags a at sample 0 */
+  double drift;                   /* ppm: b gets 1 + drift * 1e-6 samples
+                                     for every sample of a */
+  double frequency_offset;        /* Hz (complex samples only) */
+  double residual;                /* rms of the block delays around the fit */
+  double peak;                    /* mean correlation peak (0..1) */
+};
+
+/* type is SAMPLE_TYPE_S16 or SAMPLE_TYPE_CF32; block_size is a power of 2 */
+rf103_alignment_t *rf103_alignment_open(enum RF103SampleType type,
+                                        double sample_rate,
+                                        uint32_t block_size);
+
+void rf103_alignment_close(rf103_alignment_t *this);
+
+void rf103_alignment_reset(rf103_alignment_t *this);
+
+uint32_t rf103_alignment_get_block_size(rf103_alignment_t *this);
+
+/* a and b hold block_size samples from sample index position of each
+   stream, in increasing order of position; returns 1 if the block has a
+   clear correlation peak (kept for the fit), 0 if not, -1 on error; block
+   (if not null) gets the measurement of the block */
+int rf103_alignment_add_block(rf103_alignment_t *this, uint64_t position,
+                              const void *a, const void *b,
+                              struct rf103_alignment_block *block);
+
+int rf103_alignment_get_estimate(rf103_alignment_t *this,
+                                 struct rf103_alignment_estimate *estimate);
+
+
+/* activity gated channel recording: a container file with only the
+   stretches of each channel where there was a signal. It is a sequence of
+   records, each a struct rf103_channel_record (in host byte order) and its
+   payload: a channel record (one per channel, before its samples) has a
+   struct rf103_recorded_channel, a samples record has nsamples I/Q pairs
+   of int16, to be multiplied by scale (full scale 1.0). The samples of a
+   segment are contiguous: it starts with the record flagged
+   RF103_SEGMENT_START and ends with the one flagged RF103_SEGMENT_END
+   (missing only if the file was cut short) */
+enum {
+  RF103_CHANNEL_RECORD_SYNC = 0x52484352        /* "RCHR" */
+};
+
+enum RF103ChannelRecordType {
+  RF103_RECORD_CHANNEL = 1,
+  RF103_RECORD_SAMPLES = 2
+};
+
+enum {
+  RF103_SEGMENT_START = 0x1,
+  RF103_SEGMENT_END = 0x2
+};
+
+struct rf103_channel_record {
+  uint32_t sync;                  /* RF103_CHANNEL_RECORD_SYNC */
+  uint16_t type;                  /* enum RF103ChannelRecordType */
+  uint16_t channel;
+  uint32_t flags;
+  uint32_t nsamples;
+  uint64_t sample_index;          /* of the first sample, in the channel */
+  int64_t timestamp;              /* ns since the epoch (UTC) of sample_index */
+  float scale;
+  uint32_t reserved;
+};
+
+struct rf103_recorded_channel {
+  double frequency;               /* Hz */
+  double sample_rate;
+};
+
 #ifdef __cplusplus
 }
 #endif
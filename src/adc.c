@@ -34,17 +34,23 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdatomic.h>
+#include <time.h>
 
 #include "adc.h"
+#include "memory_budget.h"
 #include "usb_device.h"
 #include "usb_device_internals.h"
 #include "logging.h"
+#include "flight_recorder.h"
 
 
 typedef struct adc adc_t;
 
 /* internal functions */
 static void adc_read_async_callback(struct libusb_transfer *transfer);
+static void adc_add_callback_time(adc_t *this, const struct timespec *start,
+                                  const struct timespec *end);
+static void adc_set_status(adc_t *this, int status);
 
 
 enum ADCStatus {
@@ -66,13 +72,28 @@ typedef struct adc {
   void *callback_context;
   uint8_t **frames;
   struct libusb_transfer **transfers;
+  uint32_t batch_frames;          /* 0 = no batching */
+  adc_batch_cb_t batch_callback;
+  struct rf103_frame *batch;      /* completed and not yet delivered */
+  struct libusb_transfer **batch_transfers;
+  uint32_t batch_count;
+  uint64_t batch_timeout_ns;      /* a partial batch waits at most this long */
+  uint64_t sequence;              /* frames completed since the start */
   atomic_int active_transfers;
+  /* statistics: written only by the USB event thread, read by anybody */
+  atomic_ullong completed_transfers;
+  atomic_ullong received_bytes;
+  atomic_ullong transfer_errors;
+  atomic_ullong callback_time_ns;
+  atomic_ullong callback_time_max_ns;
+  atomic_ullong callbacks;
 } adc_t;
 
 
 static const uint32_t DEFAULT_ADC_SAMPLE_RATE = 64000000;   /* 64Msps */
 static const uint32_t DEFAULT_ADC_FRAME_SIZE = (2 * DEFAULT_ADC_SAMPLE_RATE / 1000);  /* ~ 1 ms */
 static const uint32_t DEFAULT_ADC_NUM_FRAMES = 96;  /* we should not exceed 120 ms in total! */
+static const uint32_t MIN_ADC_NUM_FRAMES = 4;       /* with a memory budget */
 const unsigned int BULK_XFER_TIMEOUT = 5000; // timeout (in ms) for each bulk transfer
 
 
@@ -98,7 +119,20 @@ adc_t *adc_open_sync(usb_device_t *usb_device)
   this->callback_context = 0;
   this->frames = 0;
   this->transfers = 0;
+  this->batch_frames = 0;
+  this->batch_callback = 0;
+  this->batch = 0;
+  this->batch_transfers = 0;
+  this->batch_count = 0;
+  this->batch_timeout_ns = 0;
+  this->sequence = 0;
   atomic_init(&this->active_transfers, 0);
+  atomic_init(&this->completed_transfers, 0);
+  atomic_init(&this->received_bytes, 0);
+  atomic_init(&this->transfer_errors, 0);
+  atomic_init(&this->callback_time_ns, 0);
+  atomic_init(&this->callback_time_max_ns, 0);
+  atomic_init(&this->callbacks, 0);
 
   ret_val = this;
   return ret_val;
@@ -136,6 +170,23 @@ adc_t *adc_open_async(usb_device_t *usb_device, uint32_t frame_size,
     return ret_val;
   }
 
+  /* with a memory budget the pool shrinks to what fits */
+  uint64_t available = memory_budget_available();
+  if ((uint64_t) num_frames * frame_size > available) {
+    if (available / frame_size < MIN_ADC_NUM_FRAMES) {
+      fprintf(stderr, "ERROR - the memory budget does not fit %u ADC frames of %u bytes\n",
+              MIN_ADC_NUM_FRAMES, (unsigned)frame_size);
+      return ret_val;
+    }
+    fprintf(stderr, "WARNING - only %u of the %u ADC frames fit the memory budget\n",
+            (unsigned)(available / frame_size), (unsigned)num_frames);
+    num_frames = (uint32_t) (available / frame_size);
+  }
+  if (memory_budget_reserve(MEMORY_TRANSFERS, (size_t) num_frames * frame_size,
+                            "ADC frames") < 0) {
+    return ret_val;
+  }
+
   /* allocate frames for zerocopy USB bulk transfers */
   uint8_t **frames = (uint8_t **) malloc(num_frames * sizeof(uint8_t *));
   for (uint32_t i = 0; i < num_frames; ++i) {
@@ -145,6 +196,7 @@ adc_t *adc_open_async(usb_device_t *usb_device, uint32_t frame_size,
       for (uint32_t j = 0; j < i; j++) {
         libusb_dev_mem_free(usb_device->dev_handle, frames[j], frame_size);
       }
+      memory_budget_release(MEMORY_TRANSFERS, (size_t) num_frames * frame_size);
       return ret_val;
     }
   }
@@ -171,7 +223,20 @@ adc_t *adc_open_async(usb_device_t *usb_device, uint32_t frame_size,
                               this, BULK_XFER_TIMEOUT);
   }
   this->transfers = transfers;
+  this->batch_frames = 0;
+  this->batch_callback = 0;
+  this->batch = 0;
+  this->batch_transfers = 0;
+  this->batch_count = 0;
+  this->batch_timeout_ns = 0;
+  this->sequence = 0;
   atomic_init(&this->active_transfers, 0);
+  atomic_init(&this->completed_transfers, 0);
+  atomic_init(&this->received_bytes, 0);
+  atomic_init(&this->transfer_errors, 0);
+  atomic_init(&this->callback_time_ns, 0);
+  atomic_init(&this->callback_time_max_ns, 0);
+  atomic_init(&this->callbacks, 0);
 
   ret_val = this;
   return ret_val;
@@ -192,12 +257,115 @@ void adc_close(adc_t *this)
                           this->frame_size);
     }
     free(this->frames);
+    memory_budget_release(MEMORY_TRANSFERS,
+                          (size_t) this->num_frames * this->frame_size);
   }
+  free(this->batch);
+  free(this->batch_transfers);
   free(this);
   return;
 }
 
 
+int adc_set_batch(adc_t *this, uint32_t batch_frames, adc_batch_cb_t callback)
+{
+  if (this->status == ADC_STATUS_STREAMING) {
+    fprintf(stderr, "ERROR - adc_set_batch() failed: streaming in progress\n");
+    return -1;
+  }
+  if (this->transfers == 0) {
+    fprintf(stderr, "ERROR - adc_set_batch() failed: synchronous streaming\n");
+    return -1;
+  }
+  /* half of the transfers stay queued while the other half is delivered */
+  if (batch_frames > this->num_frames / 2 || (batch_frames > 0 && callback == 0)) {
+    fprintf(stderr, "ERROR - invalid batch size: %u (max %u)\n", batch_frames,
+            this->num_frames / 2);
+    return -1;
+  }
+  free(this->batch);
+  free(this->batch_transfers);
+  this->batch = 0;
+  this->batch_transfers = 0;
+  this->batch_frames = 0;
+  this->batch_callback = 0;
+  if (batch_frames > 0) {
+    this->batch = (struct rf103_frame *) malloc(batch_frames * sizeof(struct rf103_frame));
+    this->batch_transfers = (struct libusb_transfer **) malloc(batch_frames * sizeof(struct libusb_transfer *));
+    this->batch_frames = batch_frames;
+    this->batch_callback = callback;
+  }
+  this->batch_count = 0;
+  return 0;
+}
+
+
+void adc_flush_batch(adc_t *this)
+{
+  uint32_t nframes = this->batch_count;
+  if (nframes == 0) {
+    return;
+  }
+  this->batch_count = 0;
+  /* the frames held back while stopping are just dropped, and their
+     transfers are not active any more */
+  if (this->status != ADC_STATUS_STREAMING) {
+    atomic_fetch_sub(&this->active_transfers, (int) nframes);
+    return;
+  }
+
+  uint64_t bytes = 0;
+  for (uint32_t i = 0; i < nframes; ++i) {
+    /* remove ADC randomization */
+    if (this->random) {
+      uint16_t *samples = (uint16_t *) this->batch[i].data;
+      uint32_t n = this->batch[i].size / 2;
+      for (uint32_t j = 0; j < n; ++j) {
+        if (samples[j] & 1) {
+          samples[j] ^= 0xfffe;
+        }
+      }
+    }
+    bytes += this->batch[i].size;
+  }
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  this->batch_callback(nframes, this->batch, this->callback_context);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  adc_add_callback_time(this, &start, &end);
+  atomic_fetch_add_explicit(&this->completed_transfers, nframes,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&this->received_bytes, bytes,
+                            memory_order_relaxed);
+
+  /* resubmit them all in one go */
+  for (uint32_t i = 0; i < nframes; ++i) {
+    int ret = libusb_submit_transfer(this->batch_transfers[i]);
+    if (ret < 0) {
+      log_usb_error(ret, __func__, __FILE__, __LINE__);
+      adc_set_status(this, ADC_STATUS_FAILED);
+      atomic_fetch_sub(&this->active_transfers, 1);
+    }
+  }
+  return;
+}
+
+
+void adc_flush_stale_batch(adc_t *this)
+{
+  if (this->batch_count == 0) {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t now_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  if (now_ns - this->batch[0].timestamp_ns >= this->batch_timeout_ns) {
+    adc_flush_batch(this);
+  }
+  return;
+}
+
+
 int adc_set_random(adc_t *this, int random)
 {
   this->random = random;
@@ -213,6 +381,12 @@ int adc_set_sample_rate(adc_t *this, uint32_t sample_rate)
 }
 
 
+uint32_t adc_get_frame_size(adc_t *this)
+{
+  return this->frame_size;
+}
+
+
 int adc_start(adc_t *this)
 {
   if (this->status != ADC_STATUS_READY) {
@@ -222,23 +396,29 @@ int adc_start(adc_t *this)
 
   /* if there is no callback, then streaming is synchronous - nothing to do */
   if (this->callback == 0) {
-    this->status = ADC_STATUS_STREAMING;
+    adc_set_status(this, ADC_STATUS_STREAMING);
     return 0;
   }
 
   /* submit all the transfers */
+  this->batch_count = 0;
+  /* twice the time the ADC takes to fill a batch, so at a steady rate the
+     batches are always full */
+  this->batch_timeout_ns = (uint64_t) this->batch_frames * this->frame_size *
+                           1000000000ULL / this->sample_rate;
+  this->sequence = 0;
   atomic_init(&this->active_transfers, 0);
   for (uint32_t i = 0; i < this->num_frames; ++i) {
     int ret = libusb_submit_transfer(this->transfers[i]);
     if (ret < 0) {
       log_usb_error(ret, __func__, __FILE__, __LINE__);
-      this->status = ADC_STATUS_FAILED;
+      adc_set_status(this, ADC_STATUS_FAILED);
       return -1;
     }
     atomic_fetch_add(&this->active_transfers, 1);
   }
 
-  this->status = ADC_STATUS_STREAMING;
+  adc_set_status(this, ADC_STATUS_STREAMING);
 
   return 0;
 }
@@ -249,12 +429,12 @@ int adc_stop(adc_t *this)
   /* if there is no callback, then streaming is synchronous - nothing to do */
   if (this->callback == 0) {
     if (this->status == ADC_STATUS_STREAMING) {
-      this->status = ADC_STATUS_READY;
+      adc_set_status(this, ADC_STATUS_READY);
     }
     return 0;
   }
 
-  this->status = ADC_STATUS_CANCELLED;
+  adc_set_status(this, ADC_STATUS_CANCELLED);
   /* cancel all the active transfers */
   for (uint32_t i = 0; i < this->num_frames; ++i) {
     int ret = libusb_cancel_transfer(this->transfers[i]);
@@ -263,7 +443,7 @@ int adc_stop(adc_t *this)
         continue;
       }
       log_usb_error(ret, __func__, __FILE__, __LINE__);
-      this->status = ADC_STATUS_FAILED;
+      adc_set_status(this, ADC_STATUS_FAILED);
     }
   }
 
@@ -272,8 +452,10 @@ int adc_stop(adc_t *this)
   int ret = libusb_handle_events_timeout_completed(0, &noblock, 0);
   if (ret < 0) {
     log_usb_error(ret, __func__, __FILE__, __LINE__);
-    this->status = ADC_STATUS_FAILED;
+    adc_set_status(this, ADC_STATUS_FAILED);
   }
+  /* drop a partial batch, which is not waiting on any events */
+  adc_flush_batch(this);
 
   return 0;
 }
@@ -300,7 +482,7 @@ int adc_reset_status(adc_t *this)
   }
 
   /* we are good here; reset the status */
-  this->status = ADC_STATUS_READY;
+  adc_set_status(this, ADC_STATUS_READY);
   return 0;
 }
 
@@ -330,6 +512,28 @@ int adc_read_sync(adc_t *this, uint8_t *data, int length, int *transferred)
 }
 
 
+void adc_get_stats(adc_t *this, struct adc_stats *stats)
+{
+  stats->transfers = atomic_load_explicit(&this->completed_transfers,
+                                          memory_order_relaxed);
+  stats->bytes = atomic_load_explicit(&this->received_bytes,
+                                      memory_order_relaxed);
+  stats->transfer_errors = atomic_load_explicit(&this->transfer_errors,
+                                                memory_order_relaxed);
+  stats->callback_time_ns = atomic_load_explicit(&this->callback_time_ns,
+                                                 memory_order_relaxed);
+  stats->callback_time_max_ns = atomic_load_explicit(&this->callback_time_max_ns,
+                                                     memory_order_relaxed);
+  stats->callbacks = atomic_load_explicit(&this->callbacks,
+                                          memory_order_relaxed);
+  int active_transfers = atomic_load_explicit(&this->active_transfers,
+                                              memory_order_relaxed);
+  stats->active_transfers = active_transfers > 0 ? active_transfers : 0;
+  stats->num_transfers = this->num_frames;
+  return;
+}
+
+
 /* internal functions */
 static void LIBUSB_CALL adc_read_async_callback(struct libusb_transfer *transfer)
 {
@@ -338,6 +542,21 @@ static void LIBUSB_CALL adc_read_async_callback(struct libusb_transfer *transfer
   switch (transfer->status) {
     case LIBUSB_TRANSFER_COMPLETED:
       /* success!!! */
+      if (this->status == ADC_STATUS_STREAMING && this->batch_frames > 0) {
+        /* hold it back until the batch is complete */
+        struct rf103_frame *frame = &this->batch[this->batch_count];
+        frame->data = transfer->buffer;
+        frame->size = transfer->actual_length;
+        frame->sequence = this->sequence++;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        frame->timestamp_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+        this->batch_transfers[this->batch_count++] = transfer;
+        if (this->batch_count == this->batch_frames) {
+          adc_flush_batch(this);
+        }
+        return;
+      }
       if (this->status == ADC_STATUS_STREAMING) {
         /* remove ADC randomization */
         if (this->random) {
@@ -349,8 +568,17 @@ static void LIBUSB_CALL adc_read_async_callback(struct libusb_transfer *transfer
             }
           }
         }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
         this->callback(transfer->actual_length, transfer->buffer,
                        this->callback_context);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        adc_add_callback_time(this, &start, &end);
+        atomic_fetch_add_explicit(&this->completed_transfers, 1,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&this->received_bytes,
+                                  transfer->actual_length,
+                                  memory_order_relaxed);
         ret = libusb_submit_transfer(transfer);
         if (ret == 0) {
           return;
@@ -366,11 +594,17 @@ static void LIBUSB_CALL adc_read_async_callback(struct libusb_transfer *transfer
     case LIBUSB_TRANSFER_STALL:
     case LIBUSB_TRANSFER_NO_DEVICE:
     case LIBUSB_TRANSFER_OVERFLOW:
+      atomic_fetch_add_explicit(&this->transfer_errors, 1,
+                                memory_order_relaxed);
+      flight_recorder_record(FR_EVENT_TRANSFER_ERROR, transfer->status,
+                             transfer->actual_length,
+                             atomic_load(&this->active_transfers),
+                             transfer->status, 0);
       log_usb_error(transfer->status, __func__, __FILE__, __LINE__);
       break;
   }
 
-  this->status = ADC_STATUS_FAILED;
+  adc_set_status(this, ADC_STATUS_FAILED);
   atomic_fetch_sub(&this->active_transfers, 1);
   fprintf(stderr, "Cancelling\n");
   /* cancel all the active transfers */
@@ -386,3 +620,33 @@ static void LIBUSB_CALL adc_read_async_callback(struct libusb_transfer *transfer
   return;
 }
 
+
+static void adc_add_callback_time(adc_t *this, const struct timespec *start,
+                                  const struct timespec *end)
+{
+  uint64_t elapsed = (uint64_t) (end->tv_sec - start->tv_sec) * 1000000000 +
+                     end->tv_nsec - start->tv_nsec;
+  atomic_fetch_add_explicit(&this->callbacks, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&this->callback_time_ns, elapsed,
+                            memory_order_relaxed);
+  /* single writer, so no compare and swap needed */
+  if (elapsed > atomic_load_explicit(&this->callback_time_max_ns,
+                                     memory_order_relaxed)) {
+    atomic_store_explicit(&this->callback_time_max_ns, elapsed,
+                          memory_order_relaxed);
+  }
+  return;
+}
+
+
+static void adc_set_status(adc_t *this, int status)
+{
+  int old_status = this->status;
+  flight_recorder_record(FR_EVENT_ADC_STATUS, status, old_status, 0, 0, 0);
+  this->status = status;
+  /* dump only on the first failure (all the pending transfers fail too) */
+  if (status == ADC_STATUS_FAILED && old_status != ADC_STATUS_FAILED) {
+    flight_recorder_failure();
+  }
+  return;
+}
@@ -32,6 +32,20 @@ extern "C" {
 
 typedef struct adc adc_t;
 
+typedef void (*adc_batch_cb_t)(uint32_t nframes, struct rf103_frame *frames,
+                               void *context);
+
+struct adc_stats {
+  uint64_t transfers;
+  uint64_t bytes;
+  uint64_t transfer_errors;
+  uint64_t callback_time_ns;
+  uint64_t callback_time_max_ns;
+  uint64_t callbacks;
+  uint32_t active_transfers;
+  uint32_t num_transfers;
+};
+
 adc_t *adc_open_sync(usb_device_t *usb_device);
 
 adc_t *adc_open_async(usb_device_t *usb_device, uint32_t frame_size,
@@ -40,10 +54,26 @@ adc_t *adc_open_async(usb_device_t *usb_device, uint32_t frame_size,
 
 void adc_close(adc_t *this);
 
+/* batch_frames > 0 holds the completed transfers back until there are
+   batch_frames of them (or adc_flush_batch() is called), then passes them
+   to the batch callback (instead of the async callback) all at once and
+   resubmits them together; the callback context is the one given to
+   adc_open_async() */
+int adc_set_batch(adc_t *this, uint32_t batch_frames, adc_batch_cb_t callback);
+
+/* delivers a partial batch */
+void adc_flush_batch(adc_t *this);
+
+/* delivers a partial batch only if its first frame has waited longer than
+   twice the time it takes to fill a batch at the sample rate */
+void adc_flush_stale_batch(adc_t *this);
+
 int adc_set_random(adc_t *this, int random);
 
 int adc_set_sample_rate(adc_t *this, uint32_t sample_rate);
 
+uint32_t adc_get_frame_size(adc_t *this);
+
 int adc_start(adc_t *this);
 
 int adc_stop(adc_t *this);
@@ -52,6 +82,9 @@ int adc_reset_status(adc_t *this);
 
 int adc_read_sync(adc_t *this, uint8_t *data, int length, int *transferred);
 
+/* lock-free snapshot; safe to call from any thread */
+void adc_get_stats(adc_t *this, struct adc_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,585 @@
+/*
+ * alignment.c - cross-receiver delay and drift estimation
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* each block of a and b (taken at the same sample index) is zero padded to
+ * twice its length and cross-correlated in the frequency domain with the
+ * phase transform (GCC-PHAT), which whitens the common signal, so the
+ * correlation peak stays one sample wide whatever its spectrum; real blocks
+ * share one complex FFT (a in the real part, b in the imaginary part). The
+ * fraction of a sample comes from the slope of the phase of the cross
+ * spectrum once the integer lag is removed. The delays of the blocks are
+ * fitted to a line (delay at sample 0 and drift), dropping the blocks far
+ * from it (a strong narrowband signal can win over the common signal now
+ * and then) and fitting again; for complex samples the unwrapped phase of
+ * the peak of the same blocks is fitted too (frequency offset)
+ *
+ * References:
+ *  - C. Knapp, G. Carter - The Generalized Correlation Method for Estimation of Time Delay (IEEE Trans. ASSP, 1976)
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rf103.h"
+#include "fft.h"
+#include "memory_budget.h"
+
+
+typedef struct rf103_alignment rf103_alignment_t;
+
+struct alignment_measurement {
+  double position;               /* middle of the block */
+  double delay;
+  double phase;
+  double peak;
+  int used;                      /* in the fit */
+};
+
+/* internal functions */
+static void alignment_cross_spectrum_real(rf103_alignment_t *this,
+                                          const int16_t *a, const int16_t *b);
+static void alignment_cross_spectrum_complex(rf103_alignment_t *this,
+                                             const float *a, const float *b);
+static int alignment_find_peak(rf103_alignment_t *this, double *lag,
+                               double *phase, double *peak);
+static void alignment_phase_slope(rf103_alignment_t *this, double lag,
+                                  double phase, double *residual_delay,
+                                  double *residual_phase);
+static uint32_t alignment_fit(const struct alignment_measurement *measurements,
+                              uint32_t nmeasurements, int phase,
+                              double *slope, double *intercept, double *rms);
+static int compare_doubles(const void *a, const void *b);
+
+
+enum {
+  ALIGNMENT_ALIGNMENT = 32,
+  ALIGNMENT_REFINEMENTS = 2,     /* of the fraction of a sample */
+  ALIGNMENT_FIT_PASSES = 3,
+  ALIGNMENT_INITIAL_MEASUREMENTS = 256
+};
+
+/* the peak must stand this much above the mean power of the correlation
+   (the largest of 64k lags of noise is ~11 times the mean) */
+static const double ALIGNMENT_DETECTION_THRESHOLD = 30.0;
+/* blocks further from the line than this many times the median distance
+   (but at least the minimum, in samples) are outliers */
+static const double ALIGNMENT_OUTLIER_FACTOR = 5.0;
+static const double ALIGNMENT_OUTLIER_MINIMUM = 0.05;
+
+typedef struct rf103_alignment {
+  enum RF103SampleType type;
+  double sample_rate;
+  uint32_t block_size;
+  uint32_t fft_size;             /* 2 * block_size */
+  fft_t *fft;
+  float *buffer_a;               /* fft_size complex */
+  float *buffer_b;               /* complex samples only */
+  float *cross;                  /* cross spectrum B * conj(A), fft_size complex */
+  float *magnitude;              /* |cross| */
+  uint32_t rejected;
+  struct alignment_measurement *measurements;
+  uint32_t nmeasurements;
+  uint32_t max_measurements;
+  double *residuals;             /* max_measurements */
+} rf103_alignment_t;
+
+
+rf103_alignment_t *rf103_alignment_open(enum RF103SampleType type,
+                                        double sample_rate,
+                                        uint32_t block_size)
+{
+  rf103_alignment_t *ret_val = 0;
+
+  if (type != SAMPLE_TYPE_S16 && type != SAMPLE_TYPE_CF32) {
+    fprintf(stderr, "ERROR - invalid alignment sample type: %d\n", type);
+    return ret_val;
+  }
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - invalid alignment sample rate: %f\n", sample_rate);
+    return ret_val;
+  }
+  if (block_size < 64 || (block_size & (block_size - 1)) != 0) {
+    fprintf(stderr, "ERROR - invalid alignment block size: %u (must be a power of 2 >= 64)\n",
+            block_size);
+    return ret_val;
+  }
+
+  uint32_t fft_size = 2 * block_size;
+  fft_t *fft = fft_open(fft_size);
+  if (fft == 0) {
+    fprintf(stderr, "ERROR - fft_open() failed\n");
+    return ret_val;
+  }
+  size_t nfloats = 7 * (size_t) fft_size;
+  float *floats = (float *) memory_budget_aligned_alloc(MEMORY_DSP,
+                                                        ALIGNMENT_ALIGNMENT,
+                                                        nfloats * sizeof(float),
+                                                        "alignment");
+  if (floats == 0) {
+    fft_close(fft);
+    return ret_val;
+  }
+  uint32_t max_measurements = ALIGNMENT_INITIAL_MEASUREMENTS;
+  struct alignment_measurement *measurements =
+      (struct alignment_measurement *) malloc(max_measurements *
+                                              sizeof(struct alignment_measurement));
+  double *residuals = (double *) malloc(max_measurements * sizeof(double));
+
+  /* we are good here - create and initialize the alignment */
+  rf103_alignment_t *this = (rf103_alignment_t *) malloc(sizeof(rf103_alignment_t));
+  this->type = type;
+  this->sample_rate = sample_rate;
+  this->block_size = block_size;
+  this->fft_size = fft_size;
+  this->fft = fft;
+  this->buffer_a = floats;
+  this->buffer_b = floats + 2 * fft_size;
+  this->cross = floats + 4 * fft_size;
+  this->magnitude = floats + 6 * fft_size;
+  this->measurements = measurements;
+  this->max_measurements = max_measurements;
+  this->residuals = residuals;
+  rf103_alignment_reset(this);
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void rf103_alignment_close(rf103_alignment_t *this)
+{
+  free(this->residuals);
+  free(this->measurements);
+  memory_budget_free(this->buffer_a);
+  fft_close(this->fft);
+  free(this);
+  return;
+}
+
+
+void rf103_alignment_reset(rf103_alignment_t *this)
+{
+  this->rejected = 0;
+  this->nmeasurements = 0;
+  return;
+}
+
+
+uint32_t rf103_alignment_get_block_size(rf103_alignment_t *this)
+{
+  return this->block_size;
+}
+
+
+int rf103_alignment_add_block(rf103_alignment_t *this, uint64_t position,
+                              const void *a, const void *b,
+                              struct rf103_alignment_block *block)
+{
+  if (this->type == SAMPLE_TYPE_S16) {
+    alignment_cross_spectrum_real(this, (const int16_t *) a,
+                                  (const int16_t *) b);
+  } else {
+    alignment_cross_spectrum_complex(this, (const float *) a,
+                                     (const float *) b);
+  }
+
+  double lag = 0.0;
+  double phase = 0.0;
+  double peak = 0.0;
+  int found = alignment_find_peak(this, &lag, &phase, &peak);
+
+  /* the delay refers to the middle of the block */
+  double center = (double) position + 0.5 * this->block_size;
+  if (block) {
+    block->position = center;
+    block->delay = lag;
+    block->phase = phase;
+    block->peak = peak;
+    block->valid = found;
+  }
+  if (!found) {
+    this->rejected++;
+    return 0;
+  }
+
+  if (this->nmeasurements == this->max_measurements) {
+    uint32_t max_measurements = 2 * this->max_measurements;
+    struct alignment_measurement *measurements =
+        (struct alignment_measurement *) realloc(this->measurements,
+                                                 max_measurements *
+                                                 sizeof(struct alignment_measurement));
+    if (measurements == 0) {
+      fprintf(stderr, "ERROR - out of memory for the alignment blocks\n");
+      return -1;
+    }
+    this->measurements = measurements;
+    double *residuals = (double *) realloc(this->residuals,
+                                           max_measurements * sizeof(double));
+    if (residuals == 0) {
+      fprintf(stderr, "ERROR - out of memory for the alignment blocks\n");
+      return -1;
+    }
+    this->residuals = residuals;
+    this->max_measurements = max_measurements;
+  }
+  struct alignment_measurement *measurement = &this->measurements[this->nmeasurements++];
+  measurement->position = center;
+  measurement->delay = lag;
+  measurement->phase = phase;
+  measurement->peak = peak;
+  measurement->used = 1;
+  return 1;
+}
+
+
+int rf103_alignment_get_estimate(rf103_alignment_t *this,
+                                 struct rf103_alignment_estimate *estimate)
+{
+  struct alignment_measurement *measurements = this->measurements;
+  uint32_t nmeasurements = this->nmeasurements;
+  memset(estimate, 0, sizeof(*estimate));
+  estimate->rejected = this->rejected;
+  if (nmeasurements == 0) {
+    fprintf(stderr, "ERROR - no block with a correlation peak\n");
+    return -1;
+  }
+
+  /* fit, drop the outliers and fit again */
+  double slope = 0.0;
+  double intercept = 0.0;
+  double rms = 0.0;
+  for (uint32_t i = 0; i < nmeasurements; ++i) {
+    measurements[i].used = 1;
+  }
+  for (int pass = 0; pass < ALIGNMENT_FIT_PASSES; ++pass) {
+    alignment_fit(measurements, nmeasurements, 0, &slope, &intercept, &rms);
+    for (uint32_t i = 0; i < nmeasurements; ++i) {
+      this->residuals[i] = fabs(measurements[i].delay - intercept -
+                                slope * measurements[i].position);
+    }
+    double *sorted = this->residuals;
+    qsort(sorted, nmeasurements, sizeof(double), compare_doubles);
+    double limit = ALIGNMENT_OUTLIER_FACTOR * sorted[nmeasurements / 2];
+    if (limit < ALIGNMENT_OUTLIER_MINIMUM) {
+      limit = ALIGNMENT_OUTLIER_MINIMUM;
+    }
+    for (uint32_t i = 0; i < nmeasurements; ++i) {
+      measurements[i].used = fabs(measurements[i].delay - intercept -
+                                  slope * measurements[i].position) <= limit;
+    }
+  }
+  uint32_t blocks = alignment_fit(measurements, nmeasurements, 0, &slope,
+                                  &intercept, &rms);
+  double peak_sum = 0.0;
+  for (uint32_t i = 0; i < nmeasurements; ++i) {
+    if (measurements[i].used) {
+      peak_sum += measurements[i].peak;
+    }
+  }
+  estimate->blocks = blocks;
+  estimate->outliers = nmeasurements - blocks;
+  estimate->delay = intercept;
+  estimate->drift = slope * 1e6;
+  estimate->residual = rms;
+  estimate->peak = peak_sum / blocks;
+
+  if (this->type == SAMPLE_TYPE_CF32 && blocks > 1) {
+    /* the offset must be small enough to turn the phase by less than half
+       a cycle from one block to the next */
+    double last_phase = 0.0;
+    int first = 1;
+    for (uint32_t i = 0; i < nmeasurements; ++i) {
+      struct alignment_measurement *measurement = &measurements[i];
+      if (!measurement->used) {
+        continue;
+      }
+      if (!first) {
+        measurement->phase += 2 * M_PI * round((last_phase - measurement->phase) /
+                                               (2 * M_PI));
+      }
+      last_phase = measurement->phase;
+      first = 0;
+    }
+    alignment_fit(measurements, nmeasurements, 1, &slope, &intercept, &rms);
+    estimate->frequency_offset = slope * this->sample_rate / (2 * M_PI);
+  }
+  return 0;
+}
+
+
+/* internal functions */
+static void alignment_cross_spectrum_real(rf103_alignment_t *this,
+                                          const int16_t *a, const int16_t *b)
+{
+  uint32_t block_size = this->block_size;
+  uint32_t fft_size = this->fft_size;
+  float *buffer = this->buffer_a;
+  for (uint32_t i = 0; i < block_size; ++i) {
+    buffer[2*i] = a[i];
+    buffer[2*i+1] = b[i];
+  }
+  memset(buffer + 2 * block_size, 0, 2 * block_size * sizeof(float));
+  fft_forward(this->fft, buffer);
+
+  /* with z = a + i*b: A[k] = (Z[k] + conj(Z[-k])) / 2 and
+     B[k] = (Z[k] - conj(Z[-k])) / 2i */
+  float *cross = this->cross;
+  float *magnitude = this->magnitude;
+  for (uint32_t k = 0; k < fft_size; ++k) {
+    uint32_t j = (fft_size - k) & (fft_size - 1);
+    float zr = buffer[2*k];
+    float zi = buffer[2*k+1];
+    float yr = buffer[2*j];
+    float yi = buffer[2*j+1];
+    float ar = 0.5f * (zr + yr);
+    float ai = 0.5f * (zi - yi);
+    float br = 0.5f * (zi + yi);
+    float bi = 0.5f * (yr - zr);
+    float cr = br * ar + bi * ai;
+    float ci = bi * ar - br * ai;
+    cross[2*k] = cr;
+    cross[2*k+1] = ci;
+    magnitude[k] = sqrtf(cr * cr + ci * ci);
+  }
+  return;
+}
+
+
+static void alignment_cross_spectrum_complex(rf103_alignment_t *this,
+                                             const float *a, const float *b)
+{
+  uint32_t block_size = this->block_size;
+  uint32_t fft_size = this->fft_size;
+  float *buffer_a = this->buffer_a;
+  float *buffer_b = this->buffer_b;
+  memcpy(buffer_a, a, 2 * block_size * sizeof(float));
+  memset(buffer_a + 2 * block_size, 0, 2 * block_size * sizeof(float));
+  memcpy(buffer_b, b, 2 * block_size * sizeof(float));
+  memset(buffer_b + 2 * block_size, 0, 2 * block_size * sizeof(float));
+  fft_forward(this->fft, buffer_a);
+  fft_forward(this->fft, buffer_b);
+
+  float *cross = this->cross;
+  float *magnitude = this->magnitude;
+  for (uint32_t k = 0; k < fft_size; ++k) {
+    float ar = buffer_a[2*k];
+    float ai = buffer_a[2*k+1];
+    float br = buffer_b[2*k];
+    float bi = buffer_b[2*k+1];
+    float cr = br * ar + bi * ai;
+    float ci = bi * ar - br * ai;
+    cross[2*k] = cr;
+    cross[2*k+1] = ci;
+    magnitude[k] = sqrtf(cr * cr + ci * ci);
+  }
+  return;
+}
+
+
+static int alignment_find_peak(rf103_alignment_t *this, double *lag,
+                               double *phase, double *peak)
+{
+  uint32_t fft_size = this->fft_size;
+  const float *cross = this->cross;
+  const float *magnitude = this->magnitude;
+
+  /* phase transform: keep only the phase of the cross spectrum */
+  float *correlation = this->buffer_a;
+  uint32_t bins = 0;
+  for (uint32_t k = 0; k < fft_size; ++k) {
+    if (magnitude[k] > 0) {
+      float scale = 1.0f / magnitude[k];
+      correlation[2*k] = cross[2*k] * scale;
+      correlation[2*k+1] = cross[2*k+1] * scale;
+      bins++;
+    } else {
+      correlation[2*k] = 0.0f;
+      correlation[2*k+1] = 0.0f;
+    }
+  }
+  if (bins == 0) {
+    return 0;
+  }
+  fft_inverse(this->fft, correlation);
+
+  /* b lags a by m samples: the peak is at index m (mod fft_size); with
+     less than half of the blocks overlapping the peak is not reliable */
+  uint32_t max_lag = this->block_size / 2;
+  double total = 0.0;
+  float best = -1.0f;
+  uint32_t best_index = 0;
+  for (uint32_t k = 0; k < fft_size; ++k) {
+    float re = correlation[2*k];
+    float im = correlation[2*k+1];
+    float power = re * re + im * im;
+    total += power;
+    if (power > best && (k <= max_lag || k >= fft_size - max_lag)) {
+      best = power;
+      best_index = k;
+    }
+  }
+  double mean = total / fft_size;
+  if (mean <= 0 || best < ALIGNMENT_DETECTION_THRESHOLD * mean) {
+    return 0;
+  }
+
+  double integer_lag = best_index <= max_lag ? (double) best_index :
+                       (double) best_index - fft_size;
+  double peak_phase = atan2(correlation[2*best_index+1],
+                            correlation[2*best_index]);
+  /* the fraction of a sample and the phase at zero frequency come from the
+     line through the residual phase of the cross spectrum; the fit is
+     repeated on what is left, so the first one does not have to be exact */
+  double delay = integer_lag;
+  for (int i = 0; i < ALIGNMENT_REFINEMENTS; ++i) {
+    double residual_delay;
+    double residual_phase;
+    alignment_phase_slope(this, delay, peak_phase, &residual_delay,
+                          &residual_phase);
+    delay += residual_delay;
+    peak_phase += residual_phase;
+  }
+  if (fabs(delay - integer_lag) > 1.0) {
+    return 0;
+  }
+
+  *lag = delay;
+  *phase = atan2(sin(peak_phase), cos(peak_phase));
+  *peak = sqrt(best) / bins;
+  return 1;
+}
+
+
+/* weighted least squares fit of the phase of
+   cross[k] * exp(i*w[k]*lag - i*phase) to a line in w[k]: the phase of
+   B * conj(A) falls by w per sample of delay, so the slope is minus the
+   delay left and the intercept the phase left */
+static void alignment_phase_slope(rf103_alignment_t *this, double lag,
+                                  double phase, double *residual_delay,
+                                  double *residual_phase)
+{
+  uint32_t fft_size = this->fft_size;
+  const float *cross = this->cross;
+  const float *magnitude = this->magnitude;
+  /* the cross spectrum of real signals is hermitian: the positive
+     frequencies are enough */
+  uint32_t nbins = this->type == SAMPLE_TYPE_S16 ? fft_size / 2 : fft_size;
+  double dw = 2 * M_PI / fft_size;
+  /* rotator for exp(i*w[k]*lag) */
+  double step_re = cos(dw * lag);
+  double step_im = sin(dw * lag);
+  double rot_re = cos(-phase);
+  double rot_im = sin(-phase);
+  double sw = 0.0;
+  double swx = 0.0;
+  double swy = 0.0;
+  double swxx = 0.0;
+  double swxy = 0.0;
+  for (uint32_t k = 0; k < nbins; ++k) {
+    double w = k < fft_size / 2 ? dw * k : dw * ((double) k - fft_size);
+    if (k == fft_size / 2) {
+      /* the rotator goes on from +pi, which is also -pi */
+      rot_re = cos(-phase - M_PI * lag);
+      rot_im = sin(-phase - M_PI * lag);
+    }
+    double weight = magnitude[k];
+    if (weight > 0) {
+      double re = cross[2*k] * rot_re - cross[2*k+1] * rot_im;
+      double im = cross[2*k] * rot_im + cross[2*k+1] * rot_re;
+      double y = atan2(im, re);
+      sw += weight;
+      swx += weight * w;
+      swy += weight * y;
+      swxx += weight * w * w;
+      swxy += weight * w * y;
+    }
+    double re = rot_re * step_re - rot_im * step_im;
+    rot_im = rot_re * step_im + rot_im * step_re;
+    rot_re = re;
+  }
+  double det = sw * swxx - swx * swx;
+  if (sw <= 0 || det <= 0) {
+    *residual_delay = 0.0;
+    *residual_phase = 0.0;
+    return;
+  }
+  *residual_delay = -(sw * swxy - swx * swy) / det;
+  *residual_phase = (swxx * swy - swx * swxy) / det;
+  return;
+}
+
+
+/* least squares line through the delays (or phases) of the blocks in use;
+   returns how many they are */
+static uint32_t alignment_fit(const struct alignment_measurement *measurements,
+                              uint32_t nmeasurements, int phase,
+                              double *slope, double *intercept, double *rms)
+{
+  /* centered on the first block in use, so the sums keep their precision */
+  uint32_t n = 0;
+  double x0 = 0.0;
+  double sx = 0.0;
+  double sy = 0.0;
+  double sxx = 0.0;
+  double sxy = 0.0;
+  for (uint32_t i = 0; i < nmeasurements; ++i) {
+    const struct alignment_measurement *measurement = &measurements[i];
+    if (!measurement->used) {
+      continue;
+    }
+    if (n == 0) {
+      x0 = measurement->position;
+    }
+    double x = measurement->position - x0;
+    double y = phase ? measurement->phase : measurement->delay;
+    n++;
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+  }
+  double det = n * sxx - sx * sx;
+  *slope = n > 1 && det > 0 ? (n * sxy - sx * sy) / det : 0.0;
+  *intercept = n > 0 ? (sy - *slope * sx) / n - *slope * x0 : 0.0;
+
+  double ssr = 0.0;
+  for (uint32_t i = 0; i < nmeasurements; ++i) {
+    const struct alignment_measurement *measurement = &measurements[i];
+    if (measurement->used) {
+      double y = phase ? measurement->phase : measurement->delay;
+      double r = y - *intercept - *slope * measurement->position;
+      ssr += r * r;
+    }
+  }
+  *rms = n > 0 ? sqrt(ssr / n) : 0.0;
+  return n;
+}
+
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * birdie.c - birdie identification and list functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* the finder runs the CFAR detector (order statistic, so a birdie next to a
+ * strong station is still found) on the averaged spectra and follows the
+ * tracks that stay narrow (BIRDIE_MAX_WIDTH bins away from the peak the
+ * power is down by BIRDIE_SKIRT, whatever the CFAR cluster width, which
+ * grows with the level because of the window sidelobes): a track whose center
+ * does not move by more than a bin for min_age spectra is a birdie (real
+ * stations are either modulated, hence wider, or not on all the time).
+ * The board clocks leak into the spectrum as harmonics folded by the
+ * sampling, so a birdie that lands on one of them is labelled with its
+ * origin; the labels are informative only
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "birdie.h"
+#include "cfar.h"
+
+
+typedef struct birdie_finder birdie_finder_t;
+
+
+enum {
+  BIRDIE_MAX_WIDTH = 3,          /* bins from the peak */
+  BIRDIE_MAX_CANDIDATES = 1024
+};
+
+static const float BIRDIE_SKIRT = 0.01f;        /* -20dB */
+
+/* harmonics are considered up to the analog bandwidth of the ADC */
+static const double BIRDIE_MAX_HARMONIC_FREQUENCY = 1e9;
+/* and they move with the crystal error */
+static const double BIRDIE_CLOCK_TOLERANCE = 20e-6;
+
+static const struct {
+  const char *origin;
+  double frequency;
+} birdie_clocks[] = {
+  { "si5351", 27e6 },            /* SI5351_FREQ in clock_source.c */
+  { "usb", 12e6 }                /* USB reference (48MHz, 60MHz, 480MHz) */
+};
+
+struct birdie_candidate {
+  uint32_t id;                   /* of the CFAR track */
+  double center;                 /* when first seen narrow (bins) */
+  uint64_t first_seen;
+  int reported;
+  int seen;
+};
+
+typedef struct birdie_finder {
+  cfar_t *cfar;
+  uint32_t nbins;
+  double bin_width;
+  uint32_t min_age;
+  uint64_t timestamp;            /* spectra so far */
+  struct birdie_candidate candidates[BIRDIE_MAX_CANDIDATES];
+  uint32_t ncandidates;
+} birdie_finder_t;
+
+
+birdie_finder_t *birdie_finder_open(uint32_t nbins, double bin_width,
+                                    double threshold, uint32_t min_age)
+{
+  birdie_finder_t *ret_val = 0;
+
+  cfar_t *cfar = cfar_open(nbins, CFAR_ORDER_STATISTIC, threshold);
+  if (cfar == 0) {
+    fprintf(stderr, "ERROR - cfar_open() failed\n");
+    return ret_val;
+  }
+
+  /* we are good here - create and initialize the birdie finder */
+  birdie_finder_t *this = (birdie_finder_t *) malloc(sizeof(birdie_finder_t));
+  this->cfar = cfar;
+  this->nbins = nbins;
+  this->bin_width = bin_width;
+  this->min_age = min_age;
+  this->timestamp = 0;
+  this->ncandidates = 0;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void birdie_finder_close(birdie_finder_t *this)
+{
+  cfar_close(this->cfar);
+  free(this);
+  return;
+}
+
+
+uint32_t birdie_finder_update(birdie_finder_t *this, const float *power,
+                              double *found, uint32_t max_found)
+{
+  uint64_t timestamp = this->timestamp++;
+  const struct cfar_signal *signals;
+  uint32_t nsignals = cfar_detect(this->cfar, power, timestamp, &signals);
+
+  for (uint32_t i = 0; i < this->ncandidates; ++i)
+    this->candidates[i].seen = 0;
+
+  uint32_t nfound = 0;
+  for (uint32_t i = 0; i < nsignals; ++i) {
+    const struct cfar_signal *signal = &signals[i];
+    if (signal->last_seen != timestamp)
+      continue;
+    int64_t peak = llround(signal->center);
+    if (peak < BIRDIE_MAX_WIDTH || peak + BIRDIE_MAX_WIDTH >= this->nbins ||
+        power[peak - BIRDIE_MAX_WIDTH] > power[peak] * BIRDIE_SKIRT ||
+        power[peak + BIRDIE_MAX_WIDTH] > power[peak] * BIRDIE_SKIRT)
+      continue;
+    struct birdie_candidate *candidate = 0;
+    for (uint32_t j = 0; j < this->ncandidates; ++j) {
+      if (this->candidates[j].id == signal->id) {
+        candidate = &this->candidates[j];
+        break;
+      }
+    }
+    if (candidate == 0) {
+      if (this->ncandidates == BIRDIE_MAX_CANDIDATES)
+        continue;
+      candidate = &this->candidates[this->ncandidates++];
+      candidate->id = signal->id;
+      candidate->center = signal->center;
+      candidate->first_seen = timestamp;
+      candidate->reported = 0;
+    } else if (fabs(signal->center - candidate->center) > 1.0) {
+      /* it moves: start over from here */
+      candidate->center = signal->center;
+      candidate->first_seen = timestamp;
+    }
+    candidate->seen = 1;
+    if (!candidate->reported &&
+        timestamp - candidate->first_seen + 1 >= this->min_age &&
+        nfound < max_found) {
+      found[nfound++] = signal->center * this->bin_width;
+      candidate->reported = 1;
+    }
+  }
+
+  /* forget the candidates that went away or got wider */
+  uint32_t ncandidates = 0;
+  for (uint32_t i = 0; i < this->ncandidates; ++i) {
+    if (this->candidates[i].seen)
+      this->candidates[ncandidates++] = this->candidates[i];
+  }
+  this->ncandidates = ncandidates;
+  return nfound;
+}
+
+
+const char *birdie_origin(double frequency, double sample_rate,
+                          double tolerance)
+{
+  for (size_t i = 0; i < sizeof(birdie_clocks) / sizeof(birdie_clocks[0]); ++i) {
+    double clock = birdie_clocks[i].frequency;
+    for (int harmonic = 1; harmonic * clock <= BIRDIE_MAX_HARMONIC_FREQUENCY;
+         ++harmonic) {
+      double alias = fmod(harmonic * clock, sample_rate);
+      if (alias > sample_rate / 2)
+        alias = sample_rate - alias;
+      if (fabs(alias - frequency) <= tolerance +
+                                     harmonic * clock * BIRDIE_CLOCK_TOLERANCE)
+        return birdie_clocks[i].origin;
+    }
+  }
+  return 0;
+}
+
+
+int birdie_read_list(const char *filename, struct rf103_birdie *birdies,
+                     int max)
+{
+  FILE *file = fopen(filename, "r");
+  if (file == 0) {
+    if (errno == ENOENT)
+      return 0;
+    fprintf(stderr, "ERROR - fopen(%s) failed: %s\n", filename,
+            strerror(errno));
+    return -1;
+  }
+  int nbirdies = 0;
+  int line_number = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), file)) {
+    line_number++;
+    char *text = line + strspn(line, " \t");
+    if (*text == '#' || *text == '\n' || *text == '\0')
+      continue;
+    if (nbirdies == max) {
+      fprintf(stderr, "ERROR - too many birdies in %s (max %d)\n", filename,
+              max);
+      break;
+    }
+    struct rf103_birdie *birdie = &birdies[nbirdies];
+    memset(birdie, 0, sizeof(struct rf103_birdie));
+    int n = sscanf(text, "%lf %lf %15s", &birdie->frequency, &birdie->width,
+                   birdie->origin);
+    if (n < 2 || birdie->frequency <= 0 || birdie->width < 0) {
+      fprintf(stderr, "ERROR - invalid birdie in %s at line %d\n", filename,
+              line_number);
+      continue;
+    }
+    nbirdies++;
+  }
+  fclose(file);
+  return nbirdies;
+}
+
+
+int birdie_write_list(const char *filename,
+                      const struct rf103_birdie *birdies, int nbirdies)
+{
+  /* replace the file in one step, so it is never seen half written */
+  char temporary[1024];
+  snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+  FILE *file = fopen(temporary, "w");
+  if (file == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed: %s\n", temporary,
+            strerror(errno));
+    return -1;
+  }
+  fprintf(file, "# birdies: <frequency (Hz)> <notch width (Hz)> [<origin>]\n");
+  fprintf(file, "# a width of 0 keeps the carrier\n");
+  for (int i = 0; i < nbirdies; ++i) {
+    fprintf(file, "%.1f %g %s\n", birdies[i].frequency, birdies[i].width,
+            birdies[i].origin);
+  }
+  if (fclose(file) != 0 || rename(temporary, filename) != 0) {
+    fprintf(stderr, "ERROR - writing %s failed: %s\n", filename,
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * birdie.h - birdie identification and list functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+#ifndef __BIRDIE_H
+#define __BIRDIE_H
+
+#include <stdint.h>
+
+#include "rf103.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct birdie_finder birdie_finder_t;
+
+/* finds the stable narrowband carriers in a sequence of averaged power
+ * spectra of the real stream (nbins from 0 to the Nyquist frequency) */
+birdie_finder_t *birdie_finder_open(uint32_t nbins, double bin_width,
+                                    double threshold, uint32_t min_age);
+
+void birdie_finder_close(birdie_finder_t *this);
+
+/* returns the number of carriers (stored in found[], in Hz) that have been
+ * narrow and at the same frequency for min_age spectra up to this one;
+ * each carrier is reported once */
+uint32_t birdie_finder_update(birdie_finder_t *this, const float *power,
+                              double *found, uint32_t max_found);
+
+/* the board clock ("si5351", "usb") that has a harmonic which the ADC sees
+ * within tolerance of frequency, or 0 */
+const char *birdie_origin(double frequency, double sample_rate,
+                          double tolerance);
+
+/* returns the number of birdies read (0 if the file does not exist) or -1;
+ * only frequency, width and origin are set */
+int birdie_read_list(const char *filename, struct rf103_birdie *birdies,
+                     int max);
+
+int birdie_write_list(const char *filename,
+                      const struct rf103_birdie *birdies, int nbirdies);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BIRDIE_H */
@@ -0,0 +1,435 @@
+/*
+ * broadcast.c - in-process fan-out of stream frames
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* the frames live in a pool of buffers with reference counts; the ring holds
+ * the pool indexes of the last num_frames frames, and every consumer has its
+ * own cursor (frame sequence number) into it. A buffer is reused only when
+ * it is out of the ring and no consumer is reading it, so the pool needs
+ * num_frames buffers for the ring, one for each consumer and one for the
+ * producer. The data is copied once (from the USB buffer into the pool); the
+ * copy is done outside the lock and the consumers run their callbacks
+ * without holding it either
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "broadcast.h"
+#include "memory_budget.h"
+
+
+typedef struct broadcast broadcast_t;
+
+/* internal functions */
+static void *broadcast_consumer_thread(void *arg);
+static int broadcast_is_blocked(broadcast_t *this);
+
+
+enum {
+  BROADCAST_MIN_FRAMES = 4         /* with a memory budget */
+};
+
+struct broadcast_consumer {
+  broadcast_t *broadcast;
+  int active;
+  enum RF103OverflowPolicy policy;
+  rf103_read_async_cb_t callback;
+  void *callback_context;
+  pthread_t thread;
+  int started;
+  uint64_t cursor;                 /* next frame to read */
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t lost_frames;
+  uint32_t lag;
+  uint32_t max_lag;
+};
+
+typedef struct broadcast {
+  uint32_t num_frames;
+  uint32_t ring_frames;            /* of this run (fewer with a memory budget) */
+  uint32_t max_frame_size;
+  uint32_t num_buffers;
+  uint8_t *buffers;                /* num_buffers * max_frame_size */
+  uint32_t *sizes;
+  uint32_t *references;            /* ring + readers + producer */
+  uint32_t *ring;                  /* buffer of frame n: ring[n % ring_frames] */
+  uint64_t head;                   /* frames written */
+  int running;
+  int stopping;
+  struct broadcast_consumer consumers[BROADCAST_MAX_CONSUMERS];
+  pthread_mutex_t mutex;
+  pthread_cond_t frame_available;  /* for the consumers */
+  pthread_cond_t space_available;  /* for the producer */
+} broadcast_t;
+
+
+broadcast_t *broadcast_open(uint32_t num_frames)
+{
+  broadcast_t *ret_val = 0;
+
+  if (num_frames == 0) {
+    fprintf(stderr, "ERROR - invalid number of broadcast frames: %u\n",
+            num_frames);
+    return ret_val;
+  }
+
+  /* we are good here - create and initialize the broadcast */
+  broadcast_t *this = (broadcast_t *) malloc(sizeof(broadcast_t));
+  this->num_frames = num_frames;
+  this->ring_frames = 0;
+  this->max_frame_size = 0;
+  this->num_buffers = 0;
+  this->buffers = 0;
+  this->sizes = 0;
+  this->references = 0;
+  this->ring = 0;
+  this->head = 0;
+  this->running = 0;
+  this->stopping = 0;
+  memset(this->consumers, 0, sizeof(this->consumers));
+  pthread_mutex_init(&this->mutex, 0);
+  pthread_cond_init(&this->frame_available, 0);
+  pthread_cond_init(&this->space_available, 0);
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void broadcast_close(broadcast_t *this)
+{
+  if (this->running) {
+    broadcast_stop(this);
+  }
+  pthread_mutex_destroy(&this->mutex);
+  pthread_cond_destroy(&this->frame_available);
+  pthread_cond_destroy(&this->space_available);
+  free(this);
+  return;
+}
+
+
+int broadcast_set_num_frames(broadcast_t *this, uint32_t num_frames)
+{
+  if (this->running) {
+    fprintf(stderr, "ERROR - broadcast_set_num_frames() failed: broadcast running\n");
+    return -1;
+  }
+  if (num_frames == 0) {
+    fprintf(stderr, "ERROR - invalid number of broadcast frames: %u\n",
+            num_frames);
+    return -1;
+  }
+  this->num_frames = num_frames;
+  return 0;
+}
+
+
+int broadcast_add_consumer(broadcast_t *this,
+                           enum RF103OverflowPolicy policy,
+                           rf103_read_async_cb_t callback,
+                           void *callback_context)
+{
+  if (this->running) {
+    fprintf(stderr, "ERROR - broadcast_add_consumer() failed: broadcast running\n");
+    return -1;
+  }
+  if (policy != OVERFLOW_BLOCK && policy != OVERFLOW_SKIP &&
+      policy != OVERFLOW_DROP_OLDEST) {
+    fprintf(stderr, "ERROR - invalid overflow policy: %d\n", policy);
+    return -1;
+  }
+  if (callback == 0) {
+    fprintf(stderr, "ERROR - broadcast_add_consumer() failed: no callback\n");
+    return -1;
+  }
+  for (int i = 0; i < BROADCAST_MAX_CONSUMERS; ++i) {
+    struct broadcast_consumer *consumer = &this->consumers[i];
+    if (!consumer->active) {
+      memset(consumer, 0, sizeof(struct broadcast_consumer));
+      consumer->broadcast = this;
+      consumer->active = 1;
+      consumer->policy = policy;
+      consumer->callback = callback;
+      consumer->callback_context = callback_context;
+      return i;
+    }
+  }
+  fprintf(stderr, "ERROR - too many consumers (max %d)\n",
+          BROADCAST_MAX_CONSUMERS);
+  return -1;
+}
+
+
+int broadcast_remove_consumer(broadcast_t *this, int consumer)
+{
+  if (this->running) {
+    fprintf(stderr, "ERROR - broadcast_remove_consumer() failed: broadcast running\n");
+    return -1;
+  }
+  if (consumer < 0 || consumer >= BROADCAST_MAX_CONSUMERS ||
+      !this->consumers[consumer].active) {
+    fprintf(stderr, "ERROR - invalid consumer: %d\n", consumer);
+    return -1;
+  }
+  this->consumers[consumer].active = 0;
+  return 0;
+}
+
+
+int broadcast_get_num_consumers(broadcast_t *this)
+{
+  int num_consumers = 0;
+  for (int i = 0; i < BROADCAST_MAX_CONSUMERS; ++i) {
+    num_consumers += this->consumers[i].active;
+  }
+  return num_consumers;
+}
+
+
+int broadcast_start(broadcast_t *this, uint32_t max_frame_size)
+{
+  if (this->running) {
+    fprintf(stderr, "ERROR - broadcast_start() failed: already running\n");
+    return -1;
+  }
+
+  /* with a memory budget the ring shrinks to what fits */
+  uint32_t ring_frames = this->num_frames;
+  uint64_t available = memory_budget_available() / max_frame_size;
+  if (ring_frames + BROADCAST_MAX_CONSUMERS + 1 > available) {
+    if (available < BROADCAST_MIN_FRAMES + BROADCAST_MAX_CONSUMERS + 1) {
+      fprintf(stderr, "ERROR - the memory budget does not fit %u consumer frames of %u bytes\n",
+              BROADCAST_MIN_FRAMES, max_frame_size);
+      return -1;
+    }
+    fprintf(stderr, "WARNING - only %u of the %u consumer frames fit the memory budget\n",
+            (unsigned)(available - BROADCAST_MAX_CONSUMERS - 1), this->num_frames);
+    ring_frames = (uint32_t) (available - BROADCAST_MAX_CONSUMERS - 1);
+  }
+
+  uint32_t num_buffers = ring_frames + BROADCAST_MAX_CONSUMERS + 1;
+  uint8_t *buffers = (uint8_t *) memory_budget_alloc(MEMORY_WRITERS,
+                                                     (size_t) num_buffers * max_frame_size,
+                                                     "consumer frames");
+  uint32_t *sizes = (uint32_t *) calloc(num_buffers, sizeof(uint32_t));
+  uint32_t *references = (uint32_t *) calloc(num_buffers, sizeof(uint32_t));
+  uint32_t *ring = (uint32_t *) calloc(ring_frames, sizeof(uint32_t));
+  if (buffers == 0 || sizes == 0 || references == 0 || ring == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    memory_budget_free(buffers);
+    free(sizes);
+    free(references);
+    free(ring);
+    return -1;
+  }
+  this->ring_frames = ring_frames;
+  this->max_frame_size = max_frame_size;
+  this->num_buffers = num_buffers;
+  this->buffers = buffers;
+  this->sizes = sizes;
+  this->references = references;
+  this->ring = ring;
+  this->head = 0;
+  this->stopping = 0;
+  this->running = 1;
+
+  for (int i = 0; i < BROADCAST_MAX_CONSUMERS; ++i) {
+    struct broadcast_consumer *consumer = &this->consumers[i];
+    if (!consumer->active) {
+      continue;
+    }
+    consumer->cursor = 0;
+    consumer->frames = 0;
+    consumer->bytes = 0;
+    consumer->lost_frames = 0;
+    consumer->lag = 0;
+    consumer->max_lag = 0;
+    int ret = pthread_create(&consumer->thread, 0, broadcast_consumer_thread,
+                             consumer);
+    if (ret != 0) {
+      fprintf(stderr, "ERROR - pthread_create() failed: %s\n", strerror(ret));
+      broadcast_stop(this);
+      return -1;
+    }
+    consumer->started = 1;
+  }
+  return 0;
+}
+
+
+int broadcast_stop(broadcast_t *this)
+{
+  if (!this->running) {
+    return 0;
+  }
+  pthread_mutex_lock(&this->mutex);
+  this->stopping = 1;
+  pthread_cond_broadcast(&this->frame_available);
+  pthread_cond_broadcast(&this->space_available);
+  pthread_mutex_unlock(&this->mutex);
+  for (int i = 0; i < BROADCAST_MAX_CONSUMERS; ++i) {
+    if (this->consumers[i].started) {
+      pthread_join(this->consumers[i].thread, 0);
+      this->consumers[i].started = 0;
+    }
+  }
+  this->running = 0;
+  memory_budget_free(this->buffers);
+  free(this->sizes);
+  free(this->references);
+  free(this->ring);
+  this->buffers = 0;
+  this->sizes = 0;
+  this->references = 0;
+  this->ring = 0;
+  return 0;
+}
+
+
+void broadcast_write(broadcast_t *this, const uint8_t *data, uint32_t size)
+{
+  if (size > this->max_frame_size) {
+    size = this->max_frame_size;
+  }
+
+  pthread_mutex_lock(&this->mutex);
+  while (broadcast_is_blocked(this)) {
+    pthread_cond_wait(&this->space_available, &this->mutex);
+  }
+  /* there is always a free buffer (see above) */
+  uint32_t buffer = 0;
+  while (this->references[buffer] != 0) {
+    buffer++;
+  }
+  this->references[buffer] = 1;
+  pthread_mutex_unlock(&this->mutex);
+
+  rf103_copy_frame(this->buffers + (size_t) buffer * this->max_frame_size,
+                   data, size);
+  this->sizes[buffer] = size;
+
+  pthread_mutex_lock(&this->mutex);
+  uint32_t slot = this->head % this->ring_frames;
+  if (this->head >= this->ring_frames) {
+    /* the oldest frame leaves the ring */
+    this->references[this->ring[slot]]--;
+  }
+  this->ring[slot] = buffer;
+  this->head++;
+  pthread_cond_broadcast(&this->frame_available);
+  pthread_mutex_unlock(&this->mutex);
+  return;
+}
+
+
+int broadcast_get_consumer_stats(broadcast_t *this, int consumer,
+                                 struct rf103_consumer_stats *stats)
+{
+  if (consumer < 0 || consumer >= BROADCAST_MAX_CONSUMERS ||
+      !this->consumers[consumer].active) {
+    fprintf(stderr, "ERROR - invalid consumer: %d\n", consumer);
+    return -1;
+  }
+  pthread_mutex_lock(&this->mutex);
+  const struct broadcast_consumer *c = &this->consumers[consumer];
+  stats->frames = c->frames;
+  stats->bytes = c->bytes;
+  stats->lost_frames = c->lost_frames;
+  stats->lag = c->lag;
+  stats->max_lag = c->max_lag;
+  pthread_mutex_unlock(&this->mutex);
+  return 0;
+}
+
+
+/* internal functions */
+static void *broadcast_consumer_thread(void *arg)
+{
+  struct broadcast_consumer *consumer = (struct broadcast_consumer *) arg;
+  broadcast_t *this = consumer->broadcast;
+  uint32_t ring_frames = this->ring_frames;
+
+  pthread_mutex_lock(&this->mutex);
+  for (;;) {
+    while (consumer->cursor == this->head && !this->stopping) {
+      pthread_cond_wait(&this->frame_available, &this->mutex);
+    }
+    if (consumer->cursor == this->head) {
+      /* stopping and nothing left */
+      break;
+    }
+    if (this->head - consumer->cursor > ring_frames) {
+      /* overrun (never for OVERFLOW_BLOCK) */
+      uint64_t next = consumer->policy == OVERFLOW_SKIP ? this->head - 1 :
+                      this->head - ring_frames;
+      consumer->lost_frames += next - consumer->cursor;
+      consumer->cursor = next;
+    }
+    uint32_t buffer = this->ring[consumer->cursor % ring_frames];
+    this->references[buffer]++;
+    consumer->cursor++;
+    consumer->lag = (uint32_t) (this->head - consumer->cursor);
+    if (consumer->lag > consumer->max_lag) {
+      consumer->max_lag = consumer->lag;
+    }
+    if (consumer->policy == OVERFLOW_BLOCK) {
+      pthread_cond_signal(&this->space_available);
+    }
+    pthread_mutex_unlock(&this->mutex);
+
+    uint32_t size = this->sizes[buffer];
+    consumer->callback(size,
+                       this->buffers + (size_t) buffer * this->max_frame_size,
+                       consumer->callback_context);
+
+    pthread_mutex_lock(&this->mutex);
+    this->references[buffer]--;
+    consumer->frames++;
+    consumer->bytes += size;
+  }
+  pthread_mutex_unlock(&this->mutex);
+  return 0;
+}
+
+
+/* the next write would overwrite a frame an OVERFLOW_BLOCK consumer has not
+   read yet */
+static int broadcast_is_blocked(broadcast_t *this)
+{
+  if (this->stopping || this->head < this->ring_frames) {
+    return 0;
+  }
+  uint64_t oldest = this->head - this->ring_frames;
+  for (int i = 0; i < BROADCAST_MAX_CONSUMERS; ++i) {
+    const struct broadcast_consumer *consumer = &this->consumers[i];
+    if (consumer->started && consumer->policy == OVERFLOW_BLOCK &&
+        consumer->cursor <= oldest) {
+      return 1;
+    }
+  }
+  return 0;
+}
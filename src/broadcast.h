@@ -0,0 +1,75 @@
+/*
+ * broadcast.h - in-process fan-out of stream frames
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+#ifndef __BROADCAST_H
+#define __BROADCAST_H
+
+#include <stdint.h>
+
+#include "rf103.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct broadcast broadcast_t;
+
+enum {
+  BROADCAST_MAX_CONSUMERS = 16
+};
+
+broadcast_t *broadcast_open(uint32_t num_frames);
+
+void broadcast_close(broadcast_t *this);
+
+int broadcast_set_num_frames(broadcast_t *this, uint32_t num_frames);
+
+/* returns the consumer id */
+int broadcast_add_consumer(broadcast_t *this,
+                           enum RF103OverflowPolicy policy,
+                           rf103_read_async_cb_t callback,
+                           void *callback_context);
+
+int broadcast_remove_consumer(broadcast_t *this, int consumer);
+
+int broadcast_get_num_consumers(broadcast_t *this);
+
+/* allocate the frames (up to max_frame_size bytes each) and start the
+ * consumer threads */
+int broadcast_start(broadcast_t *this, uint32_t max_frame_size);
+
+/* let the consumers drain the frames already written, then stop them */
+int broadcast_stop(broadcast_t *this);
+
+/* called by the (single) producer; it only waits for OVERFLOW_BLOCK
+ * consumers */
+void broadcast_write(broadcast_t *this, const uint8_t *data, uint32_t size);
+
+int broadcast_get_consumer_stats(broadcast_t *this, int consumer,
+                                 struct rf103_consumer_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BROADCAST_H */
@@ -0,0 +1,139 @@
+/*
+ * calibration.c - frequency calibration functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - E. Jacobsen, P. Kootsookos - Fast, Accurate Frequency Estimators (IEEE Signal Processing Magazine, May 2007)
+ *  - D. Grandke - Interpolation Algorithms for Discrete Fourier Transforms of Weighted Signals (IEEE Trans. Instrum. Meas., 1983)
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "calibration.h"
+#include "fft.h"
+
+
+static const uint32_t MAX_CALIBRATION_FFT_SIZE = 1 << 18;
+static const uint32_t MIN_CALIBRATION_FFT_SIZE = 1 << 10;
+
+
+int calibration_estimate_carrier_frequency(const int16_t *samples,
+                                           uint32_t nsamples,
+                                           double sample_rate,
+                                           double carrier_frequency,
+                                           double search_span,
+                                           double *measured_frequency)
+{
+  if (sample_rate <= 0 || carrier_frequency <= 0 ||
+      carrier_frequency >= sample_rate / 2) {
+    fprintf(stderr, "ERROR - invalid carrier frequency %lg for sample rate %lg\n",
+            carrier_frequency, sample_rate);
+    return -1;
+  }
+
+  /* largest power of 2 that fits in the capture */
+  uint32_t fft_size = MAX_CALIBRATION_FFT_SIZE;
+  while (fft_size > nsamples && fft_size > MIN_CALIBRATION_FFT_SIZE) {
+    fft_size >>= 1;
+  }
+  if (fft_size > nsamples) {
+    fprintf(stderr, "ERROR - capture too short for calibration: %u samples\n",
+            nsamples);
+    return -1;
+  }
+  uint32_t nblocks = nsamples / fft_size;
+
+  /* bins to search */
+  double bin_width = sample_rate / fft_size;
+  int32_t lower_bin = (int32_t) ((carrier_frequency - search_span / 2) / bin_width);
+  int32_t upper_bin = (int32_t) ((carrier_frequency + search_span / 2) / bin_width) + 1;
+  if (lower_bin < 1) {
+    lower_bin = 1;
+  }
+  if (upper_bin > (int32_t) fft_size / 2 - 2) {
+    upper_bin = fft_size / 2 - 2;
+  }
+  if (upper_bin <= lower_bin) {
+    fprintf(stderr, "ERROR - search span is too narrow: %lg\n", search_span);
+    return -1;
+  }
+
+  fft_t *fft = fft_open(fft_size);
+  if (fft == 0) {
+    fprintf(stderr, "ERROR - fft_open() failed\n");
+    return -1;
+  }
+  float *window = (float *) malloc(fft_size * sizeof(float));
+  float *data = (float *) malloc(2 * fft_size * sizeof(float));
+  double *power = (double *) calloc(fft_size / 2, sizeof(double));
+  for (uint32_t i = 0; i < fft_size; ++i) {
+    window[i] = (float) (0.5 - 0.5 * cos(2 * M_PI * i / fft_size));
+  }
+
+  /* average the power spectra of the blocks (Hann window) */
+  for (uint32_t block = 0; block < nblocks; ++block) {
+    const int16_t *x = samples + block * fft_size;
+    for (uint32_t i = 0; i < fft_size; ++i) {
+      data[2 * i] = window[i] * x[i];
+      data[2 * i + 1] = 0;
+    }
+    fft_forward(fft, data);
+    for (int32_t k = lower_bin - 1; k <= upper_bin + 1; ++k) {
+      power[k] += (double) data[2 * k] * data[2 * k] +
+                  (double) data[2 * k + 1] * data[2 * k + 1];
+    }
+  }
+
+  /* peak search */
+  int32_t peak = lower_bin;
+  for (int32_t k = lower_bin; k <= upper_bin; ++k) {
+    if (power[k] > power[peak]) {
+      peak = k;
+    }
+  }
+
+  /* interpolate between bins using the magnitude ratio of the largest
+     neighbor (exact for a single tone with a Hann window) */
+  double center = sqrt(power[peak]);
+  double left = sqrt(power[peak - 1]);
+  double right = sqrt(power[peak + 1]);
+  double delta = 0;
+  if (center > 0) {
+    if (right >= left) {
+      double alpha = right / center;
+      delta = (2 * alpha - 1) / (alpha + 1);
+    } else {
+      double alpha = left / center;
+      delta = -(2 * alpha - 1) / (alpha + 1);
+    }
+  }
+
+  *measured_frequency = (peak + delta) * bin_width;
+
+  free(power);
+  free(data);
+  free(window);
+  fft_close(fft);
+  return 0;
+}
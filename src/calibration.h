@@ -0,0 +1,43 @@
+/*
+ * calibration.h - frequency calibration functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __CALIBRATION_H
+#define __CALIBRATION_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int calibration_estimate_carrier_frequency(const int16_t *samples,
+                                           uint32_t nsamples,
+                                           double sample_rate,
+                                           double carrier_frequency,
+                                           double search_span,
+                                           double *measured_frequency);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CALIBRATION_H */
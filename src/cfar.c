@@ -0,0 +1,470 @@
+/*
+ * cfar.c - CFAR signal detection and tracking
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* the noise floor around each bin is estimated from the training cells on
+ * both sides (skipping the guard cells next to it), with the spectrum edges
+ * reflected so every bin has a full window; cell averaging uses prefix sums,
+ * so its cost does not depend on the window size, and both the noise and the
+ * threshold loops are straight array code that the compiler vectorizes.
+ * Bins above threshold are clustered into signals and matched to the tracks
+ * from the previous spectra: a signal is reported after CFAR_CONFIRM_FRAMES
+ * detections and kept for CFAR_HOLD_FRAMES misses, and the bins of a tracked
+ * signal use a threshold CFAR_HYSTERESIS dB lower, so signals close to the
+ * threshold do not flicker
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cfar.h"
+
+
+typedef struct cfar cfar_t;
+
+/* internal functions */
+static void cfar_noise_cell_averaging(cfar_t *this);
+static void cfar_noise_order_statistic(cfar_t *this);
+static float select_kth(float *values, uint32_t n, uint32_t k);
+static void cfar_add_cluster(cfar_t *this, const float *power, uint32_t first,
+                             uint32_t last, uint64_t timestamp);
+static int compare_tracks(const void *a, const void *b);
+
+
+enum {
+  CFAR_MIN_GUARD_CELLS = 4,      /* per side */
+  CFAR_MIN_TRAINING_CELLS = 16,  /* per side */
+  CFAR_MERGE_GAP = 2,            /* bins below threshold within a signal */
+  CFAR_CONFIRM_FRAMES = 2,
+  CFAR_HOLD_FRAMES = 3
+};
+
+static const double CFAR_HYSTERESIS = 3.0;      /* dB */
+
+struct cfar_track {
+  struct cfar_signal signal;
+  uint32_t hits;
+  uint32_t misses;
+  int matched;
+};
+
+typedef struct cfar {
+  uint32_t nbins;
+  enum CFARMethod method;
+  uint32_t guard_cells;          /* per side */
+  uint32_t training_cells;       /* per side */
+  uint32_t margin;               /* guard_cells + training_cells */
+  float *cells;                  /* order statistic: training cells */
+  float threshold_on;            /* linear */
+  float threshold_off;           /* for the bins of tracked signals */
+  float *extended;               /* power with the edges reflected */
+  double *prefix;                /* prefix sums of extended */
+  float *noise;
+  uint8_t *detected;
+  uint8_t *active;               /* bins of the tracked signals */
+  struct cfar_track *tracks;     /* ordered by center */
+  uint32_t ntracks;
+  uint32_t max_tracks;
+  uint32_t nsorted;              /* tracks from the previous spectra */
+  struct cfar_signal *signals;
+  uint32_t next_id;
+} cfar_t;
+
+
+cfar_t *cfar_open(uint32_t nbins, enum CFARMethod method, double threshold)
+{
+  cfar_t *ret_val = 0;
+
+  /* the windows grow with the resolution, so wide signals do not raise
+     their own noise estimate */
+  uint32_t guard_cells = nbins / 256;
+  if (guard_cells < CFAR_MIN_GUARD_CELLS) {
+    guard_cells = CFAR_MIN_GUARD_CELLS;
+  }
+  uint32_t training_cells = nbins / 128;
+  if (training_cells < CFAR_MIN_TRAINING_CELLS) {
+    training_cells = CFAR_MIN_TRAINING_CELLS;
+  }
+  uint32_t margin = guard_cells + training_cells;
+  if (nbins <= 2 * margin) {
+    fprintf(stderr, "ERROR - too few bins for CFAR: %u (need more than %u)\n",
+            nbins, 2 * margin);
+    return ret_val;
+  }
+  if (method != CFAR_CELL_AVERAGING && method != CFAR_ORDER_STATISTIC) {
+    fprintf(stderr, "ERROR - invalid CFAR method: %d\n", method);
+    return ret_val;
+  }
+  if (threshold <= CFAR_HYSTERESIS) {
+    fprintf(stderr, "ERROR - CFAR threshold must be above %.1fdB: %.1fdB\n",
+            CFAR_HYSTERESIS, threshold);
+    return ret_val;
+  }
+
+  /* new signals are at most one every other bin, plus the ones on hold */
+  uint32_t max_tracks = nbins + 1;
+  float *extended = (float *) malloc((nbins + 2 * margin) * sizeof(float));
+  double *prefix = (double *) malloc((nbins + 2 * margin + 1) * sizeof(double));
+  float *noise = (float *) malloc(nbins * sizeof(float));
+  uint8_t *detected = (uint8_t *) malloc(nbins * sizeof(uint8_t));
+  uint8_t *active = (uint8_t *) calloc(nbins, sizeof(uint8_t));
+  float *cells = (float *) malloc(2 * training_cells * sizeof(float));
+  struct cfar_track *tracks = (struct cfar_track *) malloc(max_tracks * sizeof(struct cfar_track));
+  struct cfar_signal *signals = (struct cfar_signal *) malloc(max_tracks * sizeof(struct cfar_signal));
+  if (extended == 0 || prefix == 0 || noise == 0 || detected == 0 ||
+      active == 0 || cells == 0 || tracks == 0 || signals == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    free(extended);
+    free(prefix);
+    free(noise);
+    free(detected);
+    free(active);
+    free(cells);
+    free(tracks);
+    free(signals);
+    return ret_val;
+  }
+
+  /* we are good here - create and initialize the cfar */
+  cfar_t *this = (cfar_t *) malloc(sizeof(cfar_t));
+  this->nbins = nbins;
+  this->method = method;
+  this->guard_cells = guard_cells;
+  this->training_cells = training_cells;
+  this->margin = margin;
+  this->cells = cells;
+  this->threshold_on = (float) pow(10.0, threshold / 10.0);
+  this->threshold_off = (float) pow(10.0, (threshold - CFAR_HYSTERESIS) / 10.0);
+  this->extended = extended;
+  this->prefix = prefix;
+  this->noise = noise;
+  this->detected = detected;
+  this->active = active;
+  this->tracks = tracks;
+  this->ntracks = 0;
+  this->max_tracks = max_tracks;
+  this->nsorted = 0;
+  this->signals = signals;
+  this->next_id = 1;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void cfar_close(cfar_t *this)
+{
+  free(this->extended);
+  free(this->prefix);
+  free(this->noise);
+  free(this->detected);
+  free(this->active);
+  free(this->cells);
+  free(this->tracks);
+  free(this->signals);
+  free(this);
+  return;
+}
+
+
+void cfar_reset(cfar_t *this)
+{
+  this->ntracks = 0;
+  memset(this->active, 0, this->nbins * sizeof(uint8_t));
+  return;
+}
+
+
+uint32_t cfar_detect(cfar_t *this, const float *power, uint64_t timestamp,
+                     const struct cfar_signal **signals)
+{
+  uint32_t margin = this->margin;
+  uint32_t nbins = this->nbins;
+
+  /* reflect the edges: extended[margin + i] = power[i] */
+  float *extended = this->extended;
+  for (uint32_t j = 0; j < margin; ++j) {
+    extended[j] = power[margin - j];
+    extended[margin + nbins + j] = power[nbins - 2 - j];
+  }
+  memcpy(extended + margin, power, nbins * sizeof(float));
+
+  if (this->method == CFAR_CELL_AVERAGING) {
+    cfar_noise_cell_averaging(this);
+  } else {
+    cfar_noise_order_statistic(this);
+  }
+
+  /* threshold (lower on the bins of the signals already tracked) */
+  const float *noise = this->noise;
+  const uint8_t *active = this->active;
+  uint8_t *detected = this->detected;
+  float threshold_on = this->threshold_on;
+  float threshold_delta = this->threshold_off - this->threshold_on;
+  for (uint32_t i = 0; i < nbins; ++i) {
+    float threshold = threshold_on + active[i] * threshold_delta;
+    detected[i] = power[i] > noise[i] * threshold;
+  }
+
+  /* cluster the detections and match them to the tracks */
+  this->nsorted = this->ntracks;
+  for (uint32_t i = 0; i < this->ntracks; ++i) {
+    this->tracks[i].matched = 0;
+  }
+  uint32_t i = 0;
+  while (i < nbins) {
+    if (!detected[i]) {
+      i++;
+      continue;
+    }
+    uint32_t first = i;
+    uint32_t last = i;
+    for (i = i + 1; i < nbins && i <= last + CFAR_MERGE_GAP + 1; ++i) {
+      if (detected[i]) {
+        last = i;
+      }
+    }
+    cfar_add_cluster(this, power, first, last, timestamp);
+    i = last + 1;
+  }
+
+  /* age the tracks that were not seen */
+  uint32_t ntracks = 0;
+  for (uint32_t i = 0; i < this->ntracks; ++i) {
+    struct cfar_track *track = &this->tracks[i];
+    if (!track->matched) {
+      track->misses++;
+      if (track->misses > CFAR_HOLD_FRAMES) {
+        continue;
+      }
+    }
+    this->tracks[ntracks++] = *track;
+  }
+  this->ntracks = ntracks;
+  qsort(this->tracks, ntracks, sizeof(struct cfar_track), compare_tracks);
+
+  /* publish the confirmed signals and remember their bins */
+  memset(this->active, 0, nbins * sizeof(uint8_t));
+  uint32_t nsignals = 0;
+  for (uint32_t i = 0; i < ntracks; ++i) {
+    const struct cfar_track *track = &this->tracks[i];
+    if (track->hits < CFAR_CONFIRM_FRAMES) {
+      continue;
+    }
+    this->signals[nsignals++] = track->signal;
+    double half_width = track->signal.width / 2;
+    int64_t lower = (int64_t) floor(track->signal.center - half_width);
+    int64_t upper = (int64_t) ceil(track->signal.center + half_width);
+    if (lower < 0) {
+      lower = 0;
+    }
+    if (upper >= nbins) {
+      upper = nbins - 1;
+    }
+    for (int64_t k = lower; k <= upper; ++k) {
+      this->active[k] = 1;
+    }
+  }
+
+  *signals = this->signals;
+  return nsignals;
+}
+
+
+/* internal functions */
+static void cfar_noise_cell_averaging(cfar_t *this)
+{
+  uint32_t margin = this->margin;
+  uint32_t n = this->nbins + 2 * margin;
+  const float *extended = this->extended;
+  double *prefix = this->prefix;
+  prefix[0] = 0;
+  for (uint32_t j = 0; j < n; ++j) {
+    prefix[j + 1] = prefix[j] + extended[j];
+  }
+
+  /* training cells: [i - margin, i - guard - 1] and [i + guard + 1, i + margin]
+     (in extended, bin i is at i + margin) */
+  const double *left_lower = prefix;
+  const double *left_upper = prefix + this->training_cells;
+  const double *right_lower = prefix + margin + this->guard_cells + 1;
+  const double *right_upper = prefix + 2 * margin + 1;
+  float *noise = this->noise;
+  const double scale = 1.0 / (2 * this->training_cells);
+  for (uint32_t i = 0; i < this->nbins; ++i) {
+    noise[i] = (float) ((left_upper[i] - left_lower[i] +
+                         right_upper[i] - right_lower[i]) * scale);
+  }
+  return;
+}
+
+
+/* the order statistic is evaluated every training_cells bins and
+ * interpolated linearly in between (the windows of two neighboring points
+ * still overlap by half), since a full selection for every bin would cost
+ * as much as the FFT */
+static void cfar_noise_order_statistic(cfar_t *this)
+{
+  uint32_t nbins = this->nbins;
+  uint32_t training_cells = this->training_cells;
+  uint32_t ncells = 2 * training_cells;
+  uint32_t k = 3 * ncells / 4;
+  uint32_t stride = training_cells;
+  const float *left = this->extended;
+  const float *right = this->extended + this->margin + this->guard_cells + 1;
+  float *cells = this->cells;
+  float *noise = this->noise;
+
+  float previous = 0;
+  for (uint32_t i = 0; ; i += stride) {
+    if (i >= nbins) {
+      i = nbins - 1;
+    }
+    memcpy(cells, left + i, training_cells * sizeof(float));
+    memcpy(cells + training_cells, right + i, training_cells * sizeof(float));
+    float current = select_kth(cells, ncells, k);
+    noise[i] = current;
+    if (i > 0) {
+      uint32_t first = i > stride ? i - stride : 0;
+      float step = (current - previous) / (i - first);
+      for (uint32_t j = 1; j < i - first; ++j) {
+        noise[first + j] = previous + step * j;
+      }
+    }
+    previous = current;
+    if (i == nbins - 1) {
+      break;
+    }
+  }
+  return;
+}
+
+
+/* k-th smallest value (quickselect; values are reordered) */
+static float select_kth(float *values, uint32_t n, uint32_t k)
+{
+  uint32_t left = 0;
+  uint32_t right = n - 1;
+  while (left < right) {
+    uint32_t middle = (left + right) / 2;
+    float pivot = values[middle];
+    values[middle] = values[right];
+    values[right] = pivot;
+    uint32_t store = left;
+    /* branch free partition (the comparisons are unpredictable) */
+    for (uint32_t i = left; i < right; ++i) {
+      float value = values[i];
+      values[i] = values[store];
+      values[store] = value;
+      store += value < pivot;
+    }
+    values[right] = values[store];
+    values[store] = pivot;
+    if (k == store) {
+      break;
+    } else if (k < store) {
+      right = store - 1;
+    } else {
+      left = store + 1;
+    }
+  }
+  return values[k];
+}
+
+
+static void cfar_add_cluster(cfar_t *this, const float *power, uint32_t first,
+                             uint32_t last, uint64_t timestamp)
+{
+  const float *noise = this->noise;
+  const uint8_t *detected = this->detected;
+  double sum = 0;
+  double weighted_sum = 0;
+  float peak_snr = 0;
+  for (uint32_t k = first; k <= last; ++k) {
+    if (!detected[k]) {
+      continue;
+    }
+    double excess = power[k] - noise[k];
+    sum += excess;
+    weighted_sum += k * excess;
+    float snr = power[k] / noise[k];
+    if (snr > peak_snr) {
+      peak_snr = snr;
+    }
+  }
+  double center = weighted_sum / sum;
+  double width = last - first + 1;
+
+  /* closest track from the previous spectra whose center is within the
+     cluster (with some slack) */
+  double lower = (double) first - CFAR_MERGE_GAP - 1;
+  double upper = (double) last + CFAR_MERGE_GAP + 1;
+  uint32_t lo = 0;
+  uint32_t hi = this->nsorted;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (this->tracks[mid].signal.center < lower) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  struct cfar_track *track = 0;
+  for (uint32_t i = lo; i < this->nsorted &&
+                        this->tracks[i].signal.center <= upper; ++i) {
+    if (this->tracks[i].matched) {
+      continue;
+    }
+    if (track == 0 || fabs(this->tracks[i].signal.center - center) <
+                      fabs(track->signal.center - center)) {
+      track = &this->tracks[i];
+    }
+  }
+
+  if (track == 0) {
+    if (this->ntracks == this->max_tracks) {
+      return;
+    }
+    track = &this->tracks[this->ntracks++];
+    track->signal.id = this->next_id++;
+    track->signal.first_seen = timestamp;
+    track->hits = 0;
+  }
+  track->signal.center = center;
+  track->signal.width = width;
+  track->signal.snr = (float) (10 * log10(peak_snr));
+  track->signal.last_seen = timestamp;
+  track->hits++;
+  track->misses = 0;
+  track->matched = 1;
+  return;
+}
+
+
+static int compare_tracks(const void *a, const void *b)
+{
+  double center_a = ((const struct cfar_track *) a)->signal.center;
+  double center_b = ((const struct cfar_track *) b)->signal.center;
+  return (center_a > center_b) - (center_a < center_b);
+}
@@ -0,0 +1,70 @@
+/*
+ * cfar.h - CFAR signal detection and tracking
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+#ifndef __CFAR_H
+#define __CFAR_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct cfar cfar_t;
+
+enum CFARMethod {
+  CFAR_CELL_AVERAGING,       /* noise = mean of the training cells */
+  CFAR_ORDER_STATISTIC       /* noise = 3/4 quantile of the training cells
+                                (robust to nearby strong signals) */
+};
+
+/* frequencies are in bins of the power spectrum; the timestamps are the ones
+ * passed to cfar_detect() */
+struct cfar_signal {
+  uint32_t id;               /* stays the same while the signal is tracked */
+  double center;             /* power weighted center */
+  double width;
+  float snr;                 /* peak power over the noise estimate (dB) */
+  uint64_t first_seen;
+  uint64_t last_seen;
+};
+
+/* threshold is in dB over the noise estimate */
+cfar_t *cfar_open(uint32_t nbins, enum CFARMethod method, double threshold);
+
+void cfar_close(cfar_t *this);
+
+/* forget all the tracked signals (e.g. after a retune) */
+void cfar_reset(cfar_t *this);
+
+/* detect the signals in a power spectrum and update the tracks; returns the
+ * number of confirmed signals (ordered by frequency) stored in *signals,
+ * valid until the next call */
+uint32_t cfar_detect(cfar_t *this, const float *power, uint64_t timestamp,
+                     const struct cfar_signal **signals);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CFAR_H */
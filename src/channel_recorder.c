@@ -0,0 +1,432 @@
+/*
+ * channel_recorder.c - activity gated channel recorder
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* every channel keeps the last preroll + one gate block of samples in a
+ * history ring; the gate is decided at the end of each block, and what has
+ * to be written is copied from the ring into a pending buffer, which goes
+ * to the file as one record when it is full or the segment ends. The
+ * samples of a record are stored as 16 bit integers with a scale of their
+ * own (block floating point), so weak channels keep their resolution at
+ * half the size of floats. The noise floor follows the quietest blocks down
+ * at once and creeps up while the channel is idle, so a steady carrier
+ * keeps its channel open
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel_recorder.h"
+#include "memory_budget.h"
+
+
+typedef struct channel_recorder channel_recorder_t;
+
+struct recorder_channel;
+
+/* internal functions */
+static void channel_gate(channel_recorder_t *this,
+                         struct recorder_channel *channel);
+static void channel_history_write(struct recorder_channel *channel,
+                                  const float *samples, uint32_t nsamples);
+static int channel_append(channel_recorder_t *this,
+                          struct recorder_channel *channel, uint64_t from,
+                          uint64_t to);
+static int channel_flush(channel_recorder_t *this,
+                         struct recorder_channel *channel, uint32_t flags);
+static int channel_recorder_write(channel_recorder_t *this,
+                                  struct recorder_channel *channel,
+                                  const struct rf103_channel_record *record,
+                                  const void *payload, size_t payload_size);
+
+
+enum {
+  CHANNEL_RECORDER_MAX_CHANNELS = 256,
+  CHANNEL_RECORDER_RECORD_SAMPLES = 8192,
+  CHANNEL_RECORDER_MIN_BLOCK = 16          /* samples */
+};
+
+static const double CHANNEL_RECORDER_GATE_BLOCK = 0.01;      /* s */
+static const double CHANNEL_RECORDER_FLOOR_RISE = 1.0;       /* dB/s */
+
+struct recorder_channel {
+  int number;
+  double frequency;
+  double sample_rate;
+  uint32_t block_samples;        /* of the gate */
+  uint32_t history_samples;      /* preroll + one block */
+  uint64_t hang_samples;
+  float *history;                /* ring, history_samples complex */
+  uint64_t position;             /* samples processed */
+  double block_energy;
+  uint32_t block_count;
+  double noise_floor;            /* power; 0 = not known yet */
+  double floor_rise;             /* per block */
+  int active;
+  uint64_t hang_left;
+  uint64_t written;              /* end of the last segment */
+  float *pending;                /* CHANNEL_RECORDER_RECORD_SAMPLES complex */
+  uint32_t npending;
+  uint64_t pending_index;        /* of pending[0] */
+  int pending_start;             /* pending[0] starts a segment */
+  struct channel_recorder_stats stats;
+};
+
+typedef struct channel_recorder {
+  FILE *file;
+  int64_t start_time;            /* ns */
+  double threshold;              /* power ratio */
+  double preroll;                /* s */
+  double hang;
+  int nchannels;
+  struct recorder_channel *channels[CHANNEL_RECORDER_MAX_CHANNELS];
+  int16_t samples[2 * CHANNEL_RECORDER_RECORD_SAMPLES];   /* being written */
+} channel_recorder_t;
+
+
+channel_recorder_t *channel_recorder_open(const char *filename,
+                                          double start_time, double threshold,
+                                          double preroll, double hang)
+{
+  channel_recorder_t *ret_val = 0;
+
+  if (threshold <= 0 || preroll < 0 || hang < 0) {
+    fprintf(stderr, "ERROR - invalid channel recorder gate: threshold=%f preroll=%f hang=%f\n",
+            threshold, preroll, hang);
+    return ret_val;
+  }
+  FILE *file = fopen(filename, "wb");
+  if (file == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed\n", filename);
+    return ret_val;
+  }
+
+  /* we are good here - create and initialize the channel recorder */
+  channel_recorder_t *this = (channel_recorder_t *) malloc(sizeof(channel_recorder_t));
+  this->file = file;
+  this->start_time = (int64_t) llround(start_time * 1e9);
+  this->threshold = pow(10.0, threshold / 10.0);
+  this->preroll = preroll;
+  this->hang = hang;
+  this->nchannels = 0;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void channel_recorder_close(channel_recorder_t *this)
+{
+  for (int i = 0; i < this->nchannels; ++i) {
+    struct recorder_channel *channel = this->channels[i];
+    /* a segment still open ends with the samples seen so far */
+    if (channel->active &&
+        (channel_append(this, channel, channel->written,
+                        channel->position) < 0 ||
+         channel_flush(this, channel, RF103_SEGMENT_END) < 0)) {
+      fprintf(stderr, "ERROR - channel recorder write failed\n");
+    }
+    memory_budget_free(channel->history);
+    free(channel);
+  }
+  if (fclose(this->file) != 0) {
+    fprintf(stderr, "ERROR - channel recorder write failed\n");
+  }
+  free(this);
+  return;
+}
+
+
+int channel_recorder_add_channel(channel_recorder_t *this, double frequency,
+                                 double sample_rate)
+{
+  if (this->nchannels == CHANNEL_RECORDER_MAX_CHANNELS) {
+    fprintf(stderr, "ERROR - too many recorder channels\n");
+    return -1;
+  }
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - invalid recorder channel sample rate: %f\n",
+            sample_rate);
+    return -1;
+  }
+
+  uint32_t block_samples = (uint32_t) (CHANNEL_RECORDER_GATE_BLOCK * sample_rate);
+  if (block_samples < CHANNEL_RECORDER_MIN_BLOCK) {
+    block_samples = CHANNEL_RECORDER_MIN_BLOCK;
+  }
+  uint32_t history_samples = (uint32_t) ceil(this->preroll * sample_rate) +
+                             block_samples;
+  size_t nfloats = 2 * ((size_t) history_samples + CHANNEL_RECORDER_RECORD_SAMPLES);
+  float *floats = (float *) memory_budget_alloc(MEMORY_DSP,
+                                                nfloats * sizeof(float),
+                                                "channel recorder");
+  if (floats == 0) {
+    return -1;
+  }
+
+  struct recorder_channel *channel = (struct recorder_channel *) malloc(sizeof(struct recorder_channel));
+  memset(channel, 0, sizeof(struct recorder_channel));
+  channel->number = this->nchannels;
+  channel->frequency = frequency;
+  channel->sample_rate = sample_rate;
+  channel->block_samples = block_samples;
+  channel->history_samples = history_samples;
+  channel->hang_samples = (uint64_t) (this->hang * sample_rate);
+  channel->history = floats;
+  channel->pending = floats + 2 * (size_t) history_samples;
+  channel->floor_rise = pow(10.0, CHANNEL_RECORDER_FLOOR_RISE *
+                                  block_samples / sample_rate / 10.0);
+
+  struct rf103_channel_record record = {
+    .sync = RF103_CHANNEL_RECORD_SYNC,
+    .type = RF103_RECORD_CHANNEL,
+    .channel = (uint16_t) channel->number,
+    .timestamp = this->start_time
+  };
+  struct rf103_recorded_channel description = {
+    .frequency = frequency,
+    .sample_rate = sample_rate
+  };
+  if (channel_recorder_write(this, channel, &record, &description,
+                             sizeof(description)) < 0) {
+    memory_budget_free(floats);
+    free(channel);
+    return -1;
+  }
+
+  this->channels[this->nchannels] = channel;
+  return this->nchannels++;
+}
+
+
+int channel_recorder_process(channel_recorder_t *this, int channel_number,
+                             const float *samples, uint32_t nsamples)
+{
+  if (channel_number < 0 || channel_number >= this->nchannels) {
+    fprintf(stderr, "ERROR - invalid recorder channel: %d\n", channel_number);
+    return -1;
+  }
+  struct recorder_channel *channel = this->channels[channel_number];
+  channel->stats.samples += nsamples;
+  while (nsamples > 0) {
+    uint32_t n = channel->block_samples - channel->block_count;
+    if (n > nsamples) {
+      n = nsamples;
+    }
+    channel_history_write(channel, samples, n);
+    float energy = 0.0f;
+    for (uint32_t k = 0; k < 2 * n; ++k) {
+      energy += samples[k] * samples[k];
+    }
+    channel->block_energy += energy;
+    channel->block_count += n;
+    channel->position += n;
+    samples += 2 * n;
+    nsamples -= n;
+
+    if (channel->block_count == channel->block_samples) {
+      int was_active = channel->active;
+      uint64_t written = channel->written;
+      channel_gate(this, channel);
+      /* from the start of the preroll (or the end of the last segment, if
+         it is closer) when the channel opens, the last block otherwise */
+      if (channel->active) {
+        uint64_t from = written;
+        if (!was_active) {
+          uint64_t history = channel->position < channel->history_samples ?
+                             channel->position : channel->history_samples;
+          from = channel->position - history;
+          if (from < written) {
+            from = written;
+          }
+          channel->pending_start = 1;
+          channel->stats.segments++;
+        }
+        if (channel_append(this, channel, from, channel->position) < 0) {
+          return -1;
+        }
+        channel->written = channel->position;
+      } else if (was_active) {
+        if (channel_append(this, channel, written, channel->position) < 0 ||
+            channel_flush(this, channel, RF103_SEGMENT_END) < 0) {
+          return -1;
+        }
+        channel->written = channel->position;
+      }
+    }
+  }
+  return 0;
+}
+
+
+int channel_recorder_get_stats(channel_recorder_t *this, int channel_number,
+                               struct channel_recorder_stats *stats)
+{
+  if (channel_number < 0 || channel_number >= this->nchannels) {
+    fprintf(stderr, "ERROR - invalid recorder channel: %d\n", channel_number);
+    return -1;
+  }
+  struct recorder_channel *channel = this->channels[channel_number];
+  *stats = channel->stats;
+  stats->noise_floor = channel->noise_floor > 0 ?
+                       10.0 * log10(channel->noise_floor) : -INFINITY;
+  stats->active = channel->active;
+  return 0;
+}
+
+
+/* internal functions */
+static void channel_gate(channel_recorder_t *this,
+                         struct recorder_channel *channel)
+{
+  double power = channel->block_energy / channel->block_count;
+  channel->block_energy = 0.0;
+  channel->block_count = 0;
+
+  if (channel->noise_floor <= 0 || power < channel->noise_floor) {
+    channel->noise_floor = power;
+  }
+  if (power > channel->noise_floor * this->threshold) {
+    channel->active = 1;
+    channel->hang_left = channel->hang_samples;
+    return;
+  }
+  channel->noise_floor *= channel->floor_rise;
+  if (channel->active) {
+    if (channel->hang_left > channel->block_samples) {
+      channel->hang_left -= channel->block_samples;
+    } else {
+      channel->active = 0;
+    }
+  }
+  return;
+}
+
+
+static void channel_history_write(struct recorder_channel *channel,
+                                  const float *samples, uint32_t nsamples)
+{
+  uint32_t size = channel->history_samples;
+  uint32_t index = (uint32_t) (channel->position % size);
+  uint32_t n = size - index < nsamples ? size - index : nsamples;
+  memcpy(channel->history + 2 * index, samples, 2 * n * sizeof(float));
+  memcpy(channel->history, samples + 2 * n, 2 * (nsamples - n) * sizeof(float));
+  return;
+}
+
+
+/* copies the samples from..to-1 (still in the history) to the pending
+   buffer, writing it out every time it fills up */
+static int channel_append(channel_recorder_t *this,
+                          struct recorder_channel *channel, uint64_t from,
+                          uint64_t to)
+{
+  uint32_t size = channel->history_samples;
+  if (channel->npending == 0) {
+    channel->pending_index = from;
+  }
+  while (from < to) {
+    uint32_t index = (uint32_t) (from % size);
+    uint64_t n = to - from;
+    if (n > size - index) {
+      n = size - index;
+    }
+    if (n > CHANNEL_RECORDER_RECORD_SAMPLES - channel->npending) {
+      n = CHANNEL_RECORDER_RECORD_SAMPLES - channel->npending;
+    }
+    memcpy(channel->pending + 2 * channel->npending,
+           channel->history + 2 * index, 2 * n * sizeof(float));
+    channel->npending += (uint32_t) n;
+    from += n;
+    if (channel->npending == CHANNEL_RECORDER_RECORD_SAMPLES) {
+      if (channel_flush(this, channel, 0) < 0) {
+        return -1;
+      }
+      channel->pending_index = from;
+    }
+  }
+  return 0;
+}
+
+
+static int channel_flush(channel_recorder_t *this,
+                         struct recorder_channel *channel, uint32_t flags)
+{
+  uint32_t npending = channel->npending;
+  if (npending == 0 && flags == 0) {
+    return 0;
+  }
+  if (channel->pending_start) {
+    flags |= RF103_SEGMENT_START;
+  }
+
+  const float *pending = channel->pending;
+  float peak = 0.0f;
+  for (uint32_t k = 0; k < 2 * npending; ++k) {
+    float x = fabsf(pending[k]);
+    peak = x > peak ? x : peak;
+  }
+  float scale = peak > 0 ? peak / 32767.0f : 1.0f / 32767.0f;
+  float gain = 1.0f / scale;
+  int16_t *samples = this->samples;
+  for (uint32_t k = 0; k < 2 * npending; ++k) {
+    samples[k] = (int16_t) lrintf(pending[k] * gain);
+  }
+
+  struct rf103_channel_record record = {
+    .sync = RF103_CHANNEL_RECORD_SYNC,
+    .type = RF103_RECORD_SAMPLES,
+    .channel = (uint16_t) channel->number,
+    .flags = flags,
+    .nsamples = npending,
+    .sample_index = channel->pending_index,
+    .timestamp = this->start_time +
+                 (int64_t) llround(channel->pending_index * 1e9 /
+                                   channel->sample_rate),
+    .scale = scale
+  };
+  if (channel_recorder_write(this, channel, &record, samples,
+                             2 * npending * sizeof(int16_t)) < 0) {
+    return -1;
+  }
+  channel->stats.recorded += npending;
+  channel->npending = 0;
+  channel->pending_start = 0;
+  return 0;
+}
+
+
+static int channel_recorder_write(channel_recorder_t *this,
+                                  struct recorder_channel *channel,
+                                  const struct rf103_channel_record *record,
+                                  const void *payload, size_t payload_size)
+{
+  if (fwrite(record, sizeof(*record), 1, this->file) != 1 ||
+      (payload_size > 0 &&
+       fwrite(payload, payload_size, 1, this->file) != 1)) {
+    fprintf(stderr, "ERROR - channel recorder write failed\n");
+    return -1;
+  }
+  channel->stats.bytes += sizeof(*record) + payload_size;
+  return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * channel_recorder.h - activity gated channel recorder
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __CHANNEL_RECORDER_H
+#define __CHANNEL_RECORDER_H
+
+#include <stdint.h>
+
+#include "rf103.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct channel_recorder channel_recorder_t;
+
+/* writes the channels (complex float samples, like the channelizer and the
+ * DDC output) to a container file (see struct rf103_channel_record) only
+ * while they are active: a channel opens when its power over a 10ms block
+ * is threshold dB over its noise floor and closes after hang seconds below
+ * it; every segment starts with the preroll seconds before the block that
+ * opened it, so the onset of a burst is kept. The timestamps count from
+ * start_time (UTC seconds of the first sample of every channel) */
+
+struct channel_recorder_stats {
+  uint64_t samples;               /* processed */
+  uint64_t recorded;              /* written to the file */
+  uint64_t segments;
+  uint64_t bytes;                 /* written to the file */
+  double noise_floor;             /* dBFS */
+  int active;
+};
+
+channel_recorder_t *channel_recorder_open(const char *filename,
+                                          double start_time, double threshold,
+                                          double preroll, double hang);
+
+/* ends the segments still open */
+void channel_recorder_close(channel_recorder_t *this);
+
+/* returns the channel number */
+int channel_recorder_add_channel(channel_recorder_t *this, double frequency,
+                                 double sample_rate);
+
+int channel_recorder_process(channel_recorder_t *this, int channel,
+                             const float *samples, uint32_t nsamples);
+
+int channel_recorder_get_stats(channel_recorder_t *this, int channel,
+                               struct channel_recorder_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CHANNEL_RECORDER_H */
@@ -0,0 +1,426 @@
+/*
+ * channelizer.c - fast convolution channelizer functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* overlap-save fast convolution: every block of fft_size real samples
+ * (overlapping the previous one by a quarter) goes through one forward FFT,
+ * done as a half size complex FFT of the even and odd samples; each channel
+ * then picks the few bins around its frequency straight from the bit
+ * reversed output, multiplies them by its filter response and returns to the
+ * time domain with a small inverse FFT of its own, so the cost per channel
+ * is tiny and independent of the input rate.  The channel filter is time
+ * limited to a quarter of the block, so the last three quarters of every
+ * inverse FFT are valid output.  The channel center bin is a multiple of 4,
+ * which makes its phase advance by a whole number of turns from one block
+ * to the next (the hop is 3/4 of the block); the remaining offset from the
+ * requested frequency is removed by a rotator on the (low rate) output
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channelizer.h"
+#include "memory_budget.h"
+#include "fft.h"
+
+
+typedef struct channelizer channelizer_t;
+struct channel;
+
+/* internal functions */
+static void channelizer_block(channelizer_t *this);
+static void channelizer_channel(channelizer_t *this, int channel);
+
+
+enum {
+  CHANNELIZER_MAX_CHANNELS = 256,
+  CHANNELIZER_MIN_CHANNEL_SIZE = 8
+};
+
+/* one bin of a channel: X[m] of the real input is computed from Z[a] and
+ * Z[b] of the half size complex FFT (already in bit reversed positions);
+ * bins with a negative frequency are the conjugate of the positive ones */
+struct channel_bin {
+  uint32_t a;
+  uint32_t b;
+  float w_re;                    /* exp(-2*pi*i*m/fft_size) */
+  float w_im;
+  float h_re;                    /* filter response and scale */
+  float h_im;
+  int conjugate;
+};
+
+struct channel {
+  double frequency;
+  int32_t center_bin;
+  double sample_rate;
+  uint32_t size;                 /* inverse FFT size */
+  struct channel_bin *bins;      /* in natural order of the inverse FFT */
+  fft_t *fft;
+  float *buffer;                 /* interleaved */
+  double rotator_re;             /* removes the offset from the center bin */
+  double rotator_im;
+  double step_re;
+  double step_im;
+};
+
+typedef struct channelizer {
+  double sample_rate;
+  uint32_t fft_size;
+  uint32_t hop;                  /* 3/4 fft_size */
+  fft_t *fft;                    /* fft_size/2 complex */
+  const uint32_t *bit_reverse;
+  float *re;                     /* even input samples */
+  float *im;                     /* odd input samples */
+  int16_t *history;              /* fft_size samples */
+  uint32_t history_fill;
+  int nchannels;
+  struct channel channels[CHANNELIZER_MAX_CHANNELS];
+  channelizer_cb_t callback;
+  void *callback_context;
+} channelizer_t;
+
+
+channelizer_t *channelizer_open(double sample_rate, uint32_t fft_size,
+                                channelizer_cb_t callback,
+                                void *callback_context)
+{
+  channelizer_t *ret_val = 0;
+
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - invalid channelizer sample rate: %f\n",
+            sample_rate);
+    return ret_val;
+  }
+  if (fft_size < 64 || (fft_size & (fft_size - 1)) != 0) {
+    fprintf(stderr, "ERROR - invalid channelizer FFT size: %u\n", fft_size);
+    return ret_val;
+  }
+  if (callback == 0) {
+    fprintf(stderr, "ERROR - channelizer callback is missing\n");
+    return ret_val;
+  }
+
+  fft_t *fft = fft_open(fft_size / 2);
+  if (fft == 0) {
+    fprintf(stderr, "ERROR - fft_open() failed\n");
+    return ret_val;
+  }
+  float *re = (float *) memory_budget_aligned_alloc(MEMORY_DSP, 64, fft_size / 2 * sizeof(float),
+                                                    "channelizer buffers");
+  float *im = (float *) memory_budget_aligned_alloc(MEMORY_DSP, 64, fft_size / 2 * sizeof(float),
+                                                    "channelizer buffers");
+  int16_t *history = (int16_t *) memory_budget_calloc(MEMORY_DSP, fft_size * sizeof(int16_t),
+                                                      "channelizer buffers");
+  if (re == 0 || im == 0 || history == 0) {
+    fprintf(stderr, "ERROR - channelizer buffer allocation failed\n");
+    memory_budget_free(re);
+    memory_budget_free(im);
+    memory_budget_free(history);
+    fft_close(fft);
+    return ret_val;
+  }
+
+  /* we are good here - create and initialize the channelizer */
+  channelizer_t *this = (channelizer_t *) malloc(sizeof(channelizer_t));
+  this->sample_rate = sample_rate;
+  this->fft_size = fft_size;
+  this->hop = fft_size / 4 * 3;
+  this->fft = fft;
+  this->bit_reverse = fft_get_bit_reverse(fft);
+  this->re = re;
+  this->im = im;
+  this->history = history;
+  /* the first block starts with a quarter block of silence */
+  this->history_fill = fft_size - this->hop;
+  this->nchannels = 0;
+  this->callback = callback;
+  this->callback_context = callback_context;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void channelizer_close(channelizer_t *this)
+{
+  for (int i = 0; i < this->nchannels; ++i) {
+    struct channel *channel = &this->channels[i];
+    fft_close(channel->fft);
+    memory_budget_free(channel->bins);
+    memory_budget_free(channel->buffer);
+  }
+  fft_close(this->fft);
+  memory_budget_free(this->re);
+  memory_budget_free(this->im);
+  memory_budget_free(this->history);
+  free(this);
+  return;
+}
+
+
+int channelizer_add_channel(channelizer_t *this, double frequency,
+                            double bandwidth)
+{
+  if (this->nchannels == CHANNELIZER_MAX_CHANNELS) {
+    fprintf(stderr, "ERROR - too many channelizer channels\n");
+    return -1;
+  }
+  if (frequency < 0 || frequency > this->sample_rate / 2) {
+    fprintf(stderr, "ERROR - invalid channel frequency: %f\n", frequency);
+    return -1;
+  }
+  if (bandwidth <= 0 || bandwidth > this->sample_rate / 8) {
+    fprintf(stderr, "ERROR - invalid channel bandwidth: %f\n", bandwidth);
+    return -1;
+  }
+
+  uint32_t fft_size = this->fft_size;
+  double bin_width = this->sample_rate / fft_size;
+  int32_t center_bin = 4 * (int32_t) round(frequency / bin_width / 4);
+  double offset = frequency - center_bin * bin_width;
+
+  /* the channel filter is a Blackman windowed sinc as long as a quarter of
+     the inverse FFT; pick the smallest size where its transition band fits
+     between the passband and the Nyquist frequency of the channel (less the
+     offset from the center bin) */
+  uint32_t size = CHANNELIZER_MIN_CHANNEL_SIZE;
+  double sample_rate;
+  double transition;
+  for (;; size *= 2) {
+    if (size > fft_size / 4) {
+      fprintf(stderr, "ERROR - channel bandwidth too large for FFT size %u: %f\n",
+              fft_size, bandwidth);
+      return -1;
+    }
+    sample_rate = bin_width * size;
+    transition = 5.5 * sample_rate / (size / 4 + 1);
+    if (bandwidth / 2 + transition <= sample_rate / 2 - fabs(offset))
+      break;
+  }
+
+  fft_t *fft = fft_open(size);
+  struct channel_bin *bins = (struct channel_bin *) memory_budget_alloc(MEMORY_DSP, size * sizeof(struct channel_bin),
+                                                                        "channelizer buffers");
+  float *buffer = (float *) memory_budget_alloc(MEMORY_DSP, 2 * size * sizeof(float),
+                                                "channelizer buffers");
+  if (fft == 0 || bins == 0 || buffer == 0) {
+    fprintf(stderr, "ERROR - channel allocation failed\n");
+    if (fft)
+      fft_close(fft);
+    memory_budget_free(bins);
+    memory_budget_free(buffer);
+    return -1;
+  }
+
+  /* impulse response centered on size/8, shifted to the offset of the
+     requested frequency from the center bin, and its frequency response;
+     1 / (fft_size * 32768) scales the input and the forward FFT so a full
+     scale real tone comes out with amplitude 0.5 (like the DDC) */
+  uint32_t taps = size / 4 + 1;
+  double cutoff = (bandwidth / 2 + transition / 2) / sample_rate;
+  double sum = 0;
+  memset(buffer, 0, 2 * size * sizeof(float));
+  for (uint32_t m = 0; m < taps; ++m) {
+    double t = (double) m - size / 8;
+    double sinc = t == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * t) / (M_PI * t);
+    double window = 0.42 - 0.5 * cos(2 * M_PI * m / (taps - 1)) +
+                    0.08 * cos(4 * M_PI * m / (taps - 1));
+    double phase = 2 * M_PI * offset * t / sample_rate;
+    buffer[2 * m] = (float) (sinc * window * cos(phase));
+    buffer[2 * m + 1] = (float) (sinc * window * sin(phase));
+    sum += sinc * window;
+  }
+  float scale = (float) (1.0 / (sum * fft_size * 32768.0));
+  for (uint32_t m = 0; m < 2 * taps; ++m)
+    buffer[m] *= scale;
+  fft_forward(fft, buffer);
+
+  /* where each bin of the inverse FFT comes from */
+  uint32_t half = fft_size / 2;
+  for (uint32_t i = 0; i < size; ++i) {
+    /* bin i of the inverse FFT has frequency (i or i - size) * bin_width
+       relative to the center bin */
+    int32_t relative = i < size / 2 ? (int32_t) i : (int32_t) i - (int32_t) size;
+    int64_t k = ((int64_t) center_bin + relative) % fft_size;
+    if (k < 0)
+      k += fft_size;
+    int conjugate = k > half;
+    uint32_t m = conjugate ? fft_size - k : k;
+    struct channel_bin *bin = &bins[i];
+    bin->a = this->bit_reverse[m % half];
+    bin->b = this->bit_reverse[(half - m) % half];
+    bin->w_re = (float) cos(2 * M_PI * m / fft_size);
+    bin->w_im = (float) -sin(2 * M_PI * m / fft_size);
+    bin->h_re = buffer[2 * i];
+    bin->h_im = buffer[2 * i + 1];
+    bin->conjugate = conjugate;
+  }
+
+  struct channel *channel = &this->channels[this->nchannels];
+  channel->frequency = frequency;
+  channel->center_bin = center_bin;
+  channel->sample_rate = sample_rate;
+  channel->size = size;
+  channel->bins = bins;
+  channel->fft = fft;
+  channel->buffer = buffer;
+  channel->rotator_re = 1.0;
+  channel->rotator_im = 0.0;
+  channel->step_re = cos(2 * M_PI * offset / sample_rate);
+  channel->step_im = -sin(2 * M_PI * offset / sample_rate);
+  return this->nchannels++;
+}
+
+
+int channelizer_excise(channelizer_t *this, double frequency, double width)
+{
+  if (frequency < 0 || frequency > this->sample_rate / 2 || width < 0) {
+    fprintf(stderr, "ERROR - invalid excision: %f %f\n", frequency, width);
+    return -1;
+  }
+  double bin_width = this->sample_rate / this->fft_size;
+  double reach = width / 2 + bin_width;
+  for (int i = 0; i < this->nchannels; ++i) {
+    struct channel *channel = &this->channels[i];
+    uint32_t size = channel->size;
+    for (uint32_t j = 0; j < size; ++j) {
+      int32_t relative = j < size / 2 ? (int32_t) j : (int32_t) j - (int32_t) size;
+      /* the bins below 0 Hz are mirrors of the positive ones */
+      double bin_frequency = fabs((channel->center_bin + relative) * bin_width);
+      if (fabs(bin_frequency - frequency) <= reach) {
+        channel->bins[j].h_re = 0;
+        channel->bins[j].h_im = 0;
+      }
+    }
+  }
+  return 0;
+}
+
+
+double channelizer_get_sample_rate(channelizer_t *this, int channel)
+{
+  return this->channels[channel].sample_rate;
+}
+
+
+double channelizer_get_delay(channelizer_t *this, int channel)
+{
+  return (this->channels[channel].size / 8) / this->channels[channel].sample_rate;
+}
+
+
+void channelizer_process(channelizer_t *this, const int16_t *samples,
+                         uint32_t nsamples)
+{
+  uint32_t fft_size = this->fft_size;
+  while (nsamples > 0) {
+    uint32_t n = fft_size - this->history_fill;
+    if (n > nsamples)
+      n = nsamples;
+    memcpy(this->history + this->history_fill, samples, n * sizeof(int16_t));
+    this->history_fill += n;
+    samples += n;
+    nsamples -= n;
+    if (this->history_fill == fft_size) {
+      channelizer_block(this);
+      memmove(this->history, this->history + this->hop,
+              (fft_size - this->hop) * sizeof(int16_t));
+      this->history_fill = fft_size - this->hop;
+    }
+  }
+  return;
+}
+
+
+/* internal functions */
+static void channelizer_block(channelizer_t *this)
+{
+  uint32_t half = this->fft_size / 2;
+  const int16_t *history = this->history;
+  float *restrict re = this->re;
+  float *restrict im = this->im;
+  for (uint32_t m = 0; m < half; ++m) {
+    re[m] = history[2 * m];
+    im[m] = history[2 * m + 1];
+  }
+  fft_forward_split(this->fft, re, im);
+
+  for (int i = 0; i < this->nchannels; ++i)
+    channelizer_channel(this, i);
+  return;
+}
+
+
+static void channelizer_channel(channelizer_t *this, int channel_number)
+{
+  struct channel *channel = &this->channels[channel_number];
+  const float *re = this->re;
+  const float *im = this->im;
+  uint32_t size = channel->size;
+  float *buffer = channel->buffer;
+
+  /* X[m] = (Z[m] + conj(Z[N/2-m])) / 2 +
+            exp(-2*pi*i*m/N) * (Z[m] - conj(Z[N/2-m])) / 2i */
+  for (uint32_t i = 0; i < size; ++i) {
+    const struct channel_bin *bin = &channel->bins[i];
+    float a_re = re[bin->a];
+    float a_im = im[bin->a];
+    float b_re = re[bin->b];
+    float b_im = -im[bin->b];
+    float even_re = 0.5f * (a_re + b_re);
+    float even_im = 0.5f * (a_im + b_im);
+    float odd_re = 0.5f * (a_im - b_im);
+    float odd_im = -0.5f * (a_re - b_re);
+    float x_re = even_re + bin->w_re * odd_re - bin->w_im * odd_im;
+    float x_im = even_im + bin->w_re * odd_im + bin->w_im * odd_re;
+    if (bin->conjugate)
+      x_im = -x_im;
+    buffer[2 * i] = x_re * bin->h_re - x_im * bin->h_im;
+    buffer[2 * i + 1] = x_re * bin->h_im + x_im * bin->h_re;
+  }
+  fft_inverse(channel->fft, buffer);
+
+  /* the first quarter is corrupted by the circular convolution */
+  uint32_t discard = size / 4;
+  uint32_t noutput = size - discard;
+  double rotator_re = channel->rotator_re;
+  double rotator_im = channel->rotator_im;
+  for (uint32_t i = 0; i < noutput; ++i) {
+    float x_re = buffer[2 * (i + discard)];
+    float x_im = buffer[2 * (i + discard) + 1];
+    buffer[2 * i] = (float) (x_re * rotator_re - x_im * rotator_im);
+    buffer[2 * i + 1] = (float) (x_re * rotator_im + x_im * rotator_re);
+    double r = rotator_re * channel->step_re - rotator_im * channel->step_im;
+    rotator_im = rotator_re * channel->step_im + rotator_im * channel->step_re;
+    rotator_re = r;
+  }
+  /* keep the rotator on the unit circle */
+  double norm = 1.0 / sqrt(rotator_re * rotator_re + rotator_im * rotator_im);
+  channel->rotator_re = rotator_re * norm;
+  channel->rotator_im = rotator_im * norm;
+
+  this->callback(channel_number, buffer, noutput, this->callback_context);
+  return;
+}
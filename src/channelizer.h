@@ -0,0 +1,72 @@
+/*
+ * channelizer.h - fast convolution channelizer functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+#ifndef __CHANNELIZER_H
+#define __CHANNELIZER_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct channelizer channelizer_t;
+
+/* called once per block for every channel with its complex float samples
+ * (interleaved I/Q, full scale 1.0 like the DDC) */
+typedef void (*channelizer_cb_t)(int channel, const float *samples,
+                                 uint32_t nsamples, void *context);
+
+/* one forward FFT of fft_size real input samples (a power of 2) every
+ * 3/4 fft_size samples serves all the channels (overlap-save) */
+channelizer_t *channelizer_open(double sample_rate, uint32_t fft_size,
+                                channelizer_cb_t callback,
+                                void *callback_context);
+
+void channelizer_close(channelizer_t *this);
+
+/* the channel is centered on 'frequency' and flat over 'bandwidth'; its
+ * output sample rate is the smallest power of 2 fraction of the input rate
+ * that leaves room for the filter skirts; returns the channel number */
+int channelizer_add_channel(channelizer_t *this, double frequency,
+                            double bandwidth);
+
+/* removes the carrier at 'frequency' (and 'width' around it) from the
+ * channels added so far by zeroing the bins that hold it, plus one on each
+ * side for the leakage; it costs nothing at run time, but the hole is at
+ * least three bins (3 * sample_rate / fft_size) wide */
+int channelizer_excise(channelizer_t *this, double frequency, double width);
+
+double channelizer_get_sample_rate(channelizer_t *this, int channel);
+
+/* group delay of the channel filter in seconds */
+double channelizer_get_delay(channelizer_t *this, int channel);
+
+void channelizer_process(channelizer_t *this, const int16_t *samples,
+                         uint32_t nsamples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CHANNELIZER_H */
@@ -43,6 +43,8 @@ typedef struct clock_source clock_source_t;
 
 /* internal functions */
 static int power_down_clocks(clock_source_t *this);
+static int configure_pll(clock_source_t *this, int index,
+                         double vco_frequency);
 static void rational_approximation(double value, uint32_t max_denominator,
                                    uint32_t *a, uint32_t *b, uint32_t *c);
 static int configure_clock_input_and_pll(clock_source_t *this, int index,
@@ -55,6 +57,7 @@ typedef struct clock_source {
   usb_device_t *usb_device;
   double crystal_frequency;
   double frequency_correction;
+  double vco_frequency[2];    /* 0 if the PLL has not been configured yet */
 } clock_source_t;
 
 
@@ -106,6 +109,8 @@ clock_source_t *clock_source_open(usb_device_t *usb_device)
   this->usb_device = usb_device;
   this->crystal_frequency = SI5351_FREQ;
   this->frequency_correction = SI5351_FREQ_CORR;
+  this->vco_frequency[0] = 0;
+  this->vco_frequency[1] = 0;
 
   /* power down all the clocks to save power */
   ret = power_down_clocks(this);
@@ -138,10 +143,35 @@ void clock_source_set_crystal_frequency(clock_source_t *this,
 }
 
 
-void clock_source_set_frequency_correction(clock_source_t *this,
-                                           double frequency_correction)
+double clock_source_get_frequency_correction(clock_source_t *this)
 {
+  return this->frequency_correction;
+}
+
+
+int clock_source_set_frequency_correction(clock_source_t *this,
+                                          double frequency_correction)
+{
+  if (frequency_correction <= 0) {
+    fprintf(stderr, "ERROR - invalid frequency correction: %lg\n",
+            frequency_correction);
+    return -1;
+  }
   this->frequency_correction = frequency_correction;
+
+  /* reprogram only the feedback (fractional) MS of the PLLs already in use;
+     the output MS and the R dividers do not depend on the crystal */
+  for (int index = 0; index < 2; ++index) {
+    if (this->vco_frequency[index] == 0) {
+      continue;
+    }
+    int ret = configure_pll(this, index, this->vco_frequency[index]);
+    if (ret < 0) {
+      fprintf(stderr, "ERROR - configure_pll() failed\n");
+      return -1;
+    }
+  }
+  return 0;
 }
 
 
@@ -174,19 +204,12 @@ int clock_source_set_clock(clock_source_t *this, int index, double frequency)
     return -1;
   }
 
-  /* feedback MS */
-  double feedback_ms = vco_frequency / (this->crystal_frequency / this->frequency_correction);
-  /* find a good rational approximation for feedback_ms */
-  uint32_t a;
-  uint32_t b;
-  uint32_t c;
-  rational_approximation(feedback_ms, SI5351_MAX_DENOMINATOR, &a, &b, &c);
-
-  int ret = configure_clock_input_and_pll(this, index, a, b, c);
+  int ret = configure_pll(this, index, vco_frequency);
   if (ret < 0) {
-    fprintf(stderr, "ERROR - configure_clock_input_and_pll() failed\n");
+    fprintf(stderr, "ERROR - configure_pll() failed\n");
     return -1;
   }
+  this->vco_frequency[index] = vco_frequency;
 
   ret = configure_clock_output(this, index, output_ms, rdiv);
   if (ret < 0) {
@@ -273,6 +296,26 @@ static int power_down_clocks(clock_source_t *this)
 }
 
 
+static int configure_pll(clock_source_t *this, int index,
+                         double vco_frequency)
+{
+  /* feedback MS */
+  double feedback_ms = vco_frequency / (this->crystal_frequency / this->frequency_correction);
+  /* find a good rational approximation for feedback_ms */
+  uint32_t a;
+  uint32_t b;
+  uint32_t c;
+  rational_approximation(feedback_ms, SI5351_MAX_DENOMINATOR, &a, &b, &c);
+
+  int ret = configure_clock_input_and_pll(this, index, a, b, c);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - configure_clock_input_and_pll() failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+
 /* best rational approximation:
  *
  *     value ~= a + b/c     (where b <= max_denominator)
@@ -344,7 +387,7 @@ static int configure_clock_input_and_pll(clock_source_t *this, int index,
     (msn_p2 & 0x000000ff) >>  0
   };
 
-  uint8_t msn_register;
+  uint8_t msn_register = SI5351_REGISTER_MSNA_BASE;
   if (index == 0) {
     msn_register = SI5351_REGISTER_MSNA_BASE;
   } else if (index == 1) {
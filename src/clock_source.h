@@ -44,8 +44,10 @@ void clock_source_close(clock_source_t *this);
 void clock_source_set_crystal_frequency(clock_source_t *this, 
                                         double crystal_frequency);
 
-void clock_source_set_frequency_correction(clock_source_t *this,
-                                           double frequency_correction);
+double clock_source_get_frequency_correction(clock_source_t *this);
+
+int clock_source_set_frequency_correction(clock_source_t *this,
+                                          double frequency_correction);
 
 int clock_source_set_clock(clock_source_t *this, int index, double frequency);
 
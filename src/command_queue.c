@@ -0,0 +1,345 @@
+/*
+ * command_queue.c - commands timed to sample indices
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* the pending commands are kept sorted by sample; the control thread sleeps
+ * until the head one is due, i.e. until the ADC (as extrapolated from the
+ * last frame received) is one execution time away from its sample, where
+ * the execution time is a running average for that type of command. The
+ * effective sample is where the ADC was when the command completed; the
+ * tags wait in a FIFO until the streaming thread has received that sample
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "command_queue.h"
+#include "operation_stats.h"
+
+
+typedef struct command_queue command_queue_t;
+
+/* internal functions */
+static void *command_queue_thread(void *arg);
+static uint64_t command_queue_due_time(command_queue_t *this,
+                                       const struct command *command);
+static uint64_t command_queue_sample_at(command_queue_t *this,
+                                        uint64_t time_ns);
+
+
+typedef struct command_queue {
+  uint32_t max_commands;
+  double stream_latency;
+  command_queue_execute_t execute;
+  void *execute_context;
+  rf103_command_tag_cb_t callback;
+  void *callback_context;
+  struct command *pending;         /* sorted by sample */
+  uint32_t npending;
+  struct rf103_command_tag *tags;  /* FIFO of max_commands */
+  uint32_t tags_head;
+  uint32_t ntags;
+  int executing;                   /* a command is out of the queue */
+  uint32_t next_id;
+  double sample_rate;
+  int has_reference;               /* a frame arrived since the start */
+  uint64_t reference_position;
+  uint64_t reference_time;
+  uint64_t execution_time[COMMANDS];  /* running average (ns) */
+  int running;
+  int stopping;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+} command_queue_t;
+
+
+command_queue_t *command_queue_open(uint32_t max_commands,
+                                    double stream_latency,
+                                    command_queue_execute_t execute,
+                                    void *execute_context,
+                                    rf103_command_tag_cb_t callback,
+                                    void *callback_context)
+{
+  command_queue_t *ret_val = 0;
+
+  if (max_commands == 0) {
+    fprintf(stderr, "ERROR - invalid number of commands: %u\n", max_commands);
+    return ret_val;
+  }
+  if (stream_latency < 0) {
+    fprintf(stderr, "ERROR - invalid stream latency: %f\n", stream_latency);
+    return ret_val;
+  }
+
+  /* we are good here - create and initialize the command queue */
+  command_queue_t *this = (command_queue_t *) malloc(sizeof(command_queue_t));
+  this->max_commands = max_commands;
+  this->stream_latency = stream_latency;
+  this->execute = execute;
+  this->execute_context = execute_context;
+  this->callback = callback;
+  this->callback_context = callback_context;
+  this->pending = (struct command *) malloc(max_commands *
+                                            sizeof(struct command));
+  this->npending = 0;
+  this->tags = (struct rf103_command_tag *) malloc(max_commands *
+                                                   sizeof(struct rf103_command_tag));
+  this->tags_head = 0;
+  this->ntags = 0;
+  this->executing = 0;
+  this->next_id = 1;
+  this->sample_rate = 0;
+  this->has_reference = 0;
+  this->reference_position = 0;
+  this->reference_time = 0;
+  memset(this->execution_time, 0, sizeof(this->execution_time));
+  this->running = 0;
+  this->stopping = 0;
+  pthread_mutex_init(&this->mutex, 0);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&this->changed, &attr);
+  pthread_condattr_destroy(&attr);
+
+  int ret = pthread_create(&this->thread, 0, command_queue_thread, this);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR - pthread_create() failed: %s\n", strerror(ret));
+    command_queue_close(this);
+    return ret_val;
+  }
+  this->running = 1;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void command_queue_close(command_queue_t *this)
+{
+  if (this->running) {
+    pthread_mutex_lock(&this->mutex);
+    this->stopping = 1;
+    pthread_cond_signal(&this->changed);
+    pthread_mutex_unlock(&this->mutex);
+    pthread_join(this->thread, 0);
+  }
+  pthread_mutex_destroy(&this->mutex);
+  pthread_cond_destroy(&this->changed);
+  free(this->pending);
+  free(this->tags);
+  free(this);
+  return;
+}
+
+
+int command_queue_schedule(command_queue_t *this, enum RF103CommandType type,
+                           double value, uint64_t sample)
+{
+  if (type < 0 || type >= COMMANDS) {
+    fprintf(stderr, "ERROR - invalid command type: %d\n", type);
+    return -1;
+  }
+
+  pthread_mutex_lock(&this->mutex);
+  if (this->npending + this->ntags + this->executing >= this->max_commands) {
+    pthread_mutex_unlock(&this->mutex);
+    fprintf(stderr, "ERROR - command queue full\n");
+    return -1;
+  }
+  /* after the ones for the same sample, so they run in order */
+  uint32_t i = this->npending;
+  while (i > 0 && this->pending[i-1].sample > sample) {
+    this->pending[i] = this->pending[i-1];
+    --i;
+  }
+  struct command *command = &this->pending[i];
+  command->id = this->next_id++;
+  command->type = type;
+  command->value = value;
+  command->sample = sample;
+  this->npending++;
+  int id = (int) command->id;
+  if (i == 0) {
+    pthread_cond_signal(&this->changed);
+  }
+  pthread_mutex_unlock(&this->mutex);
+  return id;
+}
+
+
+int command_queue_time_to_sample(command_queue_t *this, uint64_t time_ns,
+                                 uint64_t *sample)
+{
+  pthread_mutex_lock(&this->mutex);
+  if (!this->has_reference) {
+    pthread_mutex_unlock(&this->mutex);
+    fprintf(stderr, "ERROR - no samples received yet\n");
+    return -1;
+  }
+  *sample = command_queue_sample_at(this, time_ns);
+  pthread_mutex_unlock(&this->mutex);
+  return 0;
+}
+
+
+void command_queue_start(command_queue_t *this, double sample_rate)
+{
+  pthread_mutex_lock(&this->mutex);
+  this->sample_rate = sample_rate;
+  this->has_reference = 0;
+  pthread_mutex_unlock(&this->mutex);
+  return;
+}
+
+
+void command_queue_stop(command_queue_t *this)
+{
+  pthread_mutex_lock(&this->mutex);
+  if (this->npending > 0 || this->ntags > 0) {
+    fprintf(stderr, "WARNING - discarding %u pending commands\n",
+            this->npending + this->ntags);
+  }
+  this->npending = 0;
+  this->ntags = 0;
+  this->has_reference = 0;
+  pthread_mutex_unlock(&this->mutex);
+  return;
+}
+
+
+void command_queue_observe(command_queue_t *this, uint64_t position,
+                           uint64_t timestamp_ns)
+{
+  pthread_mutex_lock(&this->mutex);
+  this->reference_position = position;
+  this->reference_time = timestamp_ns;
+  if (!this->has_reference) {
+    this->has_reference = 1;
+    pthread_cond_signal(&this->changed);
+  }
+  /* the tags are delivered in order of completion, which is also the order
+     of their effective samples */
+  while (this->ntags > 0 &&
+         this->tags[this->tags_head].effective_sample < position) {
+    struct rf103_command_tag tag = this->tags[this->tags_head];
+    this->tags_head = (this->tags_head + 1) % this->max_commands;
+    this->ntags--;
+    pthread_mutex_unlock(&this->mutex);
+    if (this->callback) {
+      this->callback(&tag, this->callback_context);
+    }
+    pthread_mutex_lock(&this->mutex);
+  }
+  pthread_mutex_unlock(&this->mutex);
+  return;
+}
+
+
+/* internal functions */
+static void *command_queue_thread(void *arg)
+{
+  command_queue_t *this = (command_queue_t *) arg;
+
+  pthread_mutex_lock(&this->mutex);
+  while (!this->stopping) {
+    if (this->npending == 0 || !this->has_reference) {
+      pthread_cond_wait(&this->changed, &this->mutex);
+      continue;
+    }
+    uint64_t due = command_queue_due_time(this, &this->pending[0]);
+    if (operation_stats_now() < due) {
+      struct timespec ts = { due / 1000000000, due % 1000000000 };
+      pthread_cond_timedwait(&this->changed, &this->mutex, &ts);
+      continue;
+    }
+
+    struct command command = this->pending[0];
+    this->npending--;
+    memmove(this->pending, this->pending + 1,
+            this->npending * sizeof(struct command));
+    this->executing = 1;
+    pthread_mutex_unlock(&this->mutex);
+
+    uint64_t start = operation_stats_now();
+    int ret = this->execute(&command, this->execute_context);
+    uint64_t end = operation_stats_now();
+
+    pthread_mutex_lock(&this->mutex);
+    this->executing = 0;
+    uint64_t *execution_time = &this->execution_time[command.type];
+    uint64_t elapsed = end - start;
+    *execution_time = *execution_time == 0 ? elapsed :
+                      (7 * *execution_time + elapsed) / 8;
+    /* streaming stopped meanwhile: nobody is going to receive the tag */
+    if (!this->has_reference) {
+      continue;
+    }
+    uint32_t tail = (this->tags_head + this->ntags) % this->max_commands;
+    struct rf103_command_tag *tag = &this->tags[tail];
+    tag->id = command.id;
+    tag->type = command.type;
+    tag->value = command.value;
+    tag->result = ret < 0 ? -1 : 0;
+    tag->requested_sample = command.sample;
+    tag->effective_sample = command_queue_sample_at(this, end);
+    /* a tag can't come before the ones already queued */
+    if (this->ntags > 0) {
+      uint32_t last = (tail + this->max_commands - 1) % this->max_commands;
+      if (tag->effective_sample < this->tags[last].effective_sample) {
+        tag->effective_sample = this->tags[last].effective_sample;
+      }
+    }
+    this->ntags++;
+  }
+  pthread_mutex_unlock(&this->mutex);
+
+  return 0;
+}
+
+
+/* when the command has to be issued to complete at its sample */
+static uint64_t command_queue_due_time(command_queue_t *this,
+                                       const struct command *command)
+{
+  double delay = 0;
+  if (command->sample > this->reference_position) {
+    delay = (command->sample - this->reference_position) / this->sample_rate;
+  }
+  delay -= this->stream_latency;
+  double due = this->reference_time + delay * 1e9 -
+               this->execution_time[command->type];
+  return due > 0 ? (uint64_t) due : 0;
+}
+
+
+/* where the ADC is (or was) at time_ns */
+static uint64_t command_queue_sample_at(command_queue_t *this, uint64_t time_ns)
+{
+  double elapsed = ((double) time_ns - (double) this->reference_time) * 1e-9 +
+                   this->stream_latency;
+  double sample = this->reference_position + elapsed * this->sample_rate;
+  return sample > 0 ? (uint64_t) (sample + 0.5) : 0;
+}
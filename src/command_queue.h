@@ -0,0 +1,77 @@
+/*
+ * command_queue.h - commands timed to sample indices
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __COMMAND_QUEUE_H
+#define __COMMAND_QUEUE_H
+
+#include <stdint.h>
+
+#include "rf103.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct command_queue command_queue_t;
+
+struct command {
+  uint32_t id;
+  enum RF103CommandType type;
+  double value;
+  uint64_t sample;
+};
+
+/* runs the command in the control thread; 0 or -1 */
+typedef int (*command_queue_execute_t)(const struct command *command,
+                                       void *context);
+
+command_queue_t *command_queue_open(uint32_t max_commands,
+                                    double stream_latency,
+                                    command_queue_execute_t execute,
+                                    void *execute_context,
+                                    rf103_command_tag_cb_t callback,
+                                    void *callback_context);
+
+void command_queue_close(command_queue_t *this);
+
+/* returns the id of the command */
+int command_queue_schedule(command_queue_t *this, enum RF103CommandType type,
+                           double value, uint64_t sample);
+
+/* the ADC sample at time_ns (CLOCK_MONOTONIC) */
+int command_queue_time_to_sample(command_queue_t *this, uint64_t time_ns,
+                                 uint64_t *sample);
+
+void command_queue_start(command_queue_t *this, double sample_rate);
+
+void command_queue_stop(command_queue_t *this);
+
+/* from the streaming thread: 'position' ADC samples have arrived at
+   timestamp_ns; delivers the tags up to there */
+void command_queue_observe(command_queue_t *this, uint64_t position,
+                           uint64_t timestamp_ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __COMMAND_QUEUE_H */
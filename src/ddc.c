@@ -0,0 +1,262 @@
+/*
+ * ddc.c - digital downconverter functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The mixer uses a table with one block of the NCO phasor and a rotator
+ * (in double precision) advanced once per block, so the inner loops are
+ * plain float multiply-adds on contiguous arrays.
+ * The decimating FIR keeps I and Q in separate arrays and the taps are zero
+ * padded to a multiple of DDC_LANES, so the dot products run in the SIMD
+ * kernel picked for that tap count (see dsp_kernels.c).
+ * The taps come from the shared FIR design cache, so several DDCs with the
+ * same decimation share them.
+ * I and Q are stored in double mapped ring buffers, so the filter history
+ * is always contiguous without copying it around.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ddc.h"
+#include "dsp_kernels.h"
+#include "fir_design.h"
+#include "ring_buffer.h"
+
+
+typedef struct ddc ddc_t;
+
+/* internal functions */
+static void ddc_mix(ddc_t *this, const int16_t *samples, uint32_t nsamples);
+static uint32_t ddc_decimate(ddc_t *this, float *output);
+
+
+enum {
+  DDC_NCO_BLOCK = 256,
+  DDC_MIX_BLOCK = 4096,          /* samples mixed before filtering them */
+  DDC_LANES = 8
+};
+
+typedef struct ddc {
+  double sample_rate;
+  double frequency;
+  uint32_t decimation;
+  float nco_re[DDC_NCO_BLOCK];   /* exp(-i*w*k), k = 0..DDC_NCO_BLOCK-1 */
+  float nco_im[DDC_NCO_BLOCK];
+  double rotator_re;             /* exp(-i*w*DDC_NCO_BLOCK*m) */
+  double rotator_im;
+  double step_re;                /* exp(-i*w*DDC_NCO_BLOCK) */
+  double step_im;
+  uint32_t nco_index;
+  const struct fir_taps *fir;
+  uint32_t num_taps;             /* padded to a multiple of DDC_LANES */
+  const float *taps;
+  dsp_fir_decimate_t fir_decimate;
+  ring_buffer_t *ring_re;        /* mixer output */
+  ring_buffer_t *ring_im;
+  uint64_t head;                 /* samples written to the rings */
+  uint64_t next_output;          /* first sample of the next output */
+} ddc_t;
+
+
+ddc_t *ddc_open(double sample_rate, double frequency, uint32_t decimation)
+{
+  ddc_t *ret_val = 0;
+
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - invalid DDC sample rate: %f\n", sample_rate);
+    return ret_val;
+  }
+  /* the image of the mixed real input is only rejected by the low pass, and
+     at least a factor of 2 leaves it room for a transition band */
+  if (decimation < 2) {
+    fprintf(stderr, "ERROR - invalid DDC decimation: %u\n", decimation);
+    return ret_val;
+  }
+
+  /* low pass with the passband up to 60% of the output Nyquist frequency
+     and 80dB of rejection of what aliases into it */
+  struct fir_design_spec spec = {
+    .method = FIR_DESIGN_KAISER,
+    .passband = 0.3 / decimation,
+    .stopband = 0.7 / decimation,
+    .attenuation = 80.0,
+    .ripple = 0.0,
+    .gain = 1.0 / 32768.0        /* the input is scaled to full scale 1.0 */
+  };
+  const struct fir_taps *fir = fir_design_lowpass(&spec);
+  if (fir == 0) {
+    fprintf(stderr, "ERROR - fir_design_lowpass() failed\n");
+    return ret_val;
+  }
+  uint32_t padded_taps = fir->padded_taps;
+  /* the rings hold the filter history plus one mixer block */
+  size_t ring_size = (padded_taps + decimation + DDC_MIX_BLOCK) * sizeof(float);
+  ring_buffer_t *ring_re = ring_buffer_open(ring_size);
+  ring_buffer_t *ring_im = ring_re ? ring_buffer_open(ring_size) : 0;
+  if (ring_im == 0) {
+    fprintf(stderr, "ERROR - ring_buffer_open() failed\n");
+    if (ring_re)
+      ring_buffer_close(ring_re);
+    fir_release_taps(fir);
+    return ret_val;
+  }
+
+  /* we are good here - create and initialize the ddc */
+  ddc_t *this = (ddc_t *) malloc(sizeof(ddc_t));
+  this->sample_rate = sample_rate;
+  this->decimation = decimation;
+  this->fir = fir;
+  this->num_taps = padded_taps;
+  this->taps = fir->taps;
+  this->fir_decimate = dsp_get_fir_decimate(padded_taps);
+  this->ring_re = ring_re;
+  this->ring_im = ring_im;
+  /* the rings start zeroed, i.e. with num_taps - 1 samples of silence */
+  this->head = padded_taps - 1;
+  this->next_output = 0;
+  ddc_set_frequency(this, frequency);
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void ddc_close(ddc_t *this)
+{
+  fir_release_taps(this->fir);
+  ring_buffer_close(this->ring_re);
+  ring_buffer_close(this->ring_im);
+  free(this);
+  return;
+}
+
+
+int ddc_set_frequency(ddc_t *this, double frequency)
+{
+  double w = 2 * M_PI * frequency / this->sample_rate;
+  for (uint32_t k = 0; k < DDC_NCO_BLOCK; ++k) {
+    this->nco_re[k] = (float) cos(w * k);
+    this->nco_im[k] = (float) -sin(w * k);
+  }
+  this->frequency = frequency;
+  this->step_re = cos(w * DDC_NCO_BLOCK);
+  this->step_im = -sin(w * DDC_NCO_BLOCK);
+  /* restart the NCO at the beginning of a block (phase continuity is not
+     meaningful across a retune anyway) */
+  this->rotator_re = 1.0;
+  this->rotator_im = 0.0;
+  this->nco_index = 0;
+  return 0;
+}
+
+
+uint32_t ddc_get_decimation(ddc_t *this)
+{
+  return this->decimation;
+}
+
+
+uint32_t ddc_max_output(ddc_t *this, uint32_t nsamples)
+{
+  return nsamples / this->decimation + 1;
+}
+
+
+uint32_t ddc_process(ddc_t *this, const int16_t *samples, uint32_t nsamples,
+                     float *output)
+{
+  uint32_t noutput = 0;
+  while (nsamples > 0) {
+    uint32_t nmix = nsamples < DDC_MIX_BLOCK ? nsamples : DDC_MIX_BLOCK;
+    samples += nmix;
+    nsamples -= nmix;
+    const int16_t *mix_samples = samples - nmix;
+    while (nmix > 0) {
+      /* one segment never crosses an NCO block boundary */
+      uint32_t n = DDC_NCO_BLOCK - this->nco_index;
+      if (n > nmix) {
+        n = nmix;
+      }
+      ddc_mix(this, mix_samples, n);
+      mix_samples += n;
+      nmix -= n;
+    }
+    noutput += ddc_decimate(this, output + 2 * noutput);
+  }
+  return noutput;
+}
+
+
+/* internal functions */
+static void ddc_mix(ddc_t *this, const int16_t *samples, uint32_t nsamples)
+{
+  float rotator_re = (float) this->rotator_re;
+  float rotator_im = (float) this->rotator_im;
+  const float *nco_re = this->nco_re + this->nco_index;
+  const float *nco_im = this->nco_im + this->nco_index;
+  uint64_t position = this->head * sizeof(float);
+  float *restrict buffer_re = (float *) ring_buffer_get_pointer(this->ring_re,
+                                                                position);
+  float *restrict buffer_im = (float *) ring_buffer_get_pointer(this->ring_im,
+                                                                position);
+  for (uint32_t k = 0; k < nsamples; ++k) {
+    float x = samples[k];
+    buffer_re[k] = x * (rotator_re * nco_re[k] - rotator_im * nco_im[k]);
+    buffer_im[k] = x * (rotator_re * nco_im[k] + rotator_im * nco_re[k]);
+  }
+  this->head += nsamples;
+
+  this->nco_index += nsamples;
+  if (this->nco_index == DDC_NCO_BLOCK) {
+    double re = this->rotator_re * this->step_re -
+                this->rotator_im * this->step_im;
+    double im = this->rotator_re * this->step_im +
+                this->rotator_im * this->step_re;
+    /* keep the rotator on the unit circle */
+    double norm = 1.0 / sqrt(re * re + im * im);
+    this->rotator_re = re * norm;
+    this->rotator_im = im * norm;
+    this->nco_index = 0;
+  }
+  return;
+}
+
+
+static uint32_t ddc_decimate(ddc_t *this, float *output)
+{
+  uint32_t num_taps = this->num_taps;
+  const float *taps = this->taps;
+  /* the whole span from the next output to the head is contiguous */
+  uint64_t position = this->next_output * sizeof(float);
+  const float *buffer_re = (const float *) ring_buffer_get_pointer(this->ring_re,
+                                                                   position);
+  const float *buffer_im = (const float *) ring_buffer_get_pointer(this->ring_im,
+                                                                   position);
+  uint32_t available = (uint32_t) (this->head - this->next_output);
+  uint32_t consumed;
+  uint32_t noutput = this->fir_decimate(taps, num_taps, buffer_re, buffer_im,
+                                        available, this->decimation, output,
+                                        &consumed);
+  this->next_output += consumed;
+  return noutput;
+}
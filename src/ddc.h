@@ -0,0 +1,58 @@
+/*
+ * ddc.h - digital downconverter functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __DDC_H
+#define __DDC_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ddc ddc_t;
+
+/* the DDC shifts the component at 'frequency' in the real input to 0Hz
+ * (a negative frequency selects the image, i.e. it inverts the spectrum),
+ * then low pass filters and decimates by 'decimation' (at least 2); the
+ * output is complex float samples (interleaved I/Q) with full scale 1.0 */
+
+ddc_t *ddc_open(double sample_rate, double frequency, uint32_t decimation);
+
+void ddc_close(ddc_t *this);
+
+int ddc_set_frequency(ddc_t *this, double frequency);
+
+uint32_t ddc_get_decimation(ddc_t *this);
+
+/* maximum number of output samples for nsamples input samples */
+uint32_t ddc_max_output(ddc_t *this, uint32_t nsamples);
+
+/* returns the number of complex samples written to output */
+uint32_t ddc_process(ddc_t *this, const int16_t *samples, uint32_t nsamples,
+                     float *output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DDC_H */
@@ -0,0 +1,333 @@
+/*
+ * ddc16.c - fixed point digital downconverter functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* the 16 bit version of the DDC in ddc.c, to move half the bytes through
+ * the cache: the NCO is the same table of one block of the phasor plus a
+ * rotator (in double precision) advanced once per block, except that at
+ * the start of each block the table is rotated into a Q15 phasor for that
+ * block; the mixer output is x * phasor rounded to 16 bits (the same
+ * scale as the float DDC), and since the sum of the absolute values of the
+ * Q15 taps stays below 2.0 (it is about 1.5) the FIR sums always fit 32
+ * bits; the decimating FIR runs in a 16 bit kernel from dsp_kernels.c that
+ * rounds and saturates the outputs. The taps are those of the float DDC quantized to Q15, which
+ * limits the stopband of the longest filters to about -75dB
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ddc16.h"
+#include "dsp_kernels.h"
+#include "fir_design.h"
+#include "memory_budget.h"
+#include "ring_buffer.h"
+
+
+typedef struct ddc16 ddc16_t;
+
+/* internal functions */
+static void ddc16_rotate_phasor(ddc16_t *this);
+static void ddc16_mix(ddc16_t *this, const int16_t *samples, uint32_t nsamples);
+static uint32_t ddc16_decimate(ddc16_t *this, int16_t *output);
+
+
+enum {
+  DDC16_NCO_BLOCK = 256,
+  DDC16_MIX_BLOCK = 4096,        /* samples mixed before filtering them */
+  DDC16_LANES = DSP_KERNEL_LANES_S16,
+  DDC16_ONE = 32767              /* 1.0 in Q15 */
+};
+
+typedef struct ddc16 {
+  double sample_rate;
+  double frequency;
+  uint32_t decimation;
+  int16_t nco_re[DDC16_NCO_BLOCK];       /* exp(-i*w*k) in Q15 */
+  int16_t nco_im[DDC16_NCO_BLOCK];
+  int16_t phasor_re[DDC16_NCO_BLOCK];    /* rotator * nco for this block */
+  int16_t phasor_im[DDC16_NCO_BLOCK];
+  double rotator_re;             /* exp(-i*w*DDC16_NCO_BLOCK*m) */
+  double rotator_im;
+  double step_re;                /* exp(-i*w*DDC16_NCO_BLOCK) */
+  double step_im;
+  uint32_t nco_index;
+  uint32_t num_taps;             /* padded to a multiple of DDC16_LANES */
+  int16_t *taps;                 /* Q15 */
+  dsp_fir_decimate_s16_t fir_decimate;
+  ring_buffer_t *ring_re;        /* mixer output */
+  ring_buffer_t *ring_im;
+  uint64_t head;                 /* samples written to the rings */
+  uint64_t next_output;          /* first sample of the next output */
+} ddc16_t;
+
+
+ddc16_t *ddc16_open(double sample_rate, double frequency, uint32_t decimation)
+{
+  ddc16_t *ret_val = 0;
+
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - invalid DDC sample rate: %f\n", sample_rate);
+    return ret_val;
+  }
+  /* as in ddc.c, the low pass is what rejects the image */
+  if (decimation < 2) {
+    fprintf(stderr, "ERROR - invalid DDC decimation: %u\n", decimation);
+    return ret_val;
+  }
+
+  /* the filter of the float DDC (see ddc.c) with unity gain, in Q15 */
+  struct fir_design_spec spec = {
+    .method = FIR_DESIGN_KAISER,
+    .passband = 0.3 / decimation,
+    .stopband = 0.7 / decimation,
+    .attenuation = 80.0,
+    .ripple = 0.0,
+    .gain = 1.0
+  };
+  const struct fir_taps *fir = fir_design_lowpass(&spec);
+  if (fir == 0) {
+    fprintf(stderr, "ERROR - fir_design_lowpass() failed\n");
+    return ret_val;
+  }
+  uint32_t padded_taps = (fir->padded_taps + DDC16_LANES - 1) / DDC16_LANES * DDC16_LANES;
+  int16_t *taps = (int16_t *) memory_budget_aligned_alloc(MEMORY_DSP, FIR_TAPS_ALIGNMENT,
+                                                          padded_taps * sizeof(int16_t),
+                                                          "DDC taps");
+  if (taps == 0) {
+    fir_release_taps(fir);
+    return ret_val;
+  }
+  memset(taps, 0, padded_taps * sizeof(int16_t));
+  for (uint32_t i = 0; i < fir->num_taps; ++i) {
+    long tap = lrint(fir->taps[i] * 32768.0);
+    taps[i] = (int16_t) (tap > DDC16_ONE ? DDC16_ONE : tap < -DDC16_ONE ? -DDC16_ONE : tap);
+  }
+  fir_release_taps(fir);
+
+  /* the rings hold the filter history plus one mixer block */
+  size_t ring_size = (padded_taps + decimation + DDC16_MIX_BLOCK) * sizeof(int16_t);
+  ring_buffer_t *ring_re = ring_buffer_open(ring_size);
+  ring_buffer_t *ring_im = ring_re ? ring_buffer_open(ring_size) : 0;
+  if (ring_im == 0) {
+    fprintf(stderr, "ERROR - ring_buffer_open() failed\n");
+    if (ring_re)
+      ring_buffer_close(ring_re);
+    memory_budget_free(taps);
+    return ret_val;
+  }
+
+  /* we are good here - create and initialize the ddc16 */
+  ddc16_t *this = (ddc16_t *) malloc(sizeof(ddc16_t));
+  this->sample_rate = sample_rate;
+  this->decimation = decimation;
+  this->num_taps = padded_taps;
+  this->taps = taps;
+  this->fir_decimate = dsp_get_fir_decimate_s16(padded_taps);
+  this->ring_re = ring_re;
+  this->ring_im = ring_im;
+  /* the rings start zeroed, i.e. with num_taps - 1 samples of silence */
+  this->head = padded_taps - 1;
+  this->next_output = 0;
+  ddc16_set_frequency(this, frequency);
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void ddc16_close(ddc16_t *this)
+{
+  memory_budget_free(this->taps);
+  ring_buffer_close(this->ring_re);
+  ring_buffer_close(this->ring_im);
+  free(this);
+  return;
+}
+
+
+int ddc16_set_frequency(ddc16_t *this, double frequency)
+{
+  double w = 2 * M_PI * frequency / this->sample_rate;
+  for (uint32_t k = 0; k < DDC16_NCO_BLOCK; ++k) {
+    this->nco_re[k] = (int16_t) lrint(DDC16_ONE * cos(w * k));
+    this->nco_im[k] = (int16_t) lrint(DDC16_ONE * -sin(w * k));
+  }
+  this->frequency = frequency;
+  this->step_re = cos(w * DDC16_NCO_BLOCK);
+  this->step_im = -sin(w * DDC16_NCO_BLOCK);
+  /* restart the NCO at the beginning of a block (phase continuity is not
+     meaningful across a retune anyway) */
+  this->rotator_re = 1.0;
+  this->rotator_im = 0.0;
+  this->nco_index = 0;
+  ddc16_rotate_phasor(this);
+  return 0;
+}
+
+
+uint32_t ddc16_get_decimation(ddc16_t *this)
+{
+  return this->decimation;
+}
+
+
+uint32_t ddc16_max_output(ddc16_t *this, uint32_t nsamples)
+{
+  return nsamples / this->decimation + 1;
+}
+
+
+uint32_t ddc16_process(ddc16_t *this, const int16_t *samples,
+                       uint32_t nsamples, int16_t *output)
+{
+  uint32_t noutput = 0;
+  while (nsamples > 0) {
+    uint32_t nmix = nsamples < DDC16_MIX_BLOCK ? nsamples : DDC16_MIX_BLOCK;
+    samples += nmix;
+    nsamples -= nmix;
+    const int16_t *mix_samples = samples - nmix;
+    while (nmix > 0) {
+      /* one segment never crosses an NCO block boundary */
+      uint32_t n = DDC16_NCO_BLOCK - this->nco_index;
+      if (n > nmix) {
+        n = nmix;
+      }
+      ddc16_mix(this, mix_samples, n);
+      mix_samples += n;
+      nmix -= n;
+    }
+    noutput += ddc16_decimate(this, output + 2 * noutput);
+  }
+  return noutput;
+}
+
+
+/* internal functions */
+/* phasor = rotator * nco, rounded to Q15 */
+static void ddc16_rotate_phasor(ddc16_t *this)
+{
+  int16_t rotator_re = (int16_t) lrint(DDC16_ONE * this->rotator_re);
+  int16_t rotator_im = (int16_t) lrint(DDC16_ONE * this->rotator_im);
+  uint32_t k = 0;
+#ifdef __SSE2__
+  /* pairs (nco_re, nco_im) times (rotator_re, -rotator_im) and
+     (rotator_im, rotator_re) are the real and imaginary parts */
+  __m128i rotate_re = _mm_set1_epi32((int32_t) ((uint32_t) (uint16_t) -rotator_im << 16 | (uint16_t) rotator_re));
+  __m128i rotate_im = _mm_set1_epi32((int32_t) ((uint32_t) (uint16_t) rotator_re << 16 | (uint16_t) rotator_im));
+  __m128i half = _mm_set1_epi32(1 << 14);
+  for (; k < DDC16_NCO_BLOCK; k += 8) {
+    __m128i nco_re = _mm_loadu_si128((const __m128i *) (this->nco_re + k));
+    __m128i nco_im = _mm_loadu_si128((const __m128i *) (this->nco_im + k));
+    __m128i lo = _mm_unpacklo_epi16(nco_re, nco_im);
+    __m128i hi = _mm_unpackhi_epi16(nco_re, nco_im);
+    __m128i re_lo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(lo, rotate_re), half), 15);
+    __m128i re_hi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(hi, rotate_re), half), 15);
+    __m128i im_lo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(lo, rotate_im), half), 15);
+    __m128i im_hi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(hi, rotate_im), half), 15);
+    _mm_storeu_si128((__m128i *) (this->phasor_re + k), _mm_packs_epi32(re_lo, re_hi));
+    _mm_storeu_si128((__m128i *) (this->phasor_im + k), _mm_packs_epi32(im_lo, im_hi));
+  }
+#endif
+  for (; k < DDC16_NCO_BLOCK; ++k) {
+    int32_t re = (rotator_re * this->nco_re[k] - rotator_im * this->nco_im[k] + (1 << 14)) >> 15;
+    int32_t im = (rotator_im * this->nco_re[k] + rotator_re * this->nco_im[k] + (1 << 14)) >> 15;
+    this->phasor_re[k] = (int16_t) (re > DDC16_ONE ? DDC16_ONE : re < -DDC16_ONE ? -DDC16_ONE : re);
+    this->phasor_im[k] = (int16_t) (im > DDC16_ONE ? DDC16_ONE : im < -DDC16_ONE ? -DDC16_ONE : im);
+  }
+  return;
+}
+
+
+static void ddc16_mix(ddc16_t *this, const int16_t *samples, uint32_t nsamples)
+{
+  const int16_t *phasor_re = this->phasor_re + this->nco_index;
+  const int16_t *phasor_im = this->phasor_im + this->nco_index;
+  uint64_t position = this->head * sizeof(int16_t);
+  int16_t *restrict buffer_re = (int16_t *) ring_buffer_get_pointer(this->ring_re,
+                                                                    position);
+  int16_t *restrict buffer_im = (int16_t *) ring_buffer_get_pointer(this->ring_im,
+                                                                    position);
+  uint32_t k = 0;
+#ifdef __SSE2__
+  /* x * phasor / 32768 rounded: twice the high half of the product plus
+     the top two bits of the low half (0, 1 or 2 once rounded) */
+  __m128i one = _mm_set1_epi16(1);
+  for (; k + 8 <= nsamples; k += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (samples + k));
+    __m128i c_re = _mm_loadu_si128((const __m128i *) (phasor_re + k));
+    __m128i c_im = _mm_loadu_si128((const __m128i *) (phasor_im + k));
+    __m128i hi_re = _mm_mulhi_epi16(x, c_re);
+    __m128i hi_im = _mm_mulhi_epi16(x, c_im);
+    __m128i lo_re = _mm_srli_epi16(_mm_add_epi16(_mm_srli_epi16(_mm_mullo_epi16(x, c_re), 14), one), 1);
+    __m128i lo_im = _mm_srli_epi16(_mm_add_epi16(_mm_srli_epi16(_mm_mullo_epi16(x, c_im), 14), one), 1);
+    __m128i re = _mm_adds_epi16(_mm_adds_epi16(hi_re, hi_re), lo_re);
+    __m128i im = _mm_adds_epi16(_mm_adds_epi16(hi_im, hi_im), lo_im);
+    _mm_storeu_si128((__m128i *) (buffer_re + k), re);
+    _mm_storeu_si128((__m128i *) (buffer_im + k), im);
+  }
+#endif
+  for (; k < nsamples; ++k) {
+    int32_t x = samples[k];
+    buffer_re[k] = (int16_t) ((x * phasor_re[k] + (1 << 14)) >> 15);
+    buffer_im[k] = (int16_t) ((x * phasor_im[k] + (1 << 14)) >> 15);
+  }
+  this->head += nsamples;
+
+  this->nco_index += nsamples;
+  if (this->nco_index == DDC16_NCO_BLOCK) {
+    double re = this->rotator_re * this->step_re -
+                this->rotator_im * this->step_im;
+    double im = this->rotator_re * this->step_im +
+                this->rotator_im * this->step_re;
+    /* keep the rotator on the unit circle */
+    double norm = 1.0 / sqrt(re * re + im * im);
+    this->rotator_re = re * norm;
+    this->rotator_im = im * norm;
+    this->nco_index = 0;
+    ddc16_rotate_phasor(this);
+  }
+  return;
+}
+
+
+static uint32_t ddc16_decimate(ddc16_t *this, int16_t *output)
+{
+  /* the whole span from the next output to the head is contiguous */
+  uint64_t position = this->next_output * sizeof(int16_t);
+  const int16_t *buffer_re = (const int16_t *) ring_buffer_get_pointer(this->ring_re,
+                                                                       position);
+  const int16_t *buffer_im = (const int16_t *) ring_buffer_get_pointer(this->ring_im,
+                                                                       position);
+  uint32_t available = (uint32_t) (this->head - this->next_output);
+  uint32_t consumed;
+  uint32_t noutput = this->fir_decimate(this->taps, this->num_taps, buffer_re,
+                                        buffer_im, available,
+                                        this->decimation, output, &consumed);
+  this->next_output += consumed;
+  return noutput;
+}
@@ -0,0 +1,59 @@
+/*
+ * ddc16.h - fixed point digital downconverter functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+
+#ifndef __DDC16_H
+#define __DDC16_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ddc16 ddc16_t;
+
+/* same as the DDC in ddc.h, all in 16 bit fixed point: the output is
+ * complex 16 bit samples (interleaved I/Q), i.e. the float output of the
+ * DDC times 32768, rounded and saturated */
+
+ddc16_t *ddc16_open(double sample_rate, double frequency, uint32_t decimation);
+
+void ddc16_close(ddc16_t *this);
+
+int ddc16_set_frequency(ddc16_t *this, double frequency);
+
+uint32_t ddc16_get_decimation(ddc16_t *this);
+
+/* maximum number of output samples for nsamples input samples */
+uint32_t ddc16_max_output(ddc16_t *this, uint32_t nsamples);
+
+/* returns the number of complex samples written to output */
+uint32_t ddc16_process(ddc16_t *this, const int16_t *samples,
+                       uint32_t nsamples, int16_t *output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DDC16_H */
@@ -0,0 +1,794 @@
+/*
+ * dsp_kernels.c - specialized FIR kernels
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* every kernel is written once as a macro body and instantiated for each
+ * tap count in DSP_KERNEL_TAPS and each SIMD flavor (SSE2, and AVX2 with
+ * FMA compiled with a target attribute, so the library still runs on any
+ * x86-64); with the tap count a constant the compiler unrolls the dot
+ * product and keeps the partial sums in registers. The registries list the
+ * instances (tap count 0 is the one for any count, which is still SIMD);
+ * the DDC and the resampler look their kernel up once when they are opened,
+ * according to their tap count and the CPU. The plain C kernels with the
+ * DSP_KERNEL_LANES partial sums are what is left on other architectures.
+ * The 16 bit kernels (for the fixed point DDC) multiply pairs of samples
+ * with pmaddwd into 32 bit sums; they only come in the any tap count
+ * flavor. The Goertzel bank runs the resonators of several tones side by
+ * side in the SIMD lanes, a group of tones at a time over the whole input,
+ * so the states stay in registers and each sample is loaded once per group
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#define DSP_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+#include "dsp_kernels.h"
+
+
+/* the padded tap counts of the DDC filters (multiples of 16) up to a
+   decimation of 16 */
+#define DSP_KERNEL_TAPS(X) \
+  X(16) X(32) X(48) X(64) X(80) X(96) X(112) X(128) \
+  X(144) X(160) X(176) X(192) X(208) X(224) X(240) X(256)
+
+struct dsp_fir_decimate_entry {
+  uint32_t ntaps;                /* 0 = any */
+  const char *name;
+  dsp_fir_decimate_t kernel;
+};
+
+struct dsp_fir_interpolate_entry {
+  uint32_t ntaps;
+  const char *name;
+  dsp_fir_interpolate_t kernel;
+};
+
+struct dsp_fir_decimate_s16_entry {
+  uint32_t ntaps;
+  const char *name;
+  dsp_fir_decimate_s16_t kernel;
+};
+
+struct dsp_goertzel_entry {
+  uint32_t ntones;
+  const char *name;
+  dsp_goertzel_t kernel;
+};
+
+
+/* Q15 sum of products -> rounded and saturated 16 bit sample */
+static inline int16_t dsp_round_s16(int32_t acc)
+{
+  int32_t y = (acc + (1 << 14)) >> 15;
+  y = y < -32768 ? -32768 : y;
+  y = y > 32767 ? 32767 : y;
+  return (int16_t) y;
+}
+
+
+uint32_t dsp_fir_decimate_generic(const float *taps, uint32_t ntaps,
+                                  const float *x_re, const float *x_im,
+                                  uint32_t available, uint32_t decimation,
+                                  float *output, uint32_t *consumed)
+{
+  uint32_t noutput = 0;
+  uint32_t i;
+  for (i = 0; i + ntaps <= available; i += decimation) {
+    const float *a = x_re + i;
+    const float *b = x_im + i;
+    float acc_re[DSP_KERNEL_LANES] = { 0 };
+    float acc_im[DSP_KERNEL_LANES] = { 0 };
+    for (uint32_t t = 0; t < ntaps; t += DSP_KERNEL_LANES) {
+      for (int l = 0; l < DSP_KERNEL_LANES; ++l) {
+        acc_re[l] += taps[t + l] * a[t + l];
+        acc_im[l] += taps[t + l] * b[t + l];
+      }
+    }
+    float re = 0;
+    float im = 0;
+    for (int l = 0; l < DSP_KERNEL_LANES; ++l) {
+      re += acc_re[l];
+      im += acc_im[l];
+    }
+    output[2 * noutput] = re;
+    output[2 * noutput + 1] = im;
+    noutput++;
+  }
+  *consumed = i;
+  return noutput;
+}
+
+
+void dsp_fir_interpolate_generic(const float *taps0, const float *taps1,
+                                 float mu, uint32_t ntaps, const float *x_re,
+                                 const float *x_im, float *output)
+{
+  float acc_re[DSP_KERNEL_LANES] = { 0 };
+  float acc_im[DSP_KERNEL_LANES] = { 0 };
+  for (uint32_t t = 0; t < ntaps; t += DSP_KERNEL_LANES) {
+    for (int l = 0; l < DSP_KERNEL_LANES; ++l) {
+      float tap = taps0[t + l] + mu * (taps1[t + l] - taps0[t + l]);
+      acc_re[l] += tap * x_re[t + l];
+      acc_im[l] += tap * x_im[t + l];
+    }
+  }
+  float re = 0;
+  float im = 0;
+  for (int l = 0; l < DSP_KERNEL_LANES; ++l) {
+    re += acc_re[l];
+    im += acc_im[l];
+  }
+  output[0] = re;
+  output[1] = im;
+  return;
+}
+
+
+uint32_t dsp_fir_decimate_s16_generic(const int16_t *taps, uint32_t ntaps,
+                                      const int16_t *x_re,
+                                      const int16_t *x_im,
+                                      uint32_t available,
+                                      uint32_t decimation, int16_t *output,
+                                      uint32_t *consumed)
+{
+  uint32_t noutput = 0;
+  uint32_t i;
+  for (i = 0; i + ntaps <= available; i += decimation) {
+    const int16_t *a = x_re + i;
+    const int16_t *b = x_im + i;
+    int32_t re = 0;
+    int32_t im = 0;
+    for (uint32_t t = 0; t < ntaps; ++t) {
+      re += taps[t] * a[t];
+      im += taps[t] * b[t];
+    }
+    output[2 * noutput] = dsp_round_s16(re);
+    output[2 * noutput + 1] = dsp_round_s16(im);
+    noutput++;
+  }
+  *consumed = i;
+  return noutput;
+}
+
+
+void dsp_goertzel_generic(const float *coefficients, const float *signs,
+                          float *s, float *d, uint32_t ntones,
+                          const float *input, uint32_t ninput)
+{
+  for (uint32_t t = 0; t < ntones; t += DSP_KERNEL_LANES) {
+    float a[DSP_KERNEL_LANES];
+    float b[DSP_KERNEL_LANES];
+    for (int l = 0; l < DSP_KERNEL_LANES; ++l) {
+      a[l] = s[t + l];
+      b[l] = d[t + l];
+    }
+    for (uint32_t n = 0; n < ninput; ++n) {
+      for (int l = 0; l < DSP_KERNEL_LANES; ++l) {
+        b[l] = signs[t + l] * b[l] + input[n] + coefficients[t + l] * a[l];
+        a[l] = b[l] + signs[t + l] * a[l];
+      }
+    }
+    for (int l = 0; l < DSP_KERNEL_LANES; ++l) {
+      s[t + l] = a[l];
+      d[t + l] = b[l];
+    }
+  }
+  return;
+}
+
+
+#ifdef DSP_KERNELS_X86
+
+static inline float dsp_sum_sse2(__m128 v)
+{
+  __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+
+__attribute__((target("avx2,fma")))
+static inline float dsp_sum_avx2(__m256 v)
+{
+  return dsp_sum_sse2(_mm_add_ps(_mm256_castps256_ps128(v),
+                                 _mm256_extractf128_ps(v, 1)));
+}
+
+
+/* SSE2: two partial sums of 4 for I and for Q */
+#define DSP_FIR_DECIMATE_SSE2(NTAPS) \
+  uint32_t noutput = 0; \
+  uint32_t i; \
+  for (i = 0; i + (NTAPS) <= available; i += decimation) { \
+    const float *a = x_re + i; \
+    const float *b = x_im + i; \
+    __m128 re0 = _mm_setzero_ps(); \
+    __m128 re1 = _mm_setzero_ps(); \
+    __m128 im0 = _mm_setzero_ps(); \
+    __m128 im1 = _mm_setzero_ps(); \
+    for (uint32_t t = 0; t < (NTAPS); t += 8) { \
+      __m128 h0 = _mm_loadu_ps(taps + t); \
+      __m128 h1 = _mm_loadu_ps(taps + t + 4); \
+      re0 = _mm_add_ps(re0, _mm_mul_ps(h0, _mm_loadu_ps(a + t))); \
+      re1 = _mm_add_ps(re1, _mm_mul_ps(h1, _mm_loadu_ps(a + t + 4))); \
+      im0 = _mm_add_ps(im0, _mm_mul_ps(h0, _mm_loadu_ps(b + t))); \
+      im1 = _mm_add_ps(im1, _mm_mul_ps(h1, _mm_loadu_ps(b + t + 4))); \
+    } \
+    output[2 * noutput] = dsp_sum_sse2(_mm_add_ps(re0, re1)); \
+    output[2 * noutput + 1] = dsp_sum_sse2(_mm_add_ps(im0, im1)); \
+    noutput++; \
+  } \
+  *consumed = i; \
+  return noutput;
+
+/* AVX2: fused multiply-adds on 8 lanes, two partial sums where the tap
+   count allows */
+#define DSP_FIR_DECIMATE_AVX2(NTAPS) \
+  uint32_t noutput = 0; \
+  uint32_t i; \
+  for (i = 0; i + (NTAPS) <= available; i += decimation) { \
+    const float *a = x_re + i; \
+    const float *b = x_im + i; \
+    __m256 re0 = _mm256_setzero_ps(); \
+    __m256 re1 = _mm256_setzero_ps(); \
+    __m256 im0 = _mm256_setzero_ps(); \
+    __m256 im1 = _mm256_setzero_ps(); \
+    uint32_t t = 0; \
+    for (; t + 16 <= (NTAPS); t += 16) { \
+      __m256 h0 = _mm256_loadu_ps(taps + t); \
+      __m256 h1 = _mm256_loadu_ps(taps + t + 8); \
+      re0 = _mm256_fmadd_ps(h0, _mm256_loadu_ps(a + t), re0); \
+      re1 = _mm256_fmadd_ps(h1, _mm256_loadu_ps(a + t + 8), re1); \
+      im0 = _mm256_fmadd_ps(h0, _mm256_loadu_ps(b + t), im0); \
+      im1 = _mm256_fmadd_ps(h1, _mm256_loadu_ps(b + t + 8), im1); \
+    } \
+    if (t < (NTAPS)) { \
+      __m256 h0 = _mm256_loadu_ps(taps + t); \
+      re0 = _mm256_fmadd_ps(h0, _mm256_loadu_ps(a + t), re0); \
+      im0 = _mm256_fmadd_ps(h0, _mm256_loadu_ps(b + t), im0); \
+    } \
+    output[2 * noutput] = dsp_sum_avx2(_mm256_add_ps(re0, re1)); \
+    output[2 * noutput + 1] = dsp_sum_avx2(_mm256_add_ps(im0, im1)); \
+    noutput++; \
+  } \
+  *consumed = i; \
+  return noutput;
+
+#define DSP_FIR_DECIMATE_ARGS \
+  const float *restrict taps, \
+  uint32_t ntaps __attribute__((unused)), \
+  const float *restrict x_re, const float *restrict x_im, \
+  uint32_t available, uint32_t decimation, float *restrict output, \
+  uint32_t *consumed
+
+#define DSP_DEFINE_SSE2(NTAPS) \
+  static uint32_t dsp_fir_decimate_sse2_##NTAPS(DSP_FIR_DECIMATE_ARGS) \
+  { \
+    DSP_FIR_DECIMATE_SSE2(NTAPS) \
+  }
+#define DSP_DEFINE_AVX2(NTAPS) \
+  __attribute__((target("avx2,fma"))) \
+  static uint32_t dsp_fir_decimate_avx2_##NTAPS(DSP_FIR_DECIMATE_ARGS) \
+  { \
+    DSP_FIR_DECIMATE_AVX2(NTAPS) \
+  }
+
+DSP_KERNEL_TAPS(DSP_DEFINE_SSE2)
+DSP_KERNEL_TAPS(DSP_DEFINE_AVX2)
+
+static uint32_t dsp_fir_decimate_sse2_any(DSP_FIR_DECIMATE_ARGS)
+{
+  DSP_FIR_DECIMATE_SSE2(ntaps)
+}
+
+__attribute__((target("avx2,fma")))
+static uint32_t dsp_fir_decimate_avx2_any(DSP_FIR_DECIMATE_ARGS)
+{
+  DSP_FIR_DECIMATE_AVX2(ntaps)
+}
+
+
+static void dsp_fir_interpolate_sse2(const float *restrict taps0,
+                                     const float *restrict taps1, float mu,
+                                     uint32_t ntaps,
+                                     const float *restrict x_re,
+                                     const float *restrict x_im,
+                                     float *restrict output)
+{
+  __m128 m = _mm_set1_ps(mu);
+  __m128 re0 = _mm_setzero_ps();
+  __m128 re1 = _mm_setzero_ps();
+  __m128 im0 = _mm_setzero_ps();
+  __m128 im1 = _mm_setzero_ps();
+  for (uint32_t t = 0; t < ntaps; t += 8) {
+    __m128 a0 = _mm_loadu_ps(taps0 + t);
+    __m128 a1 = _mm_loadu_ps(taps0 + t + 4);
+    __m128 h0 = _mm_add_ps(a0, _mm_mul_ps(m, _mm_sub_ps(_mm_loadu_ps(taps1 + t), a0)));
+    __m128 h1 = _mm_add_ps(a1, _mm_mul_ps(m, _mm_sub_ps(_mm_loadu_ps(taps1 + t + 4), a1)));
+    re0 = _mm_add_ps(re0, _mm_mul_ps(h0, _mm_loadu_ps(x_re + t)));
+    re1 = _mm_add_ps(re1, _mm_mul_ps(h1, _mm_loadu_ps(x_re + t + 4)));
+    im0 = _mm_add_ps(im0, _mm_mul_ps(h0, _mm_loadu_ps(x_im + t)));
+    im1 = _mm_add_ps(im1, _mm_mul_ps(h1, _mm_loadu_ps(x_im + t + 4)));
+  }
+  output[0] = dsp_sum_sse2(_mm_add_ps(re0, re1));
+  output[1] = dsp_sum_sse2(_mm_add_ps(im0, im1));
+  return;
+}
+
+
+__attribute__((target("avx2,fma")))
+static void dsp_fir_interpolate_avx2(const float *restrict taps0,
+                                     const float *restrict taps1, float mu,
+                                     uint32_t ntaps,
+                                     const float *restrict x_re,
+                                     const float *restrict x_im,
+                                     float *restrict output)
+{
+  __m256 m = _mm256_set1_ps(mu);
+  __m256 re = _mm256_setzero_ps();
+  __m256 im = _mm256_setzero_ps();
+  for (uint32_t t = 0; t < ntaps; t += 8) {
+    __m256 a = _mm256_loadu_ps(taps0 + t);
+    __m256 h = _mm256_fmadd_ps(m, _mm256_sub_ps(_mm256_loadu_ps(taps1 + t), a), a);
+    re = _mm256_fmadd_ps(h, _mm256_loadu_ps(x_re + t), re);
+    im = _mm256_fmadd_ps(h, _mm256_loadu_ps(x_im + t), im);
+  }
+  output[0] = dsp_sum_avx2(re);
+  output[1] = dsp_sum_avx2(im);
+  return;
+}
+
+
+/* I and Q sums as the two lowest 32 bit lanes */
+static inline __m128i dsp_sum_epi32_sse2(__m128i re, __m128i im)
+{
+  __m128i lo = _mm_unpacklo_epi32(re, im);
+  __m128i hi = _mm_unpackhi_epi32(re, im);
+  __m128i s = _mm_add_epi32(lo, hi);
+  return _mm_add_epi32(s, _mm_unpackhi_epi64(s, s));
+}
+
+
+static void dsp_store_s16_sse2(__m128i sums, int16_t *output)
+{
+  /* round, shift back from Q15 and saturate */
+  __m128i y = _mm_srai_epi32(_mm_add_epi32(sums, _mm_set1_epi32(1 << 14)), 15);
+  y = _mm_packs_epi32(y, y);
+  int32_t iq = _mm_cvtsi128_si32(y);
+  memcpy(output, &iq, sizeof(iq));
+  return;
+}
+
+
+static uint32_t dsp_fir_decimate_s16_sse2(const int16_t *restrict taps,
+                                          uint32_t ntaps,
+                                          const int16_t *restrict x_re,
+                                          const int16_t *restrict x_im,
+                                          uint32_t available,
+                                          uint32_t decimation,
+                                          int16_t *restrict output,
+                                          uint32_t *consumed)
+{
+  uint32_t noutput = 0;
+  uint32_t i;
+  for (i = 0; i + ntaps <= available; i += decimation) {
+    const int16_t *a = x_re + i;
+    const int16_t *b = x_im + i;
+    __m128i re0 = _mm_setzero_si128();
+    __m128i re1 = _mm_setzero_si128();
+    __m128i im0 = _mm_setzero_si128();
+    __m128i im1 = _mm_setzero_si128();
+    for (uint32_t t = 0; t < ntaps; t += 16) {
+      __m128i h0 = _mm_loadu_si128((const __m128i *) (taps + t));
+      __m128i h1 = _mm_loadu_si128((const __m128i *) (taps + t + 8));
+      re0 = _mm_add_epi32(re0, _mm_madd_epi16(h0, _mm_loadu_si128((const __m128i *) (a + t))));
+      re1 = _mm_add_epi32(re1, _mm_madd_epi16(h1, _mm_loadu_si128((const __m128i *) (a + t + 8))));
+      im0 = _mm_add_epi32(im0, _mm_madd_epi16(h0, _mm_loadu_si128((const __m128i *) (b + t))));
+      im1 = _mm_add_epi32(im1, _mm_madd_epi16(h1, _mm_loadu_si128((const __m128i *) (b + t + 8))));
+    }
+    dsp_store_s16_sse2(dsp_sum_epi32_sse2(_mm_add_epi32(re0, re1),
+                                          _mm_add_epi32(im0, im1)),
+                       output + 2 * noutput);
+    noutput++;
+  }
+  *consumed = i;
+  return noutput;
+}
+
+
+__attribute__((target("avx2")))
+static uint32_t dsp_fir_decimate_s16_avx2(const int16_t *restrict taps,
+                                          uint32_t ntaps,
+                                          const int16_t *restrict x_re,
+                                          const int16_t *restrict x_im,
+                                          uint32_t available,
+                                          uint32_t decimation,
+                                          int16_t *restrict output,
+                                          uint32_t *consumed)
+{
+  uint32_t noutput = 0;
+  uint32_t i;
+  for (i = 0; i + ntaps <= available; i += decimation) {
+    const int16_t *a = x_re + i;
+    const int16_t *b = x_im + i;
+    __m256i re0 = _mm256_setzero_si256();
+    __m256i re1 = _mm256_setzero_si256();
+    __m256i im0 = _mm256_setzero_si256();
+    __m256i im1 = _mm256_setzero_si256();
+    uint32_t t = 0;
+    for (; t + 32 <= ntaps; t += 32) {
+      __m256i h0 = _mm256_loadu_si256((const __m256i *) (taps + t));
+      __m256i h1 = _mm256_loadu_si256((const __m256i *) (taps + t + 16));
+      re0 = _mm256_add_epi32(re0, _mm256_madd_epi16(h0, _mm256_loadu_si256((const __m256i *) (a + t))));
+      re1 = _mm256_add_epi32(re1, _mm256_madd_epi16(h1, _mm256_loadu_si256((const __m256i *) (a + t + 16))));
+      im0 = _mm256_add_epi32(im0, _mm256_madd_epi16(h0, _mm256_loadu_si256((const __m256i *) (b + t))));
+      im1 = _mm256_add_epi32(im1, _mm256_madd_epi16(h1, _mm256_loadu_si256((const __m256i *) (b + t + 16))));
+    }
+    if (t < ntaps) {
+      __m256i h0 = _mm256_loadu_si256((const __m256i *) (taps + t));
+      re0 = _mm256_add_epi32(re0, _mm256_madd_epi16(h0, _mm256_loadu_si256((const __m256i *) (a + t))));
+      im0 = _mm256_add_epi32(im0, _mm256_madd_epi16(h0, _mm256_loadu_si256((const __m256i *) (b + t))));
+    }
+    __m256i re = _mm256_add_epi32(re0, re1);
+    __m256i im = _mm256_add_epi32(im0, im1);
+    dsp_store_s16_sse2(dsp_sum_epi32_sse2(_mm_add_epi32(_mm256_castsi256_si128(re),
+                                                        _mm256_extracti128_si256(re, 1)),
+                                          _mm_add_epi32(_mm256_castsi256_si128(im),
+                                                        _mm256_extracti128_si256(im, 1))),
+                       output + 2 * noutput);
+    noutput++;
+  }
+  *consumed = i;
+  return noutput;
+}
+
+
+/* Goertzel: the recursion is a chain of dependent operations for each
+   tone, so groups of 16 (SSE2) or 32 tones (AVX2) keep four of them in
+   flight; the last tones go 8 at a time */
+static void dsp_goertzel_sse2(const float *restrict coefficients,
+                              const float *restrict signs, float *restrict s,
+                              float *restrict d, uint32_t ntones,
+                              const float *restrict input, uint32_t ninput)
+{
+  uint32_t t = 0;
+  for (; t + 16 <= ntones; t += 16) {
+    __m128 k0 = _mm_loadu_ps(coefficients + t);
+    __m128 k1 = _mm_loadu_ps(coefficients + t + 4);
+    __m128 k2 = _mm_loadu_ps(coefficients + t + 8);
+    __m128 k3 = _mm_loadu_ps(coefficients + t + 12);
+    __m128 g0 = _mm_loadu_ps(signs + t);
+    __m128 g1 = _mm_loadu_ps(signs + t + 4);
+    __m128 g2 = _mm_loadu_ps(signs + t + 8);
+    __m128 g3 = _mm_loadu_ps(signs + t + 12);
+    __m128 a0 = _mm_loadu_ps(s + t);
+    __m128 a1 = _mm_loadu_ps(s + t + 4);
+    __m128 a2 = _mm_loadu_ps(s + t + 8);
+    __m128 a3 = _mm_loadu_ps(s + t + 12);
+    __m128 b0 = _mm_loadu_ps(d + t);
+    __m128 b1 = _mm_loadu_ps(d + t + 4);
+    __m128 b2 = _mm_loadu_ps(d + t + 8);
+    __m128 b3 = _mm_loadu_ps(d + t + 12);
+    for (uint32_t n = 0; n < ninput; ++n) {
+      __m128 x = _mm_set1_ps(input[n]);
+      b0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(g0, b0), x), _mm_mul_ps(k0, a0));
+      b1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(g1, b1), x), _mm_mul_ps(k1, a1));
+      b2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(g2, b2), x), _mm_mul_ps(k2, a2));
+      b3 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(g3, b3), x), _mm_mul_ps(k3, a3));
+      a0 = _mm_add_ps(b0, _mm_mul_ps(g0, a0));
+      a1 = _mm_add_ps(b1, _mm_mul_ps(g1, a1));
+      a2 = _mm_add_ps(b2, _mm_mul_ps(g2, a2));
+      a3 = _mm_add_ps(b3, _mm_mul_ps(g3, a3));
+    }
+    _mm_storeu_ps(s + t, a0);
+    _mm_storeu_ps(s + t + 4, a1);
+    _mm_storeu_ps(s + t + 8, a2);
+    _mm_storeu_ps(s + t + 12, a3);
+    _mm_storeu_ps(d + t, b0);
+    _mm_storeu_ps(d + t + 4, b1);
+    _mm_storeu_ps(d + t + 8, b2);
+    _mm_storeu_ps(d + t + 12, b3);
+  }
+  for (; t < ntones; t += 8) {
+    __m128 k0 = _mm_loadu_ps(coefficients + t);
+    __m128 k1 = _mm_loadu_ps(coefficients + t + 4);
+    __m128 g0 = _mm_loadu_ps(signs + t);
+    __m128 g1 = _mm_loadu_ps(signs + t + 4);
+    __m128 a0 = _mm_loadu_ps(s + t);
+    __m128 a1 = _mm_loadu_ps(s + t + 4);
+    __m128 b0 = _mm_loadu_ps(d + t);
+    __m128 b1 = _mm_loadu_ps(d + t + 4);
+    for (uint32_t n = 0; n < ninput; ++n) {
+      __m128 x = _mm_set1_ps(input[n]);
+      b0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(g0, b0), x), _mm_mul_ps(k0, a0));
+      b1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(g1, b1), x), _mm_mul_ps(k1, a1));
+      a0 = _mm_add_ps(b0, _mm_mul_ps(g0, a0));
+      a1 = _mm_add_ps(b1, _mm_mul_ps(g1, a1));
+    }
+    _mm_storeu_ps(s + t, a0);
+    _mm_storeu_ps(s + t + 4, a1);
+    _mm_storeu_ps(d + t, b0);
+    _mm_storeu_ps(d + t + 4, b1);
+  }
+  return;
+}
+
+
+__attribute__((target("avx2,fma")))
+static void dsp_goertzel_avx2(const float *restrict coefficients,
+                              const float *restrict signs, float *restrict s,
+                              float *restrict d, uint32_t ntones,
+                              const float *restrict input, uint32_t ninput)
+{
+  uint32_t t = 0;
+  for (; t + 32 <= ntones; t += 32) {
+    __m256 k0 = _mm256_loadu_ps(coefficients + t);
+    __m256 k1 = _mm256_loadu_ps(coefficients + t + 8);
+    __m256 k2 = _mm256_loadu_ps(coefficients + t + 16);
+    __m256 k3 = _mm256_loadu_ps(coefficients + t + 24);
+    __m256 g0 = _mm256_loadu_ps(signs + t);
+    __m256 g1 = _mm256_loadu_ps(signs + t + 8);
+    __m256 g2 = _mm256_loadu_ps(signs + t + 16);
+    __m256 g3 = _mm256_loadu_ps(signs + t + 24);
+    __m256 a0 = _mm256_loadu_ps(s + t);
+    __m256 a1 = _mm256_loadu_ps(s + t + 8);
+    __m256 a2 = _mm256_loadu_ps(s + t + 16);
+    __m256 a3 = _mm256_loadu_ps(s + t + 24);
+    __m256 b0 = _mm256_loadu_ps(d + t);
+    __m256 b1 = _mm256_loadu_ps(d + t + 8);
+    __m256 b2 = _mm256_loadu_ps(d + t + 16);
+    __m256 b3 = _mm256_loadu_ps(d + t + 24);
+    for (uint32_t n = 0; n < ninput; ++n) {
+      __m256 x = _mm256_broadcast_ss(input + n);
+      b0 = _mm256_fmadd_ps(k0, a0, _mm256_fmadd_ps(g0, b0, x));
+      b1 = _mm256_fmadd_ps(k1, a1, _mm256_fmadd_ps(g1, b1, x));
+      b2 = _mm256_fmadd_ps(k2, a2, _mm256_fmadd_ps(g2, b2, x));
+      b3 = _mm256_fmadd_ps(k3, a3, _mm256_fmadd_ps(g3, b3, x));
+      a0 = _mm256_fmadd_ps(g0, a0, b0);
+      a1 = _mm256_fmadd_ps(g1, a1, b1);
+      a2 = _mm256_fmadd_ps(g2, a2, b2);
+      a3 = _mm256_fmadd_ps(g3, a3, b3);
+    }
+    _mm256_storeu_ps(s + t, a0);
+    _mm256_storeu_ps(s + t + 8, a1);
+    _mm256_storeu_ps(s + t + 16, a2);
+    _mm256_storeu_ps(s + t + 24, a3);
+    _mm256_storeu_ps(d + t, b0);
+    _mm256_storeu_ps(d + t + 8, b1);
+    _mm256_storeu_ps(d + t + 16, b2);
+    _mm256_storeu_ps(d + t + 24, b3);
+  }
+  for (; t < ntones; t += 8) {
+    __m256 k0 = _mm256_loadu_ps(coefficients + t);
+    __m256 g0 = _mm256_loadu_ps(signs + t);
+    __m256 a0 = _mm256_loadu_ps(s + t);
+    __m256 b0 = _mm256_loadu_ps(d + t);
+    for (uint32_t n = 0; n < ninput; ++n) {
+      __m256 x = _mm256_broadcast_ss(input + n);
+      b0 = _mm256_fmadd_ps(k0, a0, _mm256_fmadd_ps(g0, b0, x));
+      a0 = _mm256_fmadd_ps(g0, a0, b0);
+    }
+    _mm256_storeu_ps(s + t, a0);
+    _mm256_storeu_ps(d + t, b0);
+  }
+  return;
+}
+
+
+#define DSP_ENTRY_SSE2(NTAPS) \
+  { NTAPS, "sse2/" #NTAPS, dsp_fir_decimate_sse2_##NTAPS },
+#define DSP_ENTRY_AVX2(NTAPS) \
+  { NTAPS, "avx2/" #NTAPS, dsp_fir_decimate_avx2_##NTAPS },
+
+static const struct dsp_fir_decimate_entry dsp_fir_decimate_sse2[] = {
+  DSP_KERNEL_TAPS(DSP_ENTRY_SSE2)
+  { 0, "sse2/any", dsp_fir_decimate_sse2_any }
+};
+
+static const struct dsp_fir_decimate_entry dsp_fir_decimate_avx2[] = {
+  DSP_KERNEL_TAPS(DSP_ENTRY_AVX2)
+  { 0, "avx2/any", dsp_fir_decimate_avx2_any }
+};
+
+static const struct dsp_fir_interpolate_entry dsp_fir_interpolate_sse2_any[] = {
+  { 0, "sse2/any", dsp_fir_interpolate_sse2 }
+};
+
+static const struct dsp_fir_interpolate_entry dsp_fir_interpolate_avx2_any[] = {
+  { 0, "avx2/any", dsp_fir_interpolate_avx2 }
+};
+
+static const struct dsp_fir_decimate_s16_entry dsp_fir_decimate_s16_sse2_any[] = {
+  { 0, "sse2/any", dsp_fir_decimate_s16_sse2 }
+};
+
+static const struct dsp_fir_decimate_s16_entry dsp_fir_decimate_s16_avx2_any[] = {
+  { 0, "avx2/any", dsp_fir_decimate_s16_avx2 }
+};
+
+static const struct dsp_goertzel_entry dsp_goertzel_sse2_any[] = {
+  { 0, "sse2/any", dsp_goertzel_sse2 }
+};
+
+static const struct dsp_goertzel_entry dsp_goertzel_avx2_any[] = {
+  { 0, "avx2/any", dsp_goertzel_avx2 }
+};
+
+#endif /* DSP_KERNELS_X86 */
+
+static const struct dsp_fir_decimate_entry dsp_fir_decimate_c[] = {
+  { 0, "c/any", dsp_fir_decimate_generic }
+};
+
+static const struct dsp_fir_interpolate_entry dsp_fir_interpolate_c[] = {
+  { 0, "c/any", dsp_fir_interpolate_generic }
+};
+
+static const struct dsp_fir_decimate_s16_entry dsp_fir_decimate_s16_c[] = {
+  { 0, "c/any", dsp_fir_decimate_s16_generic }
+};
+
+static const struct dsp_goertzel_entry dsp_goertzel_c[] = {
+  { 0, "c/any", dsp_goertzel_generic }
+};
+
+
+/* internal functions */
+static int dsp_has_avx2();
+
+
+dsp_fir_decimate_t dsp_get_fir_decimate(uint32_t ntaps)
+{
+  const struct dsp_fir_decimate_entry *registry = dsp_fir_decimate_c;
+#ifdef DSP_KERNELS_X86
+  registry = dsp_has_avx2() ? dsp_fir_decimate_avx2 : dsp_fir_decimate_sse2;
+#endif
+  /* the last entry takes any tap count */
+  const struct dsp_fir_decimate_entry *entry = registry;
+  while (entry->ntaps != 0 && entry->ntaps != ntaps)
+    entry++;
+  return entry->kernel;
+}
+
+
+dsp_fir_interpolate_t dsp_get_fir_interpolate(uint32_t ntaps __attribute__((unused)))
+{
+  const struct dsp_fir_interpolate_entry *registry = dsp_fir_interpolate_c;
+#ifdef DSP_KERNELS_X86
+  registry = dsp_has_avx2() ? dsp_fir_interpolate_avx2_any :
+                              dsp_fir_interpolate_sse2_any;
+#endif
+  return registry->kernel;
+}
+
+
+dsp_fir_decimate_s16_t dsp_get_fir_decimate_s16(uint32_t ntaps __attribute__((unused)))
+{
+  const struct dsp_fir_decimate_s16_entry *registry = dsp_fir_decimate_s16_c;
+#ifdef DSP_KERNELS_X86
+  registry = dsp_has_avx2() ? dsp_fir_decimate_s16_avx2_any :
+                              dsp_fir_decimate_s16_sse2_any;
+#endif
+  return registry->kernel;
+}
+
+
+dsp_goertzel_t dsp_get_goertzel(uint32_t ntones __attribute__((unused)))
+{
+  const struct dsp_goertzel_entry *registry = dsp_goertzel_c;
+#ifdef DSP_KERNELS_X86
+  registry = dsp_has_avx2() ? dsp_goertzel_avx2_any : dsp_goertzel_sse2_any;
+#endif
+  return registry->kernel;
+}
+
+
+const char *dsp_get_fir_decimate_name(dsp_fir_decimate_t kernel)
+{
+  const struct dsp_fir_decimate_entry *registries[] = {
+#ifdef DSP_KERNELS_X86
+    dsp_fir_decimate_sse2,
+    dsp_fir_decimate_avx2,
+#endif
+    dsp_fir_decimate_c
+  };
+  for (size_t i = 0; i < sizeof(registries) / sizeof(registries[0]); ++i) {
+    const struct dsp_fir_decimate_entry *entry = registries[i];
+    for (;; ++entry) {
+      if (entry->kernel == kernel)
+        return entry->name;
+      if (entry->ntaps == 0)
+        break;
+    }
+  }
+  return "unknown";
+}
+
+
+const char *dsp_get_fir_interpolate_name(dsp_fir_interpolate_t kernel)
+{
+  const struct dsp_fir_interpolate_entry *registries[] = {
+#ifdef DSP_KERNELS_X86
+    dsp_fir_interpolate_sse2_any,
+    dsp_fir_interpolate_avx2_any,
+#endif
+    dsp_fir_interpolate_c
+  };
+  for (size_t i = 0; i < sizeof(registries) / sizeof(registries[0]); ++i) {
+    if (registries[i]->kernel == kernel)
+      return registries[i]->name;
+  }
+  return "unknown";
+}
+
+
+const char *dsp_get_fir_decimate_s16_name(dsp_fir_decimate_s16_t kernel)
+{
+  const struct dsp_fir_decimate_s16_entry *registries[] = {
+#ifdef DSP_KERNELS_X86
+    dsp_fir_decimate_s16_sse2_any,
+    dsp_fir_decimate_s16_avx2_any,
+#endif
+    dsp_fir_decimate_s16_c
+  };
+  for (size_t i = 0; i < sizeof(registries) / sizeof(registries[0]); ++i) {
+    if (registries[i]->kernel == kernel)
+      return registries[i]->name;
+  }
+  return "unknown";
+}
+
+
+const char *dsp_get_goertzel_name(dsp_goertzel_t kernel)
+{
+  const struct dsp_goertzel_entry *registries[] = {
+#ifdef DSP_KERNELS_X86
+    dsp_goertzel_sse2_any,
+    dsp_goertzel_avx2_any,
+#endif
+    dsp_goertzel_c
+  };
+  for (size_t i = 0; i < sizeof(registries) / sizeof(registries[0]); ++i) {
+    if (registries[i]->kernel == kernel)
+      return registries[i]->name;
+  }
+  return "unknown";
+}
+
+
+/* internal functions */
+static int dsp_has_avx2()
+{
+#ifdef DSP_KERNELS_X86
+  /* RF103_DSP_KERNELS=sse2 forces the SSE2 kernels (for comparisons) */
+  const char *kernels = getenv("RF103_DSP_KERNELS");
+  if (kernels && kernels[0] == 's')
+    return 0;
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+  return 0;
+#endif
+}
@@ -0,0 +1,123 @@
+/*
+ * dsp_kernels.h - specialized FIR kernels
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+#ifndef __DSP_KERNELS_H
+#define __DSP_KERNELS_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* decimating FIR with real taps on complex samples kept in separate I and Q
+ * arrays: one output (interleaved I/Q) every 'decimation' input samples, for
+ * as long as ntaps samples are available; returns the number of outputs and
+ * sets *consumed to the input samples the next call starts from */
+typedef uint32_t (*dsp_fir_decimate_t)(const float *taps, uint32_t ntaps,
+                                       const float *x_re, const float *x_im,
+                                       uint32_t available,
+                                       uint32_t decimation, float *output,
+                                       uint32_t *consumed);
+
+/* one output of a polyphase interpolator: the taps are taps0 + mu * (taps1 -
+ * taps0) */
+typedef void (*dsp_fir_interpolate_t)(const float *taps0, const float *taps1,
+                                      float mu, uint32_t ntaps,
+                                      const float *x_re, const float *x_im,
+                                      float *output);
+
+/* the same on 16 bit samples with Q15 taps: the products are accumulated
+ * in 32 bits and each output is rounded and saturated to 16 bits */
+typedef uint32_t (*dsp_fir_decimate_s16_t)(const int16_t *taps,
+                                           uint32_t ntaps,
+                                           const int16_t *x_re,
+                                           const int16_t *x_im,
+                                           uint32_t available,
+                                           uint32_t decimation,
+                                           int16_t *output,
+                                           uint32_t *consumed);
+
+/* a bank of Goertzel resonators on the same real input, in Reinsch's form
+ * (the plain recursion with 2cos(w) in float is far off for w near 0 or
+ * pi): for every tone d = sign * d + x + coefficient * s and then
+ * s = d + sign * s, with sign = 1 and coefficient = -4sin(w/2)^2 for
+ * cos(w) >= 0, sign = -1 and coefficient = 4cos(w/2)^2 otherwise; s is the
+ * last state of the Goertzel recursion and d its difference (or sum) with
+ * the one before, both updated in place; ntones must be a multiple of
+ * DSP_KERNEL_LANES */
+typedef void (*dsp_goertzel_t)(const float *coefficients, const float *signs,
+                               float *s, float *d, uint32_t ntones,
+                               const float *input, uint32_t ninput);
+
+/* ntaps must be a multiple of DSP_KERNEL_LANES (DSP_KERNEL_LANES_S16 for
+ * the 16 bit kernels); the kernel is the best one
+ * for ntaps and the CPU */
+enum {
+  DSP_KERNEL_LANES = 8,
+  DSP_KERNEL_LANES_S16 = 16
+};
+
+dsp_fir_decimate_t dsp_get_fir_decimate(uint32_t ntaps);
+
+dsp_fir_interpolate_t dsp_get_fir_interpolate(uint32_t ntaps);
+
+dsp_fir_decimate_s16_t dsp_get_fir_decimate_s16(uint32_t ntaps);
+
+dsp_goertzel_t dsp_get_goertzel(uint32_t ntones);
+
+/* name of the variant (like "avx2/64" or "sse2/any"), for benchmarks */
+const char *dsp_get_fir_decimate_name(dsp_fir_decimate_t kernel);
+
+const char *dsp_get_fir_interpolate_name(dsp_fir_interpolate_t kernel);
+
+const char *dsp_get_fir_decimate_s16_name(dsp_fir_decimate_s16_t kernel);
+
+const char *dsp_get_goertzel_name(dsp_goertzel_t kernel);
+
+/* the generic kernels (plain C, run time tap count), for comparisons */
+uint32_t dsp_fir_decimate_generic(const float *taps, uint32_t ntaps,
+                                  const float *x_re, const float *x_im,
+                                  uint32_t available, uint32_t decimation,
+                                  float *output, uint32_t *consumed);
+
+void dsp_fir_interpolate_generic(const float *taps0, const float *taps1,
+                                 float mu, uint32_t ntaps, const float *x_re,
+                                 const float *x_im, float *output);
+
+uint32_t dsp_fir_decimate_s16_generic(const int16_t *taps, uint32_t ntaps,
+                                      const int16_t *x_re,
+                                      const int16_t *x_im,
+                                      uint32_t available,
+                                      uint32_t decimation, int16_t *output,
+                                      uint32_t *consumed);
+
+void dsp_goertzel_generic(const float *coefficients, const float *signs,
+                          float *s, float *d, uint32_t ntones,
+                          const float *input, uint32_t ninput);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DSP_KERNELS_H */
@@ -0,0 +1,314 @@
+/*
+ * fft.c - fast Fourier transform functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* iterative radix-2 decimation in time FFT; the twiddle factors for each
+ * stage are stored contiguously (stage with half size h uses twiddles[h..2h-1])
+ * so the butterfly inner loop walks memory with unit stride; the split
+ * transform is decimation in frequency on separate real and imaginary
+ * arrays, so the butterflies of the stages with h >= 8 vectorize, and the
+ * last three stages are done as one 8 point kernel
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fft.h"
+#include "memory_budget.h"
+
+
+typedef struct fft fft_t;
+
+/* internal functions */
+static void fft_transform(fft_t *this, float *data, const float *twiddles);
+static void fft_split_butterflies(float *restrict ar, float *restrict ai,
+                                  float *restrict br, float *restrict bi,
+                                  const float *restrict wr,
+                                  const float *restrict wi, uint32_t h);
+static void fft_split_kernel8(float *re, float *im);
+
+
+typedef struct fft {
+  uint32_t size;
+  uint32_t *bit_reverse;
+  float *twiddles;           /* forward: exp(-2*pi*i*j/(2*h)) */
+  float *inverse_twiddles;   /* inverse: exp(+2*pi*i*j/(2*h)) */
+  float *split_twiddles;     /* forward, real parts then imaginary parts */
+} fft_t;
+
+
+fft_t *fft_open(uint32_t size)
+{
+  fft_t *ret_val = 0;
+
+  if (size < 2 || (size & (size - 1)) != 0) {
+    fprintf(stderr, "ERROR - invalid FFT size: %u (must be a power of 2)\n",
+            size);
+    return ret_val;
+  }
+
+  int log2_size = 0;
+  while ((1U << log2_size) < size) {
+    log2_size++;
+  }
+
+  uint32_t *bit_reverse = (uint32_t *) memory_budget_alloc(MEMORY_DSP, size * sizeof(uint32_t),
+                                                           "FFT tables");
+  float *twiddles = (float *) memory_budget_alloc(MEMORY_DSP, 2 * size * sizeof(float),
+                                                  "FFT tables");
+  float *inverse_twiddles = (float *) memory_budget_alloc(MEMORY_DSP, 2 * size * sizeof(float),
+                                                          "FFT tables");
+  float *split_twiddles = (float *) memory_budget_alloc(MEMORY_DSP, 2 * size * sizeof(float),
+                                                        "FFT tables");
+  if (bit_reverse == 0 || twiddles == 0 || inverse_twiddles == 0 ||
+      split_twiddles == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    memory_budget_free(bit_reverse);
+    memory_budget_free(twiddles);
+    memory_budget_free(inverse_twiddles);
+    memory_budget_free(split_twiddles);
+    return ret_val;
+  }
+
+  for (uint32_t i = 0; i < size; ++i) {
+    uint32_t r = 0;
+    for (int b = 0; b < log2_size; ++b) {
+      r |= ((i >> b) & 1) << (log2_size - 1 - b);
+    }
+    bit_reverse[i] = r;
+  }
+
+  for (uint32_t h = 1; h < size; h <<= 1) {
+    for (uint32_t j = 0; j < h; ++j) {
+      double angle = -M_PI * (double) j / (double) h;
+      twiddles[2 * (h + j)] = (float) cos(angle);
+      twiddles[2 * (h + j) + 1] = (float) sin(angle);
+      inverse_twiddles[2 * (h + j)] = (float) cos(angle);
+      inverse_twiddles[2 * (h + j) + 1] = (float) -sin(angle);
+      split_twiddles[h + j] = (float) cos(angle);
+      split_twiddles[size + h + j] = (float) sin(angle);
+    }
+  }
+
+  /* we are good here - create and initialize the fft */
+  fft_t *this = (fft_t *) malloc(sizeof(fft_t));
+  this->size = size;
+  this->bit_reverse = bit_reverse;
+  this->twiddles = twiddles;
+  this->inverse_twiddles = inverse_twiddles;
+  this->split_twiddles = split_twiddles;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void fft_close(fft_t *this)
+{
+  memory_budget_free(this->bit_reverse);
+  memory_budget_free(this->twiddles);
+  memory_budget_free(this->inverse_twiddles);
+  memory_budget_free(this->split_twiddles);
+  free(this);
+  return;
+}
+
+
+uint32_t fft_get_size(fft_t *this)
+{
+  return this->size;
+}
+
+
+void fft_forward(fft_t *this, float *data)
+{
+  fft_transform(this, data, this->twiddles);
+}
+
+
+void fft_inverse(fft_t *this, float *data)
+{
+  fft_transform(this, data, this->inverse_twiddles);
+}
+
+
+void fft_forward_split(fft_t *this, float *re, float *im)
+{
+  uint32_t size = this->size;
+  uint32_t h = size / 2;
+  for (; h >= (size >= 8 ? 8 : 1); h >>= 1) {
+    const float *wr = this->split_twiddles + h;
+    const float *wi = this->split_twiddles + size + h;
+    for (uint32_t k = 0; k < size; k += 2 * h) {
+      fft_split_butterflies(re + k, im + k, re + k + h, im + k + h, wr, wi, h);
+    }
+  }
+  if (size >= 8) {
+    for (uint32_t k = 0; k < size; k += 8) {
+      fft_split_kernel8(re + k, im + k);
+    }
+  }
+  return;
+}
+
+
+const uint32_t *fft_get_bit_reverse(fft_t *this)
+{
+  return this->bit_reverse;
+}
+
+
+/* internal functions */
+static void fft_transform(fft_t *this, float *data, const float *twiddles)
+{
+  uint32_t size = this->size;
+
+  /* bit reversal permutation */
+  for (uint32_t i = 0; i < size; ++i) {
+    uint32_t r = this->bit_reverse[i];
+    if (r > i) {
+      float re = data[2 * i];
+      float im = data[2 * i + 1];
+      data[2 * i] = data[2 * r];
+      data[2 * i + 1] = data[2 * r + 1];
+      data[2 * r] = re;
+      data[2 * r + 1] = im;
+    }
+  }
+
+  /* first stage (h=1) has only trivial twiddles */
+  for (uint32_t k = 0; k < size; k += 2) {
+    float *a = data + 2 * k;
+    float re = a[2];
+    float im = a[3];
+    a[2] = a[0] - re;
+    a[3] = a[1] - im;
+    a[0] += re;
+    a[1] += im;
+  }
+
+  for (uint32_t h = 2; h < size; h <<= 1) {
+    const float *w = twiddles + 2 * h;
+    for (uint32_t k = 0; k < size; k += 2 * h) {
+      float *a = data + 2 * k;
+      float *b = data + 2 * (k + h);
+      for (uint32_t j = 0; j < h; ++j) {
+        float wr = w[2 * j];
+        float wi = w[2 * j + 1];
+        float br = b[2 * j];
+        float bi = b[2 * j + 1];
+        float tr = br * wr - bi * wi;
+        float ti = br * wi + bi * wr;
+        b[2 * j] = a[2 * j] - tr;
+        b[2 * j + 1] = a[2 * j + 1] - ti;
+        a[2 * j] += tr;
+        a[2 * j + 1] += ti;
+      }
+    }
+  }
+  return;
+}
+
+
+static void fft_split_butterflies(float *restrict ar, float *restrict ai,
+                                  float *restrict br, float *restrict bi,
+                                  const float *restrict wr,
+                                  const float *restrict wi, uint32_t h)
+{
+  for (uint32_t j = 0; j < h; ++j) {
+    float xr = ar[j] - br[j];
+    float xi = ai[j] - bi[j];
+    ar[j] += br[j];
+    ai[j] += bi[j];
+    br[j] = xr * wr[j] - xi * wi[j];
+    bi[j] = xr * wi[j] + xi * wr[j];
+  }
+  return;
+}
+
+
+/* the last three decimation in frequency stages (h = 4, 2, 1) */
+static void fft_split_kernel8(float *re, float *im)
+{
+  static const float c = 0.70710678f;
+
+  /* h = 4: twiddles 1, (c, -c), -i, (-c, -c) */
+  float r0 = re[0] + re[4];
+  float i0 = im[0] + im[4];
+  float r4 = re[0] - re[4];
+  float i4 = im[0] - im[4];
+  float r1 = re[1] + re[5];
+  float i1 = im[1] + im[5];
+  float x5r = re[1] - re[5];
+  float x5i = im[1] - im[5];
+  float r2 = re[2] + re[6];
+  float i2 = im[2] + im[6];
+  float x6r = re[2] - re[6];
+  float x6i = im[2] - im[6];
+  float r3 = re[3] + re[7];
+  float i3 = im[3] + im[7];
+  float x7r = re[3] - re[7];
+  float x7i = im[3] - im[7];
+  float r5 = c * (x5r + x5i);
+  float i5 = c * (x5i - x5r);
+  float r6 = x6i;
+  float i6 = -x6r;
+  float r7 = c * (x7i - x7r);
+  float i7 = -c * (x7r + x7i);
+
+  /* h = 2: twiddles 1, -i */
+  float a0r = r0 + r2;
+  float a0i = i0 + i2;
+  float a2r = r0 - r2;
+  float a2i = i0 - i2;
+  float a1r = r1 + r3;
+  float a1i = i1 + i3;
+  float a3r = i1 - i3;
+  float a3i = r3 - r1;
+  float b0r = r4 + r6;
+  float b0i = i4 + i6;
+  float b2r = r4 - r6;
+  float b2i = i4 - i6;
+  float b1r = r5 + r7;
+  float b1i = i5 + i7;
+  float b3r = i5 - i7;
+  float b3i = r7 - r5;
+
+  /* h = 1 */
+  re[0] = a0r + a1r;
+  im[0] = a0i + a1i;
+  re[1] = a0r - a1r;
+  im[1] = a0i - a1i;
+  re[2] = a2r + a3r;
+  im[2] = a2i + a3i;
+  re[3] = a2r - a3r;
+  im[3] = a2i - a3i;
+  re[4] = b0r + b1r;
+  im[4] = b0i + b1i;
+  re[5] = b0r - b1r;
+  im[5] = b0i - b1i;
+  re[6] = b2r + b3r;
+  im[6] = b2i + b3i;
+  re[7] = b2r - b3r;
+  im[7] = b2i - b3i;
+  return;
+}
@@ -0,0 +1,59 @@
+/*
+ * fft.h - fast Fourier transform functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __FFT_H
+#define __FFT_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fft fft_t;
+
+/* complex samples are stored interleaved: re[0], im[0], re[1], im[1], ... */
+
+fft_t *fft_open(uint32_t size);
+
+void fft_close(fft_t *this);
+
+uint32_t fft_get_size(fft_t *this);
+
+void fft_forward(fft_t *this, float *data);
+
+/* the inverse transform is not scaled by 1/size */
+void fft_inverse(fft_t *this, float *data);
+
+/* forward transform of separate real and imaginary arrays that leaves the
+   result in bit reversed order (bin k is at index fft_get_bit_reverse()[k]);
+   skipping the reordering and the interleaving makes it several times
+   faster, which matters when only some of the bins are needed */
+void fft_forward_split(fft_t *this, float *re, float *im);
+
+const uint32_t *fft_get_bit_reverse(fft_t *this);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FFT_H */
@@ -0,0 +1,563 @@
+/*
+ * fir_design.c - FIR filter design functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - J.F. Kaiser, "Nonrecursive digital filter design using the I0-sinh
+ *    window function", Proc. IEEE ISCAS, 1974
+ *  - J.H. McClellan, T.W. Parks, L.R. Rabiner, "A computer program for
+ *    designing optimum FIR linear phase digital filters", IEEE Trans. Audio
+ *    Electroacoust., 1973
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fir_design.h"
+#include "memory_budget.h"
+
+
+/* internal functions */
+static int design_kaiser(const struct fir_design_spec *spec, double **h);
+static int design_equiripple(const struct fir_design_spec *spec, double **h);
+static int remez_lowpass(double passband, double stopband, double stop_weight,
+                         uint32_t num_taps, double *h, double *deviation);
+static int select_extremal(const int *candidates, int ncandidates,
+                           const double *error, int nextremal, int *extremal,
+                           int *scratch);
+static double barycentric_weight(int k, int n, const double *x);
+static double stopband_attenuation(const double *h, int num_taps,
+                                   double stopband);
+static double bessel_i0(double x);
+
+
+/* the taps must be the first member (see fir_release_taps()) */
+struct fir_cache_entry {
+  struct fir_taps taps;
+  struct fir_design_spec spec;
+  int references;
+  struct fir_cache_entry *next;
+};
+
+static const int FIR_CACHE_SIZE = 64;        /* unreferenced designs kept */
+static const int REMEZ_GRID_DENSITY = 16;
+static const int REMEZ_MAX_ITERATIONS = 40;
+static const int EQUIRIPPLE_MAX_ORDER_STEPS = 16;
+static const int KAISER_MAX_ORDER_STEPS = 16;
+static const int STOPBAND_GRID_DENSITY = 16;  /* points per tap */
+
+static pthread_mutex_t fir_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fir_cache_entry *fir_cache = 0;
+static int fir_cache_count = 0;
+
+
+const struct fir_taps *fir_design_lowpass(const struct fir_design_spec *spec)
+{
+  if (!(spec->passband > 0 && spec->passband < spec->stopband &&
+        spec->stopband < 0.5 && spec->attenuation > 0)) {
+    fprintf(stderr, "ERROR - invalid FIR design: passband=%f stopband=%f attenuation=%f\n",
+            spec->passband, spec->stopband, spec->attenuation);
+    return 0;
+  }
+
+  pthread_mutex_lock(&fir_cache_mutex);
+  for (struct fir_cache_entry *entry = fir_cache; entry; entry = entry->next) {
+    if (entry->spec.method == spec->method &&
+        entry->spec.passband == spec->passband &&
+        entry->spec.stopband == spec->stopband &&
+        entry->spec.attenuation == spec->attenuation &&
+        entry->spec.ripple == spec->ripple &&
+        entry->spec.gain == spec->gain) {
+      entry->references++;
+      pthread_mutex_unlock(&fir_cache_mutex);
+      return &entry->taps;
+    }
+  }
+  pthread_mutex_unlock(&fir_cache_mutex);
+
+  /* design outside the lock; if two threads race for the same design, both
+     entries end up in the cache and the extra one is eventually evicted */
+  double *h = 0;
+  int num_taps;
+  switch (spec->method) {
+    case FIR_DESIGN_KAISER:
+      num_taps = design_kaiser(spec, &h);
+      break;
+    case FIR_DESIGN_EQUIRIPPLE:
+      num_taps = design_equiripple(spec, &h);
+      break;
+    default:
+      fprintf(stderr, "ERROR - invalid FIR design method: %d\n", spec->method);
+      return 0;
+  }
+  if (num_taps < 0) {
+    return 0;
+  }
+
+  const uint32_t floats_per_vector = FIR_TAPS_ALIGNMENT / sizeof(float);
+  uint32_t padded_taps = (num_taps + floats_per_vector - 1) /
+                         floats_per_vector * floats_per_vector;
+  float *taps = (float *) memory_budget_aligned_alloc(MEMORY_DSP,
+                                                      FIR_TAPS_ALIGNMENT,
+                                                      padded_taps * sizeof(float),
+                                                      "FIR taps");
+  if (taps == 0) {
+    free(h);
+    return 0;
+  }
+  for (int i = 0; i < num_taps; ++i) {
+    taps[i] = (float) (spec->gain * h[i]);
+  }
+  for (uint32_t i = num_taps; i < padded_taps; ++i) {
+    taps[i] = 0;
+  }
+  free(h);
+
+  struct fir_cache_entry *new_entry = (struct fir_cache_entry *) malloc(sizeof(struct fir_cache_entry));
+  new_entry->taps.num_taps = num_taps;
+  new_entry->taps.padded_taps = padded_taps;
+  new_entry->taps.taps = taps;
+  new_entry->spec = *spec;
+  new_entry->references = 1;
+
+  pthread_mutex_lock(&fir_cache_mutex);
+  /* evict unreferenced designs when the cache is full */
+  struct fir_cache_entry **link = &fir_cache;
+  while (*link && fir_cache_count >= FIR_CACHE_SIZE) {
+    struct fir_cache_entry *entry = *link;
+    if (entry->references == 0) {
+      *link = entry->next;
+      memory_budget_free(entry->taps.taps);
+      free(entry);
+      fir_cache_count--;
+    } else {
+      link = &entry->next;
+    }
+  }
+  new_entry->next = fir_cache;
+  fir_cache = new_entry;
+  fir_cache_count++;
+  pthread_mutex_unlock(&fir_cache_mutex);
+
+  return &new_entry->taps;
+}
+
+
+void fir_release_taps(const struct fir_taps *taps)
+{
+  struct fir_cache_entry *entry = (struct fir_cache_entry *) taps;
+  pthread_mutex_lock(&fir_cache_mutex);
+  entry->references--;
+  pthread_mutex_unlock(&fir_cache_mutex);
+  return;
+}
+
+
+/* internal functions */
+static int design_kaiser(const struct fir_design_spec *spec, double **h)
+{
+  double attenuation = spec->attenuation;
+  double beta;
+  if (attenuation > 50) {
+    beta = 0.1102 * (attenuation - 8.7);
+  } else if (attenuation >= 21) {
+    beta = 0.5842 * pow(attenuation - 21, 0.4) +
+           0.07886 * (attenuation - 21);
+  } else {
+    beta = 0;
+  }
+  double transition = spec->stopband - spec->passband;
+  /* Kaiser's estimate of the length can fall short of the attenuation (by
+     up to about 1.5dB at 80dB), so the length grows until the measured
+     stopband meets the spec */
+  int num_taps = (int) ceil((attenuation - 7.95) / (14.36 * transition)) + 1;
+  num_taps |= 1;
+  if (num_taps < 3) {
+    num_taps = 3;
+  }
+
+  double cutoff = (spec->passband + spec->stopband) / 2;
+  double i0_beta = bessel_i0(beta);
+  for (int step = 0; step < KAISER_MAX_ORDER_STEPS; ++step) {
+    double *taps = (double *) malloc(num_taps * sizeof(double));
+    if (taps == 0) {
+      fprintf(stderr, "ERROR - malloc() failed\n");
+      return -1;
+    }
+    double sum = 0;
+    int middle = num_taps / 2;
+    for (int i = 0; i < num_taps; ++i) {
+      int t = i - middle;
+      double sinc = t == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * t) / (M_PI * t);
+      double r = (double) t / middle;
+      taps[i] = sinc * bessel_i0(beta * sqrt(1 - r * r)) / i0_beta;
+      sum += taps[i];
+    }
+    /* unity gain at DC */
+    for (int i = 0; i < num_taps; ++i) {
+      taps[i] /= sum;
+    }
+    if (stopband_attenuation(taps, num_taps, spec->stopband) >= attenuation) {
+      *h = taps;
+      return num_taps;
+    }
+    free(taps);
+    /* about 1% longer each time, so long filters get there quickly too */
+    num_taps += 2 * (num_taps / 200 + 1);
+  }
+  fprintf(stderr, "ERROR - Kaiser design did not meet the attenuation\n");
+  return -1;
+}
+
+
+static int design_equiripple(const struct fir_design_spec *spec, double **h)
+{
+  double ripple = spec->ripple > 0 ? spec->ripple : 0.1;
+  double passband_deviation = (pow(10, ripple / 20) - 1) /
+                              (pow(10, ripple / 20) + 1);
+  double stopband_deviation = pow(10, -spec->attenuation / 20);
+  double transition = spec->stopband - spec->passband;
+
+  /* Kaiser's estimate of the order, then increase it until the spec is met */
+  int num_taps = (int) ceil((-20 * log10(sqrt(passband_deviation *
+                                              stopband_deviation)) - 13) /
+                            (14.6 * transition)) + 1;
+  num_taps |= 1;
+  if (num_taps < 5) {
+    num_taps = 5;
+  }
+
+  for (int step = 0; step < EQUIRIPPLE_MAX_ORDER_STEPS; ++step, num_taps += 2) {
+    double *taps = (double *) malloc(num_taps * sizeof(double));
+    if (taps == 0) {
+      fprintf(stderr, "ERROR - malloc() failed\n");
+      return -1;
+    }
+    double deviation;
+    int ret = remez_lowpass(spec->passband, spec->stopband,
+                            passband_deviation / stopband_deviation,
+                            num_taps, taps, &deviation);
+    if (ret == 0 && deviation <= passband_deviation) {
+      *h = taps;
+      return num_taps;
+    }
+    free(taps);
+  }
+  fprintf(stderr, "ERROR - equiripple design did not converge\n");
+  return -1;
+}
+
+
+/* Parks-McClellan (Remez exchange) for a type I low pass with num_taps taps;
+ * deviation is the resulting passband deviation (the stopband deviation is
+ * deviation / stop_weight) */
+static int remez_lowpass(double passband, double stopband, double stop_weight,
+                         uint32_t num_taps, double *h, double *deviation)
+{
+  int ret_val = -1;
+
+  int L = (num_taps - 1) / 2;
+  int r = L + 1;                    /* cosine coefficients */
+  int nextremal = r + 1;
+
+  /* dense grid over the two bands */
+  int grid_points = REMEZ_GRID_DENSITY * r;
+  int npass = (int) ceil(grid_points * passband / (0.5 - stopband + passband)) + 1;
+  int nstop = grid_points - npass + 1;
+  if (nstop < 2) {
+    nstop = 2;
+  }
+  int ngrid = npass + nstop;
+  double *grid = (double *) malloc(ngrid * sizeof(double));
+  double *desired = (double *) malloc(ngrid * sizeof(double));
+  double *weight = (double *) malloc(ngrid * sizeof(double));
+  double *error = (double *) malloc(ngrid * sizeof(double));
+  int *band = (int *) malloc(ngrid * sizeof(int));
+  int *extremal = (int *) malloc((nextremal + 1) * sizeof(int));
+  int *candidates = (int *) malloc((ngrid + nextremal) * sizeof(int));
+  int *merged = (int *) malloc((ngrid + nextremal) * sizeof(int));
+  int *scratch = (int *) malloc((ngrid + nextremal) * sizeof(int));
+  double *x = (double *) malloc(nextremal * sizeof(double));
+  double *y = (double *) malloc(nextremal * sizeof(double));
+  double *b = (double *) malloc(nextremal * sizeof(double));
+  double *c = (double *) malloc(nextremal * sizeof(double));
+  if (grid == 0 || desired == 0 || weight == 0 || error == 0 || band == 0 ||
+      extremal == 0 || candidates == 0 || merged == 0 || scratch == 0 ||
+      x == 0 || y == 0 || b == 0 ||
+      c == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    goto DONE;
+  }
+
+  for (int g = 0; g < npass; ++g) {
+    grid[g] = passband * g / (npass - 1);
+    desired[g] = 1;
+    weight[g] = 1;
+    band[g] = 0;
+  }
+  for (int g = 0; g < nstop; ++g) {
+    grid[npass + g] = stopband + (0.5 - stopband) * g / (nstop - 1);
+    desired[npass + g] = 0;
+    weight[npass + g] = stop_weight;
+    band[npass + g] = 1;
+  }
+
+  for (int i = 0; i < nextremal; ++i) {
+    extremal[i] = (int) ((long) i * (ngrid - 1) / (nextremal - 1));
+  }
+
+  for (int iteration = 0; iteration < REMEZ_MAX_ITERATIONS; ++iteration) {
+    /* deviation for the current extremal set */
+    for (int i = 0; i < nextremal; ++i) {
+      x[i] = cos(2 * M_PI * grid[extremal[i]]);
+    }
+    double numerator = 0;
+    double denominator = 0;
+    for (int i = 0; i < nextremal; ++i) {
+      b[i] = barycentric_weight(i, nextremal, x);
+      numerator += b[i] * desired[extremal[i]];
+      denominator += (i % 2 ? -1 : 1) * b[i] / weight[extremal[i]];
+    }
+    double delta = numerator / denominator;
+    for (int i = 0; i < nextremal; ++i) {
+      y[i] = desired[extremal[i]] - (i % 2 ? -1 : 1) * delta /
+             weight[extremal[i]];
+    }
+    /* the response interpolates the first r points */
+    for (int i = 0; i < r; ++i) {
+      c[i] = barycentric_weight(i, r, x);
+    }
+
+    double max_error = 0;
+    for (int g = 0; g < ngrid; ++g) {
+      double xg = cos(2 * M_PI * grid[g]);
+      double num = 0;
+      double den = 0;
+      double response = 0;
+      int exact = 0;
+      for (int i = 0; i < r; ++i) {
+        double d = xg - x[i];
+        if (fabs(d) < 1e-14) {
+          response = y[i];
+          exact = 1;
+          break;
+        }
+        num += c[i] * y[i] / d;
+        den += c[i] / d;
+      }
+      if (!exact) {
+        response = num / den;
+      }
+      error[g] = weight[g] * (desired[g] - response);
+      if (fabs(error[g]) > max_error) {
+        max_error = fabs(error[g]);
+      }
+    }
+    if (max_error - fabs(delta) <= 1e-6 * fabs(delta)) {
+      *deviation = max_error;
+      ret_val = 0;
+      break;
+    }
+
+    /* new extremal set: local extrema of the error (within each band) with
+       alternating signs */
+    int ncandidates = 0;
+    for (int g = 0; g < ngrid; ++g) {
+      int has_left = g > 0 && band[g - 1] == band[g];
+      int has_right = g < ngrid - 1 && band[g + 1] == band[g];
+      if (fabs(error[g]) < fabs(delta) * (1 - 1e-9)) {
+        continue;
+      }
+      if (error[g] > 0 && (has_left && error[g] < error[g - 1])) continue;
+      if (error[g] > 0 && (has_right && error[g] <= error[g + 1])) continue;
+      if (error[g] < 0 && (has_left && error[g] > error[g - 1])) continue;
+      if (error[g] < 0 && (has_right && error[g] >= error[g + 1])) continue;
+      if (error[g] == 0) continue;
+      candidates[ncandidates++] = g;
+    }
+    if (select_extremal(candidates, ncandidates, error, nextremal,
+                        extremal, scratch) == 0) {
+      continue;
+    }
+    /* not enough alternating extrema: merge back the current extremal set
+       (the error alternates there, by construction) */
+    int nmerged = 0;
+    int i = 0;
+    for (int k = 0; k < ncandidates || i < nextremal; ) {
+      if (i >= nextremal ||
+          (k < ncandidates && candidates[k] < extremal[i])) {
+        merged[nmerged++] = candidates[k++];
+      } else if (k < ncandidates && candidates[k] == extremal[i]) {
+        merged[nmerged++] = candidates[k++];
+        i++;
+      } else {
+        merged[nmerged++] = extremal[i++];
+      }
+    }
+    if (select_extremal(merged, nmerged, error, nextremal, extremal,
+                        scratch) < 0) {
+      break;
+    }
+  }
+  if (ret_val < 0) {
+    goto DONE;
+  }
+
+  /* impulse response from N samples of the (cosine polynomial) response */
+  double *response = b;   /* reuse: only L + 1 <= nextremal values needed */
+  for (int j = 0; j <= L; ++j) {
+    double xj = cos(2 * M_PI * j / num_taps);
+    double num = 0;
+    double den = 0;
+    int exact = -1;
+    for (int i = 0; i < r; ++i) {
+      double d = xj - x[i];
+      if (fabs(d) < 1e-14) {
+        exact = i;
+        break;
+      }
+      num += c[i] * y[i] / d;
+      den += c[i] / d;
+    }
+    response[j] = exact >= 0 ? y[exact] : num / den;
+  }
+  for (uint32_t n = 0; n < num_taps; ++n) {
+    double sum = response[0];
+    for (int j = 1; j <= L; ++j) {
+      sum += 2 * response[j] * cos(2 * M_PI * j * ((int) n - L) / num_taps);
+    }
+    h[n] = sum / num_taps;
+  }
+
+DONE:
+  free(grid);
+  free(desired);
+  free(weight);
+  free(error);
+  free(band);
+  free(extremal);
+  free(candidates);
+  free(merged);
+  free(scratch);
+  free(x);
+  free(y);
+  free(b);
+  free(c);
+  return ret_val;
+}
+
+
+/* keep the alternating extrema among the candidates (sorted grid indices);
+ * of two consecutive ones with the same sign the larger wins, then the
+ * smaller of the two ends is dropped until there are nextremal left */
+static int select_extremal(const int *candidates, int ncandidates,
+                           const double *error, int nextremal, int *extremal,
+                           int *scratch)
+{
+  int *alternating = scratch;
+  int nalternating = 0;
+  for (int k = 0; k < ncandidates; ++k) {
+    int g = candidates[k];
+    if (nalternating > 0 &&
+        (error[g] > 0) == (error[alternating[nalternating - 1]] > 0)) {
+      if (fabs(error[g]) > fabs(error[alternating[nalternating - 1]])) {
+        alternating[nalternating - 1] = g;
+      }
+      continue;
+    }
+    alternating[nalternating++] = g;
+  }
+  if (nalternating < nextremal) {
+    return -1;
+  }
+  int first = 0;
+  while (nalternating > nextremal) {
+    if (fabs(error[alternating[first]]) <
+        fabs(error[alternating[first + nalternating - 1]])) {
+      first++;
+    }
+    nalternating--;
+  }
+  for (int i = 0; i < nextremal; ++i) {
+    extremal[i] = alternating[first + i];
+  }
+  return 0;
+}
+
+
+/* 1 / prod(2 * (x[k] - x[i])), with the product taken in strides to avoid
+ * overflow (from the original McClellan-Parks-Rabiner program) */
+static double barycentric_weight(int k, int n, const double *x)
+{
+  double denominator = 1;
+  int stride = (n - 1) / 15 + 1;
+  for (int l = 0; l < stride; ++l) {
+    for (int i = l; i < n; i += stride) {
+      if (i != k) {
+        denominator *= 2 * (x[k] - x[i]);
+      }
+    }
+  }
+  if (fabs(denominator) < 1e-300) {
+    denominator = denominator < 0 ? -1e-300 : 1e-300;
+  }
+  return 1 / denominator;
+}
+
+
+/* attenuation (dB) of the worst point in the stopband of a type I filter
+   with unity gain at DC */
+static double stopband_attenuation(const double *h, int num_taps,
+                                   double stopband)
+{
+  int middle = num_taps / 2;
+  int npoints = STOPBAND_GRID_DENSITY * num_taps;
+  double max_response = 0;
+  for (int k = 0; k <= npoints; ++k) {
+    double f = stopband + (0.5 - stopband) * k / npoints;
+    double response = h[middle];
+    for (int i = 1; i <= middle; ++i) {
+      response += 2 * h[middle + i] * cos(2 * M_PI * f * i);
+    }
+    if (fabs(response) > max_response) {
+      max_response = fabs(response);
+    }
+  }
+  return max_response > 0 ? -20 * log10(max_response) : INFINITY;
+}
+
+
+static double bessel_i0(double x)
+{
+  double sum = 1;
+  double term = 1;
+  for (int k = 1; k < 50; ++k) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+    if (term < sum * 1e-16) {
+      break;
+    }
+  }
+  return sum;
+}
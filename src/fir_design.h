@@ -0,0 +1,68 @@
+/*
+ * fir_design.h - FIR filter design functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __FIR_DESIGN_H
+#define __FIR_DESIGN_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* tap arrays are aligned and zero padded to this many bytes, so the SIMD
+ * kernels can run over full vectors without remainder loops */
+#define FIR_TAPS_ALIGNMENT 64
+
+enum FIRDesignMethod {
+  FIR_DESIGN_KAISER,         /* windowed sinc with a Kaiser window */
+  FIR_DESIGN_EQUIRIPPLE      /* Parks-McClellan */
+};
+
+/* frequencies are normalized to the sample rate (0 - 0.5), so the same
+ * taps serve any sample rate with the same ratios */
+struct fir_design_spec {
+  enum FIRDesignMethod method;
+  double passband;           /* passband edge */
+  double stopband;           /* stopband edge */
+  double attenuation;        /* stopband attenuation (dB) */
+  double ripple;             /* passband ripple (dB; equiripple only) */
+  double gain;               /* passband gain */
+};
+
+struct fir_taps {
+  uint32_t num_taps;         /* odd (linear phase, type I) */
+  uint32_t padded_taps;      /* num_taps rounded up to the alignment */
+  float *taps;
+};
+
+/* low pass taps for spec; the taps are shared through a process wide cache,
+ * so the same design is computed only once */
+const struct fir_taps *fir_design_lowpass(const struct fir_design_spec *spec);
+
+void fir_release_taps(const struct fir_taps *taps);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FIR_DESIGN_H */
@@ -0,0 +1,284 @@
+/*
+ * flight_recorder.c - in-memory ring of control and streaming events
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flight_recorder.h"
+#include "memory_budget.h"
+
+/* on x86 the events are timestamped with the TSC (a few ns, instead of
+   tens of ns for clock_gettime()) and converted to ns in the dump */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define FLIGHT_RECORDER_TSC
+#endif
+
+
+/* internal functions */
+static void flight_recorder_signal_handler(int signum);
+static int write_all(int fd, const void *data, size_t size);
+static uint64_t monotonic_ns();
+static void flight_recorder_reserve() __attribute__((constructor));
+#ifdef FLIGHT_RECORDER_TSC
+static void flight_recorder_init() __attribute__((constructor));
+#endif
+
+
+enum {
+  FLIGHT_RECORDER_VERSION = 1,
+  FLIGHT_RECORDER_EVENTS = 8192,      /* power of 2; 256kB */
+  FLIGHT_RECORDER_DUMP_CHUNK = 64
+};
+
+static struct flight_recorder_event events[FLIGHT_RECORDER_EVENTS];
+static atomic_uint_fast64_t next_event = 0;
+static char dump_file[PATH_MAX] = "";
+static atomic_int dump_in_progress = 0;
+#ifdef FLIGHT_RECORDER_TSC
+static uint64_t reference_tsc;
+static uint64_t reference_ns;
+#endif
+
+
+uint64_t flight_recorder_timestamp()
+{
+#ifdef FLIGHT_RECORDER_TSC
+  return __rdtsc();
+#else
+  return monotonic_ns();
+#endif
+}
+
+
+void flight_recorder_record(uint16_t type, uint16_t arg0, uint32_t arg1,
+                            uint32_t arg2, int32_t result, uint64_t start)
+{
+  uint64_t now = flight_recorder_timestamp();
+  uint64_t n = atomic_fetch_add_explicit(&next_event, 1, memory_order_relaxed);
+  struct flight_recorder_event *event = &events[n & (FLIGHT_RECORDER_EVENTS - 1)];
+  /* invalidate the slot while it is being written */
+  atomic_store_explicit((_Atomic uint32_t *) &event->sequence, 0,
+                        memory_order_relaxed);
+  atomic_signal_fence(memory_order_release);
+  event->timestamp = start ? start : now;
+  event->type = type;
+  event->arg0 = arg0;
+  event->arg1 = arg1;
+  event->arg2 = arg2;
+  event->result = result;
+  uint64_t duration = start ? now - start : 0;
+  event->duration = duration < UINT32_MAX ? (uint32_t) duration : UINT32_MAX;
+  atomic_store_explicit((_Atomic uint32_t *) &event->sequence,
+                        (uint32_t) (n + 1), memory_order_release);
+  return;
+}
+
+
+/* only uses async-signal-safe functions (open, write, lseek, close,
+   clock_gettime) */
+int flight_recorder_dump(const char *filename)
+{
+  if (atomic_exchange(&dump_in_progress, 1)) {
+    return -1;
+  }
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    atomic_store(&dump_in_progress, 0);
+    return -1;
+  }
+
+  /* timestamps conversion to CLOCK_MONOTONIC ns */
+  double ns_per_tick = 1.0;
+  uint64_t tick_offset = 0;
+  uint64_t ns_offset = 0;
+#ifdef FLIGHT_RECORDER_TSC
+  uint64_t now_tsc = __rdtsc();
+  uint64_t now_ns = monotonic_ns();
+  if (now_tsc > reference_tsc) {
+    ns_per_tick = (double) (now_ns - reference_ns) / (now_tsc - reference_tsc);
+  }
+  tick_offset = reference_tsc;
+  ns_offset = reference_ns;
+#endif
+
+  uint64_t last = atomic_load_explicit(&next_event, memory_order_acquire);
+  uint64_t first = last > FLIGHT_RECORDER_EVENTS ?
+                   last - FLIGHT_RECORDER_EVENTS : 0;
+
+  struct timespec realtime, monotonic;
+  clock_gettime(CLOCK_REALTIME, &realtime);
+  clock_gettime(CLOCK_MONOTONIC, &monotonic);
+  struct flight_recorder_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FLIGHT_RECORDER_MAGIC, sizeof(header.magic));
+  header.version = FLIGHT_RECORDER_VERSION;
+  header.event_size = sizeof(struct flight_recorder_event);
+  header.num_events = 0;
+  header.lost_events = (uint32_t) first;
+  header.realtime_offset = (int64_t) (realtime.tv_sec - monotonic.tv_sec) *
+                           1000000000 + (realtime.tv_nsec - monotonic.tv_nsec);
+
+  /* events are copied out in chunks; slots overwritten (or being written)
+     in the meantime don't have the expected sequence number and are skipped */
+  int ret = write_all(fd, &header, sizeof(header));
+  struct flight_recorder_event chunk[FLIGHT_RECORDER_DUMP_CHUNK];
+  uint32_t nchunk = 0;
+  for (uint64_t n = first; ret == 0 && n < last; ++n) {
+    const struct flight_recorder_event *event = &events[n & (FLIGHT_RECORDER_EVENTS - 1)];
+    uint32_t sequence = atomic_load_explicit((_Atomic uint32_t *) &event->sequence,
+                                             memory_order_acquire);
+    if (sequence != (uint32_t) (n + 1)) {
+      continue;
+    }
+    chunk[nchunk] = *event;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit((_Atomic uint32_t *) &event->sequence,
+                             memory_order_relaxed) != sequence) {
+      continue;
+    }
+    chunk[nchunk].timestamp = ns_offset + (int64_t) ((int64_t) (chunk[nchunk].timestamp - tick_offset) * ns_per_tick);
+    chunk[nchunk].duration = (uint32_t) (chunk[nchunk].duration * ns_per_tick);
+    nchunk++;
+    header.num_events++;
+    if (nchunk == FLIGHT_RECORDER_DUMP_CHUNK) {
+      ret = write_all(fd, chunk, nchunk * sizeof(chunk[0]));
+      nchunk = 0;
+    }
+  }
+  if (ret == 0 && nchunk > 0) {
+    ret = write_all(fd, chunk, nchunk * sizeof(chunk[0]));
+  }
+  /* rewrite the header with the actual number of events */
+  if (ret == 0 && lseek(fd, 0, SEEK_SET) == 0) {
+    ret = write_all(fd, &header, sizeof(header));
+  }
+  close(fd);
+  atomic_store(&dump_in_progress, 0);
+  return ret;
+}
+
+
+int flight_recorder_set_dump_file(const char *filename)
+{
+  if (filename == 0) {
+    dump_file[0] = '\0';
+    return 0;
+  }
+  if (strlen(filename) >= sizeof(dump_file)) {
+    fprintf(stderr, "ERROR - flight recorder dump file name too long\n");
+    return -1;
+  }
+  strcpy(dump_file, filename);
+  return 0;
+}
+
+
+int flight_recorder_dump_on_signal(int signum)
+{
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = flight_recorder_signal_handler;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if (sigaction(signum, &action, 0) < 0) {
+    fprintf(stderr, "ERROR - sigaction(%d) failed: %s\n", signum,
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+
+void flight_recorder_failure()
+{
+  if (dump_file[0] == '\0') {
+    return;
+  }
+  if (flight_recorder_dump(dump_file) == 0) {
+    fprintf(stderr, "flight recorder dumped to %s\n", dump_file);
+  }
+  return;
+}
+
+
+/* internal functions */
+static void flight_recorder_signal_handler(int signum __attribute__((unused)))
+{
+  int saved_errno = errno;
+  if (dump_file[0] != '\0') {
+    flight_recorder_dump(dump_file);
+  }
+  errno = saved_errno;
+  return;
+}
+
+
+static uint64_t monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* the events are a static array, so they count from the start */
+static void flight_recorder_reserve()
+{
+  memory_budget_reserve(MEMORY_RECORDER, sizeof(events), "flight recorder");
+  return;
+}
+
+
+#ifdef FLIGHT_RECORDER_TSC
+/* reference point for the TSC to ns conversion */
+static void flight_recorder_init()
+{
+  reference_tsc = __rdtsc();
+  reference_ns = monotonic_ns();
+  return;
+}
+#endif
+
+
+static int write_all(int fd, const void *data, size_t size)
+{
+  const char *p = (const char *) data;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
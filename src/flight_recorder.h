@@ -0,0 +1,90 @@
+/*
+ * flight_recorder.h - in-memory ring of control and streaming events
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __FLIGHT_RECORDER_H
+#define __FLIGHT_RECORDER_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the flight recorder is process wide (events come from every module) and
+ * always on; recording an event is a timestamp read, an atomic increment
+ * and a 32 byte store */
+
+enum FlightRecorderEventType {
+  FR_EVENT_NONE,
+  FR_EVENT_CONTROL,          /* request, value << 16 | index, length */
+  FR_EVENT_I2C_WRITE,        /* address << 8 | register, data[0..3], length */
+  FR_EVENT_TRANSFER_ERROR,   /* libusb status, actual length, active transfers */
+  FR_EVENT_ADC_STATUS        /* new status, old status */
+};
+
+struct flight_recorder_event {
+  uint64_t timestamp;        /* CLOCK_MONOTONIC, ns (in the dump) */
+  uint32_t sequence;         /* event number + 1 (0 = slot not written) */
+  uint16_t type;
+  uint16_t arg0;
+  uint32_t arg1;
+  uint32_t arg2;
+  int32_t result;
+  uint32_t duration;         /* ns (in the dump) */
+};
+
+/* dump file: header followed by num_events events, oldest first */
+#define FLIGHT_RECORDER_MAGIC "RF103FR1"
+
+struct flight_recorder_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t event_size;
+  uint32_t num_events;
+  uint32_t lost_events;      /* overwritten before the dump */
+  int64_t realtime_offset;   /* CLOCK_REALTIME - CLOCK_MONOTONIC, ns */
+};
+
+/* opaque timestamp (TSC ticks on x86) for the start argument below */
+uint64_t flight_recorder_timestamp();
+
+/* start = 0 means an instantaneous event */
+
+void flight_recorder_record(uint16_t type, uint16_t arg0, uint32_t arg1,
+                            uint32_t arg2, int32_t result, uint64_t start);
+
+/* async-signal-safe */
+int flight_recorder_dump(const char *filename);
+
+/* file for the automatic dumps on failure or signal (0 = disabled) */
+int flight_recorder_set_dump_file(const char *filename);
+
+int flight_recorder_dump_on_signal(int signum);
+
+/* called by the modules when something goes wrong */
+void flight_recorder_failure();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FLIGHT_RECORDER_H */
@@ -0,0 +1,604 @@
+/*
+ * graph.c - dataflow graph runtime
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* every stage with an output owns a double mapped ring buffer sized at start
+ * for its largest write plus the largest read of its consumers, so both
+ * sides always see contiguous memory; each consumer has its own cursor in
+ * it. The scheduler state (heads, cursors, running/done flags) is protected
+ * by one mutex: a worker picks a stage that is not running, has enough
+ * input and has room for max_output items, runs work() without the lock and
+ * then publishes the result; a stage never runs on two workers at once, so
+ * its state needs no locking
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "graph.h"
+#include "memory_budget.h"
+#include "ring_buffer.h"
+
+
+typedef struct rf103_graph rf103_graph_t;
+
+/* internal functions */
+static void *graph_worker(void *arg);
+static int graph_next_stage(rf103_graph_t *this);
+static uint64_t graph_free_space(rf103_graph_t *this, int stage);
+static uint64_t elapsed_ns(const struct timespec *start,
+                           const struct timespec *end);
+
+
+enum {
+  GRAPH_MAX_STAGES = 32,
+  GRAPH_MAX_READERS = 8,
+  GRAPH_MAX_WORKERS = 16,
+  GRAPH_PUSH_BLOCK = 65536        /* items */
+};
+
+struct graph_stage {
+  struct rf103_stage_ops ops;
+  void *state;
+  int push;                       /* fed by graph_push() */
+  int input;                      /* upstream stage (-1 = none) */
+  int reader;                     /* our cursor in the upstream stage */
+  ring_buffer_t *output;
+  uint32_t sample_size;           /* bytes per output item */
+  uint64_t capacity;              /* output items */
+  uint64_t head;                  /* output items written */
+  int num_readers;
+  int readers[GRAPH_MAX_READERS]; /* reading stages */
+  uint64_t cursors[GRAPH_MAX_READERS];
+  int running;
+  int done;
+  struct rf103_stage_stats stats;
+};
+
+typedef struct rf103_graph {
+  struct graph_stage stages[GRAPH_MAX_STAGES];
+  int num_stages;
+  int next_stage;                 /* where the next scan starts (fairness) */
+  int num_workers;
+  pthread_t workers[GRAPH_MAX_WORKERS];
+  int started;
+  int stopping;
+  int failed;
+  int finished;
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+} rf103_graph_t;
+
+
+rf103_graph_t *rf103_graph_open()
+{
+  rf103_graph_t *ret_val = 0;
+
+  /* we are good here - create and initialize the graph */
+  rf103_graph_t *this = (rf103_graph_t *) malloc(sizeof(rf103_graph_t));
+  memset(this->stages, 0, sizeof(this->stages));
+  this->num_stages = 0;
+  this->next_stage = 0;
+  this->num_workers = 0;
+  this->started = 0;
+  this->stopping = 0;
+  this->failed = 0;
+  this->finished = 0;
+  pthread_mutex_init(&this->mutex, 0);
+  pthread_cond_init(&this->changed, 0);
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void rf103_graph_close(rf103_graph_t *this)
+{
+  if (this->started) {
+    rf103_graph_stop(this);
+    rf103_graph_wait(this);
+  }
+  for (int i = 0; i < this->num_stages; ++i) {
+    struct graph_stage *stage = &this->stages[i];
+    if (stage->ops.close) {
+      stage->ops.close(stage->state);
+    }
+    if (stage->output) {
+      ring_buffer_close(stage->output);
+    }
+  }
+  pthread_mutex_destroy(&this->mutex);
+  pthread_cond_destroy(&this->changed);
+  free(this);
+  return;
+}
+
+
+int rf103_graph_add_stage(rf103_graph_t *this,
+                          const struct rf103_stage_ops *ops, void *state)
+{
+  if (this->started) {
+    fprintf(stderr, "ERROR - rf103_graph_add_stage() failed: graph started\n");
+    return -1;
+  }
+  if (this->num_stages == GRAPH_MAX_STAGES) {
+    fprintf(stderr, "ERROR - too many stages (max %d)\n", GRAPH_MAX_STAGES);
+    return -1;
+  }
+  if (ops->work == 0 ||
+      (ops->input_type == SAMPLE_TYPE_NONE &&
+       ops->output_type == SAMPLE_TYPE_NONE) ||
+      (ops->input_type != SAMPLE_TYPE_NONE &&
+       (ops->max_input == 0 || ops->min_input > ops->max_input)) ||
+      (ops->output_type != SAMPLE_TYPE_NONE && ops->max_output == 0)) {
+    fprintf(stderr, "ERROR - invalid stage '%s'\n",
+            ops->name ? ops->name : "");
+    return -1;
+  }
+
+  int id = this->num_stages++;
+  struct graph_stage *stage = &this->stages[id];
+  memset(stage, 0, sizeof(struct graph_stage));
+  stage->ops = *ops;
+  if (stage->ops.min_input == 0) {
+    stage->ops.min_input = 1;
+  }
+  stage->state = state;
+  stage->input = -1;
+  stage->sample_size = graph_sample_size(ops->output_type);
+  return id;
+}
+
+
+int rf103_graph_connect(rf103_graph_t *this, int from, int to)
+{
+  if (this->started) {
+    fprintf(stderr, "ERROR - rf103_graph_connect() failed: graph started\n");
+    return -1;
+  }
+  if (from < 0 || from >= this->num_stages || to < 0 ||
+      to >= this->num_stages || from == to) {
+    fprintf(stderr, "ERROR - invalid connection: %d -> %d\n", from, to);
+    return -1;
+  }
+  struct graph_stage *source = &this->stages[from];
+  struct graph_stage *sink = &this->stages[to];
+  if (source->ops.output_type == SAMPLE_TYPE_NONE ||
+      source->ops.output_type != sink->ops.input_type) {
+    fprintf(stderr, "ERROR - type mismatch: %s -> %s\n", source->ops.name,
+            sink->ops.name);
+    return -1;
+  }
+  if (sink->input >= 0) {
+    fprintf(stderr, "ERROR - %s is already connected\n", sink->ops.name);
+    return -1;
+  }
+  if (source->num_readers == GRAPH_MAX_READERS) {
+    fprintf(stderr, "ERROR - too many readers for %s (max %d)\n",
+            source->ops.name, GRAPH_MAX_READERS);
+    return -1;
+  }
+  for (int i = from; i >= 0; i = this->stages[i].input) {
+    if (i == to) {
+      fprintf(stderr, "ERROR - connection %s -> %s would make a cycle\n",
+              source->ops.name, sink->ops.name);
+      return -1;
+    }
+  }
+  sink->input = from;
+  sink->reader = source->num_readers++;
+  source->readers[sink->reader] = to;
+  return 0;
+}
+
+
+int rf103_graph_start(rf103_graph_t *this, int num_workers)
+{
+  if (this->started) {
+    fprintf(stderr, "ERROR - rf103_graph_start() failed: already started\n");
+    return -1;
+  }
+  if (num_workers <= 0 || num_workers > GRAPH_MAX_WORKERS) {
+    fprintf(stderr, "ERROR - invalid number of workers: %d\n", num_workers);
+    return -1;
+  }
+
+  for (int i = 0; i < this->num_stages; ++i) {
+    struct graph_stage *stage = &this->stages[i];
+    if (stage->ops.input_type != SAMPLE_TYPE_NONE && stage->input < 0) {
+      fprintf(stderr, "ERROR - %s has no input\n", stage->ops.name);
+      return -1;
+    }
+  }
+
+  /* the output rings */
+  for (int i = 0; i < this->num_stages; ++i) {
+    struct graph_stage *stage = &this->stages[i];
+    if (stage->ops.output_type == SAMPLE_TYPE_NONE) {
+      continue;
+    }
+    uint64_t max_read = 0;
+    for (int j = 0; j < this->num_stages; ++j) {
+      if (this->stages[j].input == i &&
+          this->stages[j].ops.max_input > max_read) {
+        max_read = this->stages[j].ops.max_input;
+      }
+    }
+    size_t size = 2 * (stage->ops.max_output + max_read) * stage->sample_size;
+    /* with a tight memory budget make do with room for one block each way
+       (the stages just run more often) */
+    if (size > memory_budget_available()) {
+      size /= 2;
+    }
+    if (stage->output == 0) {
+      stage->output = ring_buffer_open(size);
+      if (stage->output == 0) {
+        fprintf(stderr, "ERROR - ring_buffer_open() failed\n");
+        return -1;
+      }
+    }
+    stage->capacity = ring_buffer_get_size(stage->output) / stage->sample_size;
+  }
+
+  for (int i = 0; i < this->num_stages; ++i) {
+    struct graph_stage *stage = &this->stages[i];
+    stage->head = 0;
+    memset(stage->cursors, 0, sizeof(stage->cursors));
+    stage->running = 0;
+    stage->done = 0;
+    memset(&stage->stats, 0, sizeof(stage->stats));
+  }
+  this->next_stage = 0;
+  this->stopping = 0;
+  this->failed = 0;
+  this->finished = 0;
+  this->started = 1;
+
+  this->num_workers = 0;
+  for (int i = 0; i < num_workers; ++i) {
+    int ret = pthread_create(&this->workers[i], 0, graph_worker, this);
+    if (ret != 0) {
+      fprintf(stderr, "ERROR - pthread_create() failed: %s\n", strerror(ret));
+      rf103_graph_stop(this);
+      rf103_graph_wait(this);
+      return -1;
+    }
+    this->num_workers++;
+  }
+  return 0;
+}
+
+
+int rf103_graph_stop(rf103_graph_t *this)
+{
+  pthread_mutex_lock(&this->mutex);
+  this->stopping = 1;
+  for (int i = 0; i < this->num_stages; ++i) {
+    if (this->stages[i].push) {
+      this->stages[i].done = 1;
+    }
+  }
+  pthread_cond_broadcast(&this->changed);
+  pthread_mutex_unlock(&this->mutex);
+  return 0;
+}
+
+
+int rf103_graph_wait(rf103_graph_t *this)
+{
+  if (!this->started) {
+    return this->failed ? -1 : 0;
+  }
+  pthread_mutex_lock(&this->mutex);
+  while (!this->finished && this->num_workers > 0) {
+    pthread_cond_wait(&this->changed, &this->mutex);
+  }
+  pthread_mutex_unlock(&this->mutex);
+  for (int i = 0; i < this->num_workers; ++i) {
+    pthread_join(this->workers[i], 0);
+  }
+  this->num_workers = 0;
+  this->started = 0;
+  return this->failed ? -1 : 0;
+}
+
+
+int rf103_graph_get_stage_stats(rf103_graph_t *this, int stage,
+                                struct rf103_stage_stats *stats)
+{
+  if (stage < 0 || stage >= this->num_stages) {
+    fprintf(stderr, "ERROR - invalid stage: %d\n", stage);
+    return -1;
+  }
+  pthread_mutex_lock(&this->mutex);
+  *stats = this->stages[stage].stats;
+  pthread_mutex_unlock(&this->mutex);
+  return 0;
+}
+
+
+int graph_add_push_source(rf103_graph_t *this, const char *name,
+                          enum RF103SampleType type, void *state,
+                          void (*close)(void *state))
+{
+  if (this->started) {
+    fprintf(stderr, "ERROR - graph_add_push_source() failed: graph started\n");
+    return -1;
+  }
+  if (this->num_stages == GRAPH_MAX_STAGES) {
+    fprintf(stderr, "ERROR - too many stages (max %d)\n", GRAPH_MAX_STAGES);
+    return -1;
+  }
+  int id = this->num_stages++;
+  struct graph_stage *stage = &this->stages[id];
+  memset(stage, 0, sizeof(struct graph_stage));
+  stage->ops.name = name;
+  stage->ops.input_type = SAMPLE_TYPE_NONE;
+  stage->ops.output_type = type;
+  stage->ops.max_output = GRAPH_PUSH_BLOCK;
+  stage->ops.close = close;
+  stage->state = state;
+  stage->push = 1;
+  stage->input = -1;
+  stage->sample_size = graph_sample_size(type);
+  return id;
+}
+
+
+int graph_push(rf103_graph_t *this, int stage_id, const void *data,
+               uint32_t size)
+{
+  struct graph_stage *stage = &this->stages[stage_id];
+  const uint8_t *bytes = (const uint8_t *) data;
+  uint32_t nitems = size / stage->sample_size;
+  int ret_val = 0;
+
+  pthread_mutex_lock(&this->mutex);
+  while (nitems > 0) {
+    if (!this->started || stage->done) {
+      ret_val = -1;
+      break;
+    }
+    uint64_t free_space = graph_free_space(this, stage_id);
+    if (free_space == 0) {
+      pthread_cond_wait(&this->changed, &this->mutex);
+      continue;
+    }
+    uint32_t n = free_space < nitems ? (uint32_t) free_space : nitems;
+    size_t length = (size_t) n * stage->sample_size;
+    void *output = ring_buffer_get_pointer(stage->output,
+                                           stage->head * stage->sample_size);
+    pthread_mutex_unlock(&this->mutex);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memcpy(output, bytes, length);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_mutex_lock(&this->mutex);
+    stage->head += n;
+    stage->stats.calls++;
+    stage->stats.output_items += n;
+    stage->stats.wall_time_ns += elapsed_ns(&start, &end);
+    pthread_cond_broadcast(&this->changed);
+    bytes += length;
+    nitems -= n;
+  }
+  pthread_mutex_unlock(&this->mutex);
+  return ret_val;
+}
+
+
+uint32_t graph_sample_size(enum RF103SampleType type)
+{
+  switch (type) {
+    case SAMPLE_TYPE_S16:
+      return sizeof(int16_t);
+    case SAMPLE_TYPE_F32:
+      return sizeof(float);
+    case SAMPLE_TYPE_CF32:
+      return 2 * sizeof(float);
+    case SAMPLE_TYPE_CS16:
+      return 2 * sizeof(int16_t);
+    default:
+      return 0;
+  }
+}
+
+
+void *graph_get_stage_state(rf103_graph_t *this, int stage, const char *name)
+{
+  if (stage < 0 || stage >= this->num_stages ||
+      this->stages[stage].ops.name == 0 ||
+      strcmp(this->stages[stage].ops.name, name) != 0) {
+    fprintf(stderr, "ERROR - invalid %s stage: %d\n", name, stage);
+    return 0;
+  }
+  return this->stages[stage].state;
+}
+
+
+/* internal functions */
+static void *graph_worker(void *arg)
+{
+  rf103_graph_t *this = (rf103_graph_t *) arg;
+
+  pthread_mutex_lock(&this->mutex);
+  while (!this->finished) {
+    int id = graph_next_stage(this);
+    if (id < 0) {
+      if (!this->finished) {
+        pthread_cond_wait(&this->changed, &this->mutex);
+      }
+      continue;
+    }
+
+    struct graph_stage *stage = &this->stages[id];
+    const void *input = 0;
+    uint32_t ninput = 0;
+    if (stage->input >= 0) {
+      struct graph_stage *upstream = &this->stages[stage->input];
+      uint64_t cursor = upstream->cursors[stage->reader];
+      uint64_t available = upstream->head - cursor;
+      ninput = available < stage->ops.max_input ? (uint32_t) available :
+               stage->ops.max_input;
+      input = ring_buffer_get_pointer(upstream->output,
+                                      cursor * upstream->sample_size);
+    }
+    void *output = 0;
+    if (stage->output) {
+      output = ring_buffer_get_pointer(stage->output,
+                                       stage->head * stage->sample_size);
+    }
+    stage->running = 1;
+    pthread_mutex_unlock(&this->mutex);
+
+    struct timespec start, end, cpu_start, cpu_end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    uint32_t noutput = 0;
+    int ret = stage->ops.work(stage->state, input, ninput, output, &noutput);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_mutex_lock(&this->mutex);
+    stage->running = 0;
+    stage->stats.calls++;
+    stage->stats.cpu_time_ns += elapsed_ns(&cpu_start, &cpu_end);
+    stage->stats.wall_time_ns += elapsed_ns(&start, &end);
+    if (noutput > stage->ops.max_output) {
+      noutput = stage->ops.max_output;
+    }
+    stage->head += noutput;
+    stage->stats.output_items += noutput;
+    if (ret >= 0) {
+      if ((uint32_t) ret > ninput) {
+        ret = ninput;
+      }
+      if (stage->input >= 0) {
+        this->stages[stage->input].cursors[stage->reader] += ret;
+        stage->stats.input_items += ret;
+        if (ret == 0 && noutput == 0) {
+          fprintf(stderr, "ERROR - %s made no progress\n", stage->ops.name);
+          ret = RF103_STAGE_ERROR;
+        }
+      }
+    }
+    if (ret == RF103_STAGE_END) {
+      stage->done = 1;
+    } else if (ret < 0) {
+      fprintf(stderr, "ERROR - stage %s failed\n", stage->ops.name);
+      stage->done = 1;
+      this->failed = 1;
+      this->stopping = 1;
+    }
+    pthread_cond_broadcast(&this->changed);
+  }
+  pthread_mutex_unlock(&this->mutex);
+  return 0;
+}
+
+
+/* pick a stage that can run (and retire the ones that are done); called with
+   the lock held */
+static int graph_next_stage(rf103_graph_t *this)
+{
+  int num_done = 0;
+  int newly_done = 0;
+  int num_stages = this->num_stages;
+  for (int k = 0; k < num_stages; ++k) {
+    int id = (this->next_stage + k) % num_stages;
+    struct graph_stage *stage = &this->stages[id];
+    if (stage->done) {
+      num_done++;
+      continue;
+    }
+    if (stage->running || stage->push) {
+      continue;
+    }
+    if (stage->input < 0) {
+      if (this->stopping) {
+        stage->done = 1;
+        num_done++;
+        newly_done = 1;
+        continue;
+      }
+    } else {
+      struct graph_stage *upstream = &this->stages[stage->input];
+      uint64_t available = upstream->head - upstream->cursors[stage->reader];
+      if (available < stage->ops.min_input) {
+        if (upstream->done) {
+          /* end of stream (an incomplete block is dropped) */
+          upstream->cursors[stage->reader] = upstream->head;
+          stage->done = 1;
+          num_done++;
+          newly_done = 1;
+        }
+        continue;
+      }
+    }
+    if (stage->output && graph_free_space(this, id) < stage->ops.max_output) {
+      continue;
+    }
+    this->next_stage = (id + 1) % num_stages;
+    return id;
+  }
+
+  if (num_done == num_stages) {
+    this->finished = 1;
+  }
+  if (newly_done || this->finished) {
+    /* wake up the readers of the stages that just ended */
+    pthread_cond_broadcast(&this->changed);
+  }
+  return -1;
+}
+
+
+/* output items that can be written without overwriting unread ones (the
+   readers that are done do not count) */
+static uint64_t graph_free_space(rf103_graph_t *this, int id)
+{
+  const struct graph_stage *stage = &this->stages[id];
+  uint64_t used = 0;
+  for (int i = 0; i < stage->num_readers; ++i) {
+    if (this->stages[stage->readers[i]].done) {
+      continue;
+    }
+    uint64_t unread = stage->head - stage->cursors[i];
+    if (unread > used) {
+      used = unread;
+    }
+  }
+  return stage->capacity - used;
+}
+
+
+static uint64_t elapsed_ns(const struct timespec *start,
+                           const struct timespec *end)
+{
+  return (uint64_t) (end->tv_sec - start->tv_sec) * 1000000000ULL +
+         end->tv_nsec - start->tv_nsec;
+}
@@ -0,0 +1,55 @@
+/*
+ * graph.h - dataflow graph runtime (internal functions)
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+#ifndef __GRAPH_H
+#define __GRAPH_H
+
+#include <stdint.h>
+
+#include "rf103.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a push source gets its data from another thread with graph_push() instead
+ * of being run by the workers */
+int graph_add_push_source(rf103_graph_t *this, const char *name,
+                          enum RF103SampleType type, void *state,
+                          void (*close)(void *state));
+
+/* waits for room in the output (backpressure); returns -1 once the graph
+ * is stopping */
+int graph_push(rf103_graph_t *this, int stage, const void *data,
+               uint32_t size);
+
+uint32_t graph_sample_size(enum RF103SampleType type);
+
+/* the state of a stage added with the given ops name, or 0 */
+void *graph_get_stage_state(rf103_graph_t *this, int stage, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GRAPH_H */
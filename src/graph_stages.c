@@ -0,0 +1,882 @@
+/*
+ * graph_stages.c - built-in stages for the dataflow graph
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "graph.h"
+#include "birdie.h"
+#include "channel_recorder.h"
+#include "ddc.h"
+#include "ddc16.h"
+#include "notch.h"
+#include "spectrum.h"
+#include "tone_bank.h"
+#include "waveread.h"
+
+
+/* internal functions */
+static void device_source_callback(uint32_t data_size, uint8_t *data,
+                                   void *context);
+static void device_source_close(void *state);
+static int file_source_work(void *state, const void *input, uint32_t ninput,
+                            void *output, uint32_t *noutput);
+static void file_source_close(void *state);
+static int converter_work(void *state, const void *input, uint32_t ninput,
+                          void *output, uint32_t *noutput);
+static int ddc_work(void *state, const void *input, uint32_t ninput,
+                    void *output, uint32_t *noutput);
+static void ddc_stage_close(void *state);
+static int ddc16_work(void *state, const void *input, uint32_t ninput,
+                      void *output, uint32_t *noutput);
+static void ddc16_stage_close(void *state);
+static int spectrum_work(void *state, const void *input, uint32_t ninput,
+                         void *output, uint32_t *noutput);
+static void spectrum_stage_callback(const float *power, uint64_t position,
+                                    void *context);
+static void spectrum_stage_close(void *state);
+static int tone_bank_work(void *state, const void *input, uint32_t ninput,
+                          void *output, uint32_t *noutput);
+static void tone_bank_stage_close(void *state);
+static int birdie_filter_work(void *state, const void *input, uint32_t ninput,
+                              void *output, uint32_t *noutput);
+static void birdie_filter_callback(const float *power, uint64_t position,
+                                   void *context);
+static void birdie_filter_close(void *state);
+static int gated_recorder_work(void *state, const void *input, uint32_t ninput,
+                               void *output, uint32_t *noutput);
+static void gated_recorder_close(void *state);
+static int file_sink_work(void *state, const void *input, uint32_t ninput,
+                          void *output, uint32_t *noutput);
+static void file_sink_close(void *state);
+static int callback_sink_work(void *state, const void *input, uint32_t ninput,
+                              void *output, uint32_t *noutput);
+
+
+enum {
+  STAGE_BLOCK = 65536,            /* items per call */
+  BIRDIE_FILTER_MAX = 256,
+  BIRDIE_FILTER_FFT_SIZE = 65536,
+  BIRDIE_FILTER_AVERAGES = 16,
+  BIRDIE_FILTER_MIN_AGE = 60,     /* spectra (one per second) */
+  BIRDIE_FILTER_MAX_FOUND = 16    /* per spectrum */
+};
+
+/* notch width for the birdies that are found */
+static const double BIRDIE_FILTER_WIDTH = 10.0;
+
+struct device_source {
+  rf103_graph_t *graph;
+  int stage;
+  rf103_t *rf103;
+  int consumer;
+};
+
+struct file_source {
+  FILE *file;
+  enum RF103SampleType type;
+  double sample_rate;
+  int realtime;
+  int16_t *samples;               /* I/Q files are converted */
+  uint64_t items;
+  struct timespec start;
+};
+
+struct spectrum_stage {
+  spectrum_t *spectrum;
+  uint32_t nbins;
+  float *output;
+  uint32_t noutput;
+};
+
+struct birdie_filter {
+  double sample_rate;
+  char *filename;
+  notch_t *notch;
+  spectrum_t *spectrum;           /* 0 = no search for new birdies */
+  birdie_finder_t *finder;
+  uint32_t nbins;
+  double bin_width;
+  int nbirdies;
+  struct rf103_birdie birdies[BIRDIE_FILTER_MAX];
+  int notches[BIRDIE_FILTER_MAX]; /* -1 = not removed */
+  pthread_mutex_t mutex;          /* the list is read by other threads */
+};
+
+struct file_sink {
+  FILE *file;
+  uint32_t sample_size;
+};
+
+struct callback_sink {
+  rf103_read_async_cb_t callback;
+  void *callback_context;
+  uint32_t sample_size;
+};
+
+
+int rf103_graph_add_device_source(rf103_graph_t *this, rf103_t *rf103,
+                                  enum RF103SampleType type)
+{
+  if (type != SAMPLE_TYPE_S16 && type != SAMPLE_TYPE_CF32) {
+    fprintf(stderr, "ERROR - invalid device source type: %d\n", type);
+    return -1;
+  }
+  struct device_source *state = (struct device_source *) malloc(sizeof(struct device_source));
+  state->graph = this;
+  state->rf103 = rf103;
+  /* the device waits for the graph: backpressure goes all the way back */
+  state->consumer = rf103_add_consumer(rf103, OVERFLOW_BLOCK,
+                                       device_source_callback, state);
+  if (state->consumer < 0) {
+    fprintf(stderr, "ERROR - rf103_add_consumer() failed\n");
+    free(state);
+    return -1;
+  }
+  state->stage = graph_add_push_source(this, "device", type, state,
+                                       device_source_close);
+  if (state->stage < 0) {
+    rf103_remove_consumer(rf103, state->consumer);
+    free(state);
+    return -1;
+  }
+  return state->stage;
+}
+
+
+int rf103_graph_add_file_source(rf103_graph_t *this, const char *filename,
+                                int realtime, double *sample_rate)
+{
+  FILE *file = fopen(filename, "rb");
+  if (file == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed\n", filename);
+    return -1;
+  }
+  unsigned samplerate;
+  unsigned frequency;
+  int bits_per_sample;
+  int num_channels;
+  uint64_t num_frames;
+  if (waveReadHeader(file, &samplerate, &frequency, &bits_per_sample,
+                     &num_channels, &num_frames) != 0 ||
+      bits_per_sample != 16 || (num_channels != 1 && num_channels != 2)) {
+    fprintf(stderr, "ERROR - %s is not a 16 bit mono or I/Q WAV file\n",
+            filename);
+    fclose(file);
+    return -1;
+  }
+
+  struct file_source *state = (struct file_source *) malloc(sizeof(struct file_source));
+  state->file = file;
+  state->type = num_channels == 1 ? SAMPLE_TYPE_S16 : SAMPLE_TYPE_CF32;
+  state->sample_rate = samplerate;
+  state->realtime = realtime;
+  state->samples = 0;
+  if (num_channels == 2) {
+    state->samples = (int16_t *) malloc(2 * STAGE_BLOCK * sizeof(int16_t));
+  }
+  state->items = 0;
+
+  struct rf103_stage_ops ops = {
+    .name = "file source",
+    .input_type = SAMPLE_TYPE_NONE,
+    .output_type = state->type,
+    .min_input = 0,
+    .max_input = 0,
+    .max_output = STAGE_BLOCK,
+    .work = file_source_work,
+    .close = file_source_close
+  };
+  int ret = rf103_graph_add_stage(this, &ops, state);
+  if (ret < 0) {
+    file_source_close(state);
+    return -1;
+  }
+  if (sample_rate) {
+    *sample_rate = samplerate;
+  }
+  return ret;
+}
+
+
+int rf103_graph_add_converter(rf103_graph_t *this)
+{
+  static const struct rf103_stage_ops ops = {
+    .name = "converter",
+    .input_type = SAMPLE_TYPE_S16,
+    .output_type = SAMPLE_TYPE_F32,
+    .min_input = 1,
+    .max_input = STAGE_BLOCK,
+    .max_output = STAGE_BLOCK,
+    .work = converter_work,
+    .close = 0
+  };
+  return rf103_graph_add_stage(this, &ops, 0);
+}
+
+
+int rf103_graph_add_ddc(rf103_graph_t *this, double sample_rate,
+                        double frequency, uint32_t decimation)
+{
+  ddc_t *ddc = ddc_open(sample_rate, frequency, decimation);
+  if (ddc == 0) {
+    fprintf(stderr, "ERROR - ddc_open() failed\n");
+    return -1;
+  }
+  struct rf103_stage_ops ops = {
+    .name = "ddc",
+    .input_type = SAMPLE_TYPE_S16,
+    .output_type = SAMPLE_TYPE_CF32,
+    .min_input = 1,
+    .max_input = STAGE_BLOCK,
+    .max_output = ddc_max_output(ddc, STAGE_BLOCK),
+    .work = ddc_work,
+    .close = ddc_stage_close
+  };
+  int ret = rf103_graph_add_stage(this, &ops, ddc);
+  if (ret < 0) {
+    ddc_close(ddc);
+  }
+  return ret;
+}
+
+
+int rf103_graph_add_ddc16(rf103_graph_t *this, double sample_rate,
+                          double frequency, uint32_t decimation)
+{
+  ddc16_t *ddc16 = ddc16_open(sample_rate, frequency, decimation);
+  if (ddc16 == 0) {
+    fprintf(stderr, "ERROR - ddc16_open() failed\n");
+    return -1;
+  }
+  struct rf103_stage_ops ops = {
+    .name = "ddc16",
+    .input_type = SAMPLE_TYPE_S16,
+    .output_type = SAMPLE_TYPE_CS16,
+    .min_input = 1,
+    .max_input = STAGE_BLOCK,
+    .max_output = ddc16_max_output(ddc16, STAGE_BLOCK),
+    .work = ddc16_work,
+    .close = ddc16_stage_close
+  };
+  int ret = rf103_graph_add_stage(this, &ops, ddc16);
+  if (ret < 0) {
+    ddc16_close(ddc16);
+  }
+  return ret;
+}
+
+
+int rf103_graph_add_spectrum(rf103_graph_t *this, enum RF103SampleType type,
+                             uint32_t fft_size, uint32_t averages,
+                             uint32_t frame_interval)
+{
+  if (type != SAMPLE_TYPE_S16 && type != SAMPLE_TYPE_CF32) {
+    fprintf(stderr, "ERROR - invalid spectrum input type: %d\n", type);
+    return -1;
+  }
+  struct spectrum_stage *state = (struct spectrum_stage *) malloc(sizeof(struct spectrum_stage));
+  enum SpectrumInput input = type == SAMPLE_TYPE_S16 ?
+                             SPECTRUM_INPUT_REAL_S16 :
+                             SPECTRUM_INPUT_COMPLEX_F32;
+  state->spectrum = spectrum_open(fft_size, input, averages, frame_interval,
+                                  spectrum_stage_callback, state);
+  if (state->spectrum == 0) {
+    fprintf(stderr, "ERROR - spectrum_open() failed\n");
+    free(state);
+    return -1;
+  }
+  state->nbins = spectrum_get_bins(state->spectrum);
+  state->output = 0;
+  state->noutput = 0;
+
+  /* one input block can complete at most this many spectra */
+  uint64_t max_spectra = STAGE_BLOCK / ((uint64_t) averages * frame_interval) + 1;
+  struct rf103_stage_ops ops = {
+    .name = "spectrum",
+    .input_type = type,
+    .output_type = SAMPLE_TYPE_F32,
+    .min_input = 1,
+    .max_input = STAGE_BLOCK,
+    .max_output = (uint32_t) (max_spectra * state->nbins),
+    .work = spectrum_work,
+    .close = spectrum_stage_close
+  };
+  int ret = rf103_graph_add_stage(this, &ops, state);
+  if (ret < 0) {
+    spectrum_stage_close(state);
+  }
+  return ret;
+}
+
+
+int rf103_graph_add_tone_bank(rf103_graph_t *this, enum RF103SampleType type,
+                              double sample_rate, const double *frequencies,
+                              uint32_t ntones, uint32_t block_length)
+{
+  if (type != SAMPLE_TYPE_S16 && type != SAMPLE_TYPE_CF32) {
+    fprintf(stderr, "ERROR - invalid tone bank input type: %d\n", type);
+    return -1;
+  }
+  tone_bank_t *tone_bank = tone_bank_open(sample_rate, frequencies, ntones,
+                                          block_length,
+                                          type == SAMPLE_TYPE_CF32);
+  if (tone_bank == 0) {
+    fprintf(stderr, "ERROR - tone_bank_open() failed\n");
+    return -1;
+  }
+  struct rf103_stage_ops ops = {
+    .name = "tone bank",
+    .input_type = type,
+    .output_type = SAMPLE_TYPE_F32,
+    .min_input = 1,
+    .max_input = STAGE_BLOCK,
+    .max_output = tone_bank_max_output(tone_bank, STAGE_BLOCK),
+    .work = tone_bank_work,
+    .close = tone_bank_stage_close
+  };
+  int ret = rf103_graph_add_stage(this, &ops, tone_bank);
+  if (ret < 0) {
+    tone_bank_close(tone_bank);
+  }
+  return ret;
+}
+
+
+int rf103_graph_add_birdie_filter(rf103_graph_t *this, double sample_rate,
+                                  const char *birdie_file, double threshold)
+{
+  if (sample_rate <= 0 || birdie_file == 0) {
+    fprintf(stderr, "ERROR - invalid birdie filter\n");
+    return -1;
+  }
+  struct birdie_filter *state = (struct birdie_filter *) malloc(sizeof(struct birdie_filter));
+  state->sample_rate = sample_rate;
+  state->filename = strdup(birdie_file);
+  state->spectrum = 0;
+  state->finder = 0;
+  state->nbins = BIRDIE_FILTER_FFT_SIZE / 2;
+  state->bin_width = sample_rate / BIRDIE_FILTER_FFT_SIZE;
+  pthread_mutex_init(&state->mutex, 0);
+  state->notch = notch_open(sample_rate);
+  if (state->notch == 0) {
+    fprintf(stderr, "ERROR - notch_open() failed\n");
+    birdie_filter_close(state);
+    return -1;
+  }
+  state->nbirdies = birdie_read_list(birdie_file, state->birdies,
+                                     BIRDIE_FILTER_MAX);
+  if (state->nbirdies < 0) {
+    state->nbirdies = 0;
+    birdie_filter_close(state);
+    return -1;
+  }
+  for (int i = 0; i < state->nbirdies; ++i) {
+    const struct rf103_birdie *birdie = &state->birdies[i];
+    state->notches[i] = birdie->width > 0 ?
+                        notch_add(state->notch, birdie->frequency,
+                                  birdie->width) : -1;
+  }
+
+  if (threshold > 0) {
+    /* about one averaged spectrum per second */
+    uint32_t frame_interval = (uint32_t) (sample_rate / BIRDIE_FILTER_AVERAGES);
+    if (frame_interval < BIRDIE_FILTER_FFT_SIZE)
+      frame_interval = BIRDIE_FILTER_FFT_SIZE;
+    state->spectrum = spectrum_open(BIRDIE_FILTER_FFT_SIZE,
+                                    SPECTRUM_INPUT_REAL_S16,
+                                    BIRDIE_FILTER_AVERAGES, frame_interval,
+                                    birdie_filter_callback, state);
+    if (state->spectrum == 0) {
+      fprintf(stderr, "ERROR - spectrum_open() failed\n");
+      birdie_filter_close(state);
+      return -1;
+    }
+    state->finder = birdie_finder_open(state->nbins, state->bin_width,
+                                       threshold, BIRDIE_FILTER_MIN_AGE);
+    if (state->finder == 0) {
+      fprintf(stderr, "ERROR - birdie_finder_open() failed\n");
+      birdie_filter_close(state);
+      return -1;
+    }
+  }
+
+  struct rf103_stage_ops ops = {
+    .name = "birdie filter",
+    .input_type = SAMPLE_TYPE_S16,
+    .output_type = SAMPLE_TYPE_S16,
+    .min_input = 1,
+    .max_input = STAGE_BLOCK,
+    .max_output = STAGE_BLOCK,
+    .work = birdie_filter_work,
+    .close = birdie_filter_close
+  };
+  int ret = rf103_graph_add_stage(this, &ops, state);
+  if (ret < 0) {
+    birdie_filter_close(state);
+  }
+  return ret;
+}
+
+
+int rf103_graph_get_birdies(rf103_graph_t *this, int stage,
+                            struct rf103_birdie *birdies, int max)
+{
+  struct birdie_filter *state = (struct birdie_filter *) graph_get_stage_state(this, stage, "birdie filter");
+  if (state == 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&state->mutex);
+  int nbirdies = state->nbirdies;
+  for (int i = 0; i < nbirdies && i < max; ++i) {
+    birdies[i] = state->birdies[i];
+    struct notch_stats stats;
+    if (state->notches[i] >= 0 &&
+        notch_get_stats(state->notch, state->notches[i], &stats) == 0) {
+      birdies[i].frequency = stats.frequency;
+      birdies[i].level = stats.level;
+      birdies[i].cpu_time_ns = stats.cpu_time_ns;
+      birdies[i].samples = stats.samples;
+    }
+  }
+  pthread_mutex_unlock(&state->mutex);
+  return nbirdies;
+}
+
+
+int rf103_graph_add_gated_recorder(rf103_graph_t *this, const char *filename,
+                                   double sample_rate, double frequency,
+                                   double start_time, double threshold,
+                                   double preroll, double hang)
+{
+  if (start_time == 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    start_time = now.tv_sec + 1e-9 * now.tv_nsec;
+  }
+  channel_recorder_t *channel_recorder = channel_recorder_open(filename,
+                                                               start_time,
+                                                               threshold,
+                                                               preroll, hang);
+  if (channel_recorder == 0) {
+    fprintf(stderr, "ERROR - channel_recorder_open() failed\n");
+    return -1;
+  }
+  if (channel_recorder_add_channel(channel_recorder, frequency,
+                                   sample_rate) < 0) {
+    fprintf(stderr, "ERROR - channel_recorder_add_channel() failed\n");
+    channel_recorder_close(channel_recorder);
+    return -1;
+  }
+  struct rf103_stage_ops ops = {
+    .name = "gated recorder",
+    .input_type = SAMPLE_TYPE_CF32,
+    .output_type = SAMPLE_TYPE_NONE,
+    .min_input = 1,
+    .max_input = STAGE_BLOCK,
+    .max_output = 0,
+    .work = gated_recorder_work,
+    .close = gated_recorder_close
+  };
+  int ret = rf103_graph_add_stage(this, &ops, channel_recorder);
+  if (ret < 0) {
+    channel_recorder_close(channel_recorder);
+  }
+  return ret;
+}
+
+
+int rf103_graph_add_file_sink(rf103_graph_t *this, enum RF103SampleType type,
+                              const char *filename)
+{
+  if (graph_sample_size(type) == 0) {
+    fprintf(stderr, "ERROR - invalid file sink type: %d\n", type);
+    return -1;
+  }
+  FILE *file = fopen(filename, "wb");
+  if (file == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed\n", filename);
+    return -1;
+  }
+  struct file_sink *state = (struct file_sink *) malloc(sizeof(struct file_sink));
+  state->file = file;
+  state->sample_size = graph_sample_size(type);
+  struct rf103_stage_ops ops = {
+    .name = "file sink",
+    .input_type = type,
+    .output_type = SAMPLE_TYPE_NONE,
+    .min_input = 1,
+    .max_input = STAGE_BLOCK,
+    .max_output = 0,
+    .work = file_sink_work,
+    .close = file_sink_close
+  };
+  int ret = rf103_graph_add_stage(this, &ops, state);
+  if (ret < 0) {
+    file_sink_close(state);
+  }
+  return ret;
+}
+
+
+int rf103_graph_add_callback_sink(rf103_graph_t *this,
+                                  enum RF103SampleType type,
+                                  rf103_read_async_cb_t callback,
+                                  void *callback_context)
+{
+  if (graph_sample_size(type) == 0 || callback == 0) {
+    fprintf(stderr, "ERROR - invalid callback sink\n");
+    return -1;
+  }
+  struct callback_sink *state = (struct callback_sink *) malloc(sizeof(struct callback_sink));
+  state->callback = callback;
+  state->callback_context = callback_context;
+  state->sample_size = graph_sample_size(type);
+  struct rf103_stage_ops ops = {
+    .name = "callback sink",
+    .input_type = type,
+    .output_type = SAMPLE_TYPE_NONE,
+    .min_input = 1,
+    .max_input = STAGE_BLOCK,
+    .max_output = 0,
+    .work = callback_sink_work,
+    .close = free
+  };
+  int ret = rf103_graph_add_stage(this, &ops, state);
+  if (ret < 0) {
+    free(state);
+  }
+  return ret;
+}
+
+
+/* internal functions */
+static void device_source_callback(uint32_t data_size, uint8_t *data,
+                                   void *context)
+{
+  struct device_source *state = (struct device_source *) context;
+  graph_push(state->graph, state->stage, data, data_size);
+  return;
+}
+
+
+static void device_source_close(void *state)
+{
+  struct device_source *device_source = (struct device_source *) state;
+  rf103_remove_consumer(device_source->rf103, device_source->consumer);
+  free(device_source);
+  return;
+}
+
+
+static int file_source_work(void *state,
+                            const void *input __attribute__((unused)),
+                            uint32_t ninput __attribute__((unused)),
+                            void *output, uint32_t *noutput)
+{
+  struct file_source *file_source = (struct file_source *) state;
+
+  if (file_source->realtime) {
+    /* keep the file at its sample rate */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (file_source->items == 0) {
+      file_source->start = now;
+    }
+    double elapsed = (now.tv_sec - file_source->start.tv_sec) +
+                     1e-9 * (now.tv_nsec - file_source->start.tv_nsec);
+    double delay = file_source->items / file_source->sample_rate - elapsed;
+    if (delay > 0) {
+      struct timespec sleep_time;
+      sleep_time.tv_sec = (time_t) delay;
+      sleep_time.tv_nsec = (long) ((delay - sleep_time.tv_sec) * 1e9);
+      nanosleep(&sleep_time, 0);
+    }
+  }
+
+  size_t n;
+  if (file_source->type == SAMPLE_TYPE_S16) {
+    n = fread(output, sizeof(int16_t), STAGE_BLOCK, file_source->file);
+  } else {
+    /* fread() instead of waveReadFrames(), which keeps the frame size in a
+       global, so several file sources can be open at the same time */
+    n = fread(file_source->samples, 2 * sizeof(int16_t), STAGE_BLOCK,
+              file_source->file);
+    float *iq = (float *) output;
+    const int16_t *samples = file_source->samples;
+    for (size_t i = 0; i < 2 * n; ++i) {
+      iq[i] = samples[i] * (1.0f / 32768.0f);
+    }
+  }
+  if (n == 0) {
+    return RF103_STAGE_END;
+  }
+  file_source->items += n;
+  *noutput = (uint32_t) n;
+  return 0;
+}
+
+
+static void file_source_close(void *state)
+{
+  struct file_source *file_source = (struct file_source *) state;
+  fclose(file_source->file);
+  free(file_source->samples);
+  free(file_source);
+  return;
+}
+
+
+static int converter_work(void *state __attribute__((unused)),
+                          const void *input, uint32_t ninput,
+                          void *output, uint32_t *noutput)
+{
+  const int16_t *samples = (const int16_t *) input;
+  float *values = (float *) output;
+  for (uint32_t i = 0; i < ninput; ++i) {
+    values[i] = samples[i] * (1.0f / 32768.0f);
+  }
+  *noutput = ninput;
+  return ninput;
+}
+
+
+static int ddc_work(void *state, const void *input, uint32_t ninput,
+                    void *output, uint32_t *noutput)
+{
+  *noutput = ddc_process((ddc_t *) state, (const int16_t *) input, ninput,
+                         (float *) output);
+  return ninput;
+}
+
+
+static void ddc_stage_close(void *state)
+{
+  ddc_close((ddc_t *) state);
+  return;
+}
+
+
+static int ddc16_work(void *state, const void *input, uint32_t ninput,
+                      void *output, uint32_t *noutput)
+{
+  *noutput = ddc16_process((ddc16_t *) state, (const int16_t *) input, ninput,
+                           (int16_t *) output);
+  return ninput;
+}
+
+
+static void ddc16_stage_close(void *state)
+{
+  ddc16_close((ddc16_t *) state);
+  return;
+}
+
+
+static int spectrum_work(void *state, const void *input, uint32_t ninput,
+                         void *output, uint32_t *noutput)
+{
+  struct spectrum_stage *spectrum_stage = (struct spectrum_stage *) state;
+  spectrum_stage->output = (float *) output;
+  spectrum_stage->noutput = 0;
+  spectrum_process(spectrum_stage->spectrum, input, ninput);
+  *noutput = spectrum_stage->noutput;
+  return ninput;
+}
+
+
+static void spectrum_stage_callback(const float *power,
+                                    uint64_t position __attribute__((unused)),
+                                    void *context)
+{
+  struct spectrum_stage *spectrum_stage = (struct spectrum_stage *) context;
+  memcpy(spectrum_stage->output + spectrum_stage->noutput, power,
+         spectrum_stage->nbins * sizeof(float));
+  spectrum_stage->noutput += spectrum_stage->nbins;
+  return;
+}
+
+
+static void spectrum_stage_close(void *state)
+{
+  struct spectrum_stage *spectrum_stage = (struct spectrum_stage *) state;
+  spectrum_close(spectrum_stage->spectrum);
+  free(spectrum_stage);
+  return;
+}
+
+
+static int tone_bank_work(void *state, const void *input, uint32_t ninput,
+                          void *output, uint32_t *noutput)
+{
+  *noutput = tone_bank_process((tone_bank_t *) state, input, ninput,
+                               (float *) output);
+  return ninput;
+}
+
+
+static void tone_bank_stage_close(void *state)
+{
+  tone_bank_close((tone_bank_t *) state);
+  return;
+}
+
+
+static int birdie_filter_work(void *state, const void *input, uint32_t ninput,
+                              void *output, uint32_t *noutput)
+{
+  struct birdie_filter *birdie_filter = (struct birdie_filter *) state;
+  /* the search looks at the input, so the birdies that are already removed
+     are still seen (and not added again) */
+  if (birdie_filter->spectrum) {
+    spectrum_process(birdie_filter->spectrum, input, ninput);
+  }
+  memcpy(output, input, ninput * sizeof(int16_t));
+  pthread_mutex_lock(&birdie_filter->mutex);
+  notch_process(birdie_filter->notch, (int16_t *) output, ninput);
+  pthread_mutex_unlock(&birdie_filter->mutex);
+  *noutput = ninput;
+  return ninput;
+}
+
+
+static void birdie_filter_callback(const float *power,
+                                   uint64_t position __attribute__((unused)),
+                                   void *context)
+{
+  struct birdie_filter *birdie_filter = (struct birdie_filter *) context;
+  double found[BIRDIE_FILTER_MAX_FOUND];
+  uint32_t nfound = birdie_finder_update(birdie_filter->finder, power, found,
+                                         BIRDIE_FILTER_MAX_FOUND);
+  int added = 0;
+  for (uint32_t i = 0; i < nfound; ++i) {
+    double frequency = found[i];
+    int known = 0;
+    for (int j = 0; j < birdie_filter->nbirdies; ++j) {
+      if (fabs(birdie_filter->birdies[j].frequency - frequency) <
+          2 * birdie_filter->bin_width) {
+        known = 1;
+        break;
+      }
+    }
+    if (known || birdie_filter->nbirdies == BIRDIE_FILTER_MAX) {
+      continue;
+    }
+    const char *origin = birdie_origin(frequency, birdie_filter->sample_rate,
+                                       birdie_filter->bin_width);
+    pthread_mutex_lock(&birdie_filter->mutex);
+    int n = birdie_filter->nbirdies;
+    struct rf103_birdie *birdie = &birdie_filter->birdies[n];
+    memset(birdie, 0, sizeof(struct rf103_birdie));
+    birdie->frequency = frequency;
+    birdie->width = BIRDIE_FILTER_WIDTH;
+    snprintf(birdie->origin, sizeof(birdie->origin), "%s",
+             origin ? origin : "found");
+    birdie_filter->notches[n] = notch_add(birdie_filter->notch, frequency,
+                                          BIRDIE_FILTER_WIDTH);
+    birdie_filter->nbirdies++;
+    pthread_mutex_unlock(&birdie_filter->mutex);
+    added = 1;
+  }
+  if (added) {
+    birdie_write_list(birdie_filter->filename, birdie_filter->birdies,
+                      birdie_filter->nbirdies);
+  }
+  return;
+}
+
+
+static void birdie_filter_close(void *state)
+{
+  struct birdie_filter *birdie_filter = (struct birdie_filter *) state;
+  if (birdie_filter->finder) {
+    birdie_finder_close(birdie_filter->finder);
+  }
+  if (birdie_filter->spectrum) {
+    spectrum_close(birdie_filter->spectrum);
+  }
+  if (birdie_filter->notch) {
+    notch_close(birdie_filter->notch);
+  }
+  pthread_mutex_destroy(&birdie_filter->mutex);
+  free(birdie_filter->filename);
+  free(birdie_filter);
+  return;
+}
+
+
+static int gated_recorder_work(void *state, const void *input, uint32_t ninput,
+                               void *output __attribute__((unused)),
+                               uint32_t *noutput __attribute__((unused)))
+{
+  if (channel_recorder_process((channel_recorder_t *) state, 0,
+                               (const float *) input, ninput) < 0) {
+    return RF103_STAGE_ERROR;
+  }
+  return ninput;
+}
+
+
+static void gated_recorder_close(void *state)
+{
+  channel_recorder_close((channel_recorder_t *) state);
+  return;
+}
+
+
+static int file_sink_work(void *state, const void *input, uint32_t ninput,
+                          void *output __attribute__((unused)),
+                          uint32_t *noutput __attribute__((unused)))
+{
+  struct file_sink *file_sink = (struct file_sink *) state;
+  size_t n = fwrite(input, file_sink->sample_size, ninput, file_sink->file);
+  if (n != ninput) {
+    fprintf(stderr, "ERROR - file sink write failed\n");
+    return RF103_STAGE_ERROR;
+  }
+  return ninput;
+}
+
+
+static void file_sink_close(void *state)
+{
+  struct file_sink *file_sink = (struct file_sink *) state;
+  fclose(file_sink->file);
+  free(file_sink);
+  return;
+}
+
+
+static int callback_sink_work(void *state, const void *input, uint32_t ninput,
+                              void *output __attribute__((unused)),
+                              uint32_t *noutput __attribute__((unused)))
+{
+  struct callback_sink *callback_sink = (struct callback_sink *) state;
+  callback_sink->callback(ninput * callback_sink->sample_size,
+                          (uint8_t *) input, callback_sink->callback_context);
+  return ninput;
+}
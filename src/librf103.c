@@ -20,6 +20,8 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,12 +32,61 @@
 #include "clock_source.h"
 #include "adc.h"
 #include "tuner.h"
+#include "calibration.h"
+#include "ddc.h"
+#include "flight_recorder.h"
+#include "memory_budget.h"
+#include "operation_stats.h"
+#include "ring_buffer.h"
+#include "spectrum.h"
+#include "cfar.h"
+#include "broadcast.h"
+#include "command_queue.h"
 
 typedef struct rf103 rf103_t;
 
 /* internal functions */
 static uint8_t initial_gpio_register();
 static int is_vhf_mode_on(rf103_t *this);
+static void rf103_read_async_callback(uint32_t data_size, uint8_t *data,
+                                      void *context);
+static void rf103_read_batch_callback(uint32_t nframes,
+                                      struct rf103_frame *frames,
+                                      void *context);
+static uint8_t *convert_frame(rf103_t *this, uint32_t *data_size,
+                              uint8_t *data, float *baseband_samples,
+                              uint64_t timestamp_ns);
+static int execute_command(const struct command *command, void *context);
+static void deliver_frame(rf103_t *this, uint32_t data_size, uint8_t *data);
+static double baseband_frequency(rf103_t *this);
+static double tuned_frequency(rf103_t *this);
+static int update_baseband_frequency(rf103_t *this);
+static int open_signal_detector(rf103_t *this);
+static void close_signal_detector(rf103_t *this);
+static void rf103_spectrum_callback(const float *power, uint64_t position,
+                                    void *context);
+static int set_rf_mode(rf103_t *this, enum RFMode rf_mode);
+static int led_on(rf103_t *this, uint8_t led_pattern);
+static int led_off(rf103_t *this, uint8_t led_pattern);
+static int led_toggle(rf103_t *this, uint8_t led_pattern);
+static int set_sample_rate(rf103_t *this, double sample_rate);
+static int start_streaming(rf103_t *this);
+static int stop_streaming(rf103_t *this);
+static int set_frequency_correction(rf103_t *this, double ppm);
+static int set_vhf_frequency(rf103_t *this, double frequency);
+static int set_vhf_harmonic_frequency(rf103_t *this, double frequency,
+                                      int harmonic);
+static int set_vhf_if_frequency(rf103_t *this, uint32_t if_frequency);
+static int set_vhf_frequency_auto(rf103_t *this, double frequency);
+static int set_vhf_lna_gain(rf103_t *this, int gain);
+static int set_vhf_lna_agc(rf103_t *this, int agc);
+static int set_vhf_mixer_gain(rf103_t *this, int gain);
+static int set_vhf_mixer_agc(rf103_t *this, int agc);
+static int set_vhf_vga_gain(rf103_t *this, int gain);
+static int set_vhf_if_bandwidth(rf103_t *this, uint32_t bandwidth);
+static uint64_t operation_begin(rf103_t *this, uint64_t *control_transfers);
+static int operation_end(rf103_t *this, enum RF103Operation operation,
+                         uint64_t start, uint64_t control_transfers, int ret);
 
 
 typedef struct rf103 {
@@ -47,6 +98,38 @@ typedef struct rf103 {
   int has_tuner;
   tuner_t *tuner;
   double sample_rate;
+  enum RF103StreamFormat stream_format;
+  uint32_t decimation;
+  rf103_read_async_cb_t callback;
+  void *callback_context;
+  uint32_t batch_frames;
+  rf103_read_batch_cb_t batch_callback;
+  void *batch_callback_context;
+  int async_streaming;
+  broadcast_t *broadcast;
+  int broadcasting;
+  ddc_t *ddc;
+  float *baseband_samples;         /* one frame per batch slot */
+  uint32_t baseband_frame_size;     /* floats */
+  double next_baseband_frequency;   /* set by retuning while streaming */
+  atomic_int baseband_retune;
+  ring_buffer_t *history;
+  atomic_ullong stream_position;    /* ADC samples since streaming started */
+  command_queue_t *command_queue;
+  enum RF103DetectorMethod detector_method;
+  uint32_t detector_fft_size;
+  double detector_update_interval;
+  double detector_threshold;
+  rf103_signals_cb_t signals_callback;
+  void *signals_callback_context;
+  spectrum_t *spectrum;
+  cfar_t *cfar;
+  struct rf103_signal *signals;
+  double detector_sample_rate;
+  double detector_center_frequency; /* baseband: tuned frequency */
+  double next_center_frequency;     /* set by retuning while streaming */
+  struct operation_stats operations[OPERATIONS];  /* library calls */
+  pthread_mutex_t control_mutex;    /* serializes the control calls */
 } rf103_t;
 
 
@@ -130,6 +213,45 @@ rf103_t *rf103_open(int index, const char* imagefile)
   this->has_tuner = has_tuner(usb_device);
   this->tuner = 0;
   this->sample_rate = 0;    /* default sample rate */
+  this->stream_format = STREAM_FORMAT_RAW;
+  this->decimation = 1;
+  this->callback = 0;
+  this->callback_context = 0;
+  this->batch_frames = 0;
+  this->batch_callback = 0;
+  this->batch_callback_context = 0;
+  this->async_streaming = 0;
+  this->broadcast = 0;
+  this->broadcasting = 0;
+  this->ddc = 0;
+  this->baseband_samples = 0;
+  this->baseband_frame_size = 0;
+  this->next_baseband_frequency = 0;
+  atomic_init(&this->baseband_retune, 0);
+  this->history = 0;
+  atomic_init(&this->stream_position, 0);
+  this->command_queue = 0;
+  this->detector_method = DETECTOR_CA_CFAR;
+  this->detector_fft_size = 0;
+  this->detector_update_interval = 0;
+  this->detector_threshold = 0;
+  this->signals_callback = 0;
+  this->signals_callback_context = 0;
+  this->spectrum = 0;
+  this->cfar = 0;
+  this->signals = 0;
+  this->detector_sample_rate = 0;
+  this->detector_center_frequency = 0;
+  this->next_center_frequency = 0;
+  for (int i = 0; i < OPERATIONS; ++i) {
+    operation_stats_init(&this->operations[i]);
+  }
+  /* recursive, because the timed commands go through the public calls */
+  pthread_mutexattr_t control_mutex_attr;
+  pthread_mutexattr_init(&control_mutex_attr);
+  pthread_mutexattr_settype(&control_mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&this->control_mutex, &control_mutex_attr);
+  pthread_mutexattr_destroy(&control_mutex_attr);
 
   ret_val = this;
   return ret_val;
@@ -145,10 +267,21 @@ void rf103_close(rf103_t *this)
 {
   if (this->adc)
     adc_close(this->adc);
+  if (this->ddc)
+    ddc_close(this->ddc);
+  memory_budget_free(this->baseband_samples);
+  close_signal_detector(this);
+  if (this->broadcast)
+    broadcast_close(this->broadcast);
+  if (this->history)
+    ring_buffer_close(this->history);
+  if (this->command_queue)
+    command_queue_close(this->command_queue);
   if (this->tuner)
     tuner_close(this->tuner);
   clock_source_close(this->clock_source);
   usb_device_close(this->usb_device);
+  pthread_mutex_destroy(&this->control_mutex);
   free(this);
   return;
 }
@@ -160,13 +293,17 @@ enum RF103Status rf103_status(rf103_t *this)
 }
 
 
-int rf103_set_rf_mode(rf103_t *this, enum RFMode rf_mode)
+static int set_rf_mode(rf103_t *this, enum RFMode rf_mode)
 {
   switch (rf_mode) {
     case HF_MODE:
-      if (this->tuner)
-        tuner_close(this->tuner);
-      this->tuner = 0;
+      /* keep the tuner around in standby, so we can switch back quickly */
+      if (this->rf_mode == VHF_MODE && this->tuner) {
+        if (tuner_standby(this->tuner) < 0) {
+          fprintf(stderr, "ERROR - tuner_standby() failed\n");
+          return -1;
+        }
+      }
       this->rf_mode = HF_MODE;
       break;
     case VHF_MODE:
@@ -174,9 +311,14 @@ int rf103_set_rf_mode(rf103_t *this, enum RFMode rf_mode)
         fprintf(stderr, "WARNING - no VHF/UHF tuner found\n");
         return -1;
       }
-      this->tuner = tuner_open(this->usb_device);
       if (this->tuner == 0) {
-        fprintf(stderr, "ERROR - tuner_open() failed\n");
+        this->tuner = tuner_open(this->usb_device);
+        if (this->tuner == 0) {
+          fprintf(stderr, "ERROR - tuner_open() failed\n");
+          return -1;
+        }
+      } else if (tuner_resume(this->tuner) < 0) {
+        fprintf(stderr, "ERROR - tuner_resume() failed\n");
         return -1;
       }
       this->rf_mode = VHF_MODE;
@@ -189,6 +331,15 @@ int rf103_set_rf_mode(rf103_t *this, enum RFMode rf_mode)
 }
 
 
+int rf103_set_rf_mode(rf103_t *this, enum RFMode rf_mode)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_SET_RF_MODE, start, control_transfers,
+                       set_rf_mode(this, rf_mode));
+}
+
+
 /******************************
  * GPIO related functions
  ******************************/
@@ -211,7 +362,7 @@ static uint8_t initial_gpio_register()
 }
 
 
-int rf103_led_on(rf103_t *this, uint8_t led_pattern)
+static int led_on(rf103_t *this, uint8_t led_pattern)
 {
   if (led_pattern & ~(GPIO_LED_RED | GPIO_LED_YELLOW | GPIO_LED_BLUE)) {
     fprintf(stderr, "ERROR - invalid LED pattern: 0x%02x\n", led_pattern);
@@ -221,7 +372,16 @@ int rf103_led_on(rf103_t *this, uint8_t led_pattern)
 }
 
 
-int rf103_led_off(rf103_t *this, uint8_t led_pattern)
+int rf103_led_on(rf103_t *this, uint8_t led_pattern)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_LED, start, control_transfers,
+                       led_on(this, led_pattern));
+}
+
+
+static int led_off(rf103_t *this, uint8_t led_pattern)
 {
   if (led_pattern & ~(GPIO_LED_RED | GPIO_LED_YELLOW | GPIO_LED_BLUE)) {
     fprintf(stderr, "ERROR - invalid LED pattern: 0x%02x\n", led_pattern);
@@ -231,7 +391,16 @@ int rf103_led_off(rf103_t *this, uint8_t led_pattern)
 }
 
 
-int rf103_led_toggle(rf103_t *this, uint8_t led_pattern)
+int rf103_led_off(rf103_t *this, uint8_t led_pattern)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_LED, start, control_transfers,
+                       led_off(this, led_pattern));
+}
+
+
+static int led_toggle(rf103_t *this, uint8_t led_pattern)
 {
   if (led_pattern & ~(GPIO_LED_RED | GPIO_LED_YELLOW | GPIO_LED_BLUE)) {
     fprintf(stderr, "ERROR - invalid LED pattern: 0x%02x\n", led_pattern);
@@ -241,7 +410,16 @@ int rf103_led_toggle(rf103_t *this, uint8_t led_pattern)
 }
 
 
-int rf103_adc_dither(rf103_t *this, int dither)
+int rf103_led_toggle(rf103_t *this, uint8_t led_pattern)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_LED, start, control_transfers,
+                       led_toggle(this, led_pattern));
+}
+
+
+static int adc_dither(rf103_t *this, int dither)
 {
   if (dither) {
     return usb_device_gpio_on(this->usb_device, GPIO_DITHER);
@@ -251,18 +429,35 @@ int rf103_adc_dither(rf103_t *this, int dither)
 }
 
 
-int rf103_adc_random(rf103_t *this, int random)
+int rf103_adc_dither(rf103_t *this, int dither)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_ADC_DITHER, start, control_transfers,
+                       adc_dither(this, dither));
+}
+
+
+static int adc_random(rf103_t *this, int random)
 {
   if (random) {
     return usb_device_gpio_on(this->usb_device, GPIO_RANDOM);
   } else {
     return usb_device_gpio_off(this->usb_device, GPIO_RANDOM);
   }
-  adc_set_random(this->adc, random);
 }
 
 
-int rf103_hf_attenuation(rf103_t *this, double attenuation)
+int rf103_adc_random(rf103_t *this, int random)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_ADC_RANDOM, start, control_transfers,
+                       adc_random(this, random));
+}
+
+
+static int hf_attenuation(rf103_t *this, double attenuation)
 {
   uint8_t bit_pattern = 0;
   switch ((int) attenuation) {
@@ -284,11 +479,20 @@ int rf103_hf_attenuation(rf103_t *this, double attenuation)
 }
 
 
+int rf103_hf_attenuation(rf103_t *this, double attenuation)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_HF_ATTENUATION, start,
+                       control_transfers, hf_attenuation(this, attenuation));
+}
+
+
 /******************************
  * streaming related functions
  ******************************/
 
-int rf103_set_sample_rate(rf103_t *this, double sample_rate)
+static int set_sample_rate(rf103_t *this, double sample_rate)
 {
   /* no checks yet */
   this->sample_rate = sample_rate;
@@ -296,6 +500,16 @@ int rf103_set_sample_rate(rf103_t *this, double sample_rate)
 }
 
 
+int rf103_set_sample_rate(rf103_t *this, double sample_rate)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_SET_SAMPLE_RATE,
+                       start, control_transfers,
+                       set_sample_rate(this, sample_rate));
+}
+
+
 int rf103_set_async_params(rf103_t *this, uint32_t frame_size,
                            uint32_t num_frames, rf103_read_async_cb_t callback,
                            void *callback_context)
@@ -305,76 +519,419 @@ int rf103_set_async_params(rf103_t *this, uint32_t frame_size,
     return -1;
   }
 
+  /* the ADC calls back into the library first, so the data can be converted
+     to the stream format and handed to the consumers */
+  this->callback = callback;
+  this->callback_context = callback_context;
+  this->async_streaming = callback != 0 || this->batch_callback != 0 ||
+                          (this->broadcast &&
+                           broadcast_get_num_consumers(this->broadcast) > 0);
   this->adc = adc_open_async(this->usb_device, frame_size, num_frames,
-                              callback, callback_context);
+                              this->async_streaming ?
+                              rf103_read_async_callback : 0,
+                              this);
   if (this->adc == 0) {
     fprintf(stderr, "ERROR - adc_open_async() failed\n");
     return -1;
   }
+  if (this->batch_callback &&
+      adc_set_batch(this->adc, this->batch_frames,
+                    rf103_read_batch_callback) < 0) {
+    fprintf(stderr, "ERROR - adc_set_batch() failed\n");
+    adc_close(this->adc);
+    this->adc = 0;
+    return -1;
+  }
 
   return 0;
 }
 
 
-int rf103_start_streaming(rf103_t *this)
+int rf103_set_async_batch(rf103_t *this, uint32_t batch_frames,
+                          rf103_read_batch_cb_t callback,
+                          void *callback_context)
+{
+  if (this->adc) {
+    fprintf(stderr, "ERROR - rf103_set_async_batch() failed: call it before rf103_set_async_params()\n");
+    return -1;
+  }
+  if (callback != 0 && batch_frames == 0) {
+    fprintf(stderr, "ERROR - invalid batch size: %u\n", batch_frames);
+    return -1;
+  }
+  this->batch_frames = callback ? batch_frames : 0;
+  this->batch_callback = callback;
+  this->batch_callback_context = callback_context;
+  return 0;
+}
+
+
+int rf103_set_stream_format(rf103_t *this, enum RF103StreamFormat format,
+                            uint32_t decimation)
+{
+  if (this->status == STATUS_STREAMING) {
+    fprintf(stderr, "ERROR - rf103_set_stream_format() failed: streaming in progress\n");
+    return -1;
+  }
+  switch (format) {
+    case STREAM_FORMAT_RAW:
+      decimation = 1;
+      break;
+    case STREAM_FORMAT_BASEBAND_CF32:
+      if (decimation < 2) {
+        fprintf(stderr, "ERROR - rf103_set_stream_format() failed: invalid decimation %u\n", decimation);
+        return -1;
+      }
+      break;
+    default:
+      fprintf(stderr, "ERROR - rf103_set_stream_format() failed: invalid format %d\n", format);
+      return -1;
+  }
+  this->stream_format = format;
+  this->decimation = decimation;
+  return 0;
+}
+
+
+int rf103_set_command_queue(rf103_t *this, uint32_t max_commands,
+                            double stream_latency,
+                            rf103_command_tag_cb_t callback,
+                            void *callback_context)
+{
+  if (this->status == STATUS_STREAMING) {
+    fprintf(stderr, "ERROR - rf103_set_command_queue() failed: streaming in progress\n");
+    return -1;
+  }
+  if (this->command_queue) {
+    command_queue_close(this->command_queue);
+    this->command_queue = 0;
+  }
+  if (max_commands == 0) {
+    return 0;
+  }
+  this->command_queue = command_queue_open(max_commands, stream_latency,
+                                           execute_command, this,
+                                           callback, callback_context);
+  if (this->command_queue == 0) {
+    fprintf(stderr, "ERROR - command_queue_open() failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+int rf103_schedule_command(rf103_t *this, enum RF103CommandType type,
+                           double value, uint64_t sample)
+{
+  if (this->command_queue == 0) {
+    fprintf(stderr, "ERROR - rf103_schedule_command() failed: no command queue\n");
+    return -1;
+  }
+  return command_queue_schedule(this->command_queue, type, value, sample);
+}
+
+
+int rf103_schedule_command_at(rf103_t *this, enum RF103CommandType type,
+                              double value, uint64_t time_ns)
+{
+  if (this->command_queue == 0) {
+    fprintf(stderr, "ERROR - rf103_schedule_command_at() failed: no command queue\n");
+    return -1;
+  }
+  uint64_t sample;
+  if (command_queue_time_to_sample(this->command_queue, time_ns, &sample) < 0) {
+    return -1;
+  }
+  return command_queue_schedule(this->command_queue, type, value, sample);
+}
+
+
+uint64_t rf103_get_stream_position(rf103_t *this)
+{
+  return atomic_load_explicit(&this->stream_position, memory_order_relaxed);
+}
+
+
+int rf103_set_history_size(rf103_t *this, uint32_t size)
+{
+  if (this->status == STATUS_STREAMING) {
+    fprintf(stderr, "ERROR - rf103_set_history_size() failed: streaming in progress\n");
+    return -1;
+  }
+  if (this->history) {
+    ring_buffer_close(this->history);
+    this->history = 0;
+  }
+  if (size == 0) {
+    return 0;
+  }
+  this->history = ring_buffer_open(size);
+  if (this->history == 0) {
+    fprintf(stderr, "ERROR - ring_buffer_open() failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+uint64_t rf103_get_history_position(rf103_t *this)
+{
+  return this->history ? ring_buffer_get_head(this->history) : 0;
+}
+
+
+const uint8_t *rf103_get_history(rf103_t *this, uint64_t position,
+                                 uint32_t length)
 {
+  if (this->history == 0) {
+    fprintf(stderr, "ERROR - rf103_get_history() failed: no history\n");
+    return 0;
+  }
+  uint64_t head = ring_buffer_get_head(this->history);
+  if (position + length > head ||
+      head - position > ring_buffer_get_size(this->history)) {
+    fprintf(stderr, "ERROR - rf103_get_history() failed: span not in history\n");
+    return 0;
+  }
+  return (const uint8_t *) ring_buffer_get_pointer(this->history, position);
+}
+
+
+/* broadcast to several consumers */
+static const uint32_t DEFAULT_BROADCAST_FRAMES = 64;
+
+int rf103_set_broadcast_frames(rf103_t *this, uint32_t num_frames)
+{
+  if (this->status == STATUS_STREAMING) {
+    fprintf(stderr, "ERROR - rf103_set_broadcast_frames() failed: streaming in progress\n");
+    return -1;
+  }
+  if (this->broadcast == 0) {
+    this->broadcast = broadcast_open(num_frames);
+    if (this->broadcast == 0) {
+      fprintf(stderr, "ERROR - broadcast_open() failed\n");
+      return -1;
+    }
+    return 0;
+  }
+  return broadcast_set_num_frames(this->broadcast, num_frames);
+}
+
+
+int rf103_add_consumer(rf103_t *this, enum RF103OverflowPolicy policy,
+                       rf103_read_async_cb_t callback, void *callback_context)
+{
+  if (this->status == STATUS_STREAMING) {
+    fprintf(stderr, "ERROR - rf103_add_consumer() failed: streaming in progress\n");
+    return -1;
+  }
+  if (this->adc && !this->async_streaming) {
+    fprintf(stderr, "ERROR - rf103_add_consumer() failed: synchronous streaming\n");
+    return -1;
+  }
+  if (this->broadcast == 0 &&
+      rf103_set_broadcast_frames(this, DEFAULT_BROADCAST_FRAMES) < 0) {
+    return -1;
+  }
+  return broadcast_add_consumer(this->broadcast, policy, callback,
+                                callback_context);
+}
+
+
+int rf103_remove_consumer(rf103_t *this, int consumer)
+{
+  if (this->status == STATUS_STREAMING) {
+    fprintf(stderr, "ERROR - rf103_remove_consumer() failed: streaming in progress\n");
+    return -1;
+  }
+  if (this->broadcast == 0) {
+    fprintf(stderr, "ERROR - invalid consumer: %d\n", consumer);
+    return -1;
+  }
+  return broadcast_remove_consumer(this->broadcast, consumer);
+}
+
+
+int rf103_get_consumer_stats(rf103_t *this, int consumer,
+                             struct rf103_consumer_stats *stats)
+{
+  if (this->broadcast == 0) {
+    fprintf(stderr, "ERROR - invalid consumer: %d\n", consumer);
+    return -1;
+  }
+  return broadcast_get_consumer_stats(this->broadcast, consumer, stats);
+}
+
+
+static int start_streaming(rf103_t *this)
+{
+  if (this->history &&
+      (this->adc == 0 || !this->async_streaming ||
+       adc_get_frame_size(this->adc) > ring_buffer_get_size(this->history))) {
+    fprintf(stderr, "ERROR - history requires async streaming and must hold at least one frame\n");
+    return -1;
+  }
+
+  if (this->stream_format == STREAM_FORMAT_BASEBAND_CF32) {
+    if (!is_vhf_mode_on(this)) {
+      fprintf(stderr, "ERROR - baseband stream format requires VHF mode\n");
+      return -1;
+    }
+    if (this->adc == 0 || !this->async_streaming) {
+      fprintf(stderr, "ERROR - baseband stream format requires async streaming\n");
+      return -1;
+    }
+    double frequency = baseband_frequency(this);
+    if (frequency == 0) {
+      fprintf(stderr, "ERROR - baseband stream format requires a tuned frequency\n");
+      return -1;
+    }
+    this->ddc = ddc_open(this->sample_rate, frequency, this->decimation);
+    if (this->ddc == 0) {
+      fprintf(stderr, "ERROR - ddc_open() failed\n");
+      return -1;
+    }
+    uint32_t nsamples = adc_get_frame_size(this->adc) / sizeof(int16_t);
+    uint32_t batch_frames = this->batch_frames > 0 ? this->batch_frames : 1;
+    this->baseband_frame_size = 2 * ddc_max_output(this->ddc, nsamples);
+    this->baseband_samples = (float *) memory_budget_alloc(MEMORY_DSP,
+                                                           batch_frames * this->baseband_frame_size * sizeof(float),
+                                                           "baseband frames");
+    if (this->baseband_samples == 0) {
+      goto FAIL0;
+    }
+    atomic_store(&this->baseband_retune, 0);
+  }
+
+  if (this->signals_callback) {
+    if (this->adc == 0 || !this->async_streaming) {
+      fprintf(stderr, "ERROR - signal detection requires async streaming\n");
+      goto FAIL0;
+    }
+    if (open_signal_detector(this) < 0) {
+      goto FAIL0;
+    }
+  }
+
+  if (this->broadcast && broadcast_get_num_consumers(this->broadcast) > 0) {
+    if (this->adc == 0 || !this->async_streaming) {
+      fprintf(stderr, "ERROR - consumers require async streaming (add them before rf103_set_async_params())\n");
+      goto FAIL1;
+    }
+    uint32_t max_frame_size = adc_get_frame_size(this->adc);
+    if (this->ddc) {
+      uint32_t nsamples = max_frame_size / sizeof(int16_t);
+      max_frame_size = 2 * ddc_max_output(this->ddc, nsamples) * sizeof(float);
+    }
+    if (broadcast_start(this->broadcast, max_frame_size) < 0) {
+      fprintf(stderr, "ERROR - broadcast_start() failed\n");
+      goto FAIL1;
+    }
+    this->broadcasting = 1;
+  }
+
   int ret = clock_source_set_clock(this->clock_source, ADC_CLOCK, this->sample_rate);
   if (ret < 0) {
     fprintf(stderr, "ERROR - clock_source_set_clock() failed\n");
-    return -1;
+    goto FAIL2;
   }
   ret = clock_source_start_clock(this->clock_source, ADC_CLOCK);
   if (ret < 0) {
     fprintf(stderr, "ERROR - clock_source_start_clock() failed\n");
-    return -1;
+    goto FAIL2;
   }
   if (this->rf_mode == VHF_MODE && this->tuner) {
     ret = clock_source_set_clock(this->clock_source, TUNER_CLOCK,
                                  tuner_get_xtal_frequency(this->tuner));
     if (ret < 0) {
       fprintf(stderr, "ERROR - clock_source_set_clock() failed\n");
-      return -1;
+      goto FAIL3;
     }
     ret = clock_source_start_clock(this->clock_source, TUNER_CLOCK);
     if (ret < 0) {
       fprintf(stderr, "ERROR - clock_source_start_clock() failed\n");
-      return -1;
+      goto FAIL3;
     }
     ret = tuner_start(this->tuner);
     if (ret < 0) {
       fprintf(stderr, "ERROR - tuner_start() failed\n");
-      return -1;
+      goto FAIL3;
     }
     // switch to VHF input
     ret = usb_device_gpio_set(this->usb_device, 0,
                                GPIO_SEL0 | GPIO_SEL1);
     if (ret < 0) {
       fprintf(stderr, "ERROR - input selection failed\n");
-      return -1;
+      goto FAIL3;
     }
   }
+  atomic_store_explicit(&this->stream_position, 0, memory_order_relaxed);
+  if (this->command_queue) {
+    command_queue_start(this->command_queue, this->sample_rate);
+  }
   adc_set_sample_rate(this->adc, (uint32_t) this->sample_rate);
   ret = adc_start(this->adc);
   if (ret < 0) {
     fprintf(stderr, "ERROR - adc_start() failed\n");
-    return -1;
+    goto FAIL4;
   }
   ret = usb_device_control(this->usb_device, STARTFX3, 0, 0, 0, 0);
   if (ret < 0) {
     fprintf(stderr, "ERROR - usb_device_control(STARTFX3) failed\n");
-    return -1;
+    goto FAIL5;
   }
 
   /* all good */
+  this->status = STATUS_STREAMING;
   return 0;
+
+  /* undo in reverse order, so the next start finds everything closed */
+FAIL5:
+  adc_stop(this->adc);
+FAIL4:
+  if (this->command_queue) {
+    command_queue_stop(this->command_queue);
+  }
+FAIL3:
+  clock_source_stop_clock(this->clock_source, ADC_CLOCK);
+FAIL2:
+  if (this->broadcasting) {
+    broadcast_stop(this->broadcast);
+    this->broadcasting = 0;
+  }
+FAIL1:
+  close_signal_detector(this);
+FAIL0:
+  if (this->ddc) {
+    ddc_close(this->ddc);
+    this->ddc = 0;
+    memory_budget_free(this->baseband_samples);
+    this->baseband_samples = 0;
+  }
+  return -1;
+}
+
+
+int rf103_start_streaming(rf103_t *this)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_START_STREAMING,
+                       start, control_transfers,
+                       start_streaming(this));
 }
 
 int rf103_handle_events(rf103_t *this)
 {
-  return usb_device_handle_events(this->usb_device);
+  int ret = usb_device_handle_events(this->usb_device);
+  /* a partial batch does not wait forever for more frames */
+  if (this->adc && this->batch_callback) {
+    adc_flush_stale_batch(this->adc);
+  }
+  return ret;
 }
 
-int rf103_stop_streaming(rf103_t *this)
+static int stop_streaming(rf103_t *this)
 {
   int ret = usb_device_control(this->usb_device, STOPFX3, 0, 0, 0, 0);
   if (ret < 0) {
@@ -391,11 +948,35 @@ int rf103_stop_streaming(rf103_t *this)
     fprintf(stderr, "ERROR - clock_source_stop_clock() failed\n");
     return -1;
   }
+  if (this->ddc) {
+    ddc_close(this->ddc);
+    this->ddc = 0;
+    memory_budget_free(this->baseband_samples);
+    this->baseband_samples = 0;
+  }
+  close_signal_detector(this);
+  if (this->command_queue) {
+    command_queue_stop(this->command_queue);
+  }
+  if (this->broadcasting) {
+    broadcast_stop(this->broadcast);
+    this->broadcasting = 0;
+  }
+  this->status = STATUS_READY;
 
   return 0;
 }
 
 
+int rf103_stop_streaming(rf103_t *this)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_STOP_STREAMING, start, control_transfers,
+                       stop_streaming(this));
+}
+
+
 int rf103_reset_status(rf103_t *this)
 {
   int ret = adc_reset_status(this->adc);
@@ -409,28 +990,317 @@ int rf103_reset_status(rf103_t *this)
 
 int rf103_read_sync(rf103_t *this, uint8_t *data, int length, int *transferred)
 {
+  if (this->stream_format != STREAM_FORMAT_RAW) {
+    fprintf(stderr, "ERROR - rf103_read_sync() failed: only raw stream format is supported\n");
+    return -1;
+  }
   return adc_read_sync(this->adc, data, length, transferred);
 }
 
 
+/* signal detection */
+/* spectra averaged for each update */
+static const uint32_t DETECTOR_AVERAGES = 8;
+
+int rf103_set_signal_detector(rf103_t *this, enum RF103DetectorMethod method,
+                              uint32_t fft_size, double update_interval,
+                              double threshold, rf103_signals_cb_t callback,
+                              void *callback_context)
+{
+  if (this->status == STATUS_STREAMING) {
+    fprintf(stderr, "ERROR - rf103_set_signal_detector() failed: streaming in progress\n");
+    return -1;
+  }
+  if (callback) {
+    if (method != DETECTOR_CA_CFAR && method != DETECTOR_OS_CFAR) {
+      fprintf(stderr, "ERROR - rf103_set_signal_detector() failed: invalid method %d\n", method);
+      return -1;
+    }
+    if (fft_size < 2 || (fft_size & (fft_size - 1)) != 0) {
+      fprintf(stderr, "ERROR - rf103_set_signal_detector() failed: invalid FFT size %u\n", fft_size);
+      return -1;
+    }
+    if (update_interval <= 0) {
+      fprintf(stderr, "ERROR - rf103_set_signal_detector() failed: invalid update interval %lg\n", update_interval);
+      return -1;
+    }
+  }
+  this->detector_method = method;
+  this->detector_fft_size = fft_size;
+  this->detector_update_interval = update_interval;
+  this->detector_threshold = threshold;
+  this->signals_callback = callback;
+  this->signals_callback_context = callback_context;
+  return 0;
+}
+
+
+int rf103_get_stats(rf103_t *this, struct rf103_stats *stats)
+{
+  struct adc_stats adc_stats = { 0 };
+  if (this->adc) {
+    adc_get_stats(this->adc, &adc_stats);
+  }
+  stats->transfers = adc_stats.transfers;
+  stats->bytes = adc_stats.bytes;
+  stats->transfer_errors = adc_stats.transfer_errors;
+  stats->callback_time_ns = adc_stats.callback_time_ns;
+  stats->callback_time_max_ns = adc_stats.callback_time_max_ns;
+  stats->callbacks = adc_stats.callbacks;
+  stats->active_transfers = adc_stats.active_transfers;
+  stats->num_transfers = adc_stats.num_transfers;
+  usb_device_get_control_stats(this->usb_device, &stats->control_transfers,
+                               &stats->control_errors);
+  return 0;
+}
+
+
+int rf103_get_operation_stats(rf103_t *this, enum RF103Operation operation,
+                              struct rf103_operation_stats *stats)
+{
+  if (operation < 0 || operation >= OPERATIONS) {
+    fprintf(stderr, "ERROR - invalid operation: %d\n", operation);
+    return -1;
+  }
+  if (operation <= OPERATION_FX3_COMMAND) {
+    return usb_device_get_operation_stats(this->usb_device, operation, stats);
+  }
+  operation_stats_get(&this->operations[operation], stats);
+  return 0;
+}
+
+
+void rf103_reset_operation_stats(rf103_t *this)
+{
+  usb_device_reset_operation_stats(this->usb_device);
+  for (int i = 0; i < OPERATIONS; ++i) {
+    operation_stats_reset(&this->operations[i]);
+  }
+  return;
+}
+
+
+const char *rf103_operation_name(enum RF103Operation operation)
+{
+  return operation_stats_name(operation);
+}
+
+
+int rf103_flight_recorder_dump(const char *filename)
+{
+  int ret = flight_recorder_dump(filename);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - flight_recorder_dump(%s) failed\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+
+int rf103_set_memory_budget(uint64_t budget)
+{
+  return memory_budget_set(budget);
+}
+
+
+void rf103_get_memory_report(struct rf103_memory_report *report)
+{
+  memory_budget_get_report(report);
+  return;
+}
+
+
+const char *rf103_memory_component_name(enum RF103MemoryComponent component)
+{
+  return memory_budget_component_name(component);
+}
+
+
+int rf103_flight_recorder_set_dump_file(const char *filename)
+{
+  return flight_recorder_set_dump_file(filename);
+}
+
+
+int rf103_flight_recorder_dump_on_signal(int signum)
+{
+  return flight_recorder_dump_on_signal(signum);
+}
+
+
+/* frequency correction functions */
+/* how far (in ppm) from the expected frequency to look for the carrier */
+static const double MAX_FREQUENCY_CORRECTION_PPM = 200;
+
+static int set_frequency_correction(rf103_t *this, double ppm)
+{
+  /* the clock source wants the ratio nominal/actual crystal frequency */
+  double frequency_correction = 1.0 / (1.0 + ppm * 1e-6);
+  int ret = clock_source_set_frequency_correction(this->clock_source,
+                                                  frequency_correction);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - clock_source_set_frequency_correction() failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+int rf103_set_frequency_correction(rf103_t *this, double ppm)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_SET_FREQUENCY_CORRECTION,
+                       start, control_transfers,
+                       set_frequency_correction(this, ppm));
+}
+
+double rf103_get_frequency_correction(rf103_t *this)
+{
+  double frequency_correction = clock_source_get_frequency_correction(this->clock_source);
+  return (1.0 / frequency_correction - 1.0) * 1e6;
+}
+
+int rf103_estimate_frequency_correction(const int16_t *samples,
+                                        uint32_t nsamples, double sample_rate,
+                                        double carrier_frequency, double *ppm)
+{
+  double search_span = 2 * carrier_frequency * MAX_FREQUENCY_CORRECTION_PPM * 1e-6;
+  double measured_frequency;
+  int ret = calibration_estimate_carrier_frequency(samples, nsamples,
+                                                   sample_rate,
+                                                   carrier_frequency,
+                                                   search_span,
+                                                   &measured_frequency);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - calibration_estimate_carrier_frequency() failed\n");
+    return -1;
+  }
+
+  /* in HF mode the only reference is the ADC clock: if the crystal runs fast
+     by e, the carrier shows up at carrier_frequency / (1 + e) */
+  *ppm = (carrier_frequency / measured_frequency - 1.0) * 1e6;
+  return 0;
+}
+
+int rf103_calibrate_frequency_correction(rf103_t *this, const int16_t *samples,
+                                         uint32_t nsamples,
+                                         double carrier_frequency)
+{
+  if (this->rf_mode != HF_MODE) {
+    fprintf(stderr, "ERROR - frequency calibration requires HF mode\n");
+    return -1;
+  }
+  double residual_ppm;
+  int ret = rf103_estimate_frequency_correction(samples, nsamples,
+                                                this->sample_rate,
+                                                carrier_frequency,
+                                                &residual_ppm);
+  if (ret < 0) {
+    return -1;
+  }
+  double ppm = rf103_get_frequency_correction(this);
+  ppm = ((1.0 + ppm * 1e-6) * (1.0 + residual_ppm * 1e-6) - 1.0) * 1e6;
+  return rf103_set_frequency_correction(this, ppm);
+}
+
+
 /* VHF/UHF tuner functions */
+static int set_vhf_frequency(rf103_t *this, double frequency)
+{
+  if (!is_vhf_mode_on(this)) return -1;
+  int ret = tuner_set_frequency(this->tuner, frequency);
+  if (ret < 0) return ret;
+  return update_baseband_frequency(this);
+}
+
+
 int rf103_set_vhf_frequency(rf103_t *this, double frequency)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_SET_VHF_FREQUENCY,
+                       start, control_transfers,
+                       set_vhf_frequency(this, frequency));
+}
+
+static int set_vhf_harmonic_frequency(rf103_t *this, double frequency,
+                                      int harmonic)
 {
   if (!is_vhf_mode_on(this)) return -1;
-  return tuner_set_frequency(this->tuner, frequency);
+  int ret = tuner_set_harmonic_frequency(this->tuner, frequency, harmonic);
+  if (ret < 0) return ret;
+  return update_baseband_frequency(this);
 }
 
+
 int rf103_set_vhf_harmonic_frequency(rf103_t *this, double frequency,
                                      int harmonic)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_SET_VHF_FREQUENCY,
+                       start, control_transfers,
+                       set_vhf_harmonic_frequency(this, frequency, harmonic));
+}
+
+static int set_vhf_if_frequency(rf103_t *this, uint32_t if_frequency)
 {
   if (!is_vhf_mode_on(this)) return -1;
-  return tuner_set_harmonic_frequency(this->tuner, frequency, harmonic);
+  return tuner_set_if_frequency(this->tuner, if_frequency);
 }
 
+
 int rf103_set_vhf_if_frequency(rf103_t *this, uint32_t if_frequency)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_SET_VHF_IF_FREQUENCY,
+                       start, control_transfers,
+                       set_vhf_if_frequency(this, if_frequency));
+}
+
+static int set_vhf_frequency_auto(rf103_t *this, double frequency)
 {
   if (!is_vhf_mode_on(this)) return -1;
-  return tuner_set_if_frequency(this->tuner, if_frequency);
+  struct tuner_plan plan;
+  int ret = tuner_plan_frequency(this->tuner, frequency, &plan);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - tuner_plan_frequency() failed\n");
+    return -1;
+  }
+  ret = tuner_apply_plan(this->tuner, &plan);
+  if (ret < 0) return ret;
+  return update_baseband_frequency(this);
+}
+
+
+int rf103_set_vhf_frequency_auto(rf103_t *this, double frequency)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_SET_VHF_FREQUENCY,
+                       start, control_transfers,
+                       set_vhf_frequency_auto(this, frequency));
+}
+
+int rf103_get_vhf_tuning(rf103_t *this, struct rf103_vhf_tuning *tuning)
+{
+  if (!is_vhf_mode_on(this)) return -1;
+  struct tuner_plan plan;
+  pthread_mutex_lock(&this->control_mutex);
+  int ret = tuner_get_tuning(this->tuner, &plan);
+  pthread_mutex_unlock(&this->control_mutex);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - tuner_get_tuning() failed\n");
+    return -1;
+  }
+  tuning->frequency = plan.frequency;
+  tuning->harmonic = plan.harmonic;
+  tuning->if_frequency = plan.if_frequency;
+  tuning->lo_frequency = plan.lo_frequency;
+  tuning->frequency_error = plan.frequency_error;
+  return 0;
 }
 
 int rf103_get_vhf_lna_gains(rf103_t *this, const int *gains[])
@@ -439,61 +1309,121 @@ int rf103_get_vhf_lna_gains(rf103_t *this, const int *gains[])
   return tuner_get_lna_gains(this->tuner, gains);
 }
 
-int rf103_set_vhf_lna_gain(rf103_t *this, int gain)
+static int set_vhf_lna_gain(rf103_t *this, int gain)
 {
   if (!is_vhf_mode_on(this)) return -1;
   return tuner_set_lna_gain(this->tuner, gain);
 }
 
-int rf103_set_vhf_lna_agc(rf103_t *this, int agc)
+
+int rf103_set_vhf_lna_gain(rf103_t *this, int gain)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_SET_VHF_LNA_GAIN,
+                       start, control_transfers,
+                       set_vhf_lna_gain(this, gain));
+}
+
+static int set_vhf_lna_agc(rf103_t *this, int agc)
 {
   if (!is_vhf_mode_on(this)) return -1;
   return tuner_set_lna_agc(this->tuner, agc);
 }
 
+
+int rf103_set_vhf_lna_agc(rf103_t *this, int agc)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_SET_VHF_LNA_AGC,
+                       start, control_transfers,
+                       set_vhf_lna_agc(this, agc));
+}
+
 int rf103_get_vhf_mixer_gains(rf103_t *this, const int *gains[])
 {
   if (!is_vhf_mode_on(this)) return -1;
   return tuner_get_mixer_gains(this->tuner, gains);
 }
 
-int rf103_set_vhf_mixer_gain(rf103_t *this, int gain)
+static int set_vhf_mixer_gain(rf103_t *this, int gain)
 {
   if (!is_vhf_mode_on(this)) return -1;
   return tuner_set_mixer_gain(this->tuner, gain);
 }
 
-int rf103_set_vhf_mixer_agc(rf103_t *this, int agc)
+
+int rf103_set_vhf_mixer_gain(rf103_t *this, int gain)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_SET_VHF_MIXER_GAIN,
+                       start, control_transfers,
+                       set_vhf_mixer_gain(this, gain));
+}
+
+static int set_vhf_mixer_agc(rf103_t *this, int agc)
 {
   if (!is_vhf_mode_on(this)) return -1;
   return tuner_set_mixer_agc(this->tuner, agc);
 }
 
+
+int rf103_set_vhf_mixer_agc(rf103_t *this, int agc)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_SET_VHF_MIXER_AGC,
+                       start, control_transfers,
+                       set_vhf_mixer_agc(this, agc));
+}
+
 int rf103_get_vhf_vga_gains(rf103_t *this, const int *gains[])
 {
   if (!is_vhf_mode_on(this)) return -1;
   return tuner_get_vga_gains(this->tuner, gains);
 }
 
-int rf103_set_vhf_vga_gain(rf103_t *this, int gain)
+static int set_vhf_vga_gain(rf103_t *this, int gain)
 {
   if (!is_vhf_mode_on(this)) return -1;
   return tuner_set_vga_gain(this->tuner, gain);
 }
 
+
+int rf103_set_vhf_vga_gain(rf103_t *this, int gain)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_SET_VHF_VGA_GAIN,
+                       start, control_transfers,
+                       set_vhf_vga_gain(this, gain));
+}
+
 int rf103_get_vhf_if_bandwidths(rf103_t *this, uint32_t *if_bandwidths[])
 {
   if (!is_vhf_mode_on(this)) return -1;
   return tuner_get_if_bandwidths(this->tuner, if_bandwidths);
 }
 
-int rf103_set_vhf_if_bandwidth(rf103_t *this, uint32_t bandwidth)
+static int set_vhf_if_bandwidth(rf103_t *this, uint32_t bandwidth)
 {
   if (!is_vhf_mode_on(this)) return -1;
   return tuner_set_if_bandwidth(this->tuner, bandwidth);
 }
 
 
+int rf103_set_vhf_if_bandwidth(rf103_t *this, uint32_t bandwidth)
+{
+  uint64_t control_transfers;
+  uint64_t start = operation_begin(this, &control_transfers);
+  return operation_end(this, OPERATION_SET_VHF_IF_BANDWIDTH,
+                       start, control_transfers,
+                       set_vhf_if_bandwidth(this, bandwidth));
+}
+
+
 /* auxiliary function */
 static int is_vhf_mode_on(rf103_t *this)
 {
@@ -503,3 +1433,275 @@ static int is_vhf_mode_on(rf103_t *this)
   }
   return 1;
 }
+
+
+/* baseband conversion */
+static void rf103_read_async_callback(uint32_t data_size, uint8_t *data,
+                                      void *context)
+{
+  rf103_t *this = (rf103_t *) context;
+  data = convert_frame(this, &data_size, data, this->baseband_samples,
+                       operation_stats_now());
+  deliver_frame(this, data_size, data);
+  return;
+}
+
+
+static void rf103_read_batch_callback(uint32_t nframes,
+                                      struct rf103_frame *frames,
+                                      void *context)
+{
+  rf103_t *this = (rf103_t *) context;
+  for (uint32_t i = 0; i < nframes; ++i) {
+    float *baseband_samples = this->baseband_samples +
+                              i * this->baseband_frame_size;
+    frames[i].data = convert_frame(this, &frames[i].size, frames[i].data,
+                                   baseband_samples, frames[i].timestamp_ns);
+    deliver_frame(this, frames[i].size, frames[i].data);
+  }
+  this->batch_callback(nframes, frames, this->batch_callback_context);
+  return;
+}
+
+
+/* returns the frame in the stream format (and its size) */
+static uint8_t *convert_frame(rf103_t *this, uint32_t *data_size,
+                              uint8_t *data, float *baseband_samples,
+                              uint64_t timestamp_ns)
+{
+  /* the tags for this frame go out before it */
+  uint64_t position = atomic_load_explicit(&this->stream_position,
+                                           memory_order_relaxed) +
+                      *data_size / sizeof(int16_t);
+  atomic_store_explicit(&this->stream_position, position,
+                        memory_order_relaxed);
+  if (this->command_queue) {
+    command_queue_observe(this->command_queue, position, timestamp_ns);
+  }
+  if (this->history) {
+    ring_buffer_write(this->history, data, *data_size);
+  }
+  if (this->ddc == 0) {
+    if (this->spectrum) {
+      spectrum_process(this->spectrum, data, *data_size / sizeof(int16_t));
+    }
+    return data;
+  }
+
+  if (atomic_exchange(&this->baseband_retune, 0)) {
+    ddc_set_frequency(this->ddc, this->next_baseband_frequency);
+    /* the signals tracked so far moved */
+    if (this->cfar) {
+      cfar_reset(this->cfar);
+      this->detector_center_frequency = this->next_center_frequency;
+    }
+  }
+  uint32_t noutput = ddc_process(this->ddc, (const int16_t *) data,
+                                 *data_size / sizeof(int16_t),
+                                 baseband_samples);
+  if (this->spectrum) {
+    spectrum_process(this->spectrum, baseband_samples, noutput);
+  }
+  *data_size = noutput * 2 * sizeof(float);
+  return (uint8_t *) baseband_samples;
+}
+
+
+static void deliver_frame(rf103_t *this, uint32_t data_size, uint8_t *data)
+{
+  if (this->callback) {
+    this->callback(data_size, data, this->callback_context);
+  }
+  if (this->broadcasting) {
+    broadcast_write(this->broadcast, data, data_size);
+  }
+  return;
+}
+
+
+/* timed commands (from the command queue thread) */
+static int execute_command(const struct command *command, void *context)
+{
+  rf103_t *this = (rf103_t *) context;
+  int ret;
+  pthread_mutex_lock(&this->control_mutex);
+  switch (command->type) {
+    case COMMAND_HF_ATTENUATION:
+      ret = rf103_hf_attenuation(this, command->value);
+      break;
+    case COMMAND_VHF_FREQUENCY:
+      ret = rf103_set_vhf_frequency(this, command->value);
+      break;
+    case COMMAND_VHF_LNA_GAIN:
+      ret = rf103_set_vhf_lna_gain(this, (int) command->value);
+      break;
+    case COMMAND_VHF_MIXER_GAIN:
+      ret = rf103_set_vhf_mixer_gain(this, (int) command->value);
+      break;
+    case COMMAND_VHF_VGA_GAIN:
+      ret = rf103_set_vhf_vga_gain(this, (int) command->value);
+      break;
+    case COMMAND_LED_ON:
+      ret = rf103_led_on(this, (uint8_t) command->value);
+      break;
+    case COMMAND_LED_OFF:
+      ret = rf103_led_off(this, (uint8_t) command->value);
+      break;
+    case COMMAND_ADC_DITHER:
+      ret = rf103_adc_dither(this, command->value != 0);
+      break;
+    case COMMAND_ADC_RANDOM:
+      ret = rf103_adc_random(this, command->value != 0);
+      break;
+    default:
+      fprintf(stderr, "ERROR - invalid command type: %d\n", command->type);
+      ret = -1;
+      break;
+  }
+  pthread_mutex_unlock(&this->control_mutex);
+  return ret;
+}
+
+
+/* the R820T2 LO is above the RF frequency (LO * harmonic = RF + IF), so the
+ * spectrum at the IF is inverted: the tuned frequency is at
+ * IF + frequency_error and is brought to 0Hz by mixing with the image at
+ * -(IF + frequency_error); aliases above the ADC Nyquist frequency are taken
+ * care of by the periodicity of the NCO */
+static double baseband_frequency(rf103_t *this)
+{
+  struct tuner_plan plan;
+  if (tuner_get_tuning(this->tuner, &plan) < 0) {
+    return 0;
+  }
+  return -(plan.if_frequency + plan.frequency_error);
+}
+
+
+/* RF frequency at 0Hz in baseband */
+static double tuned_frequency(rf103_t *this)
+{
+  struct tuner_plan plan;
+  if (tuner_get_tuning(this->tuner, &plan) < 0) {
+    return 0;
+  }
+  return plan.frequency;
+}
+
+
+/* a retune while streaming is picked up by the next async callback */
+static int update_baseband_frequency(rf103_t *this)
+{
+  if (this->ddc == 0) {
+    return 0;
+  }
+  this->next_baseband_frequency = baseband_frequency(this);
+  this->next_center_frequency = tuned_frequency(this);
+  atomic_store(&this->baseband_retune, 1);
+  return 0;
+}
+
+
+/* signal detection */
+static int open_signal_detector(rf103_t *this)
+{
+  enum SpectrumInput input = SPECTRUM_INPUT_REAL_S16;
+  this->detector_sample_rate = this->sample_rate;
+  this->detector_center_frequency = 0;
+  if (this->ddc) {
+    input = SPECTRUM_INPUT_COMPLEX_F32;
+    this->detector_sample_rate = this->sample_rate / this->decimation;
+    this->detector_center_frequency = tuned_frequency(this);
+  }
+
+  /* spread the averaged spectra over the update interval; the samples in
+     between are not transformed at all */
+  double frame_interval = this->detector_update_interval *
+                          this->detector_sample_rate / DETECTOR_AVERAGES;
+  if (frame_interval < this->detector_fft_size) {
+    frame_interval = this->detector_fft_size;
+  } else if (frame_interval > UINT32_MAX) {
+    frame_interval = UINT32_MAX;
+  }
+  this->spectrum = spectrum_open(this->detector_fft_size, input,
+                                 DETECTOR_AVERAGES, (uint32_t) frame_interval,
+                                 rf103_spectrum_callback, this);
+  if (this->spectrum == 0) {
+    fprintf(stderr, "ERROR - spectrum_open() failed\n");
+    return -1;
+  }
+  uint32_t nbins = spectrum_get_bins(this->spectrum);
+  enum CFARMethod method = this->detector_method == DETECTOR_OS_CFAR ?
+                           CFAR_ORDER_STATISTIC : CFAR_CELL_AVERAGING;
+  this->cfar = cfar_open(nbins, method, this->detector_threshold);
+  if (this->cfar == 0) {
+    fprintf(stderr, "ERROR - cfar_open() failed\n");
+    close_signal_detector(this);
+    return -1;
+  }
+  this->signals = (struct rf103_signal *) malloc((nbins + 1) * sizeof(struct rf103_signal));
+  return 0;
+}
+
+
+static void close_signal_detector(rf103_t *this)
+{
+  if (this->spectrum) {
+    spectrum_close(this->spectrum);
+    this->spectrum = 0;
+  }
+  if (this->cfar) {
+    cfar_close(this->cfar);
+    this->cfar = 0;
+  }
+  free(this->signals);
+  this->signals = 0;
+  return;
+}
+
+
+static void rf103_spectrum_callback(const float *power, uint64_t position,
+                                    void *context)
+{
+  rf103_t *this = (rf103_t *) context;
+  const struct cfar_signal *signals;
+  uint32_t nsignals = cfar_detect(this->cfar, power, position, &signals);
+
+  double bin_width = this->detector_sample_rate / this->detector_fft_size;
+  double first_bin = spectrum_get_first_bin(this->spectrum);
+  double frequency = this->detector_center_frequency + first_bin * bin_width;
+  for (uint32_t i = 0; i < nsignals; ++i) {
+    struct rf103_signal *signal = &this->signals[i];
+    signal->id = signals[i].id;
+    signal->frequency = frequency + signals[i].center * bin_width;
+    signal->bandwidth = signals[i].width * bin_width;
+    signal->snr = signals[i].snr;
+    signal->first_seen = signals[i].first_seen / this->detector_sample_rate;
+    signal->last_seen = signals[i].last_seen / this->detector_sample_rate;
+  }
+  this->signals_callback(nsignals, this->signals, this->signals_callback_context);
+  return;
+}
+
+
+/* the library calls are timed from the outside, and the control transfers
+   they issued are the difference in the calling thread's counter; the
+   control lock is held in between */
+static uint64_t operation_begin(rf103_t *this, uint64_t *control_transfers)
+{
+  pthread_mutex_lock(&this->control_mutex);
+  *control_transfers = usb_device_get_thread_control_transfers();
+  return operation_stats_now();
+}
+
+
+static int operation_end(rf103_t *this, enum RF103Operation operation,
+                         uint64_t start, uint64_t control_transfers, int ret)
+{
+  uint64_t elapsed = operation_stats_now() - start;
+  uint64_t end_control_transfers = usb_device_get_thread_control_transfers();
+  operation_stats_record(&this->operations[operation], elapsed, ret < 0,
+                         end_control_transfers - control_transfers);
+  pthread_mutex_unlock(&this->control_mutex);
+  return ret;
+}
@@ -0,0 +1,211 @@
+/*
+ * memory_budget.c - library memory accounting and budget
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* the totals are atomics, so the accounting works from any thread; a
+ * reservation adds to the total only if it still fits the budget (compare
+ * and swap), so concurrent ones can never overshoot it. The allocations
+ * done through memory_budget_alloc() and friends carry a small header just
+ * before the returned pointer with their size and component, so they can
+ * be released with just the pointer
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory_budget.h"
+
+
+struct memory_budget_header {
+  size_t size;
+  uint32_t component;
+  uint32_t offset;                 /* from the start of the allocation */
+};
+
+enum {
+  MEMORY_BUDGET_ALIGNMENT = 16     /* of memory_budget_alloc() */
+};
+
+static const char *component_names[MEMORY_COMPONENTS] = {
+  "transfers",
+  "rings",
+  "dsp",
+  "writers",
+  "recorder"
+};
+
+static atomic_uint_fast64_t budget = 0;
+static atomic_uint_fast64_t used = 0;
+static atomic_uint_fast64_t peak = 0;
+static atomic_uint_fast64_t denied = 0;
+static atomic_uint_fast64_t component_used[MEMORY_COMPONENTS];
+static atomic_uint_fast64_t component_peak[MEMORY_COMPONENTS];
+
+
+/* internal functions */
+static void update_peak(atomic_uint_fast64_t *peak, uint64_t value);
+
+
+int memory_budget_reserve(enum RF103MemoryComponent component, size_t size,
+                          const char *what)
+{
+  if (component < 0 || component >= MEMORY_COMPONENTS) {
+    fprintf(stderr, "ERROR - invalid memory component: %d\n", component);
+    return -1;
+  }
+  uint64_t total = atomic_load(&used);
+  uint64_t new_total;
+  do {
+    uint64_t limit = atomic_load(&budget);
+    new_total = total + size;
+    if (limit > 0 && new_total > limit) {
+      atomic_fetch_add(&denied, 1);
+      fprintf(stderr, "ERROR - memory budget exceeded: %s needs %zu bytes, %llu available\n",
+              what, size,
+              (unsigned long long) (limit > total ? limit - total : 0));
+      return -1;
+    }
+  } while (!atomic_compare_exchange_weak(&used, &total, new_total));
+  update_peak(&peak, new_total);
+  uint64_t component_total = atomic_fetch_add(&component_used[component], size) + size;
+  update_peak(&component_peak[component], component_total);
+  return 0;
+}
+
+
+void memory_budget_release(enum RF103MemoryComponent component, size_t size)
+{
+  atomic_fetch_sub(&component_used[component], size);
+  atomic_fetch_sub(&used, size);
+  return;
+}
+
+
+uint64_t memory_budget_available()
+{
+  uint64_t limit = atomic_load(&budget);
+  if (limit == 0)
+    return UINT64_MAX;
+  uint64_t total = atomic_load(&used);
+  return limit > total ? limit - total : 0;
+}
+
+
+void *memory_budget_alloc(enum RF103MemoryComponent component, size_t size,
+                          const char *what)
+{
+  return memory_budget_aligned_alloc(component, MEMORY_BUDGET_ALIGNMENT,
+                                     size, what);
+}
+
+
+void *memory_budget_calloc(enum RF103MemoryComponent component, size_t size,
+                           const char *what)
+{
+  void *ptr = memory_budget_alloc(component, size, what);
+  if (ptr)
+    memset(ptr, 0, size);
+  return ptr;
+}
+
+
+void *memory_budget_aligned_alloc(enum RF103MemoryComponent component,
+                                  size_t alignment, size_t size,
+                                  const char *what)
+{
+  if (alignment < sizeof(struct memory_budget_header))
+    alignment = sizeof(struct memory_budget_header);
+  if (memory_budget_reserve(component, size, what) < 0)
+    return 0;
+  size_t total = (size + 2 * alignment - 1) / alignment * alignment;
+  uint8_t *data = (uint8_t *) aligned_alloc(alignment, total);
+  if (data == 0) {
+    fprintf(stderr, "ERROR - aligned_alloc() failed for %s\n", what);
+    memory_budget_release(component, size);
+    return 0;
+  }
+  struct memory_budget_header *header = (struct memory_budget_header *) (data + alignment) - 1;
+  header->size = size;
+  header->component = component;
+  header->offset = (uint32_t) alignment;
+  return data + alignment;
+}
+
+
+void memory_budget_free(void *ptr)
+{
+  if (ptr == 0)
+    return;
+  struct memory_budget_header *header = (struct memory_budget_header *) ptr - 1;
+  memory_budget_release((enum RF103MemoryComponent) header->component,
+                        header->size);
+  free((uint8_t *) ptr - header->offset);
+  return;
+}
+
+
+int memory_budget_set(uint64_t new_budget)
+{
+  uint64_t total = atomic_load(&used);
+  if (new_budget > 0 && total > new_budget) {
+    fprintf(stderr, "ERROR - memory budget %llu is less than the %llu bytes already in use\n",
+            (unsigned long long) new_budget, (unsigned long long) total);
+    return -1;
+  }
+  atomic_store(&budget, new_budget);
+  return 0;
+}
+
+
+void memory_budget_get_report(struct rf103_memory_report *report)
+{
+  report->budget = atomic_load(&budget);
+  report->used = atomic_load(&used);
+  report->peak = atomic_load(&peak);
+  report->denied = atomic_load(&denied);
+  for (int i = 0; i < MEMORY_COMPONENTS; ++i) {
+    report->component_used[i] = atomic_load(&component_used[i]);
+    report->component_peak[i] = atomic_load(&component_peak[i]);
+  }
+  return;
+}
+
+
+const char *memory_budget_component_name(enum RF103MemoryComponent component)
+{
+  if (component < 0 || component >= MEMORY_COMPONENTS)
+    return "unknown";
+  return component_names[component];
+}
+
+
+/* internal functions */
+static void update_peak(atomic_uint_fast64_t *peak, uint64_t value)
+{
+  uint64_t current = atomic_load(peak);
+  while (value > current &&
+         !atomic_compare_exchange_weak(peak, &current, value))
+    ;
+  return;
+}
@@ -0,0 +1,75 @@
+/*
+ * memory_budget.h - library memory accounting and budget
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+
+#ifndef __MEMORY_BUDGET_H
+#define __MEMORY_BUDGET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rf103.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* every large buffer of the library is charged to one of the components in
+ * enum RF103MemoryComponent; with a budget set (rf103_set_memory_budget())
+ * a reservation that does not fit fails, so the subsystems that can do with
+ * less ask memory_budget_available() first and size themselves to it */
+
+/* returns -1 (with an error message naming 'what') if size does not fit */
+int memory_budget_reserve(enum RF103MemoryComponent component, size_t size,
+                          const char *what);
+
+void memory_budget_release(enum RF103MemoryComponent component, size_t size);
+
+/* bytes left in the budget (UINT64_MAX without a budget) */
+uint64_t memory_budget_available();
+
+/* malloc()/calloc()/aligned_alloc() charged to a component; the memory is
+ * released with memory_budget_free() */
+void *memory_budget_alloc(enum RF103MemoryComponent component, size_t size,
+                          const char *what);
+
+void *memory_budget_calloc(enum RF103MemoryComponent component, size_t size,
+                           const char *what);
+
+void *memory_budget_aligned_alloc(enum RF103MemoryComponent component,
+                                  size_t alignment, size_t size,
+                                  const char *what);
+
+void memory_budget_free(void *ptr);
+
+int memory_budget_set(uint64_t budget);
+
+void memory_budget_get_report(struct rf103_memory_report *report);
+
+const char *memory_budget_component_name(enum RF103MemoryComponent component);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MEMORY_BUDGET_H */
@@ -0,0 +1,326 @@
+/*
+ * metrics_server.c - Prometheus metrics endpoint for the streaming tools
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - Prometheus exposition formats: https://prometheus.io/docs/instrumenting/exposition_formats/
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "metrics_server.h"
+
+
+typedef struct metrics_server metrics_server_t;
+
+/* internal functions */
+static void *metrics_server_thread(void *arg);
+static void handle_connection(metrics_server_t *this, int fd);
+static int format_metrics(metrics_server_t *this, char *buffer, size_t size);
+
+
+typedef struct metrics_server {
+  rf103_t *rf103;
+  int listen_fd;
+  pthread_t thread;
+  atomic_int stop;
+} metrics_server_t;
+
+
+static const char DEFAULT_METRICS_HOST[] = "127.0.0.1";
+static const int METRICS_POLL_TIMEOUT = 200;    /* ms */
+
+
+metrics_server_t *metrics_server_open(const char *address, rf103_t *rf103)
+{
+  metrics_server_t *ret_val = 0;
+
+  char host[256];
+  const char *port;
+  const char *colon = strrchr(address, ':');
+  if (colon) {
+    size_t host_length = colon - address;
+    if (host_length >= sizeof(host)) {
+      fprintf(stderr, "ERROR - invalid metrics address: %s\n", address);
+      return ret_val;
+    }
+    memcpy(host, address, host_length);
+    host[host_length] = '\0';
+    port = colon + 1;
+  } else {
+    host[0] = '\0';
+    port = address;
+  }
+  if (host[0] == '\0') {
+    strcpy(host, DEFAULT_METRICS_HOST);
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  struct addrinfo *addrinfo;
+  int ret = getaddrinfo(host, port, &hints, &addrinfo);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR - getaddrinfo(%s) failed: %s\n", address,
+            gai_strerror(ret));
+    return ret_val;
+  }
+
+  int listen_fd = -1;
+  for (struct addrinfo *ai = addrinfo; ai; ai = ai->ai_next) {
+    listen_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (listen_fd < 0) {
+      continue;
+    }
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(listen_fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+        listen(listen_fd, 8) == 0) {
+      break;
+    }
+    close(listen_fd);
+    listen_fd = -1;
+  }
+  freeaddrinfo(addrinfo);
+  if (listen_fd < 0) {
+    fprintf(stderr, "ERROR - cannot listen on metrics address %s: %s\n",
+            address, strerror(errno));
+    return ret_val;
+  }
+
+  /* we are good here - create and initialize the metrics server */
+  metrics_server_t *this = (metrics_server_t *) malloc(sizeof(metrics_server_t));
+  this->rf103 = rf103;
+  this->listen_fd = listen_fd;
+  atomic_init(&this->stop, 0);
+  ret = pthread_create(&this->thread, 0, metrics_server_thread, this);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR - pthread_create() failed: %s\n", strerror(ret));
+    close(listen_fd);
+    free(this);
+    return ret_val;
+  }
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void metrics_server_close(metrics_server_t *this)
+{
+  atomic_store(&this->stop, 1);
+  pthread_join(this->thread, 0);
+  close(this->listen_fd);
+  free(this);
+  return;
+}
+
+
+/* internal functions */
+static void *metrics_server_thread(void *arg)
+{
+  metrics_server_t *this = (metrics_server_t *) arg;
+  struct pollfd pollfd = { this->listen_fd, POLLIN, 0 };
+  while (!atomic_load(&this->stop)) {
+    int ret = poll(&pollfd, 1, METRICS_POLL_TIMEOUT);
+    if (ret <= 0) {
+      continue;
+    }
+    int fd = accept(this->listen_fd, 0, 0);
+    if (fd < 0) {
+      continue;
+    }
+    handle_connection(this, fd);
+    close(fd);
+  }
+  return 0;
+}
+
+
+static void handle_connection(metrics_server_t *this, int fd)
+{
+  /* we only need the request line; don't wait forever for it */
+  struct pollfd pollfd = { fd, POLLIN, 0 };
+  if (poll(&pollfd, 1, METRICS_POLL_TIMEOUT) <= 0) {
+    return;
+  }
+  char request[1024];
+  ssize_t n = recv(fd, request, sizeof(request) - 1, 0);
+  if (n <= 0) {
+    return;
+  }
+  request[n] = '\0';
+
+  char body[16384];
+  char response[16384 + 256];
+  int length;
+  if (strncmp(request, "GET /metrics ", 13) == 0 ||
+      strncmp(request, "GET / ", 6) == 0) {
+    int body_length = format_metrics(this, body, sizeof(body));
+    length = snprintf(response, sizeof(response),
+                      "HTTP/1.0 200 OK\r\n"
+                      "Content-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: %d\r\n"
+                      "Connection: close\r\n"
+                      "\r\n"
+                      "%s", body_length, body);
+  } else {
+    length = snprintf(response, sizeof(response),
+                      "HTTP/1.0 404 Not Found\r\n"
+                      "Content-Length: 0\r\n"
+                      "Connection: close\r\n"
+                      "\r\n");
+  }
+  for (int sent = 0; sent < length; ) {
+    ssize_t ret = send(fd, response + sent, length - sent, MSG_NOSIGNAL);
+    if (ret <= 0) {
+      return;
+    }
+    sent += ret;
+  }
+  return;
+}
+
+
+static int format_metrics(metrics_server_t *this, char *buffer, size_t size)
+{
+  struct rf103_stats stats;
+  rf103_get_stats(this->rf103, &stats);
+
+  int n = snprintf(buffer, size,
+    "# HELP rf103_transfers_total Completed USB bulk transfers.\n"
+    "# TYPE rf103_transfers_total counter\n"
+    "rf103_transfers_total %llu\n"
+    "# HELP rf103_received_bytes_total Bytes received from the ADC.\n"
+    "# TYPE rf103_received_bytes_total counter\n"
+    "rf103_received_bytes_total %llu\n"
+    "# HELP rf103_transfer_errors_total Failed USB bulk transfers (dropped data).\n"
+    "# TYPE rf103_transfer_errors_total counter\n"
+    "rf103_transfer_errors_total %llu\n"
+    "# HELP rf103_callback_seconds_total Time spent in the streaming callbacks.\n"
+    "# TYPE rf103_callback_seconds_total counter\n"
+    "rf103_callback_seconds_total %.9f\n"
+    "# HELP rf103_callback_max_seconds Longest streaming callback.\n"
+    "# TYPE rf103_callback_max_seconds gauge\n"
+    "rf103_callback_max_seconds %.9f\n"
+    "# HELP rf103_callbacks_total Calls to the streaming callback.\n"
+    "# TYPE rf103_callbacks_total counter\n"
+    "rf103_callbacks_total %llu\n"
+    "# HELP rf103_control_transfers_total USB control transfers.\n"
+    "# TYPE rf103_control_transfers_total counter\n"
+    "rf103_control_transfers_total %llu\n"
+    "# HELP rf103_control_errors_total Failed USB control transfers.\n"
+    "# TYPE rf103_control_errors_total counter\n"
+    "rf103_control_errors_total %llu\n"
+    "# HELP rf103_active_transfers Bulk transfers queued to the USB stack.\n"
+    "# TYPE rf103_active_transfers gauge\n"
+    "rf103_active_transfers %u\n"
+    "# HELP rf103_transfer_pool_size Number of bulk transfers allocated.\n"
+    "# TYPE rf103_transfer_pool_size gauge\n"
+    "rf103_transfer_pool_size %u\n",
+    (unsigned long long) stats.transfers,
+    (unsigned long long) stats.bytes,
+    (unsigned long long) stats.transfer_errors,
+    stats.callback_time_ns * 1e-9,
+    stats.callback_time_max_ns * 1e-9,
+    (unsigned long long) stats.callbacks,
+    (unsigned long long) stats.control_transfers,
+    (unsigned long long) stats.control_errors,
+    stats.active_transfers,
+    stats.num_transfers);
+
+  struct rf103_memory_report memory;
+  rf103_get_memory_report(&memory);
+  if (n >= 0 && n < (int) size) {
+    n += snprintf(buffer + n, size - n,
+      "# HELP rf103_memory_budget_bytes Library memory budget (0 = none).\n"
+      "# TYPE rf103_memory_budget_bytes gauge\n"
+      "rf103_memory_budget_bytes %llu\n"
+      "# HELP rf103_memory_bytes Library memory owned by each component.\n"
+      "# TYPE rf103_memory_bytes gauge\n",
+      (unsigned long long) memory.budget);
+  }
+  for (int i = 0; i < MEMORY_COMPONENTS && n >= 0 && n < (int) size; ++i) {
+    n += snprintf(buffer + n, size - n,
+                  "rf103_memory_bytes{component=\"%s\"} %llu\n",
+                  rf103_memory_component_name((enum RF103MemoryComponent) i),
+                  (unsigned long long) memory.component_used[i]);
+  }
+
+  /* control path: one series per operation and metric */
+  static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    int seconds;                    /* the value is in ns */
+  } operation_metrics[] = {
+    { "rf103_operations_total", "counter",
+      "Control transfers (by kind) and library calls (by function).", 0 },
+    { "rf103_operation_errors_total", "counter", "Failed operations.", 0 },
+    { "rf103_operation_seconds_total", "counter",
+      "Time spent in operations.", 1 },
+    { "rf103_operation_max_seconds", "gauge", "Slowest operation.", 1 },
+    { "rf103_operation_control_transfers_total", "counter",
+      "USB control transfers issued by operations.", 0 }
+  };
+  enum {
+    NUM_OPERATION_METRICS = sizeof(operation_metrics) /
+                            sizeof(operation_metrics[0])
+  };
+  uint64_t values[OPERATIONS][NUM_OPERATION_METRICS];
+  for (int i = 0; i < OPERATIONS; ++i) {
+    struct rf103_operation_stats stats;
+    rf103_get_operation_stats(this->rf103, (enum RF103Operation) i, &stats);
+    values[i][0] = stats.count;
+    values[i][1] = stats.errors;
+    values[i][2] = stats.total_ns;
+    values[i][3] = stats.max_ns;
+    values[i][4] = stats.control_transfers;
+  }
+  for (int m = 0; m < NUM_OPERATION_METRICS && n >= 0 && n < (int) size; ++m) {
+    const char *name = operation_metrics[m].name;
+    n += snprintf(buffer + n, size - n, "# HELP %s %s\n# TYPE %s %s\n",
+                  name, operation_metrics[m].help, name,
+                  operation_metrics[m].type);
+    for (int i = 0; i < OPERATIONS && n >= 0 && n < (int) size; ++i) {
+      const char *operation = rf103_operation_name((enum RF103Operation) i);
+      if (operation_metrics[m].seconds) {
+        n += snprintf(buffer + n, size - n, "%s{operation=\"%s\"} %.9f\n",
+                      name, operation, values[i][m] * 1e-9);
+      } else {
+        n += snprintf(buffer + n, size - n, "%s{operation=\"%s\"} %llu\n",
+                      name, operation, (unsigned long long) values[i][m]);
+      }
+    }
+  }
+  return n < (int) size ? n : (int) size - 1;
+}
@@ -0,0 +1,48 @@
+/*
+ * metrics_server.h - Prometheus metrics endpoint for the streaming tools
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __METRICS_SERVER_H
+#define __METRICS_SERVER_H
+
+#include "rf103.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct metrics_server metrics_server_t;
+
+/* environment variable used by the tools to enable the endpoint */
+#define METRICS_ADDRESS_ENV "RF103_METRICS_ADDRESS"
+
+/* address is '[host:]port' (default host: 127.0.0.1); the server runs in its
+ * own thread and answers 'GET /metrics' with the library statistics in the
+ * Prometheus text exposition format */
+metrics_server_t *metrics_server_open(const char *address, rf103_t *rf103);
+
+void metrics_server_close(metrics_server_t *this);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __METRICS_SERVER_H */
@@ -0,0 +1,312 @@
+/*
+ * notch.c - adaptive notch functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* every NOTCH_BLOCK samples each notch correlates the input with its
+ * phasor, which gives the complex amplitude of the carrier over the block;
+ * a one pole average of it (the notch bandwidth) is what gets subtracted,
+ * and the phase drift between two blocks steers the phasor frequency onto
+ * the carrier (frequency locked loop), so a carrier found with a coarse
+ * spectrum is still removed completely and it is followed as it drifts.
+ * The notches run one after the other on the same float block, converted
+ * from and back to 16 bits only once; each notch makes a single pass over
+ * it that generates the phasor (a small table times a rotator per
+ * NOTCH_SEGMENT samples, kept in double precision), correlates and
+ * subtracts the average amplitude up to the previous block (the average
+ * spans many blocks anyway), with independent partial sums, so it
+ * vectorizes
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "notch.h"
+#include "memory_budget.h"
+
+
+typedef struct notch notch_t;
+struct notch_filter;
+
+/* internal functions */
+static void notch_filter_block(notch_t *this, struct notch_filter *filter,
+                               uint32_t nsamples);
+
+
+enum {
+  NOTCH_MAX = 256,
+  NOTCH_BLOCK = 16384,
+  NOTCH_SEGMENT = 64,
+  NOTCH_LANES = 8
+};
+
+static const double NOTCH_FLL_GAIN = 0.05;
+
+struct notch_filter {
+  double frequency;
+  double bandwidth;
+  double tracked_frequency;
+  double rotator_re;             /* phasor at the next sample */
+  double rotator_im;
+  double amplitude_re;           /* averaged */
+  double amplitude_im;
+  double last_re;                /* estimate from the previous block */
+  double last_im;
+  uint32_t last_samples;
+  uint64_t blocks;
+  uint64_t cpu_time_ns;
+  uint64_t samples;
+};
+
+typedef struct notch {
+  double sample_rate;
+  double pull_range;
+  int nfilters;
+  struct notch_filter filters[NOTCH_MAX];
+  float *x;
+} notch_t;
+
+
+notch_t *notch_open(double sample_rate)
+{
+  notch_t *ret_val = 0;
+
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - invalid notch sample rate: %f\n", sample_rate);
+    return ret_val;
+  }
+  float *x = (float *) memory_budget_aligned_alloc(MEMORY_DSP, 64, NOTCH_BLOCK * sizeof(float),
+                                                   "notch buffer");
+  if (x == 0) {
+    fprintf(stderr, "ERROR - aligned_alloc() failed\n");
+    return ret_val;
+  }
+
+  /* we are good here - create and initialize the notch */
+  notch_t *this = (notch_t *) malloc(sizeof(notch_t));
+  this->sample_rate = sample_rate;
+  /* the phase drift over a block must stay within +/- pi/2 */
+  this->pull_range = sample_rate / (2 * NOTCH_BLOCK);
+  this->nfilters = 0;
+  this->x = x;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void notch_close(notch_t *this)
+{
+  memory_budget_free(this->x);
+  free(this);
+  return;
+}
+
+
+int notch_add(notch_t *this, double frequency, double bandwidth)
+{
+  if (this->nfilters == NOTCH_MAX) {
+    fprintf(stderr, "ERROR - too many notches (max %d)\n", NOTCH_MAX);
+    return -1;
+  }
+  if (frequency <= 0 || frequency >= this->sample_rate / 2) {
+    fprintf(stderr, "ERROR - invalid notch frequency: %f\n", frequency);
+    return -1;
+  }
+  if (bandwidth <= 0) {
+    fprintf(stderr, "ERROR - invalid notch bandwidth: %f\n", bandwidth);
+    return -1;
+  }
+  struct notch_filter *filter = &this->filters[this->nfilters];
+  memset(filter, 0, sizeof(struct notch_filter));
+  filter->frequency = frequency;
+  filter->bandwidth = bandwidth;
+  filter->tracked_frequency = frequency;
+  filter->rotator_re = 1.0;
+  filter->rotator_im = 0.0;
+  return this->nfilters++;
+}
+
+
+int notch_get_stats(notch_t *this, int index, struct notch_stats *stats)
+{
+  if (index < 0 || index >= this->nfilters) {
+    fprintf(stderr, "ERROR - invalid notch: %d\n", index);
+    return -1;
+  }
+  const struct notch_filter *filter = &this->filters[index];
+  double amplitude = sqrt(filter->amplitude_re * filter->amplitude_re +
+                          filter->amplitude_im * filter->amplitude_im);
+  stats->frequency = filter->tracked_frequency;
+  stats->level = (float) (20 * log10(amplitude / 32768.0 + 1e-20));
+  stats->cpu_time_ns = filter->cpu_time_ns;
+  stats->samples = filter->samples;
+  return 0;
+}
+
+
+void notch_process(notch_t *this, int16_t *samples, uint32_t nsamples)
+{
+  if (this->nfilters == 0)
+    return;
+  while (nsamples > 0) {
+    uint32_t n = nsamples < NOTCH_BLOCK ? nsamples : NOTCH_BLOCK;
+    float *restrict x = this->x;
+    for (uint32_t k = 0; k < n; ++k)
+      x[k] = samples[k];
+
+    for (int i = 0; i < this->nfilters; ++i) {
+      struct notch_filter *filter = &this->filters[i];
+      struct timespec start;
+      struct timespec end;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+      notch_filter_block(this, filter, n);
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+      filter->cpu_time_ns += (end.tv_sec - start.tv_sec) * 1000000000LL +
+                             (end.tv_nsec - start.tv_nsec);
+      filter->samples += n;
+    }
+
+    /* round (half up) with a truncation of a positive value and clip as
+       integers, which vectorizes unlike lrintf() and float comparisons */
+    for (uint32_t k = 0; k < n; ++k) {
+      int32_t y = (int32_t) (x[k] + 32768.5f);
+      y = y < 0 ? 0 : y;
+      y = y > 65535 ? 65535 : y;
+      samples[k] = (int16_t) (y - 32768);
+    }
+    samples += n;
+    nsamples -= n;
+  }
+  return;
+}
+
+
+/* internal functions */
+static void notch_filter_block(notch_t *this, struct notch_filter *filter,
+                               uint32_t nsamples)
+{
+  double w = 2 * M_PI * filter->tracked_frequency / this->sample_rate;
+
+  /* phasor: exp(i*w*k) for k < NOTCH_SEGMENT times the rotator */
+  double step_re = cos(w);
+  double step_im = sin(w);
+  double table_re[NOTCH_SEGMENT + 1];
+  double table_im[NOTCH_SEGMENT + 1];
+  table_re[0] = 1.0;
+  table_im[0] = 0.0;
+  for (int k = 1; k <= NOTCH_SEGMENT; ++k) {
+    table_re[k] = table_re[k - 1] * step_re - table_im[k - 1] * step_im;
+    table_im[k] = table_re[k - 1] * step_im + table_im[k - 1] * step_re;
+  }
+  float t_re[NOTCH_SEGMENT];
+  float t_im[NOTCH_SEGMENT];
+  for (int k = 0; k < NOTCH_SEGMENT; ++k) {
+    t_re[k] = (float) table_re[k];
+    t_im[k] = (float) table_im[k];
+  }
+
+  /* one pass: correlate the input with the phasor (complex amplitude of the
+     carrier over this block: 2/n sum(x * conj(c))) and subtract the average
+     amplitude so far times the phasor */
+  float *x = this->x;
+  float a_re = (float) filter->amplitude_re;
+  float a_im = (float) filter->amplitude_im;
+  float acc_re[NOTCH_LANES] = { 0 };
+  float acc_im[NOTCH_LANES] = { 0 };
+  double rotator_re = filter->rotator_re;
+  double rotator_im = filter->rotator_im;
+  for (uint32_t start = 0; start < nsamples; start += NOTCH_SEGMENT) {
+    uint32_t n = nsamples - start < NOTCH_SEGMENT ? nsamples - start :
+                                                    NOTCH_SEGMENT;
+    float r_re = (float) rotator_re;
+    float r_im = (float) rotator_im;
+    float *segment = x + start;
+    if (n == NOTCH_SEGMENT) {
+      for (uint32_t k = 0; k < NOTCH_SEGMENT; k += NOTCH_LANES) {
+        for (int l = 0; l < NOTCH_LANES; ++l) {
+          float c_re = r_re * t_re[k + l] - r_im * t_im[k + l];
+          float c_im = r_re * t_im[k + l] + r_im * t_re[k + l];
+          float value = segment[k + l];
+          acc_re[l] += value * c_re;
+          acc_im[l] -= value * c_im;
+          segment[k + l] = value - (a_re * c_re - a_im * c_im);
+        }
+      }
+    } else {
+      for (uint32_t k = 0; k < n; ++k) {
+        float c_re = r_re * t_re[k] - r_im * t_im[k];
+        float c_im = r_re * t_im[k] + r_im * t_re[k];
+        float value = segment[k];
+        acc_re[0] += value * c_re;
+        acc_im[0] -= value * c_im;
+        segment[k] = value - (a_re * c_re - a_im * c_im);
+      }
+    }
+    double re = rotator_re * table_re[n] - rotator_im * table_im[n];
+    rotator_im = rotator_re * table_im[n] + rotator_im * table_re[n];
+    rotator_re = re;
+  }
+  /* keep the rotator on the unit circle */
+  double norm = 1.0 / sqrt(rotator_re * rotator_re + rotator_im * rotator_im);
+  filter->rotator_re = rotator_re * norm;
+  filter->rotator_im = rotator_im * norm;
+
+  double estimate_re = 0;
+  double estimate_im = 0;
+  for (int l = 0; l < NOTCH_LANES; ++l) {
+    estimate_re += acc_re[l];
+    estimate_im += acc_im[l];
+  }
+  estimate_re *= 2.0 / nsamples;
+  estimate_im *= 2.0 / nsamples;
+
+  /* frequency: the residual offset turns the estimate from block to block */
+  if (filter->blocks > 0) {
+    double drift = atan2(estimate_im * filter->last_re - estimate_re * filter->last_im,
+                         estimate_re * filter->last_re + estimate_im * filter->last_im);
+    double interval = (filter->last_samples + nsamples) / 2.0;
+    double offset = drift * this->sample_rate / (2 * M_PI * interval);
+    double frequency = filter->tracked_frequency + NOTCH_FLL_GAIN * offset;
+    if (frequency > filter->frequency + this->pull_range)
+      frequency = filter->frequency + this->pull_range;
+    if (frequency < filter->frequency - this->pull_range)
+      frequency = filter->frequency - this->pull_range;
+    filter->tracked_frequency = frequency;
+  }
+  filter->last_re = estimate_re;
+  filter->last_im = estimate_im;
+  filter->last_samples = nsamples;
+
+  /* amplitude: one pole average (a plain average for the first blocks, so
+     it settles quickly) */
+  double mu = 1.0 - exp(-2 * M_PI * filter->bandwidth * nsamples /
+                        this->sample_rate);
+  filter->blocks++;
+  if (mu < 1.0 / filter->blocks)
+    mu = 1.0 / filter->blocks;
+  filter->amplitude_re += mu * (estimate_re - filter->amplitude_re);
+  filter->amplitude_im += mu * (estimate_im - filter->amplitude_im);
+  return;
+}
@@ -0,0 +1,63 @@
+/*
+ * notch.h - adaptive notch functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+#ifndef __NOTCH_H
+#define __NOTCH_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct notch notch_t;
+
+struct notch_stats {
+  double frequency;          /* tracked */
+  float level;               /* of the carrier (dBFS) */
+  uint64_t cpu_time_ns;
+  uint64_t samples;
+};
+
+/* each notch removes a carrier from the real samples by subtracting a
+ * sinusoid that follows its amplitude and phase (with a time constant of
+ * about 1 / bandwidth, which is also the width of the notch) and its
+ * frequency (within sample_rate / 32768 of the given one) */
+
+notch_t *notch_open(double sample_rate);
+
+void notch_close(notch_t *this);
+
+/* returns the index of the notch */
+int notch_add(notch_t *this, double frequency, double bandwidth);
+
+int notch_get_stats(notch_t *this, int index, struct notch_stats *stats);
+
+/* in place */
+void notch_process(notch_t *this, int16_t *samples, uint32_t nsamples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NOTCH_H */
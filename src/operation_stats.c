@@ -0,0 +1,143 @@
+/*
+ * operation_stats.c - control path counters and latency histograms
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "operation_stats.h"
+
+
+static const char *operation_names[OPERATIONS] = {
+  "gpio",
+  "i2c_write",
+  "i2c_read",
+  "fx3_command",
+  "set_rf_mode",
+  "set_sample_rate",
+  "set_frequency_correction",
+  "set_vhf_frequency",
+  "set_vhf_if_frequency",
+  "set_vhf_if_bandwidth",
+  "set_vhf_lna_gain",
+  "set_vhf_lna_agc",
+  "set_vhf_mixer_gain",
+  "set_vhf_mixer_agc",
+  "set_vhf_vga_gain",
+  "led",
+  "hf_attenuation",
+  "adc_dither",
+  "adc_random",
+  "start_streaming",
+  "stop_streaming"
+};
+
+
+void operation_stats_init(struct operation_stats *this)
+{
+  atomic_init(&this->count, 0);
+  atomic_init(&this->errors, 0);
+  atomic_init(&this->total_ns, 0);
+  atomic_init(&this->max_ns, 0);
+  atomic_init(&this->control_transfers, 0);
+  for (int i = 0; i < RF103_LATENCY_BUCKETS; ++i) {
+    atomic_init(&this->histogram[i], 0);
+  }
+  return;
+}
+
+
+void operation_stats_reset(struct operation_stats *this)
+{
+  atomic_store_explicit(&this->count, 0, memory_order_relaxed);
+  atomic_store_explicit(&this->errors, 0, memory_order_relaxed);
+  atomic_store_explicit(&this->total_ns, 0, memory_order_relaxed);
+  atomic_store_explicit(&this->max_ns, 0, memory_order_relaxed);
+  atomic_store_explicit(&this->control_transfers, 0, memory_order_relaxed);
+  for (int i = 0; i < RF103_LATENCY_BUCKETS; ++i) {
+    atomic_store_explicit(&this->histogram[i], 0, memory_order_relaxed);
+  }
+  return;
+}
+
+
+void operation_stats_record(struct operation_stats *this, uint64_t elapsed_ns,
+                            int error, uint64_t control_transfers)
+{
+  atomic_fetch_add_explicit(&this->count, 1, memory_order_relaxed);
+  if (error) {
+    atomic_fetch_add_explicit(&this->errors, 1, memory_order_relaxed);
+  }
+  atomic_fetch_add_explicit(&this->total_ns, elapsed_ns, memory_order_relaxed);
+  atomic_fetch_add_explicit(&this->control_transfers, control_transfers,
+                            memory_order_relaxed);
+  unsigned long long max_ns = atomic_load_explicit(&this->max_ns,
+                                                   memory_order_relaxed);
+  while (elapsed_ns > max_ns &&
+         !atomic_compare_exchange_weak_explicit(&this->max_ns, &max_ns,
+                                                elapsed_ns,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+    ;
+
+  /* the bucket is the number of bits of the latency in us */
+  uint64_t us = elapsed_ns / 1000;
+  int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+  if (bucket >= RF103_LATENCY_BUCKETS) {
+    bucket = RF103_LATENCY_BUCKETS - 1;
+  }
+  atomic_fetch_add_explicit(&this->histogram[bucket], 1, memory_order_relaxed);
+  return;
+}
+
+
+void operation_stats_get(struct operation_stats *this,
+                         struct rf103_operation_stats *stats)
+{
+  stats->count = atomic_load_explicit(&this->count, memory_order_relaxed);
+  stats->errors = atomic_load_explicit(&this->errors, memory_order_relaxed);
+  stats->total_ns = atomic_load_explicit(&this->total_ns, memory_order_relaxed);
+  stats->max_ns = atomic_load_explicit(&this->max_ns, memory_order_relaxed);
+  stats->control_transfers = atomic_load_explicit(&this->control_transfers,
+                                                  memory_order_relaxed);
+  for (int i = 0; i < RF103_LATENCY_BUCKETS; ++i) {
+    stats->histogram[i] = atomic_load_explicit(&this->histogram[i],
+                                               memory_order_relaxed);
+  }
+  return;
+}
+
+
+const char *operation_stats_name(enum RF103Operation operation)
+{
+  if (operation < 0 || operation >= OPERATIONS) {
+    return "unknown";
+  }
+  return operation_names[operation];
+}
+
+
+uint64_t operation_stats_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
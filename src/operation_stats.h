@@ -0,0 +1,64 @@
+/*
+ * operation_stats.h - control path counters and latency histograms
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __OPERATION_STATS_H
+#define __OPERATION_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "rf103.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* statistics of one kind of operation (relaxed atomics) */
+struct operation_stats {
+  atomic_ullong count;
+  atomic_ullong errors;
+  atomic_ullong total_ns;
+  atomic_ullong max_ns;
+  atomic_ullong control_transfers;
+  atomic_ullong histogram[RF103_LATENCY_BUCKETS];
+};
+
+void operation_stats_init(struct operation_stats *this);
+
+void operation_stats_reset(struct operation_stats *this);
+
+void operation_stats_record(struct operation_stats *this, uint64_t elapsed_ns,
+                            int error, uint64_t control_transfers);
+
+void operation_stats_get(struct operation_stats *this,
+                         struct rf103_operation_stats *stats);
+
+const char *operation_stats_name(enum RF103Operation operation);
+
+/* CLOCK_MONOTONIC in ns */
+uint64_t operation_stats_now();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __OPERATION_STATS_H */
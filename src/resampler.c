@@ -0,0 +1,248 @@
+/*
+ * resampler.c - arbitrary ratio resampler functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* polyphase interpolator: the low pass prototype is designed at
+ * RESAMPLER_PHASES times the input rate and split into that many phases
+ * (plus one, the first phase advanced by one input sample, so every output
+ * can interpolate linearly between two neighbouring phases); each phase is
+ * stored reversed and zero padded to a multiple of RESAMPLER_LANES, so an
+ * output is a few dot products over contiguous I and Q arrays, done by the
+ * SIMD kernel picked when the resampler is opened.  The
+ * position of the next output is kept as an input sample index plus a
+ * fraction, so the output rate does not drift however long it runs
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "resampler.h"
+#include "memory_budget.h"
+#include "dsp_kernels.h"
+#include "fir_design.h"
+
+
+typedef struct resampler resampler_t;
+
+/* internal functions */
+static uint32_t resampler_interpolate(resampler_t *this, float *output);
+
+
+enum {
+  RESAMPLER_PHASES = 256,
+  RESAMPLER_BLOCK = 4096,        /* input samples buffered at a time */
+  RESAMPLER_LANES = 8
+};
+
+typedef struct resampler {
+  double input_rate;
+  double output_rate;
+  double step;                   /* input samples per output sample */
+  double delay;
+  uint32_t phase_taps;           /* padded to a multiple of RESAMPLER_LANES */
+  float *taps;                   /* (RESAMPLER_PHASES + 1) * phase_taps */
+  dsp_fir_interpolate_t fir_interpolate;
+  float *history_re;             /* phase_taps - 1 + RESAMPLER_BLOCK */
+  float *history_im;
+  uint32_t history_fill;
+  uint32_t index;                /* newest input sample of the next output */
+  double fraction;               /* and how far past it the output is */
+} resampler_t;
+
+
+resampler_t *resampler_open(double input_rate, double output_rate,
+                            double passband, double stopband,
+                            double attenuation)
+{
+  resampler_t *ret_val = 0;
+
+  if (input_rate <= 0 || output_rate <= 0) {
+    fprintf(stderr, "ERROR - invalid resampler rates: %f -> %f\n",
+            input_rate, output_rate);
+    return ret_val;
+  }
+  double nyquist = (input_rate < output_rate ? input_rate : output_rate) / 2;
+  if (passband <= 0 || stopband <= passband || stopband > nyquist) {
+    fprintf(stderr, "ERROR - invalid resampler filter: %f - %f\n",
+            passband, stopband);
+    return ret_val;
+  }
+
+  double prototype_rate = input_rate * RESAMPLER_PHASES;
+  struct fir_design_spec spec = {
+    .method = FIR_DESIGN_KAISER,
+    .passband = passband / prototype_rate,
+    .stopband = stopband / prototype_rate,
+    .attenuation = attenuation,
+    .ripple = 0.0,
+    .gain = RESAMPLER_PHASES     /* each phase has unity gain */
+  };
+  const struct fir_taps *fir = fir_design_lowpass(&spec);
+  if (fir == 0) {
+    fprintf(stderr, "ERROR - fir_design_lowpass() failed\n");
+    return ret_val;
+  }
+  uint32_t num_taps = fir->num_taps;
+  uint32_t phase_taps = (num_taps + RESAMPLER_PHASES - 1) / RESAMPLER_PHASES + 1;
+  phase_taps = (phase_taps + RESAMPLER_LANES - 1) / RESAMPLER_LANES * RESAMPLER_LANES;
+  double step = input_rate / output_rate;
+  if (step + 1 >= phase_taps) {
+    fprintf(stderr, "ERROR - resampler filter too short for ratio %f\n", step);
+    fir_release_taps(fir);
+    return ret_val;
+  }
+
+  size_t taps_size = (RESAMPLER_PHASES + 1) * phase_taps * sizeof(float);
+  size_t history_size = (phase_taps - 1 + RESAMPLER_BLOCK) * sizeof(float);
+  float *taps = (float *) memory_budget_aligned_alloc(MEMORY_DSP, FIR_TAPS_ALIGNMENT, taps_size,
+                                                      "resampler buffers");
+  float *history_re = (float *) memory_budget_calloc(MEMORY_DSP, history_size,
+                                                     "resampler buffers");
+  float *history_im = (float *) memory_budget_calloc(MEMORY_DSP, history_size,
+                                                     "resampler buffers");
+  if (taps == 0 || history_re == 0 || history_im == 0) {
+    fprintf(stderr, "ERROR - resampler buffer allocation failed\n");
+    memory_budget_free(taps);
+    memory_budget_free(history_re);
+    memory_budget_free(history_im);
+    fir_release_taps(fir);
+    return ret_val;
+  }
+  /* phase p, tap i is prototype tap i * RESAMPLER_PHASES + p (the taps past
+     the end of the prototype are 0), stored in reverse order */
+  for (uint32_t p = 0; p <= RESAMPLER_PHASES; ++p) {
+    float *phase = taps + p * phase_taps;
+    for (uint32_t i = 0; i < phase_taps; ++i) {
+      uint32_t k = i * RESAMPLER_PHASES + p;
+      phase[phase_taps - 1 - i] = k < num_taps ? fir->taps[k] : 0;
+    }
+  }
+  fir_release_taps(fir);
+
+  /* we are good here - create and initialize the resampler */
+  resampler_t *this = (resampler_t *) malloc(sizeof(resampler_t));
+  this->input_rate = input_rate;
+  this->output_rate = output_rate;
+  this->step = step;
+  this->delay = (num_taps - 1) / 2.0 / prototype_rate;
+  this->phase_taps = phase_taps;
+  this->fir_interpolate = dsp_get_fir_interpolate(phase_taps);
+  this->taps = taps;
+  this->history_re = history_re;
+  this->history_im = history_im;
+  /* the history starts with phase_taps - 1 samples of silence */
+  this->history_fill = phase_taps - 1;
+  this->index = phase_taps - 1;
+  this->fraction = 0;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void resampler_close(resampler_t *this)
+{
+  memory_budget_free(this->taps);
+  memory_budget_free(this->history_re);
+  memory_budget_free(this->history_im);
+  free(this);
+  return;
+}
+
+
+uint32_t resampler_max_output(resampler_t *this, uint32_t nsamples)
+{
+  return (uint32_t) (nsamples / this->step) + 2;
+}
+
+
+double resampler_get_delay(resampler_t *this)
+{
+  return this->delay;
+}
+
+
+uint32_t resampler_process(resampler_t *this, const float *samples,
+                           uint32_t nsamples, float *output)
+{
+  uint32_t noutput = 0;
+  uint32_t capacity = this->phase_taps - 1 + RESAMPLER_BLOCK;
+  while (nsamples > 0) {
+    uint32_t n = capacity - this->history_fill;
+    if (n > nsamples)
+      n = nsamples;
+    float *restrict history_re = this->history_re + this->history_fill;
+    float *restrict history_im = this->history_im + this->history_fill;
+    for (uint32_t k = 0; k < n; ++k) {
+      history_re[k] = samples[2 * k];
+      history_im[k] = samples[2 * k + 1];
+    }
+    this->history_fill += n;
+    samples += 2 * n;
+    nsamples -= n;
+    noutput += resampler_interpolate(this, output + 2 * noutput);
+
+    /* keep only the history the next output needs */
+    uint32_t start = this->index - (this->phase_taps - 1);
+    if (start > this->history_fill)
+      start = this->history_fill;
+    memmove(this->history_re, this->history_re + start,
+            (this->history_fill - start) * sizeof(float));
+    memmove(this->history_im, this->history_im + start,
+            (this->history_fill - start) * sizeof(float));
+    this->history_fill -= start;
+    this->index -= start;
+  }
+  return noutput;
+}
+
+
+/* internal functions */
+static uint32_t resampler_interpolate(resampler_t *this, float *output)
+{
+  uint32_t phase_taps = this->phase_taps;
+  uint32_t index = this->index;
+  double fraction = this->fraction;
+  uint32_t noutput = 0;
+  while (index < this->history_fill) {
+    double position = fraction * RESAMPLER_PHASES;
+    uint32_t p = (uint32_t) position;
+    float mu = (float) (position - p);
+    const float *taps0 = this->taps + p * phase_taps;
+    const float *taps1 = taps0 + phase_taps;
+    const float *x_re = this->history_re + index - (phase_taps - 1);
+    const float *x_im = this->history_im + index - (phase_taps - 1);
+    this->fir_interpolate(taps0, taps1, mu, phase_taps, x_re, x_im,
+                          output + 2 * noutput);
+    noutput++;
+
+    fraction += this->step;
+    uint32_t whole = (uint32_t) fraction;
+    index += whole;
+    fraction -= whole;
+  }
+  this->index = index;
+  this->fraction = fraction;
+  return noutput;
+}
@@ -0,0 +1,59 @@
+/*
+ * resampler.h - arbitrary ratio resampler functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+#ifndef __RESAMPLER_H
+#define __RESAMPLER_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct resampler resampler_t;
+
+/* the resampler converts complex float samples (interleaved I/Q) from
+ * input_rate to output_rate (any ratio); passband and stopband (in Hz) are
+ * the edges of its low pass filter, which must be below half of the lower
+ * of the two rates */
+resampler_t *resampler_open(double input_rate, double output_rate,
+                            double passband, double stopband,
+                            double attenuation);
+
+void resampler_close(resampler_t *this);
+
+/* maximum number of output samples for nsamples input samples */
+uint32_t resampler_max_output(resampler_t *this, uint32_t nsamples);
+
+/* group delay of the filter in seconds */
+double resampler_get_delay(resampler_t *this);
+
+/* returns the number of complex samples written to output */
+uint32_t resampler_process(resampler_t *this, const float *samples,
+                           uint32_t nsamples, float *output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RESAMPLER_H */
@@ -0,0 +1,231 @@
+/*
+ * rf103_align - delay and clock drift between two recordings
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* reads a block from both recordings every 1/blocks_per_second seconds
+ * (seeking over the rest, so most of the files is never read) and prints
+ * the delay of each block and the fit over all of them: the delay of b at
+ * its start, its clock drift and the resampler rates that put it on the
+ * time base of a. One channel recordings are real S16, two channel
+ * recordings are I/Q
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "rf103.h"
+#include "waveread.h"
+
+
+struct recording {
+  const char *filename;
+  FILE *file;
+  off_t data_start;
+  unsigned sample_rate;
+  int num_channels;
+  uint64_t num_frames;
+};
+
+static int open_recording(struct recording *recording, const char *filename);
+static int read_block(struct recording *recording, uint64_t position,
+                      uint32_t nframes, int16_t *frames, float *samples);
+
+static const uint32_t default_block_size = 65536;
+static const double default_blocks_per_second = 10.0;
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <wav file a> <wav file b> [<block size> [<blocks per second> [<samples to skip in b>]]]\n", argv[0]);
+    return -1;
+  }
+  uint32_t block_size = 3 < argc ? (uint32_t) atoi(argv[3]) :
+                        default_block_size;
+  double blocks_per_second = 4 < argc ? atof(argv[4]) :
+                             default_blocks_per_second;
+  long long skip = 5 < argc ? atoll(argv[5]) : 0;
+  if (blocks_per_second <= 0) {
+    fprintf(stderr, "ERROR - invalid number of blocks per second: %f\n",
+            blocks_per_second);
+    return -1;
+  }
+  if (skip < 0) {
+    fprintf(stderr, "ERROR - invalid number of samples to skip: %lld\n", skip);
+    return -1;
+  }
+
+  int ret_val = -1;
+  struct recording a = { 0 };
+  struct recording b = { 0 };
+  rf103_alignment_t *alignment = 0;
+  int16_t *frames = 0;
+  float *samples = 0;
+
+  if (open_recording(&a, argv[1]) < 0 || open_recording(&b, argv[2]) < 0)
+    goto DONE;
+  if (a.sample_rate != b.sample_rate || a.num_channels != b.num_channels) {
+    fprintf(stderr, "ERROR - %s and %s have different sample rates or channels\n",
+            a.filename, b.filename);
+    goto DONE;
+  }
+  double sample_rate = a.sample_rate;
+  int complex_samples = a.num_channels == 2;
+
+  alignment = rf103_alignment_open(complex_samples ? SAMPLE_TYPE_CF32 :
+                                   SAMPLE_TYPE_S16, sample_rate, block_size);
+  if (alignment == 0) {
+    fprintf(stderr, "ERROR - rf103_alignment_open() failed\n");
+    goto DONE;
+  }
+  frames = (int16_t *) malloc(2 * (size_t) block_size * a.num_channels *
+                              sizeof(int16_t));
+  if (complex_samples)
+    samples = (float *) malloc(2 * 2 * (size_t) block_size * sizeof(float));
+
+  uint64_t interval = (uint64_t) (sample_rate / blocks_per_second);
+  if (interval < block_size)
+    interval = block_size;
+  uint64_t length = a.num_frames;
+  if (b.num_frames - (uint64_t) skip < length)
+    length = b.num_frames < (uint64_t) skip ? 0 : b.num_frames - skip;
+
+  int16_t *frames_a = frames;
+  int16_t *frames_b = frames + (size_t) block_size * a.num_channels;
+  float *samples_a = samples;
+  float *samples_b = samples ? samples + 2 * (size_t) block_size : 0;
+
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (complex_samples) {
+    printf("# position(s) delay(samples) peak phase(rad)\n");
+  } else {
+    printf("# position(s) delay(samples) peak\n");
+  }
+  for (uint64_t position = 0; position + block_size <= length;
+       position += interval) {
+    if (read_block(&a, position, block_size, frames_a, samples_a) < 0 ||
+        read_block(&b, position + skip, block_size, frames_b, samples_b) < 0)
+      goto DONE;
+    struct rf103_alignment_block block;
+    if (rf103_alignment_add_block(alignment, position,
+                                  complex_samples ? (void *) samples_a : (void *) frames_a,
+                                  complex_samples ? (void *) samples_b : (void *) frames_b,
+                                  &block) < 0) {
+      fprintf(stderr, "ERROR - rf103_alignment_add_block() failed\n");
+      goto DONE;
+    }
+    if (!block.valid) {
+      printf("%.6f -\n", block.position / sample_rate);
+    } else if (complex_samples) {
+      printf("%.6f %.4f %.3f %.4f\n", block.position / sample_rate,
+             block.delay + skip, block.peak, block.phase);
+    } else {
+      printf("%.6f %.4f %.3f\n", block.position / sample_rate,
+             block.delay + skip, block.peak);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double elapsed = (end.tv_sec - start.tv_sec) +
+                   1e-9 * (end.tv_nsec - start.tv_nsec);
+
+  struct rf103_alignment_estimate estimate;
+  if (rf103_alignment_get_estimate(alignment, &estimate) < 0) {
+    fprintf(stderr, "ERROR - rf103_alignment_get_estimate() failed\n");
+    goto DONE;
+  }
+  double delay = estimate.delay + skip;
+  printf("# blocks: %u (%u without a clear peak, %u outliers), mean peak %.3f\n",
+         estimate.blocks, estimate.rejected, estimate.outliers, estimate.peak);
+  printf("# delay of b at its start: %.4f samples (%.3f us), residual %.4f samples\n",
+         delay, delay / sample_rate * 1e6, estimate.residual);
+  printf("# clock drift of b: %.4f ppm\n", estimate.drift);
+  if (complex_samples)
+    printf("# frequency offset of b: %.3f Hz\n", estimate.frequency_offset);
+  printf("# resampler for b: input rate %.4f Hz, output rate %.4f Hz, then advance it by %.4f samples\n",
+         sample_rate * (1 + estimate.drift * 1e-6), sample_rate, delay);
+  printf("# processed %.1f s of recording in %.3f s (%.1fx real time)\n",
+         length / sample_rate, elapsed,
+         elapsed > 0 ? length / sample_rate / elapsed : 0.0);
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  free(samples);
+  free(frames);
+  if (alignment)
+    rf103_alignment_close(alignment);
+  if (a.file)
+    fclose(a.file);
+  if (b.file)
+    fclose(b.file);
+
+  return ret_val;
+}
+
+
+static int open_recording(struct recording *recording, const char *filename)
+{
+  recording->filename = filename;
+  recording->file = fopen(filename, "rb");
+  if (recording->file == 0) {
+    fprintf(stderr, "ERROR - cannot open %s\n", filename);
+    return -1;
+  }
+  unsigned frequency;
+  int bits_per_sample;
+  if (waveReadHeader(recording->file, &recording->sample_rate, &frequency,
+                     &bits_per_sample, &recording->num_channels,
+                     &recording->num_frames) != 0 ||
+      bits_per_sample != 16 ||
+      (recording->num_channels != 1 && recording->num_channels != 2)) {
+    fprintf(stderr, "ERROR - %s is not a 16 bit one or two channel WAV file\n",
+            filename);
+    return -1;
+  }
+  recording->data_start = ftello(recording->file);
+  return 0;
+}
+
+
+static int read_block(struct recording *recording, uint64_t position,
+                      uint32_t nframes, int16_t *frames, float *samples)
+{
+  off_t offset = recording->data_start + (off_t) position *
+                 recording->num_channels * (off_t) sizeof(int16_t);
+  if (fseeko(recording->file, offset, SEEK_SET) != 0 ||
+      waveReadFrames(recording->file, frames, nframes) != nframes) {
+    fprintf(stderr, "ERROR - read from %s failed\n", recording->filename);
+    return -1;
+  }
+  if (samples) {
+    for (uint32_t i = 0; i < 2 * nframes; ++i)
+      samples[i] = frames[i] * (1.0f / 32768.0f);
+  }
+  return 0;
+}
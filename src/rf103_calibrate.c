@@ -0,0 +1,96 @@
+/*
+ * rf103_calibrate - estimate the frequency correction from a recording
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rf103.h"
+#include "waveread.h"
+
+
+/* the carrier only needs a short capture; don't read more than this */
+static const uint64_t MAX_CALIBRATION_SAMPLES = 1 << 22;
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <HF recording (.wav)> <carrier frequency> [<current correction in ppm>]\n", argv[0]);
+    return -1;
+  }
+  const char *infilename = argv[1];
+  double carrier_frequency = 0.0;
+  sscanf(argv[2], "%lf", &carrier_frequency);
+  double current_ppm = 0.0;
+  if (3 < argc)
+    sscanf(argv[3], "%lf", &current_ppm);
+
+  FILE *f = fopen(infilename, "rb");
+  if (f == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed\n", infilename);
+    return -1;
+  }
+
+  int ret_val = -1;
+  unsigned sample_rate;
+  unsigned frequency;
+  int bits_per_sample;
+  int num_channels;
+  uint64_t num_frames;
+  if (waveReadHeader(f, &sample_rate, &frequency, &bits_per_sample,
+                     &num_channels, &num_frames) != 0) {
+    fprintf(stderr, "ERROR - waveReadHeader(%s) failed\n", infilename);
+    goto DONE;
+  }
+  if (bits_per_sample != 16 || num_channels != 1) {
+    fprintf(stderr, "ERROR - expected 16 bit real samples (got %d bits, %d channels)\n",
+            bits_per_sample, num_channels);
+    goto DONE;
+  }
+
+  uint64_t max_samples = num_frames > 0 && num_frames < MAX_CALIBRATION_SAMPLES ?
+                         num_frames : MAX_CALIBRATION_SAMPLES;
+  int16_t *samples = (int16_t *) malloc(max_samples * sizeof(int16_t));
+  size_t nsamples = waveReadFrames(f, samples, max_samples);
+
+  double ppm;
+  if (rf103_estimate_frequency_correction(samples, (uint32_t) nsamples,
+                                          sample_rate, carrier_frequency,
+                                          &ppm) < 0) {
+    fprintf(stderr, "ERROR - rf103_estimate_frequency_correction() failed\n");
+    free(samples);
+    goto DONE;
+  }
+  free(samples);
+
+  double new_ppm = ((1.0 + current_ppm * 1e-6) * (1.0 + ppm * 1e-6) - 1.0) * 1e6;
+  printf("samples=%zu sample_rate=%u carrier=%lf\n", nsamples, sample_rate,
+         carrier_frequency);
+  printf("residual correction=%.3lf ppm\n", ppm);
+  printf("new frequency correction=%.3lf ppm\n", new_ppm);
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  fclose(f);
+  return ret_val;
+}
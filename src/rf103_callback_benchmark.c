@@ -0,0 +1,197 @@
+/*
+ * rf103_callback_benchmark - callback rate against frame size and batching
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* streams for a few seconds with every frame size and reports the callbacks
+ * per second and the CPU time used, with one callback per frame and with
+ * batched delivery; the callbacks do no work, so the numbers are the
+ * overhead of the delivery itself */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "rf103.h"
+
+
+static int run(const char *imagefile, double sample_rate, double seconds,
+               uint32_t frame_size, uint32_t batch_frames);
+static void frame_callback(uint32_t data_size, uint8_t *data, void *context);
+static void batch_callback(uint32_t nframes, const struct rf103_frame *frames,
+                           void *context);
+static double cpu_seconds();
+
+static const uint32_t frame_sizes[] = {
+  16384, 32768, 65536, 131072, 262144, 524288, 1048576
+};
+/* the transfer pool is always about this large */
+static const uint32_t POOL_SIZE = 16 * 1024 * 1024;
+static const uint32_t MAX_BATCH_FRAMES = 32;
+
+static unsigned long long received_bytes;
+static unsigned long long received_frames;
+static volatile int checksum;
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <image file> <sample rate> [<seconds per run>]\n", argv[0]);
+    return -1;
+  }
+  char *imagefile = argv[1];
+  double sample_rate = 0.0;
+  sscanf(argv[2], "%lf", &sample_rate);
+  double seconds = 3 < argc ? atof(argv[3]) : 5.0;
+
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - given samplerate '%f' should be > 0\n", sample_rate);
+    return -1;
+  }
+
+  printf("frame size  batch  callbacks/s    frames/s     MB/s  CPU %%  us/frame\n");
+  for (size_t i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); ++i) {
+    uint32_t num_frames = POOL_SIZE / frame_sizes[i];
+    uint32_t batch_frames = num_frames / 2 < MAX_BATCH_FRAMES ?
+                            num_frames / 2 : MAX_BATCH_FRAMES;
+    if (run(imagefile, sample_rate, seconds, frame_sizes[i], 0) < 0 ||
+        run(imagefile, sample_rate, seconds, frame_sizes[i], batch_frames) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+
+static int run(const char *imagefile, double sample_rate, double seconds,
+               uint32_t frame_size, uint32_t batch_frames)
+{
+  int ret_val = -1;
+
+  rf103_t *rf103 = rf103_open(0, imagefile);
+  if (rf103 == 0) {
+    fprintf(stderr, "ERROR - rf103_open() failed\n");
+    return -1;
+  }
+
+  if (rf103_set_sample_rate(rf103, sample_rate) < 0) {
+    fprintf(stderr, "ERROR - rf103_set_sample_rate() failed\n");
+    goto DONE;
+  }
+
+  if (batch_frames > 0 &&
+      rf103_set_async_batch(rf103, batch_frames, batch_callback, 0) < 0) {
+    fprintf(stderr, "ERROR - rf103_set_async_batch() failed\n");
+    goto DONE;
+  }
+
+  uint32_t num_frames = POOL_SIZE / frame_size;
+  if (rf103_set_async_params(rf103, frame_size, num_frames,
+                             batch_frames > 0 ? 0 : frame_callback, 0) < 0) {
+    fprintf(stderr, "ERROR - rf103_set_async_params() failed\n");
+    goto DONE;
+  }
+
+  if (rf103_start_streaming(rf103) < 0) {
+    fprintf(stderr, "ERROR - rf103_start_streaming() failed\n");
+    goto DONE;
+  }
+
+  /* skip the start up */
+  struct timespec clk_start, clk_now;
+  clock_gettime(CLOCK_MONOTONIC, &clk_start);
+  do {
+    rf103_handle_events(rf103);
+    clock_gettime(CLOCK_MONOTONIC, &clk_now);
+  } while ((clk_now.tv_sec - clk_start.tv_sec) +
+           1e-9 * (clk_now.tv_nsec - clk_start.tv_nsec) < 0.5);
+
+  struct rf103_stats start_stats, end_stats;
+  rf103_get_stats(rf103, &start_stats);
+  received_bytes = 0;
+  received_frames = 0;
+  double cpu_start = cpu_seconds();
+  clock_gettime(CLOCK_MONOTONIC, &clk_start);
+  double elapsed;
+  do {
+    rf103_handle_events(rf103);
+    clock_gettime(CLOCK_MONOTONIC, &clk_now);
+    elapsed = (clk_now.tv_sec - clk_start.tv_sec) +
+              1e-9 * (clk_now.tv_nsec - clk_start.tv_nsec);
+  } while (elapsed < seconds);
+  double cpu = cpu_seconds() - cpu_start;
+  rf103_get_stats(rf103, &end_stats);
+
+  if (rf103_stop_streaming(rf103) < 0) {
+    fprintf(stderr, "ERROR - rf103_stop_streaming() failed\n");
+    goto DONE;
+  }
+
+  unsigned long long callbacks = end_stats.callbacks - start_stats.callbacks;
+  printf("%10u  %5u  %11.0f  %10.0f  %7.1f  %5.1f  %8.2f\n", frame_size,
+         batch_frames > 0 ? batch_frames : 1, callbacks / elapsed,
+         received_frames / elapsed, received_bytes / elapsed / 1e6,
+         100.0 * cpu / elapsed,
+         received_frames ? 1e6 * cpu / received_frames : 0.0);
+  if (end_stats.transfer_errors != start_stats.transfer_errors) {
+    printf("            %llu transfer errors\n",
+           (unsigned long long) (end_stats.transfer_errors -
+                                 start_stats.transfer_errors));
+  }
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  rf103_close(rf103);
+  return ret_val;
+}
+
+
+static void frame_callback(uint32_t data_size, uint8_t *data,
+                           void *context __attribute__((unused)) )
+{
+  received_frames++;
+  received_bytes += data_size;
+  checksum += data[0];
+}
+
+
+static void batch_callback(uint32_t nframes, const struct rf103_frame *frames,
+                           void *context __attribute__((unused)) )
+{
+  for (uint32_t i = 0; i < nframes; ++i) {
+    received_bytes += frames[i].size;
+    checksum += frames[i].data[0];
+  }
+  received_frames += nframes;
+}
+
+
+/* user and system time of the whole process (libusb included) */
+static double cpu_seconds()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + 1e-6 * usage.ru_utime.tv_usec +
+         usage.ru_stime.tv_sec + 1e-6 * usage.ru_stime.tv_usec;
+}
@@ -0,0 +1,361 @@
+/*
+ * rf103_channel_recorder - activity gated recording of many channels
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* every frequency becomes a channel of one fast convolution channelizer,
+ * and every channel is written to the container file only while there is
+ * a signal in it (see channel_recorder.h), so recording a band with a few
+ * bursts now and then takes a small fraction of the disk bandwidth of a
+ * continuous recording. With -l it lists the segments of a container file
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rf103.h"
+#include "channel_recorder.h"
+#include "channelizer.h"
+#include "waveread.h"
+
+
+static void channelizer_callback(uint32_t data_size, uint8_t *data,
+                                 void *context);
+static void channel_callback(int channel, const float *samples,
+                             uint32_t nsamples, void *context);
+static int open_recorder(const char *filename, double start_time);
+static int list_segments(const char *filename);
+static void stop_handler(int signum);
+
+static const uint32_t fft_size = 131072;
+static const double default_threshold = 10.0;   /* dB */
+static const double default_preroll = 0.1;      /* s */
+static const double default_hang = 1.0;         /* s */
+
+enum {
+  MAX_CHANNELS = 256
+};
+
+static double frequencies[MAX_CHANNELS];
+static int nchannels = 0;
+static channelizer_t *channelizer = 0;
+static channel_recorder_t *channel_recorder = 0;
+static int write_failed = 0;
+static unsigned long long input_samples = 0;
+static double sample_rate = 0.0;
+static volatile sig_atomic_t stop_streaming = 0;
+
+
+int main(int argc, char **argv)
+{
+  if (argc == 3 && strcmp(argv[1], "-l") == 0)
+    return list_segments(argv[2]);
+
+  int from_file = argc >= 5 && strlen(argv[3]) > 4 &&
+                  strcmp(argv[3] + strlen(argv[3]) - 4, ".wav") == 0;
+  if (argc < (from_file ? 5 : 6)) {
+    fprintf(stderr, "usage: %s <output file> <channel bandwidth> <wav file> <frequency>...\n", argv[0]);
+    fprintf(stderr, "       %s <output file> <channel bandwidth> <image file> <sample rate> <frequency>...\n", argv[0]);
+    fprintf(stderr, "       %s -l <output file>\n", argv[0]);
+    fprintf(stderr, "set RF103_GATE_THRESHOLD=<dB> for the level over the noise floor that opens a channel (default %.0fdB)\n", default_threshold);
+    fprintf(stderr, "set RF103_GATE_PREROLL=<s> for what is kept before the signal (default %.1fs)\n", default_preroll);
+    fprintf(stderr, "set RF103_GATE_HANG=<s> for how long a channel stays open after the signal (default %.1fs)\n", default_hang);
+    return -1;
+  }
+  const char *output_file = argv[1];
+  double bandwidth = atof(argv[2]);
+  if (bandwidth <= 0) {
+    fprintf(stderr, "ERROR - invalid channel bandwidth: %s\n", argv[2]);
+    return -1;
+  }
+
+  int ret_val = -1;
+  rf103_t *rf103 = 0;
+  int streaming = 0;
+  int first_frequency = from_file ? 4 : 5;
+  double start_time = 0.0;
+
+  rf103_graph_t *graph = rf103_graph_open();
+  if (graph == 0) {
+    fprintf(stderr, "ERROR - rf103_graph_open() failed\n");
+    return -1;
+  }
+
+  int source;
+  if (from_file) {
+    /* recordings are processed as fast as possible */
+    source = rf103_graph_add_file_source(graph, argv[3], 0, &sample_rate);
+    if (source < 0) {
+      fprintf(stderr, "ERROR - rf103_graph_add_file_source() failed\n");
+      goto DONE;
+    }
+    FILE *file = fopen(argv[3], "rb");
+    if (file) {
+      unsigned samplerate;
+      unsigned frequency;
+      int bits_per_sample;
+      int num_channels = 0;
+      uint64_t num_frames;
+      time_t start;
+      double fraction;
+      if (waveReadHeader(file, &samplerate, &frequency, &bits_per_sample,
+                         &num_channels, &num_frames) == 0 &&
+          waveGetStartTime(&start, &fraction) == 0)
+        start_time = start + fraction;
+      fclose(file);
+      if (num_channels != 1) {
+        fprintf(stderr, "ERROR - the recording must have the real ADC samples\n");
+        goto DONE;
+      }
+    }
+  } else {
+    sscanf(argv[4], "%lf", &sample_rate);
+    if (sample_rate <= 0) {
+      fprintf(stderr, "ERROR - given samplerate '%f' should be > 0\n", sample_rate);
+      goto DONE;
+    }
+    rf103 = rf103_open(0, argv[3]);
+    if (rf103 == 0) {
+      fprintf(stderr, "ERROR - rf103_open() failed\n");
+      goto DONE;
+    }
+    if (rf103_set_sample_rate(rf103, sample_rate) < 0) {
+      fprintf(stderr, "ERROR - rf103_set_sample_rate() failed\n");
+      goto DONE;
+    }
+    source = rf103_graph_add_device_source(graph, rf103, SAMPLE_TYPE_S16);
+    if (source < 0) {
+      fprintf(stderr, "ERROR - rf103_graph_add_device_source() failed\n");
+      goto DONE;
+    }
+    if (rf103_set_async_params(rf103, 0, 0, 0, 0) < 0) {
+      fprintf(stderr, "ERROR - rf103_set_async_params() failed\n");
+      goto DONE;
+    }
+  }
+
+  channelizer = channelizer_open(sample_rate, fft_size, channel_callback, 0);
+  if (channelizer == 0) {
+    fprintf(stderr, "ERROR - channelizer_open() failed\n");
+    goto DONE;
+  }
+  for (int i = first_frequency; i < argc; ++i) {
+    if (nchannels == MAX_CHANNELS) {
+      fprintf(stderr, "ERROR - too many channels\n");
+      goto DONE;
+    }
+    frequencies[nchannels] = atof(argv[i]);
+    if (channelizer_add_channel(channelizer, frequencies[nchannels],
+                                bandwidth) < 0) {
+      fprintf(stderr, "ERROR - channelizer_add_channel() failed\n");
+      goto DONE;
+    }
+    nchannels++;
+  }
+
+  int sink = rf103_graph_add_callback_sink(graph, SAMPLE_TYPE_S16,
+                                           channelizer_callback, 0);
+  if (sink < 0 || rf103_graph_connect(graph, source, sink) < 0) {
+    fprintf(stderr, "ERROR - graph setup failed\n");
+    goto DONE;
+  }
+
+  if (from_file) {
+    if (open_recorder(output_file, start_time) < 0)
+      goto DONE;
+    if (rf103_graph_start(graph, 1) < 0) {
+      fprintf(stderr, "ERROR - rf103_graph_start() failed\n");
+      goto DONE;
+    }
+    /* until the end of the file */
+    ret_val = rf103_graph_wait(graph);
+  } else {
+    if (rf103_graph_start(graph, 1) < 0) {
+      fprintf(stderr, "ERROR - rf103_graph_start() failed\n");
+      goto DONE;
+    }
+    if (rf103_start_streaming(rf103) < 0) {
+      fprintf(stderr, "ERROR - rf103_start_streaming() failed\n");
+      rf103_graph_stop(graph);
+      rf103_graph_wait(graph);
+      goto DONE;
+    }
+    /* the samples are only delivered from rf103_handle_events() below */
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    streaming = 1;
+    if (open_recorder(output_file, now.tv_sec + 1e-9 * now.tv_nsec) < 0) {
+      rf103_graph_stop(graph);
+      rf103_graph_wait(graph);
+      goto DONE;
+    }
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    while (!stop_streaming && !write_failed)
+      rf103_handle_events(rf103);
+    if (rf103_stop_streaming(rf103) < 0) {
+      fprintf(stderr, "ERROR - rf103_stop_streaming() failed\n");
+    }
+    streaming = 0;
+    rf103_graph_stop(graph);
+    ret_val = rf103_graph_wait(graph);
+  }
+  if (write_failed)
+    ret_val = -1;
+
+  unsigned long long recorded_bytes = 0;
+  unsigned long long continuous_bytes = 0;
+  for (int i = 0; i < nchannels; ++i) {
+    struct channel_recorder_stats stats;
+    channel_recorder_get_stats(channel_recorder, i, &stats);
+    fprintf(stderr, "%.0f Hz: %llu segments, %.1fs of %.1fs recorded, noise floor %.1f dBFS\n",
+            frequencies[i], (unsigned long long) stats.segments,
+            stats.recorded / channelizer_get_sample_rate(channelizer, i),
+            stats.samples / channelizer_get_sample_rate(channelizer, i),
+            stats.noise_floor);
+    recorded_bytes += stats.bytes;
+    /* the same channel recorded continuously as 16 bit I/Q */
+    continuous_bytes += stats.samples * 2 * sizeof(int16_t);
+  }
+  fprintf(stderr, "processed %.1fs of signal: %.1f MB written instead of %.1f MB\n",
+          input_samples / sample_rate, recorded_bytes / 1048576.0,
+          continuous_bytes / 1048576.0);
+
+DONE:
+  if (streaming)
+    rf103_stop_streaming(rf103);
+  rf103_graph_close(graph);
+  if (channel_recorder)
+    channel_recorder_close(channel_recorder);
+  if (channelizer)
+    channelizer_close(channelizer);
+  if (rf103)
+    rf103_close(rf103);
+
+  return ret_val;
+}
+
+static void channelizer_callback(uint32_t data_size, uint8_t *data,
+                                 void *context __attribute__((unused)) )
+{
+  uint32_t nsamples = data_size / sizeof(int16_t);
+  channelizer_process(channelizer, (const int16_t *) data, nsamples);
+  input_samples += nsamples;
+}
+
+static void channel_callback(int channel, const float *samples,
+                             uint32_t nsamples,
+                             void *context __attribute__((unused)) )
+{
+  if (channel_recorder_process(channel_recorder, channel, samples,
+                               nsamples) < 0)
+    write_failed = 1;
+}
+
+/* the channels have the delay of the channelizer filter */
+static int open_recorder(const char *filename, double start_time)
+{
+  const char *threshold = getenv("RF103_GATE_THRESHOLD");
+  const char *preroll = getenv("RF103_GATE_PREROLL");
+  const char *hang = getenv("RF103_GATE_HANG");
+  channel_recorder = channel_recorder_open(filename,
+                                           start_time - channelizer_get_delay(channelizer, 0),
+                                           threshold ? atof(threshold) : default_threshold,
+                                           preroll ? atof(preroll) : default_preroll,
+                                           hang ? atof(hang) : default_hang);
+  if (channel_recorder == 0) {
+    fprintf(stderr, "ERROR - channel_recorder_open() failed\n");
+    return -1;
+  }
+  for (int i = 0; i < nchannels; ++i) {
+    if (channel_recorder_add_channel(channel_recorder, frequencies[i],
+                                     channelizer_get_sample_rate(channelizer, i)) < 0) {
+      fprintf(stderr, "ERROR - channel_recorder_add_channel() failed\n");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int list_segments(const char *filename)
+{
+  FILE *file = fopen(filename, "rb");
+  if (file == 0) {
+    fprintf(stderr, "ERROR - cannot open %s\n", filename);
+    return -1;
+  }
+  double sample_rates[MAX_CHANNELS] = { 0 };
+  uint64_t segment_start[MAX_CHANNELS] = { 0 };
+  int64_t segment_time[MAX_CHANNELS] = { 0 };
+  struct rf103_channel_record record;
+  int ret_val = 0;
+  while (fread(&record, sizeof(record), 1, file) == 1) {
+    if (record.sync != RF103_CHANNEL_RECORD_SYNC ||
+        record.channel >= MAX_CHANNELS) {
+      fprintf(stderr, "ERROR - %s: bad record\n", filename);
+      ret_val = -1;
+      break;
+    }
+    int channel = record.channel;
+    if (record.type == RF103_RECORD_CHANNEL) {
+      struct rf103_recorded_channel description;
+      if (fread(&description, sizeof(description), 1, file) != 1) {
+        ret_val = -1;
+        break;
+      }
+      sample_rates[channel] = description.sample_rate;
+      printf("channel %d: %.0f Hz, %.0f samples/s\n", channel,
+             description.frequency, description.sample_rate);
+      continue;
+    }
+    if (record.flags & RF103_SEGMENT_START) {
+      segment_start[channel] = record.sample_index;
+      segment_time[channel] = record.timestamp;
+    }
+    if (record.flags & RF103_SEGMENT_END) {
+      time_t seconds = (time_t) (segment_time[channel] / 1000000000);
+      struct tm tm;
+      gmtime_r(&seconds, &tm);
+      char date[32];
+      strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+      uint64_t length = record.sample_index + record.nsamples -
+                        segment_start[channel];
+      printf("channel %d: %s.%06ld UTC sample %llu, %.3fs\n", channel, date,
+             (long) (segment_time[channel] % 1000000000 / 1000),
+             (unsigned long long) segment_start[channel],
+             sample_rates[channel] > 0 ? length / sample_rates[channel] : 0.0);
+    }
+    if (fseek(file, (long) record.nsamples * 2 * sizeof(int16_t),
+              SEEK_CUR) != 0) {
+      ret_val = -1;
+      break;
+    }
+  }
+  fclose(file);
+  return ret_val;
+}
+
+static void stop_handler(int signum __attribute__((unused)) )
+{
+  stop_streaming = 1;
+}
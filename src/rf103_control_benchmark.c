@@ -0,0 +1,136 @@
+/*
+ * rf103_control_benchmark - control path latency benchmark for librf103
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rf103.h"
+
+
+static void print_operation_stats(rf103_t *rf103);
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <image file> [<iterations> [<VHF frequency>]]\n", argv[0]);
+    return -1;
+  }
+  char *imagefile = argv[1];
+  int iterations = 100;
+  if (2 < argc)
+    iterations = atoi(argv[2]);
+  double vhf_frequency = 100e6;
+  if (3 < argc)
+    sscanf(argv[3], "%lf", &vhf_frequency);
+
+  if (iterations <= 0) {
+    fprintf(stderr, "ERROR - given iterations '%d' should be > 0\n", iterations);
+    return -1;
+  }
+
+  rf103_t *rf103 = rf103_open(0, imagefile);
+  if (rf103 == 0) {
+    fprintf(stderr, "ERROR - rf103_open() failed\n");
+    return -1;
+  }
+
+  int ret_val = -1;
+
+  /* only count what this program does, not the setup in rf103_open() */
+  rf103_reset_operation_stats(rf103);
+
+  for (int i = 0; i < iterations; ++i) {
+    if (rf103_led_toggle(rf103, LED_BLUE) < 0) {
+      fprintf(stderr, "ERROR - rf103_led_toggle() failed\n");
+      goto DONE;
+    }
+  }
+
+  if (rf103_set_rf_mode(rf103, VHF_MODE) < 0) {
+    fprintf(stderr, "WARNING - no VHF tuner - skipping the tuner operations\n");
+  } else {
+    /* retune back and forth by 1MHz, so every call reprograms the PLL */
+    for (int i = 0; i < iterations; ++i) {
+      if (rf103_set_vhf_frequency(rf103, vhf_frequency + (i & 1) * 1e6) < 0) {
+        fprintf(stderr, "ERROR - rf103_set_vhf_frequency() failed\n");
+        goto DONE;
+      }
+    }
+    const int *gains;
+    int ngains = rf103_get_vhf_lna_gains(rf103, &gains);
+    for (int i = 0; i < iterations && ngains > 0; ++i) {
+      if (rf103_set_vhf_lna_gain(rf103, gains[i % ngains]) < 0) {
+        fprintf(stderr, "ERROR - rf103_set_vhf_lna_gain() failed\n");
+        goto DONE;
+      }
+    }
+    ngains = rf103_get_vhf_vga_gains(rf103, &gains);
+    for (int i = 0; i < iterations && ngains > 0; ++i) {
+      if (rf103_set_vhf_vga_gain(rf103, gains[i % ngains]) < 0) {
+        fprintf(stderr, "ERROR - rf103_set_vhf_vga_gain() failed\n");
+        goto DONE;
+      }
+    }
+  }
+
+  print_operation_stats(rf103);
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  rf103_close(rf103);
+
+  return ret_val;
+}
+
+
+static void print_operation_stats(rf103_t *rf103)
+{
+  printf("%-26s %8s %6s %10s %10s %9s\n", "operation", "count", "errors",
+         "mean (us)", "max (us)", "ctrl/call");
+  for (int i = 0; i < OPERATIONS; ++i) {
+    struct rf103_operation_stats stats;
+    if (rf103_get_operation_stats(rf103, (enum RF103Operation) i, &stats) < 0)
+      continue;
+    if (stats.count == 0)
+      continue;
+    printf("%-26s %8llu %6llu %10.1f %10.1f %9.2f\n",
+           rf103_operation_name((enum RF103Operation) i),
+           (unsigned long long) stats.count,
+           (unsigned long long) stats.errors,
+           stats.total_ns * 1e-3 / stats.count, stats.max_ns * 1e-3,
+           (double) stats.control_transfers / stats.count);
+    /* latency histogram, only the buckets in use */
+    printf("  ");
+    for (int b = 0; b < RF103_LATENCY_BUCKETS; ++b) {
+      if (stats.histogram[b] == 0)
+        continue;
+      if (b == 0)
+        printf(" <1us:%llu", (unsigned long long) stats.histogram[b]);
+      else
+        printf(" <%lluus:%llu", 1ULL << b,
+               (unsigned long long) stats.histogram[b]);
+    }
+    printf("\n");
+  }
+}
@@ -0,0 +1,202 @@
+/*
+ * rf103_copy_benchmark - frame copy and conversion against memcpy
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* copies frames into a destination that fits in the cache (copied over and
+ * over) and into a large capture buffer (never read back), with memcpy() and
+ * with rf103_copy_frame(); with the capture buffer it also runs a small DSP
+ * kernel on a cache sized working set between the frames, to show how much
+ * each copy slows down the processing that shares the cache with it */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rf103.h"
+
+
+static double copy_rate(int streaming, uint8_t *destination,
+                        size_t destination_size, const uint8_t *source,
+                        uint32_t frame_size, double *kernel_time);
+static double convert_rate(int streaming, float *destination,
+                           size_t destination_size, const int16_t *source,
+                           uint32_t frame_size);
+static double kernel();
+static double now();
+
+static const uint32_t frame_sizes[] = {
+  4096, 16384, 65536, 131072, 1048576
+};
+static const size_t RESIDENT_SIZE = 1048576;
+static const size_t CAPTURE_SIZE = 512 * 1048576;
+static const size_t TOTAL_BYTES = 2048ULL * 1048576;
+/* floats; about a L2 cache worth */
+enum { KERNEL_SIZE = 65536 };
+
+static float kernel_data[KERNEL_SIZE];
+static volatile double sink;
+
+
+int main(int argc, char **argv)
+{
+  if (argc > 1) {
+    fprintf(stderr, "usage: %s\n", argv[0]);
+    return -1;
+  }
+
+  uint8_t *source = (uint8_t *) malloc(frame_sizes[sizeof(frame_sizes) / sizeof(frame_sizes[0]) - 1]);
+  uint8_t *resident = (uint8_t *) aligned_alloc(64, RESIDENT_SIZE * sizeof(float));
+  uint8_t *capture = (uint8_t *) aligned_alloc(64, CAPTURE_SIZE);
+  if (source == 0 || resident == 0 || capture == 0) {
+    fprintf(stderr, "ERROR - buffer allocation failed\n");
+    return -1;
+  }
+  /* no page faults in the measurements */
+  for (uint32_t i = 0; i < frame_sizes[sizeof(frame_sizes) / sizeof(frame_sizes[0]) - 1]; ++i)
+    source[i] = (uint8_t) rand();
+  memset(resident, 0, RESIDENT_SIZE * sizeof(float));
+  memset(capture, 0, CAPTURE_SIZE);
+  for (int i = 0; i < KERNEL_SIZE; ++i)
+    kernel_data[i] = (float) i;
+
+  printf("                      cache resident        capture buffer           kernel us/pass\n");
+  printf("frame size        memcpy  rf103_copy      memcpy  rf103_copy    alone  memcpy  rf103_copy\n");
+  for (size_t i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); ++i) {
+    uint32_t frame_size = frame_sizes[i];
+    double kernel_memcpy;
+    double kernel_copy;
+    double resident_memcpy = copy_rate(0, resident, RESIDENT_SIZE, source,
+                                       frame_size, 0);
+    double resident_copy = copy_rate(1, resident, RESIDENT_SIZE, source,
+                                     frame_size, 0);
+    double capture_memcpy = copy_rate(0, capture, CAPTURE_SIZE, source,
+                                      frame_size, &kernel_memcpy);
+    double capture_copy = copy_rate(1, capture, CAPTURE_SIZE, source,
+                                    frame_size, &kernel_copy);
+    double start = now();
+    for (int k = 0; k < 1000; ++k)
+      sink = kernel();
+    double kernel_alone = (now() - start) / 1000;
+    printf("%10u  %7.2f GB/s %6.2f GB/s  %5.2f GB/s %6.2f GB/s  %7.1f %7.1f %11.1f\n",
+           frame_size, resident_memcpy / 1e9, resident_copy / 1e9,
+           capture_memcpy / 1e9, capture_copy / 1e9, kernel_alone * 1e6,
+           kernel_memcpy * 1e6, kernel_copy * 1e6);
+  }
+
+  printf("\nconversion to float (frame size in samples)\n");
+  printf("frame size        loop  rf103_convert      loop  rf103_convert\n");
+  for (size_t i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); ++i) {
+    uint32_t nsamples = frame_sizes[i] / sizeof(int16_t);
+    printf("%10u  %7.2f GS/s %6.2f GS/s  %5.2f GS/s %6.2f GS/s\n", nsamples,
+           convert_rate(0, (float *) resident, RESIDENT_SIZE,
+                        (const int16_t *) source, nsamples) / 1e9,
+           convert_rate(1, (float *) resident, RESIDENT_SIZE,
+                        (const int16_t *) source, nsamples) / 1e9,
+           convert_rate(0, (float *) capture, CAPTURE_SIZE / sizeof(float),
+                        (const int16_t *) source, nsamples) / 1e9,
+           convert_rate(1, (float *) capture, CAPTURE_SIZE / sizeof(float),
+                        (const int16_t *) source, nsamples) / 1e9);
+  }
+
+  free(source);
+  free(resident);
+  free(capture);
+  return 0;
+}
+
+
+/* bytes per second; the kernel time is per pass, one pass per frame */
+static double copy_rate(int streaming, uint8_t *destination,
+                        size_t destination_size, const uint8_t *source,
+                        uint32_t frame_size, double *kernel_time)
+{
+  size_t nframes = TOTAL_BYTES / frame_size;
+  size_t offset = 0;
+  double copy_time = 0;
+  double kernel_total = 0;
+  for (size_t n = 0; n < nframes; ++n) {
+    double start = now();
+    if (streaming)
+      rf103_copy_frame(destination + offset, source, frame_size);
+    else
+      memcpy(destination + offset, source, frame_size);
+    double end = now();
+    copy_time += end - start;
+    offset += frame_size;
+    if (offset + frame_size > destination_size)
+      offset = 0;
+    if (kernel_time) {
+      sink = kernel();
+      kernel_total += now() - end;
+    }
+  }
+  if (kernel_time)
+    *kernel_time = kernel_total / nframes;
+  return nframes * (double) frame_size / copy_time;
+}
+
+
+/* samples per second */
+static double convert_rate(int streaming, float *destination,
+                           size_t destination_size, const int16_t *source,
+                           uint32_t nsamples)
+{
+  size_t nframes = TOTAL_BYTES / sizeof(float) / nsamples;
+  size_t offset = 0;
+  double start = now();
+  for (size_t n = 0; n < nframes; ++n) {
+    if (streaming) {
+      rf103_convert_frame(destination + offset, source, nsamples);
+    } else {
+      float *d = destination + offset;
+      for (uint32_t i = 0; i < nsamples; ++i)
+        d[i] = source[i] * (1.0f / 32768.0f);
+    }
+    offset += nsamples;
+    if (offset + nsamples > destination_size)
+      offset = 0;
+  }
+  return nframes * (double) nsamples / (now() - start);
+}
+
+
+/* stands for the DSP code: a pass of multiply-adds over its working set */
+static double kernel()
+{
+  float acc[8] = { 0 };
+  for (int i = 0; i < KERNEL_SIZE; i += 8) {
+    for (int l = 0; l < 8; ++l)
+      acc[l] += kernel_data[i + l] * kernel_data[i + l];
+  }
+  double sum = 0;
+  for (int l = 0; l < 8; ++l)
+    sum += acc[l];
+  return sum;
+}
+
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9 * t.tv_nsec;
+}
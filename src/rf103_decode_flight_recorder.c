@@ -0,0 +1,167 @@
+/*
+ * rf103_decode_flight_recorder - print a flight recorder dump
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flight_recorder.h"
+
+
+static const char *control_request_name(uint16_t request);
+static const char *i2c_device_name(uint8_t address);
+static const char *adc_status_name(uint32_t status);
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <flight recorder dump>\n", argv[0]);
+    return -1;
+  }
+  const char *infilename = argv[1];
+
+  FILE *f = fopen(infilename, "rb");
+  if (f == 0) {
+    fprintf(stderr, "ERROR - fopen(%s) failed\n", infilename);
+    return -1;
+  }
+
+  int ret_val = -1;
+  struct flight_recorder_header header;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, FLIGHT_RECORDER_MAGIC, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "ERROR - %s is not a flight recorder dump\n", infilename);
+    goto DONE;
+  }
+  if (header.event_size != sizeof(struct flight_recorder_event)) {
+    fprintf(stderr, "ERROR - unsupported event size %u (version %u)\n",
+            header.event_size, header.version);
+    goto DONE;
+  }
+
+  printf("%u events", header.num_events);
+  if (header.lost_events > 0)
+    printf(" (%u older events overwritten)", header.lost_events);
+  printf("\n");
+
+  uint64_t first_timestamp = 0;
+  for (uint32_t i = 0; i < header.num_events; ++i) {
+    struct flight_recorder_event event;
+    if (fread(&event, sizeof(event), 1, f) != 1) {
+      fprintf(stderr, "ERROR - truncated dump after %u events\n", i);
+      goto DONE;
+    }
+    if (i == 0)
+      first_timestamp = event.timestamp;
+
+    /* wall clock time and time since the first event */
+    int64_t realtime = (int64_t) event.timestamp + header.realtime_offset;
+    time_t seconds = (time_t) (realtime / 1000000000);
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    char timestamp[32];
+    strftime(timestamp, sizeof(timestamp), "%H:%M:%S", &tm);
+    printf("%s.%09lld +%.6f ", timestamp,
+           (long long) (realtime % 1000000000),
+           (event.timestamp - first_timestamp) * 1e-9);
+
+    switch (event.type) {
+      case FR_EVENT_CONTROL:
+        printf("CONTROL %s value=0x%04x index=0x%04x length=%u result=%d duration=%.1fus\n",
+               control_request_name(event.arg0), event.arg1 >> 16,
+               event.arg1 & 0xffff, event.arg2, event.result,
+               event.duration * 1e-3);
+        break;
+      case FR_EVENT_I2C_WRITE:
+        printf("I2C_WRITE %s reg=0x%02x length=%u data=",
+               i2c_device_name(event.arg0 >> 8), event.arg0 & 0xff,
+               event.arg2);
+        for (uint32_t j = 0; j < event.arg2 && j < 4; ++j)
+          printf("%02x", (event.arg1 >> (8 * j)) & 0xff);
+        if (event.arg2 > 4)
+          printf("..");
+        printf(" result=%d duration=%.1fus\n", event.result,
+               event.duration * 1e-3);
+        break;
+      case FR_EVENT_TRANSFER_ERROR:
+        printf("TRANSFER_ERROR status=%u actual_length=%u active_transfers=%u\n",
+               event.arg0, event.arg1, event.arg2);
+        break;
+      case FR_EVENT_ADC_STATUS:
+        printf("ADC_STATUS %s -> %s\n", adc_status_name(event.arg1),
+               adc_status_name(event.arg0));
+        break;
+      default:
+        printf("UNKNOWN type=%u args=%u,%u,%u result=%d\n", event.type,
+               event.arg0, event.arg1, event.arg2, event.result);
+        break;
+    }
+  }
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  fclose(f);
+  return ret_val;
+}
+
+
+/* these must match usb_device.h and adc.c */
+static const char *control_request_name(uint16_t request)
+{
+  switch (request) {
+    case 0xaa: return "STARTFX3";
+    case 0xab: return "STOPFX3";
+    case 0xac: return "TESTFX3";
+    case 0xcc: return "RESETFX3";
+    case 0xdd: return "PAUSEFX3";
+    case 0xbc: return "GPIOFX3";
+    case 0xba: return "I2CWFX3";
+    case 0xbe: return "I2CRFX3";
+  }
+  return "UNKNOWN";
+}
+
+
+static const char *i2c_device_name(uint8_t address)
+{
+  switch (address) {
+    case 0x60 << 1: return "Si5351";
+    case 0x1a: return "R820T2";
+  }
+  return "unknown";
+}
+
+
+static const char *adc_status_name(uint32_t status)
+{
+  switch (status) {
+    case 0: return "OFF";
+    case 1: return "READY";
+    case 2: return "STREAMING";
+    case 3: return "CANCELLED";
+    case 0xff: return "FAILED";
+  }
+  return "UNKNOWN";
+}
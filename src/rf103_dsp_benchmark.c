@@ -0,0 +1,372 @@
+/*
+ * rf103_dsp_benchmark - FIR kernel benchmark
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+
+/* runs the decimating FIR of the DDC for each decimation (with its own
+ * filter) and the resampler interpolation for a few phase lengths, with the
+ * generic C kernel and with the kernel dsp_get_fir_*() picks, checks that
+ * they agree and prints the time per input (or output) sample; then runs
+ * the float and the 16 bit fixed point DDC on the same tone (plus a little
+ * noise) and prints their throughput on one core and the SNR of the fixed
+ * point output against the float one; last it runs the Goertzel tone bank
+ * for a few numbers of tones on a real input with two known tones and
+ * prints the cost per tone and the error on their amplitude and phase;
+ * RF103_DSP_KERNELS=sse2 leaves the AVX2 kernels out */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ddc.h"
+#include "ddc16.h"
+#include "dsp_kernels.h"
+#include "fir_design.h"
+#include "tone_bank.h"
+
+
+static double decimate_time(dsp_fir_decimate_t kernel,
+                            const struct fir_taps *fir, uint32_t decimation,
+                            float *output);
+static double interpolate_time(dsp_fir_interpolate_t kernel,
+                               uint32_t phase_taps, float *output);
+static int compare_ddc(uint32_t decimation, double amplitude);
+static int compare_tone_bank(uint32_t ntones);
+static double max_difference(const float *a, const float *b, uint32_t n);
+static double now();
+
+static const uint32_t decimations[] = { 2, 4, 8, 16, 32, 64 };
+static const uint32_t phase_lengths[] = { 176, 344, 680, 1352, 2704 };
+static const double DDC_SAMPLE_RATE = 64e6;
+static const double DDC_FREQUENCY = 10e6;
+static const uint32_t tone_counts[] = { 8, 64, 256, 1024 };
+static const double TONE_BANK_SAMPLE_RATE = 2e6;
+static const uint32_t TONE_BANK_BLOCK = 20000;   /* 100Hz bins */
+enum {
+  DDC_FRAME = 65536,
+  DDC_FRAMES = 64,
+  INPUT_SIZE = 65536,
+  INTERPOLATE_OUTPUTS = 16384,
+  PASSES = 50
+};
+
+static float input_re[INPUT_SIZE];
+static float input_im[INPUT_SIZE];
+static float taps[2 * 2704];
+static int16_t ddc_input[DDC_FRAMES * DDC_FRAME];
+
+
+int main(int argc, char **argv)
+{
+  if (argc > 1) {
+    fprintf(stderr, "usage: %s\n", argv[0]);
+    return -1;
+  }
+
+  for (int i = 0; i < INPUT_SIZE; ++i) {
+    input_re[i] = (float) rand() / RAND_MAX - 0.5f;
+    input_im[i] = (float) rand() / RAND_MAX - 0.5f;
+  }
+  for (size_t i = 0; i < sizeof(taps) / sizeof(taps[0]); ++i)
+    taps[i] = (float) rand() / RAND_MAX - 0.5f;
+  float *generic_output = (float *) malloc(2 * INPUT_SIZE * sizeof(float));
+  float *kernel_output = (float *) malloc(2 * INPUT_SIZE * sizeof(float));
+  if (generic_output == 0 || kernel_output == 0) {
+    fprintf(stderr, "ERROR - buffer allocation failed\n");
+    return -1;
+  }
+
+  int ret_val = 0;
+
+  printf("decimating FIR (ns per input sample)\n");
+  printf("decimation  taps  kernel        generic  kernel  speedup  max error\n");
+  for (size_t i = 0; i < sizeof(decimations) / sizeof(decimations[0]); ++i) {
+    uint32_t decimation = decimations[i];
+    struct fir_design_spec spec = {
+      .method = FIR_DESIGN_KAISER,
+      .passband = 0.3 / decimation,
+      .stopband = 0.7 / decimation,
+      .attenuation = 80.0,
+      .ripple = 0.0,
+      .gain = 1.0
+    };
+    const struct fir_taps *fir = fir_design_lowpass(&spec);
+    if (fir == 0) {
+      fprintf(stderr, "ERROR - fir_design_lowpass() failed\n");
+      ret_val = -1;
+      break;
+    }
+    dsp_fir_decimate_t kernel = dsp_get_fir_decimate(fir->padded_taps);
+    double generic = decimate_time(dsp_fir_decimate_generic, fir, decimation,
+                                   generic_output);
+    double selected = decimate_time(kernel, fir, decimation, kernel_output);
+    uint32_t noutput = (INPUT_SIZE - fir->padded_taps) / decimation + 1;
+    double error = max_difference(generic_output, kernel_output, 2 * noutput);
+    printf("%10u  %4u  %-12s %7.2f %7.2f %7.2fx  %9.2e\n", decimation,
+           fir->padded_taps, dsp_get_fir_decimate_name(kernel), generic * 1e9,
+           selected * 1e9, generic / selected, error);
+    if (error > 1e-4)
+      ret_val = -1;
+    fir_release_taps(fir);
+  }
+
+  printf("\nresampler interpolation (ns per output sample)\n");
+  printf("phase taps  kernel        generic  kernel  speedup  max error\n");
+  for (size_t i = 0; i < sizeof(phase_lengths) / sizeof(phase_lengths[0]); ++i) {
+    uint32_t phase_taps = phase_lengths[i];
+    dsp_fir_interpolate_t kernel = dsp_get_fir_interpolate(phase_taps);
+    double generic = interpolate_time(dsp_fir_interpolate_generic, phase_taps,
+                                      generic_output);
+    double selected = interpolate_time(kernel, phase_taps, kernel_output);
+    double error = max_difference(generic_output, kernel_output,
+                                  2 * INTERPOLATE_OUTPUTS);
+    printf("%10u  %-12s %7.2f %7.2f %7.2fx  %9.2e\n", phase_taps,
+           dsp_get_fir_interpolate_name(kernel), generic * 1e9,
+           selected * 1e9, generic / selected, error);
+    if (error > 1e-3)
+      ret_val = -1;
+  }
+
+  printf("\nDDC at %.0f Msps, float against 16 bit fixed point\n",
+         DDC_SAMPLE_RATE / 1e6);
+  printf("decimation  tone dBFS   float Msps  fixed Msps  SNR dB\n");
+  for (size_t i = 0; i < sizeof(decimations) / sizeof(decimations[0]); ++i) {
+    if (compare_ddc(decimations[i], 0.9) < 0 ||
+        compare_ddc(decimations[i], 0.01) < 0) {
+      ret_val = -1;
+      break;
+    }
+  }
+
+  printf("\nGoertzel tone bank at %.0f Msps, %u sample blocks\n",
+         TONE_BANK_SAMPLE_RATE / 1e6, TONE_BANK_BLOCK);
+  printf("tones  kernel      generic  kernel  speedup  ns/tone/sample  %%core/tone/Msps  amplitude err  phase err\n");
+  for (size_t i = 0; i < sizeof(tone_counts) / sizeof(tone_counts[0]); ++i) {
+    if (compare_tone_bank(tone_counts[i]) < 0) {
+      ret_val = -1;
+      break;
+    }
+  }
+
+  if (ret_val < 0)
+    fprintf(stderr, "ERROR - the kernels do not agree\n");
+  free(generic_output);
+  free(kernel_output);
+  return ret_val;
+}
+
+
+/* seconds per input sample */
+static double decimate_time(dsp_fir_decimate_t kernel,
+                            const struct fir_taps *fir, uint32_t decimation,
+                            float *output)
+{
+  uint32_t consumed = 0;
+  double start = now();
+  for (int n = 0; n < PASSES; ++n)
+    kernel(fir->taps, fir->padded_taps, input_re, input_im, INPUT_SIZE,
+           decimation, output, &consumed);
+  return (now() - start) / PASSES / consumed;
+}
+
+
+/* seconds per output sample; the outputs walk through the input with a
+   different fraction each time */
+static double interpolate_time(dsp_fir_interpolate_t kernel,
+                               uint32_t phase_taps, float *output)
+{
+  uint32_t span = INPUT_SIZE - phase_taps;
+  double start = now();
+  for (int n = 0; n < PASSES; ++n) {
+    for (uint32_t k = 0; k < INTERPOLATE_OUTPUTS; ++k) {
+      uint32_t offset = (k * 3) % span;
+      kernel(taps, taps + phase_taps, (k % 64) / 64.0f, phase_taps,
+             input_re + offset, input_im + offset, output + 2 * k);
+    }
+  }
+  return (now() - start) / PASSES / INTERPOLATE_OUTPUTS;
+}
+
+
+static int compare_ddc(uint32_t decimation, double amplitude);
+/* the tone is in the passband, a quarter of the output rate away from
+   the DDC frequency */
+static int compare_ddc(uint32_t decimation, double amplitude)
+{
+  double tone = DDC_FREQUENCY + DDC_SAMPLE_RATE / decimation / 4;
+  for (uint32_t k = 0; k < DDC_FRAMES * DDC_FRAME; ++k) {
+    double x = amplitude * 32767 * cos(2 * M_PI * tone / DDC_SAMPLE_RATE * k);
+    ddc_input[k] = (int16_t) lrint(x + 4.0 * rand() / RAND_MAX - 2.0);
+  }
+
+  ddc_t *ddc = ddc_open(DDC_SAMPLE_RATE, DDC_FREQUENCY, decimation);
+  ddc16_t *ddc16 = ddc16_open(DDC_SAMPLE_RATE, DDC_FREQUENCY, decimation);
+  uint32_t max_output = DDC_FRAMES * (DDC_FRAME / decimation + 1);
+  float *output = (float *) malloc(2 * max_output * sizeof(float));
+  int16_t *output16 = (int16_t *) malloc(2 * max_output * sizeof(int16_t));
+  if (ddc == 0 || ddc16 == 0 || output == 0 || output16 == 0) {
+    fprintf(stderr, "ERROR - DDC setup failed\n");
+    return -1;
+  }
+
+  uint32_t noutput = 0;
+  double start = now();
+  for (int n = 0; n < DDC_FRAMES; ++n)
+    noutput += ddc_process(ddc, ddc_input + n * DDC_FRAME, DDC_FRAME,
+                           output + 2 * noutput);
+  double float_time = now() - start;
+  uint32_t noutput16 = 0;
+  start = now();
+  for (int n = 0; n < DDC_FRAMES; ++n)
+    noutput16 += ddc16_process(ddc16, ddc_input + n * DDC_FRAME, DDC_FRAME,
+                               output16 + 2 * noutput16);
+  double fixed_time = now() - start;
+
+  /* skip the filter start up */
+  double signal = 0;
+  double error = 0;
+  uint32_t n = noutput < noutput16 ? noutput : noutput16;
+  for (uint32_t k = 2 * (n / 8); k < 2 * n; ++k) {
+    double reference = output[k] * 32768.0;
+    signal += reference * reference;
+    error += (output16[k] - reference) * (output16[k] - reference);
+  }
+  printf("%10u  %9.1f  %11.1f %11.1f  %6.1f\n", decimation,
+         20 * log10(amplitude), DDC_FRAMES * DDC_FRAME / float_time / 1e6,
+         DDC_FRAMES * DDC_FRAME / fixed_time / 1e6,
+         10 * log10(signal / error));
+
+  ddc_close(ddc);
+  ddc16_close(ddc16);
+  free(output);
+  free(output16);
+  return 0;
+}
+
+
+/* the generic and the selected kernel on the same states, then the whole
+   tone bank (with the conversion and the block outputs) for the cost */
+static int compare_tone_bank(uint32_t ntones)
+{
+  float *coefficients = (float *) malloc(2 * ntones * sizeof(float));
+  float *signs = coefficients + ntones;
+  float *states = (float *) calloc(4 * ntones, sizeof(float));
+  double *frequencies = (double *) malloc(ntones * sizeof(double));
+  if (coefficients == 0 || states == 0 || frequencies == 0) {
+    fprintf(stderr, "ERROR - tone bank setup failed\n");
+    return -1;
+  }
+  for (uint32_t k = 0; k < ntones; ++k) {
+    frequencies[k] = 1000.0 + k * 900.0;
+    coefficients[k] = (float) (-4 * pow(sin(M_PI * frequencies[k] /
+                                            TONE_BANK_SAMPLE_RATE), 2));
+    signs[k] = 1;
+  }
+
+  uint32_t ninput = INPUT_SIZE / 16;
+  dsp_goertzel_t kernel = dsp_get_goertzel(ntones);
+  double start = now();
+  for (int n = 0; n < PASSES; ++n)
+    dsp_goertzel_generic(coefficients, signs, states, states + ntones,
+                         ntones, input_re, ninput);
+  double generic = (now() - start) / PASSES / ninput / ntones;
+  start = now();
+  for (int n = 0; n < PASSES; ++n)
+    kernel(coefficients, signs, states + 2 * ntones, states + 3 * ntones,
+           ntones, input_re, ninput);
+  double selected = (now() - start) / PASSES / ninput / ntones;
+  /* relative to the largest state */
+  double state_scale = 0;
+  for (uint32_t k = 0; k < 2 * ntones; ++k)
+    state_scale = fabs(states[k]) > state_scale ? fabs(states[k]) : state_scale;
+  double state_error = max_difference(states, states + 2 * ntones, 2 * ntones) /
+                       state_scale;
+
+  /* two tones at the frequencies of tones 0 and 1, the rest is noise */
+  const double amplitudes[2] = { 0.5, 0.01 };
+  const double phases[2] = { 1.0, -2.0 };
+  uint32_t nsamples = DDC_FRAMES * DDC_FRAME;
+  for (uint32_t n = 0; n < nsamples; ++n) {
+    double x = 4.0 * rand() / RAND_MAX - 2.0;
+    for (int j = 0; j < 2; ++j)
+      x += amplitudes[j] * 32767 * cos(2 * M_PI * frequencies[j] /
+                                       TONE_BANK_SAMPLE_RATE * n + phases[j]);
+    ddc_input[n] = (int16_t) lrint(x);
+  }
+  tone_bank_t *tone_bank = tone_bank_open(TONE_BANK_SAMPLE_RATE, frequencies,
+                                          ntones, TONE_BANK_BLOCK, 0);
+  float *output = (float *) malloc(tone_bank_max_output(tone_bank, nsamples) *
+                                   sizeof(float));
+  if (tone_bank == 0 || output == 0) {
+    fprintf(stderr, "ERROR - tone bank setup failed\n");
+    return -1;
+  }
+  uint32_t noutput = 0;
+  start = now();
+  for (int n = 0; n < DDC_FRAMES; ++n)
+    noutput += tone_bank_process(tone_bank, ddc_input + n * DDC_FRAME,
+                                 DDC_FRAME, output + noutput);
+  double bank = (now() - start) / nsamples / ntones;
+
+  /* the same amplitude and phase in every block */
+  double amplitude_error = 0;
+  double phase_error = 0;
+  for (uint32_t b = 0; b < noutput; b += 2 * ntones) {
+    for (int j = 0; j < 2; ++j) {
+      double e = fabs(output[b + 2 * j] / amplitudes[j] - 1);
+      amplitude_error = e > amplitude_error ? e : amplitude_error;
+      e = fabs(remainder(output[b + 2 * j + 1] - phases[j], 2 * M_PI));
+      phase_error = e > phase_error ? e : phase_error;
+    }
+  }
+  printf("%5u  %-10s %7.3f %7.3f %7.2fx  %14.3f  %15.4f  %12.2e  %9.2e\n",
+         ntones, dsp_get_goertzel_name(kernel), generic * 1e9, selected * 1e9,
+         generic / selected, bank * 1e9, bank * 1e6 * 100,
+         amplitude_error, phase_error);
+
+  tone_bank_close(tone_bank);
+  free(output);
+  free(coefficients);
+  free(states);
+  free(frequencies);
+  return state_error < 1e-3 && amplitude_error < 1e-2 && phase_error < 1e-2 ? 0 : -1;
+}
+
+
+static double max_difference(const float *a, const float *b, uint32_t n)
+{
+  double max = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    double d = fabs(a[i] - b[i]);
+    if (d > max)
+      max = d;
+  }
+  return max;
+}
+
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9 * t.tv_nsec;
+}
@@ -0,0 +1,499 @@
+/*
+ * rf103_skimmer - multi-band front end for digital mode skimmers
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* every dial frequency becomes a channel of one fast convolution
+ * channelizer, which is resampled to 12kHz and turned into upper sideband
+ * audio; the audio is cut into files (or written to named pipes) aligned to
+ * the UTC slots of the digital modes (15s for FT8, 120s for WSPR, ...), as
+ * the decoders expect.  Time comes from the sample count: since the start
+ * of streaming for the device, since the start time in the header for a
+ * recording (or the epoch if it has none)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rf103.h"
+#include "birdie.h"
+#include "channelizer.h"
+#include "resampler.h"
+#include "wavehdr.h"
+#include "waveread.h"
+
+
+struct band;
+
+static void channelizer_callback(uint32_t data_size, uint8_t *data,
+                                 void *context);
+static void channel_callback(int channel, const float *samples,
+                             uint32_t nsamples, void *context);
+static void write_audio(struct band *band);
+static int open_slot(struct band *band);
+static void stop_handler(int signum);
+
+static const uint32_t fft_size = 131072;
+static const double channel_bandwidth = 8000.0;
+static const double audio_rate = 12000.0;
+/* the channel is centered 3kHz above the dial, so the audio passband is
+   200Hz - 5800Hz */
+static const double audio_center = 3000.0;
+static const double audio_passband = 2800.0;
+static const double audio_stopband = 3200.0;
+static const double audio_attenuation = 70.0;
+
+enum {
+  MAX_BANDS = 64,
+  AUDIO_BLOCK = 1024,            /* samples per write (atomic on pipes) */
+  RESAMPLED_SIZE = 256
+};
+
+struct band {
+  double dial;
+  resampler_t *resampler;
+  float resampled[2 * RESAMPLED_SIZE];
+  int16_t audio[AUDIO_BLOCK];
+  uint32_t naudio;
+  uint64_t position;             /* first sample in audio[] */
+  uint32_t phase;                /* of the 3kHz shift (n mod 4) */
+  time_t next_slot;
+  uint64_t next_slot_position;
+  int fd;
+  char filename[1024];           /* of the slot being written */
+  unsigned long long slots;
+  unsigned long long dropped;
+};
+
+static struct band bands[MAX_BANDS];
+static int nbands = 0;
+static channelizer_t *channelizer = 0;
+static const char *output_directory;
+static int use_pipes = 0;
+static unsigned slot_seconds;
+static uint64_t slot_samples;
+static double start_time;        /* UTC of the first input sample */
+static double audio_delay;       /* of the channel and audio filters */
+static float audio_gain;
+static unsigned long long input_samples = 0;
+static double sample_rate = 0.0;
+static volatile sig_atomic_t stop_streaming = 0;
+
+
+int main(int argc, char **argv)
+{
+  int from_file = argc >= 5 && strlen(argv[3]) > 4 &&
+                  strcmp(argv[3] + strlen(argv[3]) - 4, ".wav") == 0;
+  if (argc < (from_file ? 5 : 6)) {
+    fprintf(stderr, "usage: %s <slot seconds> <output directory> <wav file> <dial frequency>...\n", argv[0]);
+    fprintf(stderr, "       %s <slot seconds> <output directory> <image file> <sample rate> <dial frequency>...\n", argv[0]);
+    fprintf(stderr, "every band is written as 12kHz USB audio in a WAV file per slot (<YYMMDD_HHMMSS>_<dial>.wav)\n");
+    fprintf(stderr, "set RF103_SKIMMER_PIPES=1 to write raw 16 bit audio to the named pipes <dial>.raw instead\n");
+    fprintf(stderr, "set RF103_SKIMMER_GAIN=<dB> to change the audio gain (default 40dB)\n");
+    fprintf(stderr, "set RF103_BIRDIES=<file> to cut the birdies listed in it out of the bands\n");
+    return -1;
+  }
+  slot_seconds = (unsigned) atoi(argv[1]);
+  if (slot_seconds == 0) {
+    fprintf(stderr, "ERROR - invalid slot length: %s\n", argv[1]);
+    return -1;
+  }
+  slot_samples = (uint64_t) slot_seconds * (uint64_t) audio_rate;
+  output_directory = argv[2];
+  const char *pipes = getenv("RF103_SKIMMER_PIPES");
+  use_pipes = pipes && atoi(pipes) != 0;
+  const char *gain = getenv("RF103_SKIMMER_GAIN");
+  audio_gain = (float) (32767.0 * pow(10.0, (gain ? atof(gain) : 40.0) / 20.0));
+  /* a broken pipe is handled where the write fails */
+  signal(SIGPIPE, SIG_IGN);
+
+  int ret_val = -1;
+  rf103_t *rf103 = 0;
+  int streaming = 0;
+  int first_dial = from_file ? 4 : 5;
+
+  rf103_graph_t *graph = rf103_graph_open();
+  if (graph == 0) {
+    fprintf(stderr, "ERROR - rf103_graph_open() failed\n");
+    return -1;
+  }
+
+  int source;
+  if (from_file) {
+    /* recordings are processed as fast as possible */
+    source = rf103_graph_add_file_source(graph, argv[3], 0, &sample_rate);
+    if (source < 0) {
+      fprintf(stderr, "ERROR - rf103_graph_add_file_source() failed\n");
+      goto DONE;
+    }
+    FILE *file = fopen(argv[3], "rb");
+    if (file) {
+      unsigned samplerate;
+      unsigned frequency;
+      int bits_per_sample;
+      int num_channels = 0;
+      uint64_t num_frames;
+      time_t start;
+      double fraction;
+      if (waveReadHeader(file, &samplerate, &frequency, &bits_per_sample,
+                         &num_channels, &num_frames) == 0 &&
+          waveGetStartTime(&start, &fraction) == 0)
+        start_time = start + fraction;
+      fclose(file);
+      if (num_channels != 1) {
+        fprintf(stderr, "ERROR - the recording must have the real ADC samples\n");
+        goto DONE;
+      }
+    }
+  } else {
+    sscanf(argv[4], "%lf", &sample_rate);
+    if (sample_rate <= 0) {
+      fprintf(stderr, "ERROR - given samplerate '%f' should be > 0\n", sample_rate);
+      goto DONE;
+    }
+    rf103 = rf103_open(0, argv[3]);
+    if (rf103 == 0) {
+      fprintf(stderr, "ERROR - rf103_open() failed\n");
+      goto DONE;
+    }
+    if (rf103_set_sample_rate(rf103, sample_rate) < 0) {
+      fprintf(stderr, "ERROR - rf103_set_sample_rate() failed\n");
+      goto DONE;
+    }
+    source = rf103_graph_add_device_source(graph, rf103, SAMPLE_TYPE_S16);
+    if (source < 0) {
+      fprintf(stderr, "ERROR - rf103_graph_add_device_source() failed\n");
+      goto DONE;
+    }
+    if (rf103_set_async_params(rf103, 0, 0, 0, 0) < 0) {
+      fprintf(stderr, "ERROR - rf103_set_async_params() failed\n");
+      goto DONE;
+    }
+  }
+
+  channelizer = channelizer_open(sample_rate, fft_size, channel_callback, 0);
+  if (channelizer == 0) {
+    fprintf(stderr, "ERROR - channelizer_open() failed\n");
+    goto DONE;
+  }
+  for (int i = first_dial; i < argc; ++i) {
+    if (nbands == MAX_BANDS) {
+      fprintf(stderr, "ERROR - too many bands\n");
+      goto DONE;
+    }
+    struct band *band = &bands[nbands];
+    band->dial = atof(argv[i]);
+    band->fd = -1;
+    int channel = channelizer_add_channel(channelizer,
+                                          band->dial + audio_center,
+                                          channel_bandwidth);
+    if (channel < 0) {
+      fprintf(stderr, "ERROR - channelizer_add_channel() failed\n");
+      goto DONE;
+    }
+    band->resampler = resampler_open(channelizer_get_sample_rate(channelizer, channel),
+                                     audio_rate, audio_passband,
+                                     audio_stopband, audio_attenuation);
+    if (band->resampler == 0) {
+      fprintf(stderr, "ERROR - resampler_open() failed\n");
+      goto DONE;
+    }
+    nbands++;
+    /* all the channels have the same rate, so the same delay */
+    audio_delay = channelizer_get_delay(channelizer, channel) +
+                  resampler_get_delay(band->resampler);
+    if (use_pipes) {
+      snprintf(band->filename, sizeof(band->filename), "%s/%.0f.raw",
+               output_directory, band->dial);
+      if (mkfifo(band->filename, 0644) < 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR - mkfifo(%s) failed: %s\n", band->filename,
+                strerror(errno));
+        goto DONE;
+      }
+    }
+  }
+
+  /* the birdies are cut out in the frequency domain, which costs nothing
+     (the list is the one kept by the birdie filter stage) */
+  const char *birdie_file = getenv("RF103_BIRDIES");
+  if (birdie_file) {
+    struct rf103_birdie birdies[256];
+    int nbirdies = birdie_read_list(birdie_file, birdies,
+                                    sizeof(birdies) / sizeof(birdies[0]));
+    if (nbirdies < 0) {
+      fprintf(stderr, "ERROR - birdie_read_list() failed\n");
+      goto DONE;
+    }
+    for (int i = 0; i < nbirdies; ++i) {
+      if (birdies[i].width > 0 &&
+          channelizer_excise(channelizer, birdies[i].frequency,
+                             birdies[i].width) < 0) {
+        fprintf(stderr, "ERROR - channelizer_excise() failed\n");
+        goto DONE;
+      }
+    }
+  }
+
+  int sink = rf103_graph_add_callback_sink(graph, SAMPLE_TYPE_S16,
+                                           channelizer_callback, 0);
+  if (sink < 0 || rf103_graph_connect(graph, source, sink) < 0) {
+    fprintf(stderr, "ERROR - graph setup failed\n");
+    goto DONE;
+  }
+
+  if (rf103_graph_start(graph, 1) < 0) {
+    fprintf(stderr, "ERROR - rf103_graph_start() failed\n");
+    goto DONE;
+  }
+
+  if (from_file) {
+    /* until the end of the file */
+    ret_val = rf103_graph_wait(graph);
+  } else {
+    if (rf103_start_streaming(rf103) < 0) {
+      fprintf(stderr, "ERROR - rf103_start_streaming() failed\n");
+      rf103_graph_stop(graph);
+      rf103_graph_wait(graph);
+      goto DONE;
+    }
+    /* the samples are only delivered from rf103_handle_events() below */
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    start_time = now.tv_sec + 1e-9 * now.tv_nsec;
+    streaming = 1;
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    while (!stop_streaming)
+      rf103_handle_events(rf103);
+    if (rf103_stop_streaming(rf103) < 0) {
+      fprintf(stderr, "ERROR - rf103_stop_streaming() failed\n");
+    }
+    streaming = 0;
+    rf103_graph_stop(graph);
+    ret_val = rf103_graph_wait(graph);
+  }
+
+  for (int i = 0; i < nbands; ++i) {
+    if (bands[i].naudio > 0)
+      write_audio(&bands[i]);
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  double cpu = usage.ru_utime.tv_sec + 1e-6 * usage.ru_utime.tv_usec +
+               usage.ru_stime.tv_sec + 1e-6 * usage.ru_stime.tv_usec;
+  double seconds = input_samples / sample_rate;
+  fprintf(stderr, "processed %.1fs of signal in %.1fs of CPU (%.0f%% of one core)\n",
+          seconds, cpu, seconds > 0 ? 100.0 * cpu / seconds : 0.0);
+  for (int i = 0; i < nbands; ++i)
+    fprintf(stderr, "%.0f Hz: %llu slots, %llu samples dropped\n",
+            bands[i].dial, bands[i].slots, bands[i].dropped);
+
+DONE:
+  if (streaming)
+    rf103_stop_streaming(rf103);
+  rf103_graph_close(graph);
+  for (int i = 0; i < nbands; ++i) {
+    struct band *band = &bands[i];
+    if (band->fd >= 0) {
+      close(band->fd);
+      /* an incomplete slot is of no use to the decoders */
+      if (!use_pipes && band->position != band->next_slot_position)
+        unlink(band->filename);
+    }
+    resampler_close(band->resampler);
+  }
+  if (channelizer)
+    channelizer_close(channelizer);
+  if (rf103)
+    rf103_close(rf103);
+
+  return ret_val;
+}
+
+static void channelizer_callback(uint32_t data_size, uint8_t *data,
+                                 void *context __attribute__((unused)) )
+{
+  uint32_t nsamples = data_size / sizeof(int16_t);
+  channelizer_process(channelizer, (const int16_t *) data, nsamples);
+  input_samples += nsamples;
+}
+
+static void channel_callback(int channel, const float *samples,
+                             uint32_t nsamples,
+                             void *context __attribute__((unused)) )
+{
+  struct band *band = &bands[channel];
+  while (nsamples > 0) {
+    uint32_t n = nsamples;
+    uint32_t max_output = resampler_max_output(band->resampler, n);
+    if (max_output > RESAMPLED_SIZE) {
+      n = n * (RESAMPLED_SIZE - 2) / max_output;
+    }
+    uint32_t noutput = resampler_process(band->resampler, samples, n,
+                                         band->resampled);
+    samples += 2 * n;
+    nsamples -= n;
+
+    /* shift the channel up by 3kHz (multiply by i^n) and keep the real part,
+       so the dial frequency ends up at 0Hz */
+    for (uint32_t i = 0; i < noutput; ++i) {
+      float re = band->resampled[2 * i];
+      float im = band->resampled[2 * i + 1];
+      float x;
+      switch (band->phase) {
+        case 0: x = re; break;
+        case 1: x = -im; break;
+        case 2: x = -re; break;
+        default: x = im; break;
+      }
+      band->phase = (band->phase + 1) & 3;
+      x *= audio_gain;
+      if (x > 32767.0f)
+        x = 32767.0f;
+      if (x < -32768.0f)
+        x = -32768.0f;
+      band->audio[band->naudio++] = (int16_t) lrintf(x);
+      if (band->naudio == AUDIO_BLOCK)
+        write_audio(band);
+    }
+  }
+}
+
+/* hands the audio to the slot file or the pipe of the current slot; the
+   first slot starts at the first slot boundary after the first sample */
+static void write_audio(struct band *band)
+{
+  uint64_t first = band->position;
+  uint64_t end = first + band->naudio;
+  band->position = end;
+  band->naudio = 0;
+
+  if (band->next_slot == 0) {
+    double time = start_time - audio_delay + first / audio_rate;
+    band->next_slot = ((time_t) floor(time / slot_seconds) + 1) * slot_seconds;
+    band->next_slot_position = (uint64_t) llround((band->next_slot - start_time +
+                                                   audio_delay) * audio_rate);
+    if (band->next_slot_position < first) {
+      band->next_slot += slot_seconds;
+      band->next_slot_position += slot_samples;
+    }
+  }
+
+  uint64_t position = first;
+  while (position < end) {
+    if (position == band->next_slot_position) {
+      /* a pipe stays open from one slot to the next */
+      if (band->fd >= 0 && !use_pipes) {
+        close(band->fd);
+        band->fd = -1;
+      }
+      if (band->fd >= 0 || open_slot(band) == 0)
+        band->slots++;
+      band->next_slot += slot_seconds;
+      band->next_slot_position += slot_samples;
+    }
+    uint64_t n = end - position;
+    if (band->next_slot_position - position < n)
+      n = band->next_slot_position - position;
+    if (band->fd >= 0) {
+      size_t size = n * sizeof(int16_t);
+      ssize_t written = write(band->fd, band->audio + (position - first), size);
+      if (written != (ssize_t) size) {
+        /* a full pipe drops the block (writes up to PIPE_BUF are all or
+           nothing); a reader that went away reconnects at the next slot */
+        band->dropped += n;
+        if (!(use_pipes && written < 0 && errno == EAGAIN)) {
+          if (!use_pipes)
+            fprintf(stderr, "ERROR - write(%s) failed: %s\n", band->filename,
+                    strerror(errno));
+          close(band->fd);
+          band->fd = -1;
+        }
+      }
+    }
+    position += n;
+  }
+}
+
+static int open_slot(struct band *band)
+{
+  if (use_pipes) {
+    /* fails (ENXIO) while nobody is reading */
+    band->fd = open(band->filename, O_WRONLY | O_NONBLOCK);
+    return band->fd >= 0 ? 0 : -1;
+  }
+
+  struct tm tm;
+  gmtime_r(&band->next_slot, &tm);
+  char timestamp[32];
+  strftime(timestamp, sizeof(timestamp), "%y%m%d_%H%M%S", &tm);
+  snprintf(band->filename, sizeof(band->filename), "%s/%s_%.0f.wav",
+           output_directory, timestamp, band->dial);
+  band->fd = open(band->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (band->fd < 0) {
+    fprintf(stderr, "ERROR - open(%s) failed: %s\n", band->filename,
+            strerror(errno));
+    return -1;
+  }
+
+  /* the length of a slot is known, so the header is final right away */
+  uint32_t data_size = (uint32_t) (slot_samples * sizeof(int16_t));
+  struct {
+    riff_chunk r;
+    fmt_chunk f;
+    data_chunk d;
+  } __attribute__((packed)) header;
+  memcpy(header.r.hdr.ID, "RIFF", 4);
+  header.r.hdr.size = sizeof(header) - sizeof(chunk_hdr) + data_size;
+  memcpy(header.r.waveID, "WAVE", 4);
+  memcpy(header.f.hdr.ID, "fmt ", 4);
+  header.f.hdr.size = sizeof(fmt_chunk) - sizeof(chunk_hdr);
+  header.f.wFormatTag = 1;
+  header.f.nChannels = 1;
+  header.f.nSamplesPerSec = (int32_t) audio_rate;
+  header.f.nAvgBytesPerSec = (int32_t) audio_rate * sizeof(int16_t);
+  header.f.nBlockAlign = sizeof(int16_t);
+  header.f.nBitsPerSample = 16;
+  memcpy(header.d.hdr.ID, "data", 4);
+  header.d.hdr.size = data_size;
+  if (write(band->fd, &header, sizeof(header)) != sizeof(header)) {
+    fprintf(stderr, "ERROR - write(%s) failed: %s\n", band->filename,
+            strerror(errno));
+    close(band->fd);
+    band->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static void stop_handler(int signum __attribute__((unused)) )
+{
+  stop_streaming = 1;
+}
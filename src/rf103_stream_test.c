@@ -19,6 +19,7 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,10 +28,15 @@
 
 #include "rf103.h"
 #include "wavewrite.h"
+#include "metrics_server.h"
 
 
 static void count_bytes_callback(uint32_t data_size, uint8_t *data,
                                  void *context);
+static void print_signals_callback(uint32_t nsignals,
+                                   const struct rf103_signal *signals,
+                                   void *context);
+static void print_memory_report();
 
 static unsigned long long received_samples = 0;
 static unsigned long long total_samples = 0;
@@ -50,6 +56,10 @@ int main(int argc, char **argv)
 {
   if (argc < 3) {
     fprintf(stderr, "usage: %s <image file> <sample rate> [<runtime_in_ms> [<output_filename>]\n", argv[0]);
+    fprintf(stderr, "set %s=[<host>:]<port> to serve Prometheus metrics\n", METRICS_ADDRESS_ENV);
+    fprintf(stderr, "set RF103_FLIGHT_RECORDER_FILE=<file> to dump the flight recorder on failure or SIGUSR1\n");
+    fprintf(stderr, "set RF103_SIGNAL_THRESHOLD=<dB> to list the active carriers every second\n");
+    fprintf(stderr, "set RF103_MEMORY_BUDGET=<MB> to cap the memory used by the library\n");
     return -1;
   }
   char *imagefile = argv[1];
@@ -68,12 +78,43 @@ int main(int argc, char **argv)
 
   int ret_val = -1;
 
+  /* optional memory budget */
+  const char *memory_budget = getenv("RF103_MEMORY_BUDGET");
+  if (memory_budget) {
+    if (rf103_set_memory_budget((uint64_t) (atof(memory_budget) * 1048576)) < 0) {
+      fprintf(stderr, "ERROR - rf103_set_memory_budget() failed\n");
+      return -1;
+    }
+  }
+
   rf103_t *rf103 = rf103_open(0, imagefile);
   if (rf103 == 0) {
     fprintf(stderr, "ERROR - rf103_open() failed\n");
     return -1;
   }
 
+  /* optional Prometheus metrics endpoint */
+  metrics_server_t *metrics_server = 0;
+  const char *metrics_address = getenv(METRICS_ADDRESS_ENV);
+  if (metrics_address) {
+    metrics_server = metrics_server_open(metrics_address, rf103);
+    if (metrics_server == 0) {
+      fprintf(stderr, "ERROR - metrics_server_open() failed\n");
+      goto DONE;
+    }
+    fprintf(stderr, "serving metrics on %s\n", metrics_address);
+  }
+
+  /* optional flight recorder dump on failure or SIGUSR1 */
+  const char *flight_recorder_file = getenv("RF103_FLIGHT_RECORDER_FILE");
+  if (flight_recorder_file) {
+    if (rf103_flight_recorder_set_dump_file(flight_recorder_file) < 0 ||
+        rf103_flight_recorder_dump_on_signal(SIGUSR1) < 0) {
+      fprintf(stderr, "ERROR - flight recorder setup failed\n");
+      goto DONE;
+    }
+  }
+
   if (rf103_set_sample_rate(rf103, sample_rate) < 0) {
     fprintf(stderr, "ERROR - rf103_set_sample_rate() failed\n");
     goto DONE;
@@ -84,6 +125,17 @@ int main(int argc, char **argv)
     goto DONE;
   }
 
+  /* optional carrier detection */
+  const char *signal_threshold = getenv("RF103_SIGNAL_THRESHOLD");
+  if (signal_threshold) {
+    if (rf103_set_signal_detector(rf103, DETECTOR_CA_CFAR, 4096, 1.0,
+                                  atof(signal_threshold),
+                                  print_signals_callback, 0) < 0) {
+      fprintf(stderr, "ERROR - rf103_set_signal_detector() failed\n");
+      goto DONE;
+    }
+  }
+
   received_samples = 0;
   num_callbacks = 0;
   if (rf103_start_streaming(rf103) < 0) {
@@ -113,6 +165,7 @@ int main(int argc, char **argv)
   fprintf(stderr, "received=%llu 16-Bit samples in %d callbacks\n", received_samples, num_callbacks);
   fprintf(stderr, "run for %f sec\n", dur);
   fprintf(stderr, "approx. samplerate is %f kSamples/sec\n", received_samples / (1000.0*dur) );
+  print_memory_report();
 
   if (outfilename && sampleData && received_samples) {
     FILE * f = fopen(outfilename, "wb");
@@ -130,6 +183,8 @@ int main(int argc, char **argv)
   ret_val = 0;
 
 DONE:
+  if (metrics_server)
+    metrics_server_close(metrics_server);
   rf103_close(rf103);
 
   return ret_val;
@@ -145,7 +200,7 @@ static void count_bytes_callback(uint32_t data_size,
   unsigned N = data_size / sizeof(int16_t);
   if ( received_samples + N < total_samples ) {
     if (sampleData)
-      memcpy( sampleData+received_samples, data, data_size);
+      rf103_copy_frame( sampleData+received_samples, data, data_size);
     received_samples += N;
   }
   else {
@@ -154,3 +209,35 @@ static void count_bytes_callback(uint32_t data_size,
   }
 }
 
+
+static void print_signals_callback(uint32_t nsignals,
+                                   const struct rf103_signal *signals,
+                                   void *context __attribute__((unused)) )
+{
+  fprintf(stderr, "%u signals:\n", nsignals);
+  for (uint32_t i = 0; i < nsignals; ++i) {
+    fprintf(stderr, "  #%u %.3f kHz  bw=%.3f kHz  snr=%.1f dB  seen %.1f-%.1f s\n",
+            signals[i].id, signals[i].frequency / 1e3,
+            signals[i].bandwidth / 1e3, signals[i].snr,
+            signals[i].first_seen, signals[i].last_seen);
+  }
+}
+
+
+static void print_memory_report()
+{
+  struct rf103_memory_report report;
+  rf103_get_memory_report(&report);
+  fprintf(stderr, "library memory: %.1f MB (peak %.1f MB", report.used / 1048576.0,
+          report.peak / 1048576.0);
+  if (report.budget > 0)
+    fprintf(stderr, ", budget %.1f MB, %llu allocations refused",
+            report.budget / 1048576.0, (unsigned long long) report.denied);
+  fprintf(stderr, ")\n");
+  for (int i = 0; i < MEMORY_COMPONENTS; ++i) {
+    fprintf(stderr, "  %-10s %10.1f kB (peak %.1f kB)\n",
+            rf103_memory_component_name((enum RF103MemoryComponent) i),
+            report.component_used[i] / 1024.0,
+            report.component_peak[i] / 1024.0);
+  }
+}
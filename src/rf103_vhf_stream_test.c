@@ -19,6 +19,7 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +28,7 @@
 
 #include "rf103.h"
 #include "wavewrite.h"
+#include "metrics_server.h"
 
 
 static void count_bytes_callback(uint32_t data_size, uint8_t *data,
@@ -36,6 +38,7 @@ static unsigned long long received_samples = 0;
 static unsigned long long total_samples = 0;
 static int num_callbacks;
 static int16_t *sampleData = 0;
+static int numChannels = 1;     /* 2 = baseband I/Q */
 static int runtime = 3000;
 static struct timespec clk_start, clk_end;
 static int stop_reception = 0;
@@ -49,12 +52,15 @@ static double clk_diff() {
 int main(int argc, char **argv)
 {
   if (argc < 3) {
-    fprintf(stderr, "usage: %s <image file> <sample rate> [<runtime_in_ms> [<output_filename>]\n", argv[0]);
+    fprintf(stderr, "usage: %s <image file> <sample rate> [<runtime_in_ms> [<output_filename> [<baseband decimation>]]]\n", argv[0]);
+    fprintf(stderr, "set %s=[<host>:]<port> to serve Prometheus metrics\n", METRICS_ADDRESS_ENV);
+    fprintf(stderr, "set RF103_FLIGHT_RECORDER_FILE=<file> to dump the flight recorder on failure or SIGUSR1\n");
     return -1;
   }
   char *imagefile = argv[1];
   const char *outfilename = 0;
   double sample_rate = 0.0;
+  int decimation = 0;
 
   double vhf_frequency = 100e6;
   /* just playin' around with the tuner gain settings */
@@ -67,6 +73,8 @@ int main(int argc, char **argv)
     runtime = atoi(argv[3]);
   if (4 < argc)
     outfilename = argv[4];
+  if (5 < argc)
+    decimation = atoi(argv[5]);
 
   if (sample_rate <= 0) {
     fprintf(stderr, "ERROR - given samplerate '%f' should be > 0\n", sample_rate);
@@ -81,6 +89,28 @@ int main(int argc, char **argv)
     return -1;
   }
 
+  /* optional Prometheus metrics endpoint */
+  metrics_server_t *metrics_server = 0;
+  const char *metrics_address = getenv(METRICS_ADDRESS_ENV);
+  if (metrics_address) {
+    metrics_server = metrics_server_open(metrics_address, rf103);
+    if (metrics_server == 0) {
+      fprintf(stderr, "ERROR - metrics_server_open() failed\n");
+      goto DONE;
+    }
+    fprintf(stderr, "serving metrics on %s\n", metrics_address);
+  }
+
+  /* optional flight recorder dump on failure or SIGUSR1 */
+  const char *flight_recorder_file = getenv("RF103_FLIGHT_RECORDER_FILE");
+  if (flight_recorder_file) {
+    if (rf103_flight_recorder_set_dump_file(flight_recorder_file) < 0 ||
+        rf103_flight_recorder_dump_on_signal(SIGUSR1) < 0) {
+      fprintf(stderr, "ERROR - flight recorder setup failed\n");
+      goto DONE;
+    }
+  }
+
   if (rf103_set_sample_rate(rf103, sample_rate) < 0) {
     fprintf(stderr, "ERROR - rf103_set_sample_rate() failed\n");
     goto DONE;
@@ -101,6 +131,16 @@ int main(int argc, char **argv)
     goto DONE;
   }
 
+  if (decimation > 0) {
+    if (rf103_set_stream_format(rf103, STREAM_FORMAT_BASEBAND_CF32,
+                                decimation) < 0) {
+      fprintf(stderr, "ERROR - rf103_set_stream_format() failed\n");
+      goto DONE;
+    }
+    sample_rate /= decimation;
+    numChannels = 2;
+  }
+
   if (rf103_set_vhf_lna_gain(rf103, lna_gain) < 0) {
     fprintf(stderr, "ERROR - rf103_set_vhf_lna_gain() failed\n");
     goto DONE;
@@ -124,7 +164,7 @@ int main(int argc, char **argv)
   }
 
   fprintf(stderr, "started streaming .. for %d ms ..\n", runtime);
-  total_samples = (unsigned long long)(runtime * sample_rate / 1000.0);
+  total_samples = (unsigned long long)(runtime * sample_rate / 1000.0) * numChannels;
 
   if (outfilename)
     sampleData = (int16_t*)malloc(total_samples * sizeof(int16_t));
@@ -144,13 +184,13 @@ int main(int argc, char **argv)
   double dur = clk_diff();
   fprintf(stderr, "received=%llu 16-Bit samples in %d callbacks\n", received_samples, num_callbacks);
   fprintf(stderr, "run for %f sec\n", dur);
-  fprintf(stderr, "approx. samplerate is %f kSamples/sec\n", received_samples / (1000.0*dur) );
+  fprintf(stderr, "approx. samplerate is %f kSamples/sec\n", received_samples / numChannels / (1000.0*dur) );
 
   if (outfilename && sampleData && received_samples) {
     FILE * f = fopen(outfilename, "wb");
     if (f) {
-      fprintf(stderr, "saving received real samples to file ..\n");
-      waveWriteHeader( (unsigned)(0.5 + sample_rate), 0U /*frequency*/, 16 /*bitsPerSample*/, 1 /*numChannels*/, f);
+      fprintf(stderr, "saving received %s samples to file ..\n", numChannels == 2 ? "I/Q" : "real");
+      waveWriteHeader( (unsigned)(0.5 + sample_rate), numChannels == 2 ? (unsigned)vhf_frequency : 0U /*frequency*/, 16 /*bitsPerSample*/, numChannels, f);
       for ( unsigned long long off = 0; off + 65536 < received_samples; off += 65536 )
         waveWriteSamples(f,  sampleData + off, 65536, 0 /*needCleanData*/);
       waveFinalizeHeader(f);
@@ -162,6 +202,8 @@ int main(int argc, char **argv)
   ret_val = 0;
 
 DONE:
+  if (metrics_server)
+    metrics_server_close(metrics_server);
   rf103_close(rf103);
 
   return ret_val;
@@ -174,10 +216,31 @@ static void count_bytes_callback(uint32_t data_size,
   if (stop_reception)
     return;
   ++num_callbacks;
+  if (numChannels == 2) {
+    /* baseband: complex float I/Q, full scale 1.0 */
+    unsigned N = data_size / sizeof(float);
+    if ( received_samples + N < total_samples ) {
+      if (sampleData) {
+        const float *iq = (const float *) data;
+        for (unsigned i = 0; i < N; ++i) {
+          /* the filter overshoot can take a full scale input past 1.0 */
+          float sample = 32767.0f * iq[i];
+          sampleData[received_samples + i] = sample > 32767.0f ? 32767 :
+                                             sample < -32768.0f ? -32768 :
+                                             (int16_t) sample;
+        }
+      }
+      received_samples += N;
+      return;
+    }
+    clock_gettime(CLOCK_REALTIME, &clk_end);
+    stop_reception = 1;
+    return;
+  }
   unsigned N = data_size / sizeof(int16_t);
   if ( received_samples + N < total_samples ) {
     if (sampleData)
-      memcpy( sampleData+received_samples, data, data_size);
+      rf103_copy_frame( sampleData+received_samples, data, data_size);
     received_samples += N;
   }
   else {
@@ -0,0 +1,215 @@
+/*
+ * rf103_waterfall_server - spectrum/waterfall server for web browsers
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rf103.h"
+#include "waterfall_server.h"
+#include "waveread.h"
+
+
+static void publish_callback(uint32_t data_size, uint8_t *data,
+                             void *context);
+static void stop_handler(int signum);
+
+static const uint32_t fft_size = 16384;
+static const uint32_t averages = 4;
+static const double lines_per_second = 10.0;
+static const uint32_t width = 1024;
+static const uint32_t zoom_levels = 4;
+
+static waterfall_server_t *waterfall_server = 0;
+static uint32_t nbins;
+static double first_frequency;
+static double bin_width;
+static volatile sig_atomic_t stop_streaming = 0;
+
+
+int main(int argc, char **argv)
+{
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "usage: %s <address> <wav file>\n", argv[0]);
+    fprintf(stderr, "       %s <address> <image file> <sample rate>\n", argv[0]);
+    fprintf(stderr, "address is [<host>:]<port>; open http://<address>/ in a browser\n");
+    return -1;
+  }
+  const char *address = argv[1];
+  int from_file = argc == 3;
+
+  int ret_val = -1;
+  rf103_t *rf103 = 0;
+  int streaming = 0;
+
+  rf103_graph_t *graph = rf103_graph_open();
+  if (graph == 0) {
+    fprintf(stderr, "ERROR - rf103_graph_open() failed\n");
+    return -1;
+  }
+
+  /* the same graph runs on a recording (in real time) or on the device */
+  double sample_rate = 0.0;
+  double center_frequency = 0.0;
+  enum RF103SampleType type = SAMPLE_TYPE_S16;
+  int source;
+  if (from_file) {
+    source = rf103_graph_add_file_source(graph, argv[2], 1, &sample_rate);
+    if (source < 0) {
+      fprintf(stderr, "ERROR - rf103_graph_add_file_source() failed\n");
+      goto DONE;
+    }
+    /* two channel files are I/Q around the frequency in their header */
+    FILE *file = fopen(argv[2], "rb");
+    if (file) {
+      unsigned samplerate;
+      unsigned frequency;
+      int bits_per_sample;
+      int num_channels;
+      uint64_t num_frames;
+      if (waveReadHeader(file, &samplerate, &frequency, &bits_per_sample,
+                         &num_channels, &num_frames) == 0 &&
+          num_channels == 2) {
+        type = SAMPLE_TYPE_CF32;
+        center_frequency = frequency;
+      }
+      fclose(file);
+    }
+  } else {
+    sscanf(argv[3], "%lf", &sample_rate);
+    if (sample_rate <= 0) {
+      fprintf(stderr, "ERROR - given samplerate '%f' should be > 0\n", sample_rate);
+      goto DONE;
+    }
+    rf103 = rf103_open(0, argv[2]);
+    if (rf103 == 0) {
+      fprintf(stderr, "ERROR - rf103_open() failed\n");
+      goto DONE;
+    }
+    if (rf103_set_sample_rate(rf103, sample_rate) < 0) {
+      fprintf(stderr, "ERROR - rf103_set_sample_rate() failed\n");
+      goto DONE;
+    }
+    source = rf103_graph_add_device_source(graph, rf103, type);
+    if (source < 0) {
+      fprintf(stderr, "ERROR - rf103_graph_add_device_source() failed\n");
+      goto DONE;
+    }
+    if (rf103_set_async_params(rf103, 0, 0, 0, 0) < 0) {
+      fprintf(stderr, "ERROR - rf103_set_async_params() failed\n");
+      goto DONE;
+    }
+  }
+
+  uint32_t frame_interval = (uint32_t) (sample_rate / (lines_per_second * averages));
+  if (frame_interval < fft_size) {
+    frame_interval = fft_size;
+  }
+  int spectrum = rf103_graph_add_spectrum(graph, type, fft_size, averages,
+                                          frame_interval);
+  int sink = rf103_graph_add_callback_sink(graph, SAMPLE_TYPE_F32,
+                                           publish_callback, 0);
+  if (spectrum < 0 || sink < 0 ||
+      rf103_graph_connect(graph, source, spectrum) < 0 ||
+      rf103_graph_connect(graph, spectrum, sink) < 0) {
+    fprintf(stderr, "ERROR - graph setup failed\n");
+    goto DONE;
+  }
+  if (type == SAMPLE_TYPE_S16) {
+    nbins = fft_size / 2;
+    first_frequency = 0.0;
+  } else {
+    nbins = fft_size;
+    first_frequency = center_frequency - sample_rate / 2;
+  }
+  bin_width = sample_rate / fft_size;
+
+  waterfall_server = waterfall_server_open(address, nbins, width, zoom_levels);
+  if (waterfall_server == 0) {
+    fprintf(stderr, "ERROR - waterfall_server_open() failed\n");
+    goto DONE;
+  }
+
+  if (rf103_graph_start(graph, 2) < 0) {
+    fprintf(stderr, "ERROR - rf103_graph_start() failed\n");
+    goto DONE;
+  }
+  fprintf(stderr, "serving the waterfall on http://%s/\n", address);
+
+  if (from_file) {
+    /* until the end of the file */
+    ret_val = rf103_graph_wait(graph);
+  } else {
+    if (rf103_start_streaming(rf103) < 0) {
+      fprintf(stderr, "ERROR - rf103_start_streaming() failed\n");
+      rf103_graph_stop(graph);
+      rf103_graph_wait(graph);
+      goto DONE;
+    }
+    streaming = 1;
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    while (!stop_streaming)
+      rf103_handle_events(rf103);
+    if (rf103_stop_streaming(rf103) < 0) {
+      fprintf(stderr, "ERROR - rf103_stop_streaming() failed\n");
+    }
+    streaming = 0;
+    rf103_graph_stop(graph);
+    ret_val = rf103_graph_wait(graph);
+  }
+
+  struct waterfall_server_stats stats;
+  waterfall_server_get_stats(waterfall_server, &stats);
+  fprintf(stderr, "lines published=%llu encoded=%llu sent=%llu dropped=%llu\n",
+          (unsigned long long) stats.frames_published,
+          (unsigned long long) stats.frames_encoded,
+          (unsigned long long) stats.frames_sent,
+          (unsigned long long) stats.frames_dropped);
+
+DONE:
+  if (streaming)
+    rf103_stop_streaming(rf103);
+  rf103_graph_close(graph);
+  if (waterfall_server)
+    waterfall_server_close(waterfall_server);
+  if (rf103)
+    rf103_close(rf103);
+
+  return ret_val;
+}
+
+static void publish_callback(uint32_t data_size, uint8_t *data,
+                             void *context __attribute__((unused)) )
+{
+  const float *power = (const float *) data;
+  uint32_t nspectra = data_size / (nbins * sizeof(float));
+  for (uint32_t i = 0; i < nspectra; ++i)
+    waterfall_server_publish(waterfall_server, power + i * nbins,
+                             first_frequency, bin_width);
+}
+
+static void stop_handler(int signum __attribute__((unused)) )
+{
+  stop_streaming = 1;
+}
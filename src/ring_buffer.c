@@ -0,0 +1,162 @@
+/*
+ * ring_buffer.c - ring buffer mapped twice back-to-back
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - https://en.wikipedia.org/wiki/Circular_buffer#Optimization
+ *  - memfd_create(2), mmap(2)
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ring_buffer.h"
+#include "memory_budget.h"
+#include "rf103.h"
+
+
+typedef struct ring_buffer ring_buffer_t;
+
+typedef struct ring_buffer {
+  size_t size;
+  uint8_t *data;             /* 2 * size bytes of address space */
+  atomic_uint_fast64_t head;
+} ring_buffer_t;
+
+
+ring_buffer_t *ring_buffer_open(size_t size)
+{
+  ring_buffer_t *ret_val = 0;
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  size = (size + page_size - 1) / page_size * page_size;
+  if (size == 0) {
+    fprintf(stderr, "ERROR - invalid ring buffer size: 0\n");
+    return ret_val;
+  }
+
+  /* the memory is there only once, however many times it is mapped */
+  if (memory_budget_reserve(MEMORY_RINGS, size, "ring buffer") < 0) {
+    return ret_val;
+  }
+
+  int fd = memfd_create("rf103_ring_buffer", MFD_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR - memfd_create() failed: %s\n", strerror(errno));
+    memory_budget_release(MEMORY_RINGS, size);
+    return ret_val;
+  }
+  if (ftruncate(fd, size) < 0) {
+    fprintf(stderr, "ERROR - ftruncate() failed: %s\n", strerror(errno));
+    close(fd);
+    memory_budget_release(MEMORY_RINGS, size);
+    return ret_val;
+  }
+
+  /* reserve the address space for both copies, then map the memfd over it */
+  uint8_t *data = (uint8_t *) mmap(0, 2 * size, PROT_NONE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "ERROR - mmap() failed: %s\n", strerror(errno));
+    close(fd);
+    memory_budget_release(MEMORY_RINGS, size);
+    return ret_val;
+  }
+  for (int i = 0; i < 2; ++i) {
+    void *addr = mmap(data + i * size, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, fd, 0);
+    if (addr == MAP_FAILED) {
+      fprintf(stderr, "ERROR - mmap() failed: %s\n", strerror(errno));
+      munmap(data, 2 * size);
+      close(fd);
+      memory_budget_release(MEMORY_RINGS, size);
+      return ret_val;
+    }
+  }
+  /* the mappings keep the memory alive */
+  close(fd);
+
+  /* we are good here - create and initialize the ring buffer */
+  ring_buffer_t *this = (ring_buffer_t *) malloc(sizeof(ring_buffer_t));
+  this->size = size;
+  this->data = data;
+  atomic_init(&this->head, 0);
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void ring_buffer_close(ring_buffer_t *this)
+{
+  munmap(this->data, 2 * this->size);
+  memory_budget_release(MEMORY_RINGS, this->size);
+  free(this);
+  return;
+}
+
+
+size_t ring_buffer_get_size(ring_buffer_t *this)
+{
+  return this->size;
+}
+
+
+uint64_t ring_buffer_get_head(ring_buffer_t *this)
+{
+  return atomic_load_explicit(&this->head, memory_order_acquire);
+}
+
+
+void *ring_buffer_get_pointer(ring_buffer_t *this, uint64_t position)
+{
+  return this->data + position % this->size;
+}
+
+
+void ring_buffer_advance(ring_buffer_t *this, size_t length)
+{
+  uint64_t head = atomic_load_explicit(&this->head, memory_order_relaxed);
+  atomic_store_explicit(&this->head, head + length, memory_order_release);
+  return;
+}
+
+
+int ring_buffer_write(ring_buffer_t *this, const void *data, size_t length)
+{
+  if (length > this->size) {
+    fprintf(stderr, "ERROR - ring_buffer_write() failed: %zu bytes do not fit in a %zu bytes ring\n",
+            length, this->size);
+    return -1;
+  }
+  uint64_t head = atomic_load_explicit(&this->head, memory_order_relaxed);
+  /* what goes into a ring is read back later, if ever */
+  rf103_copy_frame(this->data + head % this->size, data, (uint32_t) length);
+  atomic_store_explicit(&this->head, head + length, memory_order_release);
+  return 0;
+}
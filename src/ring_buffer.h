@@ -0,0 +1,62 @@
+/*
+ * ring_buffer.h - ring buffer mapped twice back-to-back
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __RING_BUFFER_H
+#define __RING_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ring_buffer ring_buffer_t;
+
+/* the same memory is mapped twice, one copy right after the other, so any
+ * span of up to 'size' bytes starting anywhere in the ring is contiguous;
+ * positions are absolute byte counts since the ring was opened
+ *
+ * one writer (ring_buffer_get_pointer() at the head + ring_buffer_advance(),
+ * or ring_buffer_write()), any number of readers; a reader must check that
+ * the head did not move more than 'size' past its span after reading it */
+
+/* size is rounded up to a multiple of the page size */
+ring_buffer_t *ring_buffer_open(size_t size);
+
+void ring_buffer_close(ring_buffer_t *this);
+
+size_t ring_buffer_get_size(ring_buffer_t *this);
+
+uint64_t ring_buffer_get_head(ring_buffer_t *this);
+
+void *ring_buffer_get_pointer(ring_buffer_t *this, uint64_t position);
+
+void ring_buffer_advance(ring_buffer_t *this, size_t length);
+
+int ring_buffer_write(ring_buffer_t *this, const void *data, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RING_BUFFER_H */
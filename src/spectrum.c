@@ -0,0 +1,253 @@
+/*
+ * spectrum.c - averaged power spectrum of a sample stream
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* frames are collected across calls (the stream is cut in arbitrary chunks),
+ * windowed while they are copied in and transformed with the library FFT;
+ * the power of the complex FFT bins is accumulated in frequency order, so the
+ * consumers see a contiguous spectrum */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spectrum.h"
+#include "memory_budget.h"
+#include "fft.h"
+
+
+typedef struct spectrum spectrum_t;
+
+/* internal functions */
+static void spectrum_add_frame(spectrum_t *this);
+
+
+typedef struct spectrum {
+  fft_t *fft;
+  uint32_t fft_size;
+  enum SpectrumInput input;
+  uint32_t nbins;
+  uint32_t averages;
+  uint32_t frame_interval;
+  spectrum_cb_t callback;
+  void *callback_context;
+  float *window;
+  float *frame;              /* interleaved complex, fft_size samples */
+  uint32_t fill;             /* samples in the current frame */
+  float *power_sum;
+  float *power;
+  uint32_t nframes;          /* frames in power_sum */
+  float scale;               /* 1 / (averages * (sum of window)^2) */
+  uint64_t position;         /* input samples seen */
+  uint64_t frame_start;      /* position of the current/next frame */
+} spectrum_t;
+
+
+spectrum_t *spectrum_open(uint32_t fft_size, enum SpectrumInput input,
+                          uint32_t averages, uint32_t frame_interval,
+                          spectrum_cb_t callback, void *callback_context)
+{
+  spectrum_t *ret_val = 0;
+
+  if (input != SPECTRUM_INPUT_REAL_S16 && input != SPECTRUM_INPUT_COMPLEX_F32) {
+    fprintf(stderr, "ERROR - invalid spectrum input: %d\n", input);
+    return ret_val;
+  }
+  if (averages == 0 || frame_interval < fft_size || callback == 0) {
+    fprintf(stderr, "ERROR - invalid spectrum parameters: averages=%u frame_interval=%u\n",
+            averages, frame_interval);
+    return ret_val;
+  }
+  fft_t *fft = fft_open(fft_size);
+  if (fft == 0) {
+    fprintf(stderr, "ERROR - fft_open() failed\n");
+    return ret_val;
+  }
+
+  uint32_t nbins = input == SPECTRUM_INPUT_REAL_S16 ? fft_size / 2 : fft_size;
+  float *window = (float *) memory_budget_alloc(MEMORY_DSP, fft_size * sizeof(float),
+                                                "spectrum buffers");
+  float *frame = (float *) memory_budget_alloc(MEMORY_DSP, 2 * fft_size * sizeof(float),
+                                               "spectrum buffers");
+  float *power_sum = (float *) memory_budget_calloc(MEMORY_DSP, nbins * sizeof(float),
+                                                    "spectrum buffers");
+  float *power = (float *) memory_budget_alloc(MEMORY_DSP, nbins * sizeof(float),
+                                               "spectrum buffers");
+  if (window == 0 || frame == 0 || power_sum == 0 || power == 0) {
+    fprintf(stderr, "ERROR - malloc() failed\n");
+    memory_budget_free(window);
+    memory_budget_free(frame);
+    memory_budget_free(power_sum);
+    memory_budget_free(power);
+    fft_close(fft);
+    return ret_val;
+  }
+
+  double window_sum = 0;
+  for (uint32_t i = 0; i < fft_size; ++i) {
+    window[i] = (float) (0.5 - 0.5 * cos(2 * M_PI * i / fft_size));
+    window_sum += window[i];
+  }
+  /* full scale is 32768 for the raw samples; a real tone splits its power
+     between the positive and negative frequencies */
+  double full_scale = 1.0;
+  if (input == SPECTRUM_INPUT_REAL_S16) {
+    full_scale = 32768.0 / 2;
+  }
+  double gain = window_sum * full_scale;
+
+  /* we are good here - create and initialize the spectrum */
+  spectrum_t *this = (spectrum_t *) malloc(sizeof(spectrum_t));
+  this->fft = fft;
+  this->fft_size = fft_size;
+  this->input = input;
+  this->nbins = nbins;
+  this->averages = averages;
+  this->frame_interval = frame_interval;
+  this->callback = callback;
+  this->callback_context = callback_context;
+  this->window = window;
+  this->frame = frame;
+  this->fill = 0;
+  this->power_sum = power_sum;
+  this->power = power;
+  this->nframes = 0;
+  this->scale = (float) (1.0 / (averages * gain * gain));
+  this->position = 0;
+  this->frame_start = 0;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void spectrum_close(spectrum_t *this)
+{
+  memory_budget_free(this->window);
+  memory_budget_free(this->frame);
+  memory_budget_free(this->power_sum);
+  memory_budget_free(this->power);
+  fft_close(this->fft);
+  free(this);
+  return;
+}
+
+
+uint32_t spectrum_get_bins(spectrum_t *this)
+{
+  return this->nbins;
+}
+
+
+int32_t spectrum_get_first_bin(spectrum_t *this)
+{
+  return this->input == SPECTRUM_INPUT_REAL_S16 ? 0 :
+         -(int32_t) (this->fft_size / 2);
+}
+
+
+void spectrum_process(spectrum_t *this, const void *samples, uint32_t nsamples)
+{
+  const int16_t *real_samples = (const int16_t *) samples;
+  const float *complex_samples = (const float *) samples;
+  while (nsamples > 0) {
+    uint32_t n;
+    if (this->position < this->frame_start) {
+      /* between frames */
+      uint64_t skip = this->frame_start - this->position;
+      n = skip < nsamples ? (uint32_t) skip : nsamples;
+    } else {
+      n = this->fft_size - this->fill;
+      if (n > nsamples) {
+        n = nsamples;
+      }
+      const float *window = this->window + this->fill;
+      float *frame = this->frame + 2 * this->fill;
+      if (this->input == SPECTRUM_INPUT_REAL_S16) {
+        for (uint32_t i = 0; i < n; ++i) {
+          frame[2 * i] = window[i] * real_samples[i];
+          frame[2 * i + 1] = 0;
+        }
+      } else {
+        for (uint32_t i = 0; i < n; ++i) {
+          frame[2 * i] = window[i] * complex_samples[2 * i];
+          frame[2 * i + 1] = window[i] * complex_samples[2 * i + 1];
+        }
+      }
+      this->fill += n;
+      if (this->fill == this->fft_size) {
+        spectrum_add_frame(this);
+      }
+    }
+    real_samples += n;
+    complex_samples += 2 * n;
+    this->position += n;
+    nsamples -= n;
+  }
+  return;
+}
+
+
+/* internal functions */
+static void spectrum_add_frame(spectrum_t *this)
+{
+  fft_forward(this->fft, this->frame);
+
+  /* the complex spectrum goes from -fs/2 (bin fft_size/2) to fs/2 */
+  uint32_t nbins = this->nbins;
+  const float *bins = this->frame;
+  if (this->input == SPECTRUM_INPUT_COMPLEX_F32) {
+    bins += nbins;
+  }
+  float *power_sum = this->power_sum;
+  uint32_t n = this->input == SPECTRUM_INPUT_REAL_S16 ? nbins : nbins / 2;
+  for (uint32_t k = 0; k < n; ++k) {
+    power_sum[k] += bins[2 * k] * bins[2 * k] +
+                    bins[2 * k + 1] * bins[2 * k + 1];
+  }
+  if (this->input == SPECTRUM_INPUT_COMPLEX_F32) {
+    bins = this->frame;
+    power_sum += n;
+    for (uint32_t k = 0; k < n; ++k) {
+      power_sum[k] += bins[2 * k] * bins[2 * k] +
+                      bins[2 * k + 1] * bins[2 * k + 1];
+    }
+  }
+
+  uint64_t position = this->frame_start;
+  this->fill = 0;
+  this->frame_start += this->frame_interval;
+  this->nframes++;
+  if (this->nframes < this->averages) {
+    return;
+  }
+
+  float scale = this->scale;
+  for (uint32_t k = 0; k < nbins; ++k) {
+    this->power[k] = this->power_sum[k] * scale;
+    this->power_sum[k] = 0;
+  }
+  this->nframes = 0;
+  this->callback(this->power, position, this->callback_context);
+  return;
+}
@@ -0,0 +1,66 @@
+/*
+ * spectrum.h - averaged power spectrum of a sample stream
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+#ifndef __SPECTRUM_H
+#define __SPECTRUM_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct spectrum spectrum_t;
+
+enum SpectrumInput {
+  SPECTRUM_INPUT_REAL_S16,       /* raw ADC samples; fft_size/2 bins, 0 - fs/2 */
+  SPECTRUM_INPUT_COMPLEX_F32     /* interleaved I/Q; fft_size bins, -fs/2 - fs/2 */
+};
+
+/* power (spectrum_get_bins() values) is linear (full scale tone = 1.0) and
+ * ordered by frequency; position is the index of the first input sample of
+ * the last frame in the average */
+typedef void (*spectrum_cb_t)(const float *power, uint64_t position,
+                              void *context);
+
+/* one Hann windowed frame is taken every frame_interval input samples (the
+ * samples in between are skipped) and 'averages' frames are averaged before
+ * calling back */
+spectrum_t *spectrum_open(uint32_t fft_size, enum SpectrumInput input,
+                          uint32_t averages, uint32_t frame_interval,
+                          spectrum_cb_t callback, void *callback_context);
+
+void spectrum_close(spectrum_t *this);
+
+uint32_t spectrum_get_bins(spectrum_t *this);
+
+/* frequency of bin 0 in bins (0 or -fft_size/2) */
+int32_t spectrum_get_first_bin(spectrum_t *this);
+
+void spectrum_process(spectrum_t *this, const void *samples, uint32_t nsamples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SPECTRUM_H */
@@ -0,0 +1,110 @@
+/*
+ * stream_copy.c - copy and conversion of frames into user memory
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+
+/* a frame that is copied away is usually not read again soon (captures,
+ * history, frames for a consumer on another core), so above
+ * COPY_STREAM_THRESHOLD the stores bypass the caches (non-temporal stores,
+ * write combined in 64 byte lines) and the source is prefetched a few lines
+ * ahead; the caches keep the working set of the DSP code instead of the
+ * stream. Smaller copies are left to memcpy(), which is faster for data
+ * that stays in the cache. Without SSE2 both paths are the plain ones
+ */
+
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "rf103.h"
+
+
+enum {
+  COPY_STREAM_THRESHOLD = 64 * 1024,   /* bytes */
+  COPY_PREFETCH_DISTANCE = 512         /* bytes */
+};
+
+
+void rf103_copy_frame(void *destination, const void *source, uint32_t size)
+{
+#ifdef __SSE2__
+  if (size >= COPY_STREAM_THRESHOLD) {
+    uint8_t *d = (uint8_t *) destination;
+    const uint8_t *s = (const uint8_t *) source;
+    /* the streaming stores need an aligned destination */
+    uint32_t head = (16 - ((uintptr_t) d & 15)) & 15;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+    for (uint32_t n = size / 64; n > 0; --n) {
+      _mm_prefetch((const char *) s + COPY_PREFETCH_DISTANCE, _MM_HINT_NTA);
+      __m128i x0 = _mm_loadu_si128((const __m128i *) s);
+      __m128i x1 = _mm_loadu_si128((const __m128i *) (s + 16));
+      __m128i x2 = _mm_loadu_si128((const __m128i *) (s + 32));
+      __m128i x3 = _mm_loadu_si128((const __m128i *) (s + 48));
+      _mm_stream_si128((__m128i *) d, x0);
+      _mm_stream_si128((__m128i *) (d + 16), x1);
+      _mm_stream_si128((__m128i *) (d + 32), x2);
+      _mm_stream_si128((__m128i *) (d + 48), x3);
+      s += 64;
+      d += 64;
+    }
+    /* the data must be visible before the frame is handed over */
+    _mm_sfence();
+    memcpy(d, s, size % 64);
+    return;
+  }
+#endif
+  memcpy(destination, source, size);
+  return;
+}
+
+
+void rf103_convert_frame(float *destination, const int16_t *source,
+                         uint32_t nsamples)
+{
+  const float scale = 1.0f / 32768.0f;
+  uint32_t i = 0;
+#ifdef __SSE2__
+  if (nsamples * sizeof(float) >= COPY_STREAM_THRESHOLD) {
+    for (; i < nsamples && ((uintptr_t) (destination + i) & 15) != 0; ++i)
+      destination[i] = source[i] * scale;
+    __m128 factor = _mm_set1_ps(scale);
+    for (; i + 8 <= nsamples; i += 8) {
+      _mm_prefetch((const char *) (source + i) + COPY_PREFETCH_DISTANCE,
+                   _MM_HINT_NTA);
+      __m128i x = _mm_loadu_si128((const __m128i *) (source + i));
+      /* sign extension: the 16 bits in the upper half, shifted back */
+      __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+      __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+      _mm_stream_ps(destination + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), factor));
+      _mm_stream_ps(destination + i + 4,
+                    _mm_mul_ps(_mm_cvtepi32_ps(hi), factor));
+    }
+    _mm_sfence();
+  }
+#endif
+  for (; i < nsamples; ++i)
+    destination[i] = source[i] * scale;
+  return;
+}
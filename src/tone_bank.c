@@ -0,0 +1,271 @@
+/*
+ * tone_bank.c - Goertzel tone detector bank
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* one Goertzel resonator per tone (in Reinsch's form, which keeps float
+ * precision for tones close to 0 or to the Nyquist frequency), all of them
+ * run side by side by the SIMD kernel (see dsp_kernels.c) on chunks of
+ * input converted to float;
+ * a complex input runs the same resonators on I and on Q. At the end of a
+ * block the last two states give the DFT term at the exact frequency of
+ * each tone, which is rotated back to the first input sample with a phase
+ * kept in double precision, and the states start again from zero. With
+ * hundreds of tones this costs a couple of operations per tone per sample
+ * and no FFT
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tone_bank.h"
+#include "dsp_kernels.h"
+#include "memory_budget.h"
+
+
+typedef struct tone_bank tone_bank_t;
+
+/* internal functions */
+static void tone_bank_convert(tone_bank_t *this, const void *samples,
+                              uint32_t nsamples);
+static void tone_bank_output(tone_bank_t *this, float *output);
+
+
+enum {
+  TONE_BANK_CHUNK = 4096,        /* samples converted at a time */
+  TONE_BANK_ALIGNMENT = 32
+};
+
+typedef struct tone_bank {
+  uint32_t ntones;
+  uint32_t padded_tones;         /* multiple of DSP_KERNEL_LANES */
+  uint32_t block_length;
+  int complex_input;
+  dsp_goertzel_t goertzel;
+  float *coefficients;           /* see dsp_goertzel_t (0 for the padding) */
+  float *signs;
+  float *s_re;                   /* states on I (or the real input) */
+  float *d_re;
+  float *s_im;                   /* states on Q */
+  float *d_im;
+  float *input_re;               /* TONE_BANK_CHUNK converted samples */
+  float *input_im;
+  double *w;                     /* rad/sample */
+  double *block_phase;           /* w * first sample of the block */
+  uint32_t block_samples;        /* in the current block */
+} tone_bank_t;
+
+
+tone_bank_t *tone_bank_open(double sample_rate, const double *frequencies,
+                            uint32_t ntones, uint32_t block_length,
+                            int complex_input)
+{
+  tone_bank_t *ret_val = 0;
+
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - invalid tone bank sample rate: %f\n", sample_rate);
+    return ret_val;
+  }
+  if (ntones == 0) {
+    fprintf(stderr, "ERROR - invalid number of tones: %u\n", ntones);
+    return ret_val;
+  }
+  if (block_length == 0) {
+    fprintf(stderr, "ERROR - invalid tone bank block length: %u\n",
+            block_length);
+    return ret_val;
+  }
+  double min_frequency = complex_input ? -sample_rate / 2 : 0;
+  for (uint32_t k = 0; k < ntones; ++k) {
+    if (frequencies[k] < min_frequency || frequencies[k] > sample_rate / 2) {
+      fprintf(stderr, "ERROR - tone frequency out of range: %f\n",
+              frequencies[k]);
+      return ret_val;
+    }
+  }
+
+  uint32_t padded_tones = (ntones + DSP_KERNEL_LANES - 1) / DSP_KERNEL_LANES *
+                          DSP_KERNEL_LANES;
+  size_t nfloats = 6 * padded_tones + 2 * TONE_BANK_CHUNK;
+  float *floats = (float *) memory_budget_aligned_alloc(MEMORY_DSP,
+                                                        TONE_BANK_ALIGNMENT,
+                                                        nfloats * sizeof(float),
+                                                        "tone bank");
+  if (floats == 0) {
+    return ret_val;
+  }
+  double *doubles = (double *) memory_budget_alloc(MEMORY_DSP,
+                                                   2 * ntones * sizeof(double),
+                                                   "tone bank");
+  if (doubles == 0) {
+    memory_budget_free(floats);
+    return ret_val;
+  }
+  memset(floats, 0, nfloats * sizeof(float));
+
+  /* we are good here - create and initialize the tone bank */
+  tone_bank_t *this = (tone_bank_t *) malloc(sizeof(tone_bank_t));
+  this->ntones = ntones;
+  this->padded_tones = padded_tones;
+  this->block_length = block_length;
+  this->complex_input = complex_input;
+  this->goertzel = dsp_get_goertzel(padded_tones);
+  this->coefficients = floats;
+  this->signs = floats + padded_tones;
+  this->s_re = floats + 2 * padded_tones;
+  this->d_re = floats + 3 * padded_tones;
+  this->s_im = floats + 4 * padded_tones;
+  this->d_im = floats + 5 * padded_tones;
+  this->input_re = floats + 6 * padded_tones;
+  this->input_im = this->input_re + TONE_BANK_CHUNK;
+  this->w = doubles;
+  this->block_phase = doubles + ntones;
+  for (uint32_t k = 0; k < ntones; ++k) {
+    this->w[k] = 2 * M_PI * frequencies[k] / sample_rate;
+    if (cos(this->w[k]) >= 0) {
+      this->coefficients[k] = (float) (-4 * pow(sin(this->w[k] / 2), 2));
+      this->signs[k] = 1;
+    } else {
+      this->coefficients[k] = (float) (4 * pow(cos(this->w[k] / 2), 2));
+      this->signs[k] = -1;
+    }
+    this->block_phase[k] = 0;
+  }
+  this->block_samples = 0;
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void tone_bank_close(tone_bank_t *this)
+{
+  memory_budget_free(this->coefficients);
+  memory_budget_free(this->w);
+  free(this);
+  return;
+}
+
+
+uint32_t tone_bank_get_tones(tone_bank_t *this)
+{
+  return this->ntones;
+}
+
+
+uint32_t tone_bank_max_output(tone_bank_t *this, uint32_t nsamples)
+{
+  return (nsamples / this->block_length + 1) * 2 * this->ntones;
+}
+
+
+uint32_t tone_bank_process(tone_bank_t *this, const void *samples,
+                           uint32_t nsamples, float *output)
+{
+  uint32_t noutput = 0;
+  uint32_t sample_size = this->complex_input ? 2 * sizeof(float) :
+                                               sizeof(int16_t);
+  const uint8_t *input = (const uint8_t *) samples;
+  while (nsamples > 0) {
+    /* a chunk never crosses a block boundary */
+    uint32_t n = this->block_length - this->block_samples;
+    if (n > TONE_BANK_CHUNK) {
+      n = TONE_BANK_CHUNK;
+    }
+    if (n > nsamples) {
+      n = nsamples;
+    }
+    tone_bank_convert(this, input, n);
+    this->goertzel(this->coefficients, this->signs, this->s_re, this->d_re,
+                   this->padded_tones, this->input_re, n);
+    if (this->complex_input) {
+      this->goertzel(this->coefficients, this->signs, this->s_im, this->d_im,
+                     this->padded_tones, this->input_im, n);
+    }
+    input += n * sample_size;
+    nsamples -= n;
+    this->block_samples += n;
+    if (this->block_samples == this->block_length) {
+      tone_bank_output(this, output + noutput);
+      noutput += 2 * this->ntones;
+      this->block_samples = 0;
+    }
+  }
+  return noutput;
+}
+
+
+/* internal functions */
+static void tone_bank_convert(tone_bank_t *this, const void *samples,
+                              uint32_t nsamples)
+{
+  if (this->complex_input) {
+    const float *x = (const float *) samples;
+    for (uint32_t i = 0; i < nsamples; ++i) {
+      this->input_re[i] = x[2 * i];
+      this->input_im[i] = x[2 * i + 1];
+    }
+  } else {
+    const int16_t *x = (const int16_t *) samples;
+    for (uint32_t i = 0; i < nsamples; ++i) {
+      this->input_re[i] = x[i] * (1.0f / 32768.0f);
+    }
+  }
+  return;
+}
+
+
+static void tone_bank_output(tone_bank_t *this, float *output)
+{
+  uint32_t block_length = this->block_length;
+  /* a real tone splits between w and -w */
+  double scale = (this->complex_input ? 1.0 : 2.0) / block_length;
+  for (uint32_t k = 0; k < this->ntones; ++k) {
+    double w = this->w[k];
+    double sign = this->signs[k];
+    /* y = s1 - exp(-i*w) * s2 = sum of x[n] * exp(i*w*(N-1-n)), where s1
+       and s2 are the last two states of the Goertzel recursion, and
+       s1 - cos(w) * s2 = d - coefficient / 2 * s2 */
+    double sign_minus_cos = -0.5 * this->coefficients[k];
+    double s = sin(w);
+    double s2_re = sign * ((double) this->s_re[k] - this->d_re[k]);
+    double y_re = this->d_re[k] + sign_minus_cos * s2_re;
+    double y_im = s * s2_re;
+    if (this->complex_input) {
+      double s2_im = sign * ((double) this->s_im[k] - this->d_im[k]);
+      y_re -= s * s2_im;
+      y_im += this->d_im[k] + sign_minus_cos * s2_im;
+    }
+    /* back to the first sample of the block, and from there to the first
+       input sample */
+    double angle = w * (block_length - 1) + this->block_phase[k];
+    double x_re = y_re * cos(angle) + y_im * sin(angle);
+    double x_im = y_im * cos(angle) - y_re * sin(angle);
+    output[2 * k] = (float) (sqrt(x_re * x_re + x_im * x_im) * scale);
+    output[2 * k + 1] = (float) atan2(x_im, x_re);
+    this->block_phase[k] = fmod(this->block_phase[k] + w * block_length,
+                                2 * M_PI);
+  }
+  /* the four state arrays are contiguous */
+  memset(this->s_re, 0, 4 * this->padded_tones * sizeof(float));
+  return;
+}
@@ -0,0 +1,60 @@
+/*
+ * tone_bank.h - Goertzel tone detector bank
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __TONE_BANK_H
+#define __TONE_BANK_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct tone_bank tone_bank_t;
+
+/* the levels of a set of tones (in Hz, relative to the input; negative
+ * ones only for complex input) over blocks of block_length samples: after
+ * every block the output gets ntones (magnitude, phase) pairs, with the
+ * magnitude the amplitude of the tone (full scale 1.0) and the phase in
+ * radians relative to the first input sample, so a steady tone keeps it
+ * from block to block. The input is real 16 bit or complex float samples */
+
+tone_bank_t *tone_bank_open(double sample_rate, const double *frequencies,
+                            uint32_t ntones, uint32_t block_length,
+                            int complex_input);
+
+void tone_bank_close(tone_bank_t *this);
+
+uint32_t tone_bank_get_tones(tone_bank_t *this);
+
+/* maximum number of output floats for nsamples input samples */
+uint32_t tone_bank_max_output(tone_bank_t *this, uint32_t nsamples);
+
+/* returns the number of floats written to output */
+uint32_t tone_bank_process(tone_bank_t *this, const void *samples,
+                           uint32_t nsamples, float *output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TONE_BANK_H */
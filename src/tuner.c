@@ -39,7 +39,10 @@
 #define TUNER_PARAMS_LIBRTLSDR 1
 #define TUNER_PARAMS TUNER_PARAMS_BBRF103
 /* #define TUNER_PARAMS TUNER_PARAMS_LIBRTLSDR */
-#define TUNER_BOUNDARY_SPUR_PREVENTION
+/* boundary spur prevention moves the SDM fraction away from the boundaries,
+   silently mistuning the LO; the frequency planner chooses an IF that keeps
+   those spurs out of the passband instead */
+/* #define TUNER_BOUNDARY_SPUR_PREVENTION */
 
 
 #include <errno.h>
@@ -51,6 +54,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <math.h>
 
 #include <assert.h>
 
@@ -79,6 +83,16 @@ static int tuner_compute_mux_parameters(tuner_t *this,
                                         struct tuner_mux_parameters *mux_params);
 static int tuner_apply_mux_parameters(tuner_t *this,
                                       const struct tuner_mux_parameters *mux_params);
+static int tuner_make_plan(tuner_t *this, double frequency, int harmonic,
+                           uint32_t if_frequency, struct tuner_plan *plan);
+static int tuner_build_plan_table(tuner_t *this);
+static double tuner_plan_spur_distance(tuner_t *this, double lower_lo_frequency,
+                                       double upper_lo_frequency, int harmonic,
+                                       double if_frequency);
+static double tuner_lattice_distance(double lower, double upper,
+                                     double spacing, double offset);
+static double tuner_pll_frequency(tuner_t *this,
+                                  const struct tuner_pll_parameters *pll_params);
 
 static int tuner_read_value(tuner_t *this, const uint8_t where[3],
                             uint8_t *value);
@@ -86,7 +100,7 @@ static int tuner_read_registers(tuner_t *this, uint32_t register_mask);
 static int tuner_write_value(tuner_t *this, const uint8_t where[3],
                              uint8_t value);
 static int tuner_write_registers(tuner_t *this, uint32_t register_mask);
-static uint8_t tuner_get_value(tuner_t *this, const uint8_t where[3]) __attribute__((unused));
+static uint8_t tuner_get_value(tuner_t *this, const uint8_t where[3]);
 static void tuner_set_value(tuner_t *this, const uint8_t where[3],
                             uint8_t value);
 
@@ -99,12 +113,38 @@ typedef struct tuner {
   uint32_t if_frequency;
   uint8_t registers[R820T2_REGISTERS];
   uint32_t registers_dirty_mask;
+  int standby;
+  uint8_t saved_registers[R820T2_REGISTERS];
+  struct tuner_plan tuning;        /* last frequency plan applied */
+  uint32_t if_bandwidth;
+  uint8_t *plan_table;        /* best plan candidate for each frequency bucket */
+  uint32_t plan_table_size;
 } tuner_t;
 
 
 static const uint32_t DEFAULT_TUNER_XTAL_FREQUENCY = 32000000;
 static const uint32_t DEFAULT_TUNER_IF_FREQUENCY = 7000000;
 static const double CALIBRATION_LO_FREQUENCY = 88e6;
+static const uint32_t DEFAULT_TUNER_IF_BANDWIDTH = 2000000;
+
+/* frequency planner */
+static const double MIN_PLAN_LO_FREQUENCY = 1.77e9 / 64;  /* min VCO / max divider */
+static const double MAX_PLAN_LO_FREQUENCY = 1.7e9;        /* PLL does not lock reliably above this */
+static const double PLAN_BUCKET_WIDTH = 50e3;
+static const int tuner_plan_harmonics[] = { 1, 3, 5 };
+/* PLL boundaries are multiples of 250kHz in the lowest band, so the IF
+   offsets must not be */
+static const int32_t tuner_plan_if_offsets[] = {
+  0, -125000, 125000, -375000, 375000, -625000, 625000, -875000, 875000
+};
+/* the IF filter stays centered on the nominal IF, so an offset must leave at
+   least this much of the wanted signal inside it */
+static const double PLAN_SIGNAL_HALF_WIDTH = 100e3;
+enum {
+  TUNER_PLAN_HARMONICS = sizeof(tuner_plan_harmonics) / sizeof(tuner_plan_harmonics[0]),
+  TUNER_PLAN_IF_OFFSETS = sizeof(tuner_plan_if_offsets) / sizeof(tuner_plan_if_offsets[0]),
+  TUNER_PLAN_NONE = 0xff
+};
 
 static const uint8_t R820T2_ADDR = 0x1a;
 static const uint8_t R820T2_ADDR_READ  = R820T2_ADDR << 1;
@@ -209,6 +249,12 @@ tuner_t *tuner_open(usb_device_t *usb_device)
   this->if_frequency = DEFAULT_TUNER_IF_FREQUENCY;
   memset(this->registers, 0, sizeof(this->registers));
   this->registers_dirty_mask = 0;
+  this->standby = 0;
+  memset(this->saved_registers, 0, sizeof(this->saved_registers));
+  memset(&this->tuning, 0, sizeof(this->tuning));
+  this->if_bandwidth = DEFAULT_TUNER_IF_BANDWIDTH;
+  this->plan_table = 0;
+  this->plan_table_size = 0;
 
   int ret = tuner_init_registers(this);
   if (ret < 0) {
@@ -231,6 +277,13 @@ tuner_t *tuner_open(usb_device_t *usb_device)
     return ret_val;
   }
 
+  ret = tuner_build_plan_table(this);
+  if (ret < 0) {
+    log_error("tuner_build_plan_table() failed", __func__, __FILE__, __LINE__);
+    free(this);
+    return ret_val;
+  }
+
   ret_val = this;
   return ret_val;
 }
@@ -238,6 +291,7 @@ tuner_t *tuner_open(usb_device_t *usb_device)
 
 void tuner_close(tuner_t *this)
 {
+  free(this->plan_table);
   free(this);
   return;
 }
@@ -253,7 +307,7 @@ int tuner_set_xtal_frequency(tuner_t *this, uint32_t xtal_frequency)
 {
   /* no checks yet */
   this->xtal_frequency = xtal_frequency;
-  return 0;
+  return tuner_build_plan_table(this);
 }
 
 
@@ -267,25 +321,19 @@ int tuner_set_if_frequency(tuner_t *this, uint32_t if_frequency)
 {
   /* no checks yet */
   this->if_frequency = if_frequency;
-  return 0;
+  return tuner_build_plan_table(this);
 }
 
 
 int tuner_set_frequency(tuner_t *this, double frequency)
 {
-  int ret = tuner_set_mux(this, frequency);
-  if (ret < 0) {
-    fprintf(stderr, "ERROR - tuner_set_mux() failed\n");
-    return -1;
-  }
-
-  double lo_frequency = frequency + this->if_frequency;
-  ret = tuner_set_pll(this, lo_frequency);
+  struct tuner_plan plan;
+  int ret = tuner_make_plan(this, frequency, 1, this->if_frequency, &plan);
   if (ret < 0) {
-    fprintf(stderr, "ERROR - tuner_set_pll() failed\n");
+    fprintf(stderr, "ERROR - tuner_make_plan() failed\n");
     return -1;
   }
-  return 0;
+  return tuner_apply_plan(this, &plan);
 }
 
 
@@ -297,18 +345,69 @@ int tuner_set_harmonic_frequency(tuner_t *this, double frequency,
     return -1;
   }
 
-  int ret = tuner_set_mux(this, frequency);
+  struct tuner_plan plan;
+  int ret = tuner_make_plan(this, frequency, harmonic, this->if_frequency,
+                            &plan);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - tuner_make_plan() failed\n");
+    return -1;
+  }
+  return tuner_apply_plan(this, &plan);
+}
+
+
+/* frequency planner: choose between fundamental and harmonic mode, and the
+ * IF frequency (around the nominal one) that keeps PLL boundary spurs out of
+ * and the xtal harmonics out of the IF passband; the choice for each 50kHz
+ * bucket is precomputed when the tuner is opened, so tuner_plan_frequency()
+ * is just a table lookup (useful for sweeps)
+ */
+int tuner_plan_frequency(tuner_t *this, double frequency,
+                         struct tuner_plan *plan)
+{
+  if (frequency < 0 ||
+      frequency >= this->plan_table_size * PLAN_BUCKET_WIDTH) {
+    fprintf(stderr, "ERROR - tuner_plan_frequency() failed: frequency out of range %lg\n", frequency);
+    return -1;
+  }
+  uint8_t candidate = this->plan_table[(uint32_t) (frequency / PLAN_BUCKET_WIDTH)];
+  if (candidate == TUNER_PLAN_NONE) {
+    fprintf(stderr, "ERROR - tuner_plan_frequency() failed: no valid plan for %lg\n", frequency);
+    return -1;
+  }
+
+  int harmonic = tuner_plan_harmonics[candidate / TUNER_PLAN_IF_OFFSETS];
+  uint32_t if_frequency = this->if_frequency +
+                          tuner_plan_if_offsets[candidate % TUNER_PLAN_IF_OFFSETS];
+  return tuner_make_plan(this, frequency, harmonic, if_frequency, plan);
+}
+
+
+int tuner_apply_plan(tuner_t *this, const struct tuner_plan *plan)
+{
+  int ret = tuner_set_mux(this, plan->frequency);
   if (ret < 0) {
     fprintf(stderr, "ERROR - tuner_set_mux() failed\n");
     return -1;
   }
 
-  double lo_frequency = (frequency + this->if_frequency) / harmonic;
-  ret = tuner_set_pll(this, lo_frequency);
+  ret = tuner_set_pll(this, plan->requested_lo_frequency);
   if (ret < 0) {
     fprintf(stderr, "ERROR - tuner_set_pll() failed\n");
     return -1;
   }
+  this->tuning = *plan;
+  return 0;
+}
+
+
+int tuner_get_tuning(tuner_t *this, struct tuner_plan *plan)
+{
+  if (this->tuning.harmonic == 0) {
+    fprintf(stderr, "ERROR - tuner_get_tuning() failed: tuner frequency not set\n");
+    return -1;
+  }
+  *plan = this->tuning;
   return 0;
 }
 
@@ -506,7 +605,8 @@ int tuner_set_if_bandwidth(tuner_t *this, uint32_t bandwidth)
     log_error("tuner_write_registers() failed", __func__, __FILE__, __LINE__);
     return -1;
   }
-  return 0;
+  this->if_bandwidth = bandwidth;
+  return tuner_build_plan_table(this);
 }
 
 
@@ -527,6 +627,13 @@ int tuner_stop(tuner_t *this __attribute__((unused)))
 
 int tuner_standby(tuner_t *this)
 {
+  if (this->standby) {
+    return 0;
+  }
+
+  /* save the register image, so tuner_resume() can restore it later */
+  memcpy(this->saved_registers, this->registers, sizeof(this->registers));
+
   const uint8_t standby_registers[][2] = {
     { 0x06, 0xb1 }, { 0x05, 0xa0 }, { 0x07, 0x3a }, { 0x08, 0x40 },
     { 0x09, 0xc0 }, { 0x0a, 0x36 }, { 0x0c, 0x35 }, { 0x0f, 0x68 },
@@ -544,6 +651,42 @@ int tuner_standby(tuner_t *this)
     log_error("tuner_write_registers() failed", __func__, __FILE__, __LINE__);
     return -1;
   }
+  this->standby = 1;
+  return 0;
+}
+
+
+int tuner_resume(tuner_t *this)
+{
+  if (!this->standby) {
+    return 0;
+  }
+
+  /* find the registers that differ from the image saved by tuner_standby() */
+  uint32_t diff_mask = 0;
+  for (int i = 0; i < R820T2_REGISTERS; i++) {
+    if (this->registers[i] != this->saved_registers[i]) {
+      diff_mask |= 1 << i;
+    }
+  }
+  diff_mask &= R820T2_REGISTERS_WRITE_MASK;
+  memcpy(this->registers, this->saved_registers, sizeof(this->registers));
+
+  if (diff_mask != 0) {
+    /* fill the gaps between the lowest and the highest register that differ,
+       so tuner_write_registers() sends them in a single I2C write */
+    int lowest = __builtin_ctz(diff_mask);
+    int highest = 31 - __builtin_clz(diff_mask);
+    uint32_t span_mask = highest == 31 ? 0xffffffff : (1U << (highest + 1)) - 1;
+    span_mask &= ~((1U << lowest) - 1);
+    int ret = tuner_write_registers(this, span_mask);
+    if (ret < 0) {
+      log_error("tuner_write_registers() failed", __func__, __FILE__, __LINE__);
+      return -1;
+    }
+  }
+
+  this->standby = 0;
   return 0;
 }
 
@@ -817,6 +960,17 @@ static int tuner_compute_pll_parameters(tuner_t *this, double frequency,
 static int tuner_apply_pll_parameters(tuner_t *this,
                                       const struct tuner_pll_parameters *pll_params)
 {
+  /* nothing to do if the PLL is already there (frequent in sweeps) */
+  if (tuner_get_value(this, R820T2_REFDIV) == pll_params->refdiv &&
+      tuner_get_value(this, R820T2_SEL_DIV) == pll_params->sel_div &&
+      tuner_get_value(this, R820T2_PW_SDM) == pll_params->pw_sdm &&
+      tuner_get_value(this, R820T2_SI2C) == pll_params->si2c &&
+      tuner_get_value(this, R820T2_NI2C) == pll_params->ni2c &&
+      tuner_get_value(this, R820T2_SDM_INL) == (pll_params->sdm & 0xff) &&
+      tuner_get_value(this, R820T2_SDM_INH) == ((pll_params->sdm >> 8) & 0xff)) {
+    return 0;
+  }
+
   /* set PLL autotune = 128kHz */
   int ret = tuner_write_value(this, R820T2_PLL_AUTO_CLK, 0);
   if (ret < 0) {
@@ -886,6 +1040,25 @@ static int tuner_apply_pll_parameters(tuner_t *this,
 }
 
 
+/* exact LO frequency for a set of PLL parameters (including the SDM
+ * rounding), so the digital downconversion can compensate for it */
+static double tuner_pll_frequency(tuner_t *this,
+                                  const struct tuner_pll_parameters *pll_params)
+{
+  const uint32_t SDM_FRAC_PRECISION = 65536;
+
+  double multiplier = 13 + 4 * pll_params->ni2c + pll_params->si2c;
+  if (!pll_params->pw_sdm) {
+    multiplier += (double) pll_params->sdm / SDM_FRAC_PRECISION;
+  }
+  double vco_frequency = multiplier * this->xtal_frequency;
+  if (pll_params->refdiv == 0) {
+    vco_frequency *= 2.0;
+  }
+  return vco_frequency / (2 << pll_params->sel_div);
+}
+
+
 struct tuner_mux_parameters {
   uint8_t open_d;       /* Open Drain */
   uint8_t rfmux;        /* RF_MUX, Polymux */
@@ -1008,6 +1181,159 @@ static int tuner_apply_mux_parameters(tuner_t *this,
   return 0;
 }
 
+/* the candidates are tried in order of preference (lowest harmonic in range
+ * first, then IF offsets closest to the nominal IF); the first one with no
+ * spur in the IF passband wins, otherwise the one with the farthest spur.
+ * Offsets that would push the wanted signal out of the IF filter are never
+ * tried (the nominal IF always is) */
+static int tuner_build_plan_table(tuner_t *this)
+{
+  uint32_t plan_table_size = (uint32_t) (MAX_PLAN_LO_FREQUENCY *
+                                         tuner_plan_harmonics[TUNER_PLAN_HARMONICS-1] /
+                                         PLAN_BUCKET_WIDTH);
+  if (this->plan_table == 0) {
+    this->plan_table = (uint8_t *) malloc(plan_table_size);
+    if (this->plan_table == 0) {
+      log_error("malloc() failed", __func__, __FILE__, __LINE__);
+      return -1;
+    }
+    this->plan_table_size = plan_table_size;
+  }
+
+  double passband_half_width = this->if_bandwidth / 2.0;
+  for (uint32_t bucket = 0; bucket < this->plan_table_size; ++bucket) {
+    double lower_frequency = bucket * PLAN_BUCKET_WIDTH;
+    double upper_frequency = lower_frequency + PLAN_BUCKET_WIDTH;
+    uint8_t best_candidate = TUNER_PLAN_NONE;
+    double best_spur_distance = -1;
+    for (int h = 0; h < TUNER_PLAN_HARMONICS; ++h) {
+      int harmonic = tuner_plan_harmonics[h];
+      for (int i = 0; i < TUNER_PLAN_IF_OFFSETS; ++i) {
+        int32_t if_offset = tuner_plan_if_offsets[i];
+        if (if_offset != 0 &&
+            abs(if_offset) + PLAN_SIGNAL_HALF_WIDTH > passband_half_width) {
+          continue;
+        }
+        double if_frequency = (double) this->if_frequency + if_offset;
+        double lower_lo_frequency = (lower_frequency + if_frequency) / harmonic;
+        double upper_lo_frequency = (upper_frequency + if_frequency) / harmonic;
+        if (lower_lo_frequency < MIN_PLAN_LO_FREQUENCY ||
+            upper_lo_frequency > MAX_PLAN_LO_FREQUENCY) {
+          continue;
+        }
+        double spur_distance = tuner_plan_spur_distance(this,
+                                                        lower_lo_frequency,
+                                                        upper_lo_frequency,
+                                                        harmonic,
+                                                        if_frequency);
+        if (spur_distance > best_spur_distance) {
+          best_candidate = h * TUNER_PLAN_IF_OFFSETS + i;
+          best_spur_distance = spur_distance;
+        }
+        if (spur_distance > passband_half_width) {
+          break;
+        }
+      }
+      /* harmonic mode has a much higher conversion loss: use a higher
+         harmonic only if the lower ones are out of range */
+      if (best_candidate != TUNER_PLAN_NONE) {
+        break;
+      }
+    }
+    this->plan_table[bucket] = best_candidate;
+  }
+  return 0;
+}
+
+
+static int tuner_make_plan(tuner_t *this, double frequency, int harmonic,
+                           uint32_t if_frequency, struct tuner_plan *plan)
+{
+  double lo_frequency = (frequency + if_frequency) / harmonic;
+  struct tuner_pll_parameters pll_params;
+  int ret = tuner_compute_pll_parameters(this, lo_frequency, &pll_params);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - tuner_compute_pll_parameters() failed\n");
+    return -1;
+  }
+
+  plan->frequency = frequency;
+  plan->harmonic = harmonic;
+  plan->if_frequency = if_frequency;
+  plan->requested_lo_frequency = lo_frequency;
+  plan->lo_frequency = tuner_pll_frequency(this, &pll_params);
+  plan->frequency_error = harmonic * plan->lo_frequency - if_frequency -
+                          frequency;
+  plan->spur_distance = tuner_plan_spur_distance(this, plan->lo_frequency,
+                                                 plan->lo_frequency, harmonic,
+                                                 if_frequency);
+  return 0;
+}
+
+
+/* distance from the IF of the closest spur for any LO frequency in
+ * [lower_lo_frequency, upper_lo_frequency]:
+ *  - PLL boundary spurs: the fractional PLL creates spurs around the LO when
+ *    the SDM fraction is close to 0 (integer boundary) or 1/2
+ *  - xtal harmonics: n*xtal mixes with the odd LO harmonics m*LO (m <= the
+ *    harmonic in use) and lands in the passband when |m*LO - n*xtal| ~ IF
+ */
+static double tuner_plan_spur_distance(tuner_t *this, double lower_lo_frequency,
+                                       double upper_lo_frequency, int harmonic,
+                                       double if_frequency)
+{
+  const double MIN_VCO_FREQUENCY = 1.77e9;
+
+  /* use the finest boundary spacing of the two ends (conservative) */
+  double vco_frequency = lower_lo_frequency * 2.0;
+  int sel_div = 0;
+  while (vco_frequency < MIN_VCO_FREQUENCY) {
+    vco_frequency *= 2.0;
+    sel_div++;
+  }
+#if TUNER_PARAMS == TUNER_PARAMS_BBRF103
+  double pll_reference = this->xtal_frequency;
+#elif TUNER_PARAMS == TUNER_PARAMS_LIBRTLSDR
+  double pll_reference = 2.0 * this->xtal_frequency;
+#endif /* TUNER_PARAMS */
+  double boundary_spacing = pll_reference / (1 << (sel_div + 1)) / 2.0;
+
+  /* spurs around the LO are multiplied by the harmonic too */
+  double distance = harmonic * tuner_lattice_distance(lower_lo_frequency,
+                                                      upper_lo_frequency,
+                                                      boundary_spacing, 0);
+
+  for (int m = 1; m <= harmonic; m += 2) {
+    for (int sign = -1; sign <= 1; sign += 2) {
+      double d = tuner_lattice_distance(m * lower_lo_frequency,
+                                        m * upper_lo_frequency,
+                                        this->xtal_frequency,
+                                        sign * if_frequency);
+      if (d < distance) {
+        distance = d;
+      }
+    }
+  }
+  return distance;
+}
+
+
+/* distance between the interval [lower, upper] and the closest point of the
+ * lattice offset + k * spacing (0 if the interval contains one) */
+static double tuner_lattice_distance(double lower, double upper,
+                                     double spacing, double offset)
+{
+  double lower_index = floor((lower - offset) / spacing);
+  double upper_index = floor((upper - offset) / spacing);
+  if (lower_index != upper_index) {
+    return 0;
+  }
+  double lower_distance = lower - offset - lower_index * spacing;
+  double upper_distance = (upper_index + 1) * spacing - (upper - offset);
+  return lower_distance < upper_distance ? lower_distance : upper_distance;
+}
+
+
 static uint8_t r82xx_bitrev(uint8_t byte)
 {
 	const uint8_t lut[16] = { 0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe,
@@ -1128,7 +1454,10 @@ static uint8_t tuner_get_value(tuner_t *this, const uint8_t where[3]) {
 static void tuner_set_value(tuner_t *this, const uint8_t where[3],
                             uint8_t value) {
   uint8_t reg = where[0];
-  this->registers[reg] &= ~where[1];
-  this->registers[reg] |= value << where[2];
-  this->registers_dirty_mask |= 1 << reg;
+  uint8_t new_value = (this->registers[reg] & ~where[1]) | (value << where[2]);
+  /* only registers that actually change need to be written */
+  if (new_value != this->registers[reg]) {
+    this->registers[reg] = new_value;
+    this->registers_dirty_mask |= 1 << reg;
+  }
 }
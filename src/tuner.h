@@ -31,6 +31,17 @@ extern "C" {
 
 typedef struct tuner tuner_t;
 
+struct tuner_plan {
+  double frequency;               /* requested RF frequency */
+  int harmonic;                   /* 1 = fundamental */
+  uint32_t if_frequency;
+  double requested_lo_frequency;  /* (frequency + if_frequency) / harmonic */
+  double lo_frequency;            /* achieved PLL frequency */
+  double frequency_error;         /* the requested frequency shows up at
+                                     if_frequency + frequency_error */
+  double spur_distance;           /* distance of the closest spur from the IF */
+};
+
 
 int has_tuner(usb_device_t *usb_device);
 
@@ -50,6 +61,13 @@ int tuner_set_frequency(tuner_t *this, double frequency);
 
 int tuner_set_harmonic_frequency(tuner_t *this, double frequency, int harmonic);
 
+int tuner_plan_frequency(tuner_t *this, double frequency,
+                         struct tuner_plan *plan);
+
+int tuner_apply_plan(tuner_t *this, const struct tuner_plan *plan);
+
+int tuner_get_tuning(tuner_t *this, struct tuner_plan *plan);
+
 int tuner_get_lna_gains(tuner_t *this, const int *gains[]);
 
 int tuner_set_lna_gain(tuner_t *this, int gain);
@@ -76,6 +94,8 @@ int tuner_stop(tuner_t *this);
 
 int tuner_standby(tuner_t *this);
 
+int tuner_resume(tuner_t *this);
+
 #ifdef __cplusplus
 }
 #endif
@@ -39,6 +39,7 @@
 #include "usb_device_internals.h"
 #include "ezusb.h"
 #include "logging.h"
+#include "flight_recorder.h"
 
 
 typedef struct usb_device usb_device_t;
@@ -51,6 +52,9 @@ static int load_image(libusb_device_handle *dev_handle,
 static int validate_image(const uint8_t *image, const size_t size);
 static int transfer_image(const uint8_t *image,
                           libusb_device_handle *dev_handle);
+static int control_transfer(usb_device_t *this, uint8_t request,
+                            uint16_t value, uint16_t index, uint8_t *data,
+                            uint16_t length);
 static int list_endpoints(struct libusb_endpoint_descriptor endpoints[],
                           struct libusb_ss_endpoint_companion_descriptor ss_endpoints[],
                           libusb_device *device);
@@ -326,6 +330,11 @@ usb_device_t *usb_device_open(int index, const char* imagefile,
   this->bulk_in_max_packet_size = bulk_in_max_packet_size;
   this->bulk_in_max_burst = bulk_in_max_burst;
   this->gpio_register = gpio_register;
+  atomic_init(&this->control_transfers, 0);
+  atomic_init(&this->control_errors, 0);
+  for (int i = 0; i <= OPERATION_FX3_COMMAND; ++i) {
+    operation_stats_init(&this->control_operations[i]);
+  }
 
   ret_val = this;
   return ret_val;
@@ -352,58 +361,80 @@ int usb_device_handle_events(usb_device_t *this)
   return libusb_handle_events_completed(this->context, &this->completed);
 }
 
+/* control transfers issued by the calling thread, so a library call can
+   tell its own transfers from the ones of the command queue thread */
+static _Thread_local uint64_t thread_control_transfers = 0;
+
 int usb_device_control(usb_device_t *this, uint8_t request, uint16_t value,
                        uint16_t index, uint8_t *data, uint16_t length) {
 
-  const uint8_t bmWriteRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
-  const uint8_t bmReadRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
-  const unsigned int timeout = 5000;        // timeout (in ms) for each command
+  atomic_fetch_add_explicit(&this->control_transfers, 1, memory_order_relaxed);
+  ++thread_control_transfers;
+
+  uint64_t start = flight_recorder_timestamp();
+  uint64_t start_ns = operation_stats_now();
+  int ret = control_transfer(this, request, value, index, data, length);
+  enum RF103Operation operation = request == GPIOFX3 ? OPERATION_GPIO :
+                                  request == I2CWFX3 ? OPERATION_I2C_WRITE :
+                                  request == I2CRFX3 ? OPERATION_I2C_READ :
+                                  OPERATION_FX3_COMMAND;
+  operation_stats_record(&this->control_operations[operation],
+                         operation_stats_now() - start_ns, ret < 0, 1);
+  if (request == I2CWFX3) {
+    uint32_t bytes = 0;
+    for (int i = 0; i < length && i < 4; ++i) {
+      bytes |= (uint32_t) data[i] << (8 * i);
+    }
+    flight_recorder_record(FR_EVENT_I2C_WRITE, value << 8 | (index & 0xff),
+                           bytes, length, ret, start);
+  } else {
+    flight_recorder_record(FR_EVENT_CONTROL, request,
+                           (uint32_t) value << 16 | index, length, ret, start);
+  }
 
-  uint8_t dummy[] = { 0 };
+  if (ret < 0) {
+    atomic_fetch_add_explicit(&this->control_errors, 1, memory_order_relaxed);
+    flight_recorder_failure();
+    return -1;
+  }
+  return 0;
+}
 
-  int ret;
-  switch (request) {
-    case RESETFX3:
-    case STARTFX3:
-    case STOPFX3:
-    case PAUSEFX3:
-      ret = libusb_control_transfer(this->dev_handle, bmWriteRequestType,
-                                    request, 0, 0, dummy, sizeof(dummy),
-                                    timeout);
-      if (ret < 0) {
-        log_usb_error(ret, __func__, __FILE__, __LINE__);
-        return -1;
-      }
-      break;
-    case GPIOFX3:
-    case I2CWFX3:
-      ret = libusb_control_transfer(this->dev_handle, bmWriteRequestType,
-                                    request, value, index, data, length,
-                                    timeout);
-      if (ret < 0) {
-        log_usb_error(ret, __func__, __FILE__, __LINE__);
-        return -1;
-      }
-      break;
-    case TESTFX3:
-    case I2CRFX3:
-      ret = libusb_control_transfer(this->dev_handle, bmReadRequestType,
-                                    request, value, index, data, length,
-                                    timeout);
-      if (ret < 0) {
-        log_usb_error(ret, __func__, __FILE__, __LINE__);
-        return -1;
-      }
-      break;
-    default:
-      fprintf(stderr, "ERROR - unknown USB device control request: 0x%02x\n",
-              request);
-      return -1;
+
+void usb_device_get_control_stats(usb_device_t *this,
+                                  uint64_t *control_transfers,
+                                  uint64_t *control_errors) {
+  *control_transfers = atomic_load_explicit(&this->control_transfers,
+                                            memory_order_relaxed);
+  *control_errors = atomic_load_explicit(&this->control_errors,
+                                         memory_order_relaxed);
+}
+
+
+uint64_t usb_device_get_thread_control_transfers() {
+  return thread_control_transfers;
+}
+
+
+int usb_device_get_operation_stats(usb_device_t *this,
+                                   enum RF103Operation operation,
+                                   struct rf103_operation_stats *stats) {
+  if (operation < OPERATION_GPIO || operation > OPERATION_FX3_COMMAND) {
+    fprintf(stderr, "ERROR - not a control transfer operation: %d\n", operation);
+    return -1;
   }
+  operation_stats_get(&this->control_operations[operation], stats);
   return 0;
 }
 
 
+void usb_device_reset_operation_stats(usb_device_t *this) {
+  for (int i = 0; i <= OPERATION_FX3_COMMAND; ++i) {
+    operation_stats_reset(&this->control_operations[i]);
+  }
+}
+
+
 int usb_device_gpio_set(usb_device_t *this, uint8_t bit_pattern,
                         uint8_t bit_mask) {
   this->gpio_register = (this->gpio_register & ~bit_mask) | bit_pattern;
@@ -461,6 +492,60 @@ int usb_device_i2c_read(usb_device_t *this, uint8_t i2c_address,
 
 
 /* internal functions */
+static int control_transfer(usb_device_t *this, uint8_t request,
+                            uint16_t value, uint16_t index, uint8_t *data,
+                            uint16_t length)
+{
+
+  const uint8_t bmWriteRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+  const uint8_t bmReadRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+  const unsigned int timeout = 5000;        // timeout (in ms) for each command
+
+  uint8_t dummy[] = { 0 };
+
+  int ret;
+  switch (request) {
+    case RESETFX3:
+    case STARTFX3:
+    case STOPFX3:
+    case PAUSEFX3:
+      ret = libusb_control_transfer(this->dev_handle, bmWriteRequestType,
+                                    request, 0, 0, dummy, sizeof(dummy),
+                                    timeout);
+      if (ret < 0) {
+        log_usb_error(ret, __func__, __FILE__, __LINE__);
+        return ret;
+      }
+      break;
+    case GPIOFX3:
+    case I2CWFX3:
+      ret = libusb_control_transfer(this->dev_handle, bmWriteRequestType,
+                                    request, value, index, data, length,
+                                    timeout);
+      if (ret < 0) {
+        log_usb_error(ret, __func__, __FILE__, __LINE__);
+        return ret;
+      }
+      break;
+    case TESTFX3:
+    case I2CRFX3:
+      ret = libusb_control_transfer(this->dev_handle, bmReadRequestType,
+                                    request, value, index, data, length,
+                                    timeout);
+      if (ret < 0) {
+        log_usb_error(ret, __func__, __FILE__, __LINE__);
+        return ret;
+      }
+      break;
+    default:
+      fprintf(stderr, "ERROR - unknown USB device control request: 0x%02x\n",
+              request);
+      return LIBUSB_ERROR_INVALID_PARAM;
+  }
+  return 0;
+}
+
+
 static libusb_device_handle *find_usb_device(int index, libusb_context *ctx,
                              libusb_device **device, int *needs_firmware)
 {
@@ -24,6 +24,8 @@
 
 #include <libusb.h>
 
+#include "rf103.h"
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -64,6 +66,18 @@ void usb_device_close(usb_device_t *this);
 int usb_device_control(usb_device_t *this, uint8_t request, uint16_t value,
                        uint16_t index, uint8_t *data, uint16_t length);
 
+void usb_device_get_control_stats(usb_device_t *this,
+                                  uint64_t *control_transfers,
+                                  uint64_t *control_errors);
+
+uint64_t usb_device_get_thread_control_transfers();
+
+int usb_device_get_operation_stats(usb_device_t *this,
+                                   enum RF103Operation operation,
+                                   struct rf103_operation_stats *stats);
+
+void usb_device_reset_operation_stats(usb_device_t *this);
+
 int usb_device_gpio_set(usb_device_t *this, uint8_t bit_pattern,
                         uint8_t bit_mask);
 
@@ -23,7 +23,10 @@
 #ifndef __USB_DEVICE_INTERNALS_H
 #define __USB_DEVICE_INTERNALS_H
 
+#include <stdatomic.h>
+
 #include "usb_device.h"
+#include "operation_stats.h"
 
 
 #ifdef __cplusplus
@@ -43,6 +46,10 @@ typedef struct usb_device {
   uint16_t bulk_in_max_packet_size;
   uint8_t bulk_in_max_burst;
   uint8_t gpio_register;
+  atomic_ullong control_transfers;   /* statistics (relaxed atomics) */
+  atomic_ullong control_errors;
+  /* per kind of control transfer (OPERATION_GPIO..OPERATION_FX3_COMMAND) */
+  struct operation_stats control_operations[OPERATION_FX3_COMMAND + 1];
 } usb_device_t;
 typedef struct usb_device usb_device_t;
 
@@ -0,0 +1,1008 @@
+/*
+ * waterfall_server.c - WebSocket spectrum/waterfall server for the tools
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - The WebSocket Protocol: https://tools.ietf.org/html/rfc6455
+ *  - US Secure Hash Algorithm 1 (SHA1): https://tools.ietf.org/html/rfc3174
+ *  - R. F. Rice, Some practical universal noiseless coding techniques,
+ *    JPL Publication 79-22, 1979
+ */
+
+/* each spectrum is converted to dB once; every (level, tile) line that has
+ * at least one viewer is then quantized, Rice coded and wrapped in a
+ * WebSocket frame once, and that same buffer (refcounted) is sent to all the
+ * viewers of that line; a single thread serves all the clients with
+ * non blocking sockets: a client that is still sending an older line when a
+ * new one arrives just skips to the newest one when it's done
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "waterfall_server.h"
+
+
+typedef struct waterfall_server waterfall_server_t;
+struct waterfall_client;
+struct waterfall_line;
+
+/* internal functions */
+static void *waterfall_server_thread(void *arg);
+static void accept_client(waterfall_server_t *this);
+static void drop_client(waterfall_server_t *this, uint32_t index);
+static int read_client(waterfall_server_t *this,
+                       struct waterfall_client *client);
+static int handle_handshake(waterfall_server_t *this,
+                            struct waterfall_client *client);
+static int handle_messages(waterfall_server_t *this,
+                           struct waterfall_client *client);
+static void set_zoom(waterfall_server_t *this, struct waterfall_client *client,
+                     uint32_t level, uint32_t tile);
+static int write_client(waterfall_server_t *this,
+                        struct waterfall_client *client);
+static void next_line(waterfall_server_t *this,
+                      struct waterfall_client *client);
+static const uint8_t *client_output(waterfall_server_t *this,
+                                    struct waterfall_client *client);
+static struct waterfall_line *encode_line(waterfall_server_t *this,
+                                          uint32_t level, uint32_t tile,
+                                          uint64_t sequence,
+                                          double first_frequency,
+                                          double bin_width);
+static void release_line(struct waterfall_line *line);
+static void websocket_accept(const char *key, size_t key_length,
+                             char accept[29]);
+static void sha1(const uint8_t *data, size_t size, uint8_t digest[20]);
+
+
+enum {
+  WATERFALL_MAX_CLIENTS = 64,
+  WATERFALL_MAX_LEVELS = 8,
+  WATERFALL_HEADER_SIZE = 32,     /* binary message header */
+  WATERFALL_REQUEST_SIZE = 2048,  /* handshake and client messages */
+  WATERFALL_LINE = 1              /* message type */
+};
+
+enum WaterfallClientState {
+  CLIENT_HANDSHAKE,
+  CLIENT_OPEN,
+  CLIENT_CLOSING                  /* close when the output has been sent */
+};
+
+/* what is being sent; the client slots move when a client is dropped, so
+   the data is looked up when sending rather than kept as a pointer */
+enum WaterfallOutput {
+  OUTPUT_NONE,
+  OUTPUT_RESPONSE,                /* the handshake response */
+  OUTPUT_PAGE,                    /* the viewer */
+  OUTPUT_LINE                     /* the line being sent */
+};
+
+struct waterfall_line {
+  int refcount;                   /* protected by the server lock */
+  uint64_t sequence;
+  uint32_t size;                  /* WebSocket frame header + message */
+  uint8_t data[];
+};
+
+struct waterfall_client {
+  int fd;
+  enum WaterfallClientState state;
+  char request[WATERFALL_REQUEST_SIZE + 1];
+  uint32_t request_size;
+  int subscribed;
+  uint32_t slot;                  /* (level, tile) being viewed */
+  uint64_t sequence;              /* last line sent */
+  struct waterfall_line *line;    /* line being sent */
+  enum WaterfallOutput output;
+  uint32_t output_size;
+  uint32_t output_offset;
+  char response[256];
+};
+
+typedef struct waterfall_server {
+  uint32_t nbins;
+  uint32_t width;
+  uint32_t levels;
+  uint32_t num_slots;             /* 2^levels - 1 (level, tile) lines */
+  int listen_fd;
+  int wakeup[2];                  /* pipe: new lines are available */
+  pthread_t thread;
+  atomic_int stop;
+  pthread_mutex_t lock;
+  struct waterfall_line **lines;  /* latest line of each slot */
+  uint32_t *viewers;              /* clients of each slot */
+  uint32_t *pending;              /* slots to encode (publisher only) */
+  struct waterfall_line **encoded;
+  uint8_t *db;                    /* quantized spectrum (publisher only) */
+  uint8_t *pixels;
+  uint16_t *encoded_z;
+  uint8_t *bits;
+  char *page;                     /* HTTP response with the viewer */
+  uint32_t page_size;
+  struct waterfall_client clients[WATERFALL_MAX_CLIENTS];
+  uint32_t num_clients;
+  uint64_t frames_published;
+  uint64_t frames_encoded;
+  uint64_t frames_sent;
+  uint64_t frames_dropped;
+} waterfall_server_t;
+
+
+static const char DEFAULT_WATERFALL_HOST[] = "127.0.0.1";
+static const int WATERFALL_POLL_TIMEOUT = 200;  /* ms */
+static const int WATERFALL_RICE_ESCAPE = 15;
+static const char WEBSOCKET_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+/* minimal browser viewer: mouse wheel to zoom in and out */
+static const char *viewer_page[] = {
+  "<!DOCTYPE html>\n",
+  "<html><head><title>RF103 waterfall</title></head>\n",
+  "<body style='margin:0;background:#000;color:#ccc;font:12px sans-serif'>\n",
+  "<div id='info'>connecting...</div><canvas id='c' height='600'></canvas>\n",
+  "<script>\n",
+  "var c=document.getElementById('c'),g=c.getContext('2d'),",
+  "info=document.getElementById('info'),row=null,level=0,tile=0,levels=1;\n",
+  "var ws=new WebSocket('ws://'+location.host+'/');ws.binaryType='arraybuffer';\n",
+  "ws.onmessage=function(e){var v=new DataView(e.data),w=v.getUint16(4,true);\n",
+  " if(c.width!=w){c.width=w;row=g.createImageData(w,1);}\n",
+  " var k=v.getUint8(6),f=v.getFloat64(16,true),df=v.getFloat64(24,true),",
+  "bit=256,y=0;levels=v.getUint8(7);\n",
+  " function rd(n){var r=0;while(n--){r=2*r+(v.getUint8(bit>>3)>>(7-(bit&7))&1);",
+  "bit++;}return r;}\n",
+  " for(var i=0;i<w;i++){var q=0;while(q<15&&rd(1))q++;",
+  "var z=q<15?(q<<k)|rd(k):rd(9);y+=z&1?-(z+1)/2:z/2;\n",
+  "  var t=Math.max(0,Math.min(1,(y/2-127.5+130)/110));\n",
+  "  row.data[4*i]=Math.max(0,Math.min(255,765*t-255));",
+  "row.data[4*i+1]=Math.max(0,Math.min(255,765*t-510));",
+  "row.data[4*i+2]=Math.min(255,510*t);row.data[4*i+3]=255;}\n",
+  " g.drawImage(c,0,1);g.putImageData(row,0,0);\n",
+  " info.textContent=(f/1e6).toFixed(3)+' - '+((f+w*df)/1e6).toFixed(3)+",
+  "' MHz  zoom '+v.getUint8(1)+'/'+(levels-1);};\n",
+  "ws.onclose=function(){info.textContent='disconnected';};\n",
+  "c.onwheel=function(e){e.preventDefault();",
+  "var pos=(tile+e.offsetX/c.clientWidth)/(1<<level);\n",
+  " level=Math.max(0,Math.min(levels-1,level+(e.deltaY<0?1:-1)));\n",
+  " tile=Math.min((1<<level)-1,Math.floor(pos*(1<<level)));",
+  "ws.send('zoom '+level+' '+tile);};\n",
+  "</script></body></html>\n",
+  0
+};
+
+
+waterfall_server_t *waterfall_server_open(const char *address, uint32_t nbins,
+                                          uint32_t width, uint32_t levels)
+{
+  waterfall_server_t *ret_val = 0;
+
+  if (width == 0 || width > 65535) {
+    fprintf(stderr, "ERROR - invalid waterfall width: %u\n", width);
+    return ret_val;
+  }
+  if (levels == 0 || levels > WATERFALL_MAX_LEVELS ||
+      (nbins >> (levels - 1)) < width) {
+    fprintf(stderr, "ERROR - invalid waterfall zoom levels: %u (%u bins, width %u)\n",
+            levels, nbins, width);
+    return ret_val;
+  }
+
+  char host[256];
+  const char *port;
+  const char *colon = strrchr(address, ':');
+  if (colon) {
+    size_t host_length = colon - address;
+    if (host_length >= sizeof(host)) {
+      fprintf(stderr, "ERROR - invalid waterfall address: %s\n", address);
+      return ret_val;
+    }
+    memcpy(host, address, host_length);
+    host[host_length] = '\0';
+    port = colon + 1;
+  } else {
+    host[0] = '\0';
+    port = address;
+  }
+  if (host[0] == '\0') {
+    strcpy(host, DEFAULT_WATERFALL_HOST);
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  struct addrinfo *addrinfo;
+  int ret = getaddrinfo(host, port, &hints, &addrinfo);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR - getaddrinfo(%s) failed: %s\n", address,
+            gai_strerror(ret));
+    return ret_val;
+  }
+
+  int listen_fd = -1;
+  for (struct addrinfo *ai = addrinfo; ai; ai = ai->ai_next) {
+    listen_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (listen_fd < 0) {
+      continue;
+    }
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(listen_fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+        listen(listen_fd, 16) == 0) {
+      break;
+    }
+    close(listen_fd);
+    listen_fd = -1;
+  }
+  freeaddrinfo(addrinfo);
+  if (listen_fd < 0) {
+    fprintf(stderr, "ERROR - cannot listen on waterfall address %s: %s\n",
+            address, strerror(errno));
+    return ret_val;
+  }
+
+  int wakeup[2];
+  if (pipe(wakeup) < 0) {
+    fprintf(stderr, "ERROR - pipe() failed: %s\n", strerror(errno));
+    close(listen_fd);
+    return ret_val;
+  }
+  fcntl(wakeup[0], F_SETFL, O_NONBLOCK);
+  fcntl(wakeup[1], F_SETFL, O_NONBLOCK);
+
+  /* we are good here - create and initialize the waterfall server */
+  waterfall_server_t *this = (waterfall_server_t *) malloc(sizeof(waterfall_server_t));
+  this->nbins = nbins;
+  this->width = width;
+  this->levels = levels;
+  this->num_slots = (1 << levels) - 1;
+  this->listen_fd = listen_fd;
+  this->wakeup[0] = wakeup[0];
+  this->wakeup[1] = wakeup[1];
+  atomic_init(&this->stop, 0);
+  pthread_mutex_init(&this->lock, 0);
+  this->lines = (struct waterfall_line **) calloc(this->num_slots, sizeof(struct waterfall_line *));
+  this->viewers = (uint32_t *) calloc(this->num_slots, sizeof(uint32_t));
+  this->pending = (uint32_t *) malloc(this->num_slots * sizeof(uint32_t));
+  this->encoded = (struct waterfall_line **) malloc(this->num_slots * sizeof(struct waterfall_line *));
+  this->db = (uint8_t *) malloc(nbins);
+  this->pixels = (uint8_t *) malloc(width);
+  /* worst case: every pixel escaped */
+  this->encoded_z = (uint16_t *) malloc(width * sizeof(uint16_t));
+  this->bits = (uint8_t *) malloc(3 * width + 1);
+  this->num_clients = 0;
+  this->frames_published = 0;
+  this->frames_encoded = 0;
+  this->frames_sent = 0;
+  this->frames_dropped = 0;
+
+  /* the viewer page never changes: build its response once */
+  size_t page_length = 0;
+  for (const char **line = viewer_page; *line; ++line) {
+    page_length += strlen(*line);
+  }
+  char header[256];
+  int header_length = snprintf(header, sizeof(header),
+                               "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: text/html\r\n"
+                               "Content-Length: %zu\r\n"
+                               "Connection: close\r\n"
+                               "\r\n", page_length);
+  this->page_size = header_length + page_length;
+  this->page = (char *) malloc(this->page_size + 1);
+  strcpy(this->page, header);
+  for (const char **line = viewer_page; *line; ++line) {
+    strcat(this->page, *line);
+  }
+
+  ret = pthread_create(&this->thread, 0, waterfall_server_thread, this);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR - pthread_create() failed: %s\n", strerror(ret));
+    /* there is no thread to join */
+    atomic_store(&this->stop, 1);
+    waterfall_server_close(this);
+    return ret_val;
+  }
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void waterfall_server_close(waterfall_server_t *this)
+{
+  if (!atomic_load(&this->stop)) {
+    atomic_store(&this->stop, 1);
+    pthread_join(this->thread, 0);
+  }
+  while (this->num_clients > 0) {
+    drop_client(this, this->num_clients - 1);
+  }
+  for (uint32_t slot = 0; slot < this->num_slots; ++slot) {
+    if (this->lines[slot]) {
+      release_line(this->lines[slot]);
+    }
+  }
+  close(this->listen_fd);
+  close(this->wakeup[0]);
+  close(this->wakeup[1]);
+  pthread_mutex_destroy(&this->lock);
+  free(this->lines);
+  free(this->viewers);
+  free(this->pending);
+  free(this->encoded);
+  free(this->db);
+  free(this->pixels);
+  free(this->encoded_z);
+  free(this->bits);
+  free(this->page);
+  free(this);
+  return;
+}
+
+
+int waterfall_server_publish(waterfall_server_t *this, const float *power,
+                             double first_frequency, double bin_width)
+{
+  /* only the lines somebody is looking at */
+  pthread_mutex_lock(&this->lock);
+  uint64_t sequence = ++this->frames_published;
+  uint32_t num_pending = 0;
+  for (uint32_t slot = 0; slot < this->num_slots; ++slot) {
+    if (this->viewers[slot] > 0) {
+      this->pending[num_pending++] = slot;
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+  if (num_pending == 0) {
+    return 0;
+  }
+
+  /* 0.5 dB steps from -127.5 dB to full scale */
+  for (uint32_t i = 0; i < this->nbins; ++i) {
+    float db = power[i] > 1e-20f ? 10.0f * log10f(power[i]) : -200.0f;
+    this->db[i] = (uint8_t) lrintf(fminf(fmaxf(2.0f * db + 255.0f, 0.0f),
+                                         255.0f));
+  }
+
+  for (uint32_t i = 0; i < num_pending; ++i) {
+    uint32_t slot = this->pending[i];
+    uint32_t level = 0;
+    while ((2u << level) - 1 <= slot) {
+      level++;
+    }
+    uint32_t tile = slot - ((1 << level) - 1);
+    this->encoded[i] = encode_line(this, level, tile, sequence,
+                                   first_frequency, bin_width);
+  }
+
+  pthread_mutex_lock(&this->lock);
+  for (uint32_t i = 0; i < num_pending; ++i) {
+    uint32_t slot = this->pending[i];
+    if (this->lines[slot]) {
+      release_line(this->lines[slot]);
+    }
+    this->lines[slot] = this->encoded[i];
+  }
+  this->frames_encoded += num_pending;
+  pthread_mutex_unlock(&this->lock);
+
+  /* a full pipe means the server thread has not caught up yet anyway */
+  if (write(this->wakeup[1], "", 1) < 0 && errno != EAGAIN) {
+    fprintf(stderr, "ERROR - waterfall server wakeup failed: %s\n",
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+
+void waterfall_server_get_stats(waterfall_server_t *this,
+                                struct waterfall_server_stats *stats)
+{
+  pthread_mutex_lock(&this->lock);
+  stats->clients = 0;
+  for (uint32_t slot = 0; slot < this->num_slots; ++slot) {
+    stats->clients += this->viewers[slot];
+  }
+  stats->frames_published = this->frames_published;
+  stats->frames_encoded = this->frames_encoded;
+  stats->frames_sent = this->frames_sent;
+  stats->frames_dropped = this->frames_dropped;
+  pthread_mutex_unlock(&this->lock);
+  return;
+}
+
+
+/* internal functions */
+static void *waterfall_server_thread(void *arg)
+{
+  waterfall_server_t *this = (waterfall_server_t *) arg;
+  struct pollfd pollfds[2 + WATERFALL_MAX_CLIENTS];
+  while (!atomic_load(&this->stop)) {
+    pollfds[0] = (struct pollfd) { this->wakeup[0], POLLIN, 0 };
+    pollfds[1] = (struct pollfd) { this->listen_fd, POLLIN, 0 };
+    uint32_t num_clients = this->num_clients;
+    for (uint32_t i = 0; i < num_clients; ++i) {
+      struct waterfall_client *client = &this->clients[i];
+      short events = POLLIN;
+      if (client->output != OUTPUT_NONE) {
+        events |= POLLOUT;
+      }
+      pollfds[2 + i] = (struct pollfd) { client->fd, events, 0 };
+    }
+    int ret = poll(pollfds, 2 + num_clients, WATERFALL_POLL_TIMEOUT);
+    if (ret < 0) {
+      continue;
+    }
+    if (pollfds[0].revents & POLLIN) {
+      char buffer[64];
+      while (read(this->wakeup[0], buffer, sizeof(buffer)) > 0)
+        ;
+    }
+
+    /* go backwards, so dropping a client doesn't skip the next one; every
+       client gets a chance to pick up a new line, not only the writable
+       ones */
+    for (uint32_t i = num_clients; i-- > 0; ) {
+      struct waterfall_client *client = &this->clients[i];
+      short revents = pollfds[2 + i].revents;
+      ret = 0;
+      if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        ret = -1;
+      }
+      if (ret == 0 && (revents & POLLIN)) {
+        ret = read_client(this, client);
+      }
+      if (ret == 0) {
+        ret = write_client(this, client);
+      }
+      if (ret < 0) {
+        drop_client(this, i);
+      }
+    }
+
+    if (pollfds[1].revents & POLLIN) {
+      accept_client(this);
+    }
+  }
+  return 0;
+}
+
+
+static void accept_client(waterfall_server_t *this)
+{
+  int fd = accept(this->listen_fd, 0, 0);
+  if (fd < 0) {
+    return;
+  }
+  if (this->num_clients == WATERFALL_MAX_CLIENTS) {
+    close(fd);
+    return;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  int nodelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  struct waterfall_client *client = &this->clients[this->num_clients++];
+  client->fd = fd;
+  client->state = CLIENT_HANDSHAKE;
+  client->request_size = 0;
+  client->subscribed = 0;
+  client->slot = 0;
+  client->sequence = 0;
+  client->line = 0;
+  client->output = OUTPUT_NONE;
+  client->output_size = 0;
+  client->output_offset = 0;
+  return;
+}
+
+
+static void drop_client(waterfall_server_t *this, uint32_t index)
+{
+  struct waterfall_client *client = &this->clients[index];
+  close(client->fd);
+  pthread_mutex_lock(&this->lock);
+  if (client->subscribed) {
+    this->viewers[client->slot]--;
+  }
+  if (client->line) {
+    release_line(client->line);
+  }
+  pthread_mutex_unlock(&this->lock);
+  this->num_clients--;
+  if (index != this->num_clients) {
+    *client = this->clients[this->num_clients];
+  }
+  return;
+}
+
+
+static int read_client(waterfall_server_t *this,
+                       struct waterfall_client *client)
+{
+  ssize_t n = recv(client->fd, client->request + client->request_size,
+                   WATERFALL_REQUEST_SIZE - client->request_size, 0);
+  if (n == 0) {
+    return -1;
+  }
+  if (n < 0) {
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+  }
+  client->request_size += n;
+  client->request[client->request_size] = '\0';
+
+  switch (client->state) {
+  case CLIENT_HANDSHAKE:
+    return handle_handshake(this, client);
+  case CLIENT_OPEN:
+    return handle_messages(this, client);
+  case CLIENT_CLOSING:
+    client->request_size = 0;
+    return 0;
+  }
+  return 0;
+}
+
+
+static int handle_handshake(waterfall_server_t *this,
+                            struct waterfall_client *client)
+{
+  /* wait for the whole request */
+  char *end = strstr(client->request, "\r\n\r\n");
+  if (end == 0) {
+    return client->request_size < WATERFALL_REQUEST_SIZE ? 0 : -1;
+  }
+  if (strncmp(client->request, "GET ", 4) != 0) {
+    return -1;
+  }
+  const char *key = 0;
+  size_t key_length = 0;
+  for (char *line = strstr(client->request, "\r\n") + 2; line < end;
+       line = strstr(line, "\r\n") + 2) {
+    if (strncasecmp(line, "Sec-WebSocket-Key:", 18) == 0) {
+      key = line + 18;
+      key += strspn(key, " \t");
+      key_length = strcspn(key, " \t\r\n");
+      break;
+    }
+  }
+
+  if (key == 0) {
+    /* plain HTTP request: send the viewer */
+    client->state = CLIENT_CLOSING;
+    client->output = OUTPUT_PAGE;
+    client->output_size = this->page_size;
+    client->output_offset = 0;
+    return 0;
+  }
+  if (key_length == 0 || key_length > 64) {
+    return -1;
+  }
+  char accept[29];
+  websocket_accept(key, key_length, accept);
+  int length = snprintf(client->response, sizeof(client->response),
+                        "HTTP/1.1 101 Switching Protocols\r\n"
+                        "Upgrade: websocket\r\n"
+                        "Connection: Upgrade\r\n"
+                        "Sec-WebSocket-Accept: %s\r\n"
+                        "\r\n", accept);
+  client->state = CLIENT_OPEN;
+  client->output = OUTPUT_RESPONSE;
+  client->output_size = length;
+  client->output_offset = 0;
+
+  /* everybody starts with the whole band */
+  set_zoom(this, client, 0, 0);
+
+  /* the client may have sent its first messages already */
+  uint32_t consumed = end + 4 - client->request;
+  client->request_size -= consumed;
+  memmove(client->request, client->request + consumed, client->request_size);
+  return handle_messages(this, client);
+}
+
+
+static int handle_messages(waterfall_server_t *this,
+                           struct waterfall_client *client)
+{
+  uint8_t *request = (uint8_t *) client->request;
+  uint32_t offset = 0;
+  while (client->request_size - offset >= 2) {
+    uint8_t *frame = request + offset;
+    uint32_t available = client->request_size - offset;
+    int opcode = frame[0] & 0x0f;
+    uint32_t length = frame[1] & 0x7f;
+    uint32_t header = 2;
+    /* client frames must be masked */
+    if ((frame[1] & 0x80) == 0 || length == 127) {
+      return -1;
+    }
+    if (length == 126) {
+      if (available < 4) {
+        break;
+      }
+      length = (frame[2] << 8) | frame[3];
+      header = 4;
+    }
+    if (header + 4 + length > WATERFALL_REQUEST_SIZE) {
+      return -1;
+    }
+    if (available < header + 4 + length) {
+      break;
+    }
+    const uint8_t *mask = frame + header;
+    uint8_t *payload = frame + header + 4;
+    for (uint32_t i = 0; i < length; ++i) {
+      payload[i] ^= mask[i % 4];
+    }
+
+    if (opcode == 0x8) {
+      /* close */
+      return -1;
+    }
+    if (opcode == 0x1) {
+      char text[64];
+      uint32_t text_length = length < sizeof(text) ? length : sizeof(text) - 1;
+      memcpy(text, payload, text_length);
+      text[text_length] = '\0';
+      unsigned level;
+      unsigned tile;
+      if (sscanf(text, "zoom %u %u", &level, &tile) == 2) {
+        set_zoom(this, client, level, tile);
+      }
+    }
+    offset += header + 4 + length;
+  }
+  client->request_size -= offset;
+  memmove(client->request, client->request + offset, client->request_size);
+  return 0;
+}
+
+
+static void set_zoom(waterfall_server_t *this, struct waterfall_client *client,
+                     uint32_t level, uint32_t tile)
+{
+  if (level >= this->levels || tile >= (1u << level)) {
+    return;
+  }
+  pthread_mutex_lock(&this->lock);
+  if (client->subscribed) {
+    this->viewers[client->slot]--;
+  }
+  client->slot = (1 << level) - 1 + tile;
+  this->viewers[client->slot]++;
+  client->subscribed = 1;
+  /* the latest line of the new slot is not a drop */
+  client->sequence = 0;
+  pthread_mutex_unlock(&this->lock);
+  return;
+}
+
+
+static int write_client(waterfall_server_t *this,
+                        struct waterfall_client *client)
+{
+  while (1) {
+    if (client->output == OUTPUT_NONE) {
+      if (client->state == CLIENT_CLOSING) {
+        return -1;
+      }
+      if (client->state == CLIENT_OPEN) {
+        next_line(this, client);
+      }
+      if (client->output == OUTPUT_NONE) {
+        return 0;
+      }
+    }
+    ssize_t n = send(client->fd,
+                     client_output(this, client) + client->output_offset,
+                     client->output_size - client->output_offset,
+                     MSG_NOSIGNAL);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    client->output_offset += n;
+    if (client->output_offset == client->output_size) {
+      if (client->line) {
+        pthread_mutex_lock(&this->lock);
+        release_line(client->line);
+        pthread_mutex_unlock(&this->lock);
+        client->line = 0;
+      }
+      client->output = OUTPUT_NONE;
+    }
+  }
+}
+
+
+static void next_line(waterfall_server_t *this,
+                      struct waterfall_client *client)
+{
+  pthread_mutex_lock(&this->lock);
+  struct waterfall_line *line = this->lines[client->slot];
+  if (line && line->sequence > client->sequence) {
+    if (client->sequence > 0) {
+      this->frames_dropped += line->sequence - client->sequence - 1;
+    }
+    this->frames_sent++;
+    line->refcount++;
+    client->sequence = line->sequence;
+    client->line = line;
+    client->output = OUTPUT_LINE;
+    client->output_size = line->size;
+    client->output_offset = 0;
+  }
+  pthread_mutex_unlock(&this->lock);
+  return;
+}
+
+
+static const uint8_t *client_output(waterfall_server_t *this,
+                                    struct waterfall_client *client)
+{
+  switch (client->output) {
+  case OUTPUT_RESPONSE:
+    return (const uint8_t *) client->response;
+  case OUTPUT_PAGE:
+    return (const uint8_t *) this->page;
+  case OUTPUT_LINE:
+    return client->line->data;
+  case OUTPUT_NONE:
+    break;
+  }
+  return 0;
+}
+
+
+static struct waterfall_line *encode_line(waterfall_server_t *this,
+                                          uint32_t level, uint32_t tile,
+                                          uint64_t sequence,
+                                          double first_frequency,
+                                          double bin_width)
+{
+  /* each pixel is the peak of its bins, so narrow carriers don't vanish
+     when zoomed out */
+  uint32_t width = this->width;
+  uint32_t tile_bins = this->nbins >> level;
+  uint32_t first_bin = tile * tile_bins;
+  const uint8_t *db = this->db + first_bin;
+  uint8_t *pixels = this->pixels;
+  for (uint32_t p = 0; p < width; ++p) {
+    uint32_t start = (uint64_t) p * tile_bins / width;
+    uint32_t end = (uint64_t) (p + 1) * tile_bins / width;
+    uint8_t peak = db[start];
+    for (uint32_t i = start + 1; i < end; ++i) {
+      peak = db[i] > peak ? db[i] : peak;
+    }
+    pixels[p] = peak;
+  }
+
+  /* zigzag differences, and the Rice parameter with the shortest code */
+  uint16_t *z = this->encoded_z;
+  int previous = 0;
+  for (uint32_t p = 0; p < width; ++p) {
+    int diff = pixels[p] - previous;
+    z[p] = diff >= 0 ? 2 * diff : -2 * diff - 1;
+    previous = pixels[p];
+  }
+  int k = 0;
+  uint64_t best_bits = UINT64_MAX;
+  for (int kk = 0; kk < 8; ++kk) {
+    uint64_t bits = 0;
+    for (uint32_t p = 0; p < width; ++p) {
+      uint32_t q = z[p] >> kk;
+      bits += q < (uint32_t) WATERFALL_RICE_ESCAPE ? q + 1 + kk :
+              WATERFALL_RICE_ESCAPE + 9;
+    }
+    if (bits < best_bits) {
+      best_bits = bits;
+      k = kk;
+    }
+  }
+
+  uint8_t *bits = this->bits;
+  uint32_t nbits = 0;
+  memset(bits, 0, (best_bits + 7) / 8);
+  for (uint32_t p = 0; p < width; ++p) {
+    uint32_t q = z[p] >> k;
+    uint32_t code;
+    int length;
+    if (q < (uint32_t) WATERFALL_RICE_ESCAPE) {
+      /* q ones, a zero, k bits */
+      code = (((1u << q) - 1) << (k + 1)) | (z[p] & ((1u << k) - 1));
+      length = q + 1 + k;
+    } else {
+      code = (((1u << WATERFALL_RICE_ESCAPE) - 1) << 9) | z[p];
+      length = WATERFALL_RICE_ESCAPE + 9;
+    }
+    for (int b = length - 1; b >= 0; --b, ++nbits) {
+      bits[nbits / 8] |= ((code >> b) & 1) << (7 - nbits % 8);
+    }
+  }
+
+  uint32_t message_size = WATERFALL_HEADER_SIZE + (nbits + 7) / 8;
+  /* an escaped pixel takes 24 bits, so a wide line can need the 64 bit
+     length form */
+  uint32_t frame_header = message_size < 126 ? 2 :
+                          message_size < 65536 ? 4 : 10;
+  struct waterfall_line *line = (struct waterfall_line *) malloc(sizeof(struct waterfall_line) + frame_header + message_size);
+  line->refcount = 1;
+  line->sequence = sequence;
+  line->size = frame_header + message_size;
+
+  /* WebSocket frame: FIN + binary, unmasked */
+  uint8_t *data = line->data;
+  data[0] = 0x82;
+  if (frame_header == 2) {
+    data[1] = message_size;
+  } else if (frame_header == 4) {
+    data[1] = 126;
+    data[2] = message_size >> 8;
+    data[3] = message_size & 0xff;
+  } else {
+    data[1] = 127;
+    for (int i = 0; i < 8; ++i) {
+      data[2 + i] = (uint64_t) message_size >> (8 * (7 - i));
+    }
+  }
+
+  uint8_t *message = data + frame_header;
+  uint16_t tile16 = tile;
+  uint16_t width16 = width;
+  uint32_t sequence32 = (uint32_t) sequence;
+  double frequency = first_frequency + first_bin * bin_width;
+  double pixel_width = bin_width * tile_bins / width;
+  memset(message, 0, WATERFALL_HEADER_SIZE);
+  message[0] = WATERFALL_LINE;
+  message[1] = level;
+  memcpy(message + 2, &tile16, sizeof(tile16));
+  memcpy(message + 4, &width16, sizeof(width16));
+  message[6] = k;
+  message[7] = this->levels;
+  memcpy(message + 8, &sequence32, sizeof(sequence32));
+  memcpy(message + 16, &frequency, sizeof(frequency));
+  memcpy(message + 24, &pixel_width, sizeof(pixel_width));
+  memcpy(message + WATERFALL_HEADER_SIZE, bits, (nbits + 7) / 8);
+  return line;
+}
+
+
+/* call with the server lock held */
+static void release_line(struct waterfall_line *line)
+{
+  if (--line->refcount == 0) {
+    free(line);
+  }
+  return;
+}
+
+
+static void websocket_accept(const char *key, size_t key_length,
+                             char accept[29])
+{
+  static const char base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  uint8_t input[128];
+  memcpy(input, key, key_length);
+  memcpy(input + key_length, WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+  uint8_t digest[21];
+  sha1(input, key_length + sizeof(WEBSOCKET_GUID) - 1, digest);
+
+  /* 20 bytes -> 27 characters + one '=' of padding */
+  digest[20] = 0;
+  char *output = accept;
+  for (int i = 0; i < 21; i += 3) {
+    uint32_t triple = (digest[i] << 16) | (digest[i + 1] << 8) | digest[i + 2];
+    *output++ = base64[(triple >> 18) & 0x3f];
+    *output++ = base64[(triple >> 12) & 0x3f];
+    *output++ = base64[(triple >> 6) & 0x3f];
+    *output++ = base64[triple & 0x3f];
+  }
+  accept[27] = '=';
+  accept[28] = '\0';
+  return;
+}
+
+
+/* SHA-1 of a short message (at most 119 bytes) */
+static void sha1(const uint8_t *data, size_t size, uint8_t digest[20])
+{
+  uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                    0xc3d2e1f0 };
+  uint8_t message[128];
+  size_t padded_size = size + 9 <= 64 ? 64 : 128;
+  memset(message, 0, padded_size);
+  memcpy(message, data, size);
+  message[size] = 0x80;
+  uint64_t bits = (uint64_t) size * 8;
+  for (int i = 0; i < 8; ++i) {
+    message[padded_size - 1 - i] = bits >> (8 * i);
+  }
+
+  for (size_t block = 0; block < padded_size; block += 64) {
+    uint32_t w[80];
+    for (int t = 0; t < 16; ++t) {
+      const uint8_t *b = message + block + 4 * t;
+      w[t] = ((uint32_t) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+    }
+    for (int t = 16; t < 80; ++t) {
+      uint32_t x = w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16];
+      w[t] = (x << 1) | (x >> 31);
+    }
+    uint32_t a = h[0];
+    uint32_t b = h[1];
+    uint32_t c = h[2];
+    uint32_t d = h[3];
+    uint32_t e = h[4];
+    for (int t = 0; t < 80; ++t) {
+      uint32_t f;
+      uint32_t k;
+      if (t < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (t < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (t < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      uint32_t temp = ((a << 5) | (a >> 27)) + f + e + k + w[t];
+      e = d;
+      d = c;
+      c = (b << 30) | (b >> 2);
+      b = a;
+      a = temp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  for (int i = 0; i < 5; ++i) {
+    digest[4 * i] = h[i] >> 24;
+    digest[4 * i + 1] = h[i] >> 16;
+    digest[4 * i + 2] = h[i] >> 8;
+    digest[4 * i + 3] = h[i];
+  }
+  return;
+}
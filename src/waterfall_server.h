@@ -0,0 +1,85 @@
+/*
+ * waterfall_server.h - WebSocket spectrum/waterfall server for the tools
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __WATERFALL_SERVER_H
+#define __WATERFALL_SERVER_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct waterfall_server waterfall_server_t;
+
+struct waterfall_server_stats {
+  uint32_t clients;               /* connected WebSocket clients */
+  uint64_t frames_published;      /* spectra handed to the server */
+  uint64_t frames_encoded;        /* encoded (level, tile) lines */
+  uint64_t frames_sent;           /* lines queued to the clients */
+  uint64_t frames_dropped;        /* lines skipped for slow clients */
+};
+
+/* address is '[host:]port' (default host: 127.0.0.1); every spectrum has
+ * nbins bins and each waterfall line is width pixels wide; zoom level z
+ * splits the spectrum in 2^z tiles, so a client sees the whole band at
+ * level 0 and a 1/2^z slice of it at level z
+ *
+ * 'GET /' without an upgrade returns a minimal browser viewer; WebSocket
+ * clients receive one binary message per waterfall line and select the
+ * line they want with the text message 'zoom <level> <tile>'
+ *
+ * binary message (little endian):
+ *    0  uint8    message type (1 = waterfall line)
+ *    1  uint8    zoom level
+ *    2  uint16   tile
+ *    4  uint16   width (pixels)
+ *    6  uint8    Rice parameter k
+ *    7  uint8    number of zoom levels
+ *    8  uint32   sequence number
+ *   16  float64  frequency of the first pixel (Hz)
+ *   24  float64  pixel width (Hz)
+ *   32  pixels, MSB first: each pixel is the peak of the bins it covers in
+ *       0.5 dB steps (0 = -127.5 dB or less, 255 = full scale or more);
+ *       the zigzag encoded difference z from the previous pixel (0 before
+ *       the first) is Rice coded as z >> k ones, a zero and the k low bits
+ *       of z, or, when z >> k is 15 or more, as 15 ones and z in 9 bits
+ */
+waterfall_server_t *waterfall_server_open(const char *address, uint32_t nbins,
+                                          uint32_t width, uint32_t levels);
+
+void waterfall_server_close(waterfall_server_t *this);
+
+/* power is nbins linear power values (full scale = 1.0); each line that
+ * has at least one viewer is encoded once and shared by all of them, so the
+ * cost does not depend on the number of viewers */
+int waterfall_server_publish(waterfall_server_t *this, const float *power,
+                             double first_frequency, double bin_width);
+
+void waterfall_server_get_stats(waterfall_server_t *this,
+                                struct waterfall_server_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __WATERFALL_SERVER_H */
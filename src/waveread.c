@@ -0,0 +1,116 @@
+/*
+ * waveread.c - helper functions to read wave files written by wavewrite
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "wavehdr.h"
+#include "waveread.h"
+
+static int	waveBytesPerFrame = 0;
+static int	waveHaveStartTime = 0;
+static Wind_SystemTime	waveStartTime;
+
+
+int  waveReadHeader(FILE * f, unsigned *samplerate, unsigned *freq, int *bitsPerSample, int *numChannels, uint64_t *numFrames)
+{
+	riff_chunk r;
+	if ( 1 != fread(&r, sizeof(r), 1, f) )
+		return 1;
+	if ( memcmp(r.hdr.ID, "RIFF", 4) || memcmp(r.waveID, "WAVE", 4) ) {
+		fprintf(stderr, "ERROR - not a RIFF/WAVE file\n");
+		return 1;
+	}
+
+	int haveFmt = 0;
+	*freq = 0;
+	waveHaveStartTime = 0;
+	for (;;) {
+		chunk_hdr hdr;
+		if ( 1 != fread(&hdr, sizeof(hdr), 1, f) )
+			return 1;
+		if ( !memcmp(hdr.ID, "fmt ", 4) ) {
+			fmt_chunk fmt;
+			fmt.hdr = hdr;
+			size_t n = sizeof(fmt) - sizeof(hdr);
+			if ( hdr.size < n || 1 != fread(&fmt.wFormatTag, n, 1, f) )
+				return 1;
+			if ( fmt.wFormatTag != 1 ) {
+				fprintf(stderr, "ERROR - unsupported wave format: %d\n", fmt.wFormatTag);
+				return 1;
+			}
+			*samplerate = fmt.nSamplesPerSec;
+			*bitsPerSample = fmt.nBitsPerSample;
+			*numChannels = fmt.nChannels;
+			waveBytesPerFrame = fmt.nChannels * (fmt.nBitsPerSample / 8);
+			haveFmt = 1;
+			if ( fseek(f, hdr.size - n, SEEK_CUR) )
+				return 1;
+		} else if ( !memcmp(hdr.ID, "auxi", 4) ) {
+			auxi_chunk a;
+			size_t n = sizeof(a) - sizeof(hdr);
+			if ( hdr.size < n || 1 != fread(&a.StartTime, n, 1, f) )
+				return 1;
+			*freq = a.centerFreq;
+			waveStartTime = a.StartTime;
+			waveHaveStartTime = ( a.StartTime.wYear != 0 );
+			if ( fseek(f, hdr.size - n, SEEK_CUR) )
+				return 1;
+		} else if ( !memcmp(hdr.ID, "data", 4) ) {
+			if ( !haveFmt || waveBytesPerFrame == 0 )
+				return 1;
+			/* wavewrite leaves the data size at 0 when not finalized */
+			*numFrames = hdr.size / waveBytesPerFrame;
+			return 0;
+		} else {
+			if ( fseek(f, hdr.size, SEEK_CUR) )
+				return 1;
+		}
+	}
+}
+
+size_t waveReadFrames(FILE * f, void * vpData, size_t numFrames)
+{
+	if ( waveBytesPerFrame == 0 )
+		return 0;
+	return fread(vpData, waveBytesPerFrame, numFrames, f);
+}
+
+int  waveGetStartTime(time_t *tim, double *fraction)
+{
+	if ( !waveHaveStartTime )
+		return 1;
+	struct tm t;
+	memset(&t, 0, sizeof(t));
+	t.tm_year = waveStartTime.wYear - 1900;
+	t.tm_mon = waveStartTime.wMonth - 1;
+	t.tm_mday = waveStartTime.wDay;
+	t.tm_hour = waveStartTime.wHour;
+	t.tm_min = waveStartTime.wMinute;
+	t.tm_sec = waveStartTime.wSecond;
+	*tim = timegm(&t);
+	*fraction = waveStartTime.wMilliseconds / 1000.0;
+	return 0;
+}
+
+// vim: tabstop=8:softtabstop=8:shiftwidth=8:noexpandtab
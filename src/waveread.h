@@ -0,0 +1,55 @@
+/*
+ * waveread.h - helper functions to read wave files written by wavewrite
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __WAVEREAD_H
+#define __WAVEREAD_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* waveReadHeader() parses the RIFF chunks up to the 'data' chunk and leaves
+ * the file positioned at the first sample; the center frequency is taken
+ * from the 'auxi' chunk when present (0 otherwise)
+ * returns 0, when no errors occured
+ */
+int  waveReadHeader(FILE * f, unsigned *samplerate, unsigned *freq, int *bitsPerSample, int *numChannels, uint64_t *numFrames);
+
+/* waveReadFrames() reads up to numFrames frames (numFrames * numChannels samples)
+ * returns the number of frames read
+ */
+size_t waveReadFrames(FILE * f, void * vpData, size_t numFrames);
+
+/* waveGetStartTime() returns the (UTC) start time from the 'auxi' chunk of
+ * the last header read by waveReadHeader()
+ * returns 0, when the header had one
+ */
+int  waveGetStartTime(time_t *tim, double *fraction);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*__WAVEREAD_H*/